@@ -0,0 +1,149 @@
+#!/usr/bin/perl -w
+
+# (C) Nginx, Inc.
+#
+# this script converts access logs written with "binary_log_format"
+# to text, one line per request with the fields separated by tabs:
+#
+#   binlog2text.pl [-n] [file ...]
+#
+# the -n switch prints the fields as name=value; gzipped files are unpacked
+# with zcat.  a string is escaped as in the text logs, a variable not found
+# is printed as "-", milliseconds are printed as seconds with a fraction.
+
+use warnings;
+use strict;
+
+my $names = 0;
+
+if (@ARGV && $ARGV[0] eq '-n') {
+	$names = 1;
+	shift @ARGV;
+}
+
+my %schemas;
+
+push @ARGV, '-' unless @ARGV;
+
+for my $file (@ARGV) {
+	my $fh;
+
+	if ($file eq '-') {
+		$fh = \*STDIN;
+
+	} else {
+		open($fh, '<', $file) or die "$file: $!\n";
+		binmode $fh;
+
+		read($fh, my $magic, 2);
+
+		if (defined $magic && $magic eq "\x1f\x8b") {
+			close($fh);
+			open($fh, '-|', 'zcat', $file) or die "zcat $file: $!\n";
+
+		} else {
+			seek($fh, 0, 0);
+		}
+	}
+
+	binmode $fh;
+
+	while (1) {
+		my $n = read($fh, my $hdr, 4);
+		die "$file: $!\n" unless defined $n;
+		last if $n == 0;
+		die "$file: truncated record\n" if $n < 4;
+
+		my $len = unpack('V', $hdr);
+
+		$n = read($fh, my $rec, $len);
+		die "$file: truncated record\n" unless $n && $n == $len;
+
+		record($file, $rec);
+	}
+
+	close($fh);
+}
+
+sub varint {
+	my ($rec, $pos) = @_;
+	my ($n, $shift) = (0, 0);
+
+	while (1) {
+		die "truncated varint\n" if $$pos >= length($$rec);
+
+		my $b = ord(substr($$rec, $$pos++, 1));
+
+		$n += ($b & 0x7f) * 2 ** $shift;
+		return $n if $b < 0x80;
+
+		$shift += 7;
+	}
+}
+
+sub record {
+	my ($file, $rec) = @_;
+	my $pos = 1;
+
+	my $type = substr($rec, 0, 1);
+	my $id = varint(\$rec, \$pos);
+
+	if ($type eq 'S') {
+		my @fields;
+		my $nfields = varint(\$rec, \$pos);
+
+		for (1 .. $nfields) {
+			my $t = substr($rec, $pos++, 1);
+			my $len = varint(\$rec, \$pos);
+
+			push @fields, [ $t, substr($rec, $pos, $len) ];
+			$pos += $len;
+		}
+
+		$schemas{$id} = \@fields;
+		return;
+	}
+
+	if ($type ne 'D') {
+		warn "$file: unknown record type \"$type\"\n";
+		return;
+	}
+
+	my $fields = $schemas{$id};
+
+	unless ($fields) {
+		warn "$file: no schema $id\n";
+		return;
+	}
+
+	my @out;
+
+	for my $f (@$fields) {
+		my ($t, $name) = @$f;
+		my $value;
+
+		if ($t eq 's') {
+			my $len = varint(\$rec, \$pos);
+
+			if ($len == 0) {
+				$value = '-';
+
+			} else {
+				$value = substr($rec, $pos, $len - 1);
+				$pos += $len - 1;
+				$value =~ s/([\x00-\x1f"\\\x7f-\xff])/sprintf('\\x%02X', ord($1))/ge;
+			}
+
+		} elsif ($t eq 'm') {
+			my $ms = varint(\$rec, \$pos);
+			$value = sprintf('%d.%03d', int($ms / 1000), $ms % 1000);
+
+		} else {
+			$value = varint(\$rec, \$pos);
+		}
+
+		push @out, $names ? "$name=$value" : $value;
+	}
+
+	print join("\t", @out), "\n";
+}
@@ -150,6 +150,7 @@ struct ngx_connection_s {
 
     ngx_str_t           proxy_protocol_addr;
     in_port_t           proxy_protocol_port;
+    ngx_str_t           proxy_protocol_tlvs;
 
 #if (NGX_SSL)
     ngx_ssl_connection_t  *ssl;
@@ -29,6 +29,15 @@ typedef struct ngx_connection_s  ngx_connection_t;
 typedef struct ngx_thread_task_s  ngx_thread_task_t;
 #endif
 
+
+#define NGX_CPU_SSE42        0x0001
+#define NGX_CPU_PCLMUL       0x0002
+
+void ngx_cpuinfo(void);
+
+extern ngx_uint_t  ngx_cpu_features;
+
+
 typedef void (*ngx_event_handler_pt)(ngx_event_t *ev);
 typedef void (*ngx_connection_handler_pt)(ngx_connection_t *c);
 
@@ -101,8 +110,6 @@ typedef void (*ngx_connection_handler_pt)(ngx_connection_t *c);
 #define ngx_max(val1, val2)  ((val1 < val2) ? (val2) : (val1))
 #define ngx_min(val1, val2)  ((val1 > val2) ? (val2) : (val1))
 
-void ngx_cpuinfo(void);
-
 #if (NGX_HAVE_OPENAT)
 #define NGX_DISABLE_SYMLINKS_OFF        0
 #define NGX_DISABLE_SYMLINKS_ON         1
@@ -8,6 +8,15 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 
+#if (NGX_HAVE_SSE42)
+#include <nmmintrin.h>
+#endif
+
+#if (NGX_HAVE_PCLMUL)
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#endif
+
 
 /*
  * The code and lookup tables are based on the algorithm
@@ -102,10 +111,219 @@ uint32_t  ngx_crc32_table256[] = {
 uint32_t *ngx_crc32_table_short = ngx_crc32_table16;
 
 
+/* the reflected CRC-32C polynomial 0x1edc6f41, the table is built on init */
+
+static uint32_t  ngx_crc32c_table256[256];
+
+
+#if (NGX_HAVE_PCLMUL)
+
+/*
+ * CRC32 folding with PCLMULQDQ as described in the Intel paper
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction": four 128-bit lanes are folded 64 bytes ahead with
+ * the k1/k2 constants, merged into one lane with k3/k4, reduced to
+ * 64 bits with k5 and to the final 32 bits with the Barrett reduction
+ * by the reflected polynomial P' and its quotient mu.  The constants
+ * are for the bit-reflected domain, so the running crc can be xored
+ * into the data directly, as with the table-driven code.
+ */
+
+static const uint64_t  ngx_crc32_k1k2[] = {
+    0x0154442bd4, 0x01c6e41596
+};
+
+static const uint64_t  ngx_crc32_k3k4[] = {
+    0x01751997d0, 0x00ccaa009e
+};
+
+static const uint64_t  ngx_crc32_k5k0[] = {
+    0x0163cd6124, 0x0000000000
+};
+
+static const uint64_t  ngx_crc32_poly[] = {
+    0x01db710641, 0x01f7011641
+};
+
+
+__attribute__((target("pclmul,sse4.1")))
+uint32_t
+ngx_crc32_pclmul(uint32_t crc, u_char *p, size_t len)
+{
+    size_t   n;
+    __m128i  k, x1, x2, x3, x4, y1, y2, y3, y4, mask;
+
+    /* the caller guarantees at least 64 bytes */
+
+    n = len & ~((size_t) 15);
+    len -= n;
+
+    x1 = _mm_loadu_si128((__m128i *) (p + 0x00));
+    x2 = _mm_loadu_si128((__m128i *) (p + 0x10));
+    x3 = _mm_loadu_si128((__m128i *) (p + 0x20));
+    x4 = _mm_loadu_si128((__m128i *) (p + 0x30));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+
+    k = _mm_loadu_si128((__m128i *) ngx_crc32_k1k2);
+
+    p += 64;
+    n -= 64;
+
+    while (n >= 64) {
+        y1 = _mm_clmulepi64_si128(x1, k, 0x00);
+        y2 = _mm_clmulepi64_si128(x2, k, 0x00);
+        y3 = _mm_clmulepi64_si128(x3, k, 0x00);
+        y4 = _mm_clmulepi64_si128(x4, k, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, y1),
+                           _mm_loadu_si128((__m128i *) (p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, y2),
+                           _mm_loadu_si128((__m128i *) (p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, y3),
+                           _mm_loadu_si128((__m128i *) (p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, y4),
+                           _mm_loadu_si128((__m128i *) (p + 0x30)));
+
+        p += 64;
+        n -= 64;
+    }
+
+    /* fold the four lanes into one */
+
+    k = _mm_loadu_si128((__m128i *) ngx_crc32_k3k4);
+
+    y1 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, y1), x2);
+
+    y1 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, y1), x3);
+
+    y1 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, y1), x4);
+
+    while (n >= 16) {
+        y1 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, y1),
+                           _mm_loadu_si128((__m128i *) p));
+
+        p += 16;
+        n -= 16;
+    }
+
+    /* reduce 128 bits to 64 bits */
+
+    mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    k = _mm_loadl_epi64((__m128i *) ngx_crc32_k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+
+    k = _mm_loadu_si128((__m128i *) ngx_crc32_poly);
+
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, k, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = (uint32_t) _mm_extract_epi32(x1, 1);
+
+    /* the tail shorter than 16 bytes */
+
+    while (len--) {
+        crc = ngx_crc32_table256[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#endif
+
+
+#if (NGX_HAVE_SSE42)
+
+__attribute__((target("sse4.2")))
+static uint32_t
+ngx_crc32c_sse42(uint32_t crc, u_char *p, size_t len)
+{
+#if (NGX_PTR_SIZE == 8)
+    uint64_t  v;
+
+    while (len >= 8) {
+        ngx_memcpy(&v, p, 8);
+        crc = (uint32_t) _mm_crc32_u64(crc, v);
+
+        p += 8;
+        len -= 8;
+    }
+#endif
+
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+
+    return crc;
+}
+
+#endif
+
+
+void
+ngx_crc32c_update(uint32_t *crc, u_char *p, size_t len)
+{
+    uint32_t  c;
+
+#if (NGX_HAVE_SSE42)
+    if (ngx_cpu_features & NGX_CPU_SSE42) {
+        *crc = ngx_crc32c_sse42(*crc, p, len);
+        return;
+    }
+#endif
+
+    c = *crc;
+
+    while (len--) {
+        c = ngx_crc32c_table256[(c ^ *p++) & 0xff] ^ (c >> 8);
+    }
+
+    *crc = c;
+}
+
+
 ngx_int_t
 ngx_crc32_table_init(void)
 {
-    void  *p;
+    void       *p;
+    uint32_t    c;
+    ngx_uint_t  i, j;
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t) i;
+
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : (c >> 1);
+        }
+
+        ngx_crc32c_table256[i] = c;
+    }
 
     if (((uintptr_t) ngx_crc32_table_short
           & ~((uintptr_t) ngx_cacheline_size - 1))
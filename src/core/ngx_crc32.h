@@ -17,6 +17,18 @@ extern uint32_t  *ngx_crc32_table_short;
 extern uint32_t   ngx_crc32_table256[];
 
 
+/*
+ * the folding with carry-less multiplication processes 64 bytes per
+ * iteration, it is not worth the setup for shorter data
+ */
+
+#define NGX_CRC32_PCLMUL_MIN  64
+
+#if (NGX_HAVE_PCLMUL)
+uint32_t ngx_crc32_pclmul(uint32_t crc, u_char *p, size_t len);
+#endif
+
+
 static ngx_inline uint32_t
 ngx_crc32_short(u_char *p, size_t len)
 {
@@ -42,6 +54,15 @@ ngx_crc32_long(u_char *p, size_t len)
 
     crc = 0xffffffff;
 
+#if (NGX_HAVE_PCLMUL)
+    if (len >= NGX_CRC32_PCLMUL_MIN
+        && (ngx_cpu_features & (NGX_CPU_PCLMUL|NGX_CPU_SSE42))
+           == (NGX_CPU_PCLMUL|NGX_CPU_SSE42))
+    {
+        return ngx_crc32_pclmul(crc, p, len) ^ 0xffffffff;
+    }
+#endif
+
     while (len--) {
         crc = ngx_crc32_table256[(crc ^ *p++) & 0xff] ^ (crc >> 8);
     }
@@ -59,6 +80,16 @@ ngx_crc32_update(uint32_t *crc, u_char *p, size_t len)
 {
     uint32_t  c;
 
+#if (NGX_HAVE_PCLMUL)
+    if (len >= NGX_CRC32_PCLMUL_MIN
+        && (ngx_cpu_features & (NGX_CPU_PCLMUL|NGX_CPU_SSE42))
+           == (NGX_CPU_PCLMUL|NGX_CPU_SSE42))
+    {
+        *crc = ngx_crc32_pclmul(*crc, p, len);
+        return;
+    }
+#endif
+
     c = *crc;
 
     while (len--) {
@@ -73,6 +104,20 @@ ngx_crc32_update(uint32_t *crc, u_char *p, size_t len)
     crc ^= 0xffffffff
 
 
+/*
+ * CRC-32C (Castagnoli), as used by iSCSI, SCTP, and many storage formats,
+ * is computed by the SSE4.2 crc32 instruction if available
+ */
+
+#define ngx_crc32c_init(crc)                                                  \
+    crc = 0xffffffff
+
+void ngx_crc32c_update(uint32_t *crc, u_char *p, size_t len);
+
+#define ngx_crc32c_final(crc)                                                 \
+    crc ^= 0xffffffff
+
+
 ngx_int_t ngx_crc32_table_init(void);
 
 
@@ -35,6 +35,14 @@ struct ngx_shm_zone_s {
 };
 
 
+typedef ngx_msec_t (*ngx_logger_pt) (void *data);
+
+typedef struct {
+    ngx_logger_pt             handler;
+    void                     *data;
+} ngx_logger_t;
+
+
 struct ngx_cycle_s {
     void                  ****conf_ctx;
     ngx_pool_t               *pool;
@@ -56,6 +64,7 @@ struct ngx_cycle_s {
 
     ngx_array_t               listening;
     ngx_array_t               paths;
+    ngx_array_t               loggers;
     ngx_array_t               config_dump;
     ngx_list_t                open_files;
     ngx_list_t                shared_memory;
@@ -90,6 +99,8 @@ typedef struct {
     ngx_int_t                 rlimit_nofile;
     off_t                     rlimit_core;
 
+    size_t                    pool_cache;
+
     int                       priority;
 
     ngx_uint_t                cpu_affinity_auto;
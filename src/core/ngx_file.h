@@ -44,6 +44,7 @@ struct ngx_file_s {
 
 typedef time_t (*ngx_path_manager_pt) (void *data);
 typedef void (*ngx_path_loader_pt) (void *data);
+typedef void (*ngx_path_saver_pt) (void *data);
 
 
 typedef struct {
@@ -53,6 +54,7 @@ typedef struct {
 
     ngx_path_manager_pt        manager;
     ngx_path_loader_pt         loader;
+    ngx_path_saver_pt          saver;
     void                      *data;
 
     u_char                    *conf_file;
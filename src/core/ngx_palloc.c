@@ -9,18 +9,138 @@
 #include <ngx_core.h>
 
 
+/*
+ * A worker keeps the freed pool blocks and large allocations of power of
+ * two sizes from 128 bytes to 64K in per size lists to reuse them for
+ * the following connections and requests instead of malloc() and free().
+ * The size of the memory kept in a list is limited by "worker_pool_cache".
+ */
+
+#define NGX_POOL_CACHE_MIN_SHIFT  7
+#define NGX_POOL_CACHE_MAX_SHIFT  16
+
+
+typedef struct ngx_pool_cache_block_s  ngx_pool_cache_block_t;
+
+struct ngx_pool_cache_block_s {
+    ngx_pool_cache_block_t  *next;
+};
+
+
+typedef struct {
+    ngx_pool_cache_block_t  *free;
+    ngx_uint_t               number;
+    ngx_uint_t               max;
+} ngx_pool_cache_slot_t;
+
+
+static ngx_inline ngx_pool_cache_slot_t *ngx_pool_cache_slot(size_t size);
+static void *ngx_pool_cache_alloc(size_t size, ngx_log_t *log);
+static void ngx_pool_cache_free(void *p, size_t size);
 static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size,
     ngx_uint_t align);
 static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
 
 
+static ngx_uint_t             ngx_pool_cache_enabled;
+static ngx_pool_cache_slot_t  ngx_pool_cache[NGX_POOL_CACHE_MAX_SHIFT
+                                             - NGX_POOL_CACHE_MIN_SHIFT + 1];
+
+
+void
+ngx_pool_cache_init(size_t size)
+{
+#if !(NGX_DEBUG_PALLOC)
+    ngx_uint_t  i;
+
+    /* the cache is per process, so it is enabled in worker processes only */
+
+    if (size == 0) {
+        return;
+    }
+
+    for (i = 0; i <= NGX_POOL_CACHE_MAX_SHIFT - NGX_POOL_CACHE_MIN_SHIFT; i++)
+    {
+        ngx_pool_cache[i].max = size >> (i + NGX_POOL_CACHE_MIN_SHIFT);
+    }
+
+    ngx_pool_cache_enabled = 1;
+#endif
+}
+
+
+static ngx_inline ngx_pool_cache_slot_t *
+ngx_pool_cache_slot(size_t size)
+{
+    ngx_uint_t  shift;
+
+    if (!ngx_pool_cache_enabled || (size & (size - 1))) {
+        return NULL;
+    }
+
+    for (shift = NGX_POOL_CACHE_MIN_SHIFT;
+         shift <= NGX_POOL_CACHE_MAX_SHIFT;
+         shift++)
+    {
+        if (size == (size_t) 1 << shift) {
+            return &ngx_pool_cache[shift - NGX_POOL_CACHE_MIN_SHIFT];
+        }
+    }
+
+    return NULL;
+}
+
+
+static void *
+ngx_pool_cache_alloc(size_t size, ngx_log_t *log)
+{
+    ngx_pool_cache_block_t  *b;
+    ngx_pool_cache_slot_t   *slot;
+
+    slot = ngx_pool_cache_slot(size);
+
+    if (slot && slot->free) {
+        b = slot->free;
+        slot->free = b->next;
+        slot->number--;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0,
+                       "cached block: %p:%uz", b, size);
+
+        return b;
+    }
+
+    return ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+}
+
+
+static void
+ngx_pool_cache_free(void *p, size_t size)
+{
+    ngx_pool_cache_block_t  *b;
+    ngx_pool_cache_slot_t   *slot;
+
+    slot = ngx_pool_cache_slot(size);
+
+    if (slot == NULL || slot->number == slot->max) {
+        ngx_free(p);
+        return;
+    }
+
+    b = p;
+    b->next = slot->free;
+    slot->free = b;
+    slot->number++;
+}
+
+
 ngx_pool_t *
 ngx_create_pool(size_t size, ngx_log_t *log)
 {
     ngx_pool_t  *p;
 
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    p = ngx_pool_cache_alloc(size, log);
     if (p == NULL) {
         return NULL;
     }
@@ -46,6 +166,7 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 void
 ngx_destroy_pool(ngx_pool_t *pool)
 {
+    size_t               size;
     ngx_pool_t          *p, *n;
     ngx_pool_large_t    *l;
     ngx_pool_cleanup_t  *c;
@@ -82,12 +203,14 @@ ngx_destroy_pool(ngx_pool_t *pool)
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_cache_free(l->alloc, l->size);
         }
     }
 
+    size = (size_t) (pool->d.end - (u_char *) pool);
+
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);
+        ngx_pool_cache_free(p, size);
 
         if (n == NULL) {
             break;
@@ -104,7 +227,7 @@ ngx_reset_pool(ngx_pool_t *pool)
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_cache_free(l->alloc, l->size);
         }
     }
 
@@ -183,7 +306,7 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
 
     psize = (size_t) (pool->d.end - (u_char *) pool);
 
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    m = ngx_pool_cache_alloc(psize, pool->log);
     if (m == NULL) {
         return NULL;
     }
@@ -217,7 +340,16 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     ngx_uint_t         n;
     ngx_pool_large_t  *large;
 
-    p = ngx_alloc(size, pool->log);
+    if (ngx_pool_cache_slot(size)) {
+        p = ngx_pool_cache_alloc(size, pool->log);
+
+    } else {
+        p = ngx_alloc(size, pool->log);
+
+        /* the allocation is not cached and is freed with ngx_free() */
+        size = 0;
+    }
+
     if (p == NULL) {
         return NULL;
     }
@@ -227,6 +359,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     for (large = pool->large; large; large = large->next) {
         if (large->alloc == NULL) {
             large->alloc = p;
+            large->size = size;
             return p;
         }
 
@@ -237,11 +370,12 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
 
     large = ngx_palloc_small(pool, sizeof(ngx_pool_large_t), 1);
     if (large == NULL) {
-        ngx_free(p);
+        ngx_pool_cache_free(p, size);
         return NULL;
     }
 
     large->alloc = p;
+    large->size = size;
     large->next = pool->large;
     pool->large = large;
 
@@ -267,6 +401,7 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
     }
 
     large->alloc = p;
+    large->size = 0;
     large->next = pool->large;
     pool->large = large;
 
@@ -283,7 +418,7 @@ ngx_pfree(ngx_pool_t *pool, void *p)
         if (p == l->alloc) {
             ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
                            "free: %p", l->alloc);
-            ngx_free(l->alloc);
+            ngx_pool_cache_free(l->alloc, l->size);
             l->alloc = NULL;
 
             return NGX_OK;
@@ -400,31 +535,3 @@ ngx_pool_delete_file(void *data)
     }
 }
 
-
-#if 0
-
-static void *
-ngx_get_cached_block(size_t size)
-{
-    void                     *p;
-    ngx_cached_block_slot_t  *slot;
-
-    if (ngx_cycle->cache == NULL) {
-        return NULL;
-    }
-
-    slot = &ngx_cycle->cache[(size + ngx_pagesize - 1) / ngx_pagesize];
-
-    slot->tries++;
-
-    if (slot->number) {
-        p = slot->block;
-        slot->block = slot->block->next;
-        slot->number--;
-        return p;
-    }
-
-    return NULL;
-}
-
-#endif
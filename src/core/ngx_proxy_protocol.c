@@ -9,6 +9,105 @@
 #include <ngx_core.h>
 
 
+#define NGX_PROXY_PROTOCOL_AF_INET          1
+#define NGX_PROXY_PROTOCOL_AF_INET6         2
+
+#define NGX_PROXY_PROTOCOL_STREAM           1
+#define NGX_PROXY_PROTOCOL_DGRAM            2
+
+#define NGX_PROXY_PROTOCOL_LOCAL            0x20
+#define NGX_PROXY_PROTOCOL_PROXY            0x21
+
+#define NGX_PROXY_PROTOCOL_TLV_SSL          0x20
+
+
+#define ngx_proxy_protocol_parse_uint16(p)  ((p)[0] << 8 | (p)[1])
+
+#define ngx_proxy_protocol_parse_uint32(p)                                    \
+    ( ((uint32_t) (p)[0] << 24)                                               \
+    + (           (p)[1] << 16)                                               \
+    + (           (p)[2] << 8)                                                \
+    + (           (p)[3]) )
+
+
+typedef struct {
+    u_char                              signature[12];
+    u_char                              version_command;
+    u_char                              family_transport;
+    u_char                              len[2];
+} ngx_proxy_protocol_header_t;
+
+
+typedef struct {
+    u_char                              src_addr[4];
+    u_char                              dst_addr[4];
+    u_char                              src_port[2];
+    u_char                              dst_port[2];
+} ngx_proxy_protocol_inet_addrs_t;
+
+
+typedef struct {
+    u_char                              src_addr[16];
+    u_char                              dst_addr[16];
+    u_char                              src_port[2];
+    u_char                              dst_port[2];
+} ngx_proxy_protocol_inet6_addrs_t;
+
+
+typedef struct {
+    u_char                              type;
+    u_char                              len[2];
+} ngx_proxy_protocol_tlv_t;
+
+
+typedef struct {
+    u_char                              client;
+    u_char                              verify[4];
+} ngx_proxy_protocol_tlv_ssl_t;
+
+
+typedef struct {
+    ngx_str_t                           name;
+    ngx_uint_t                          type;
+} ngx_proxy_protocol_tlv_entry_t;
+
+
+static u_char *ngx_proxy_protocol_v2_read(ngx_connection_t *c, u_char *buf,
+    u_char *last);
+#if (NGX_HAVE_INET6)
+static void ngx_proxy_protocol_v2_write_inet6(struct sockaddr *sa,
+    u_char *addr, u_char *port);
+#endif
+static ngx_int_t ngx_proxy_protocol_tlv_type(u_char *p, size_t n,
+    ngx_proxy_protocol_tlv_entry_t *te);
+static ngx_int_t ngx_proxy_protocol_lookup_tlv(ngx_connection_t *c,
+    ngx_str_t *tlvs, ngx_uint_t type, ngx_str_t *value);
+
+
+static u_char  ngx_proxy_protocol_v2_signature[] =
+    "\r\n\r\n\0\r\nQUIT\n";
+
+
+static ngx_proxy_protocol_tlv_entry_t  ngx_proxy_protocol_tlv_entries[] = {
+    { ngx_string("alpn"),       0x01 },
+    { ngx_string("authority"),  0x02 },
+    { ngx_string("unique_id"),  0x05 },
+    { ngx_string("ssl"),        0x20 },
+    { ngx_string("netns"),      0x30 },
+    { ngx_null_string,          0x00 }
+};
+
+
+static ngx_proxy_protocol_tlv_entry_t  ngx_proxy_protocol_tlv_ssl_entries[] = {
+    { ngx_string("version"),    0x21 },
+    { ngx_string("cn"),         0x22 },
+    { ngx_string("cipher"),     0x23 },
+    { ngx_string("sig_alg"),    0x24 },
+    { ngx_string("key_alg"),    0x25 },
+    { ngx_null_string,          0x00 }
+};
+
+
 u_char *
 ngx_proxy_protocol_read(ngx_connection_t *c, u_char *buf, u_char *last)
 {
@@ -19,6 +118,14 @@ ngx_proxy_protocol_read(ngx_connection_t *c, u_char *buf, u_char *last)
     p = buf;
     len = last - buf;
 
+    if (len >= sizeof(ngx_proxy_protocol_v2_signature) - 1
+        && ngx_memcmp(p, ngx_proxy_protocol_v2_signature,
+                      sizeof(ngx_proxy_protocol_v2_signature) - 1)
+           == 0)
+    {
+        return ngx_proxy_protocol_v2_read(c, buf, last);
+    }
+
     if (len < 8 || ngx_strncmp(p, "PROXY ", 6) != 0) {
         goto invalid;
     }
@@ -129,7 +236,7 @@ ngx_proxy_protocol_write(ngx_connection_t *c, u_char *buf, u_char *last)
 {
     ngx_uint_t  port, lport;
 
-    if (last - buf < NGX_PROXY_PROTOCOL_MAX_HEADER) {
+    if (last - buf < NGX_PROXY_PROTOCOL_V1_MAX_HEADER) {
         return NULL;
     }
 
@@ -166,3 +273,478 @@ ngx_proxy_protocol_write(ngx_connection_t *c, u_char *buf, u_char *last)
 
     return ngx_slprintf(buf, last, " %ui %ui" CRLF, port, lport);
 }
+
+
+static u_char *
+ngx_proxy_protocol_v2_read(ngx_connection_t *c, u_char *buf, u_char *last)
+{
+    u_char                             *end, *p;
+    size_t                              len, n;
+    socklen_t                           socklen;
+    ngx_uint_t                          version, command, family;
+    ngx_sockaddr_t                      sockaddr;
+    ngx_proxy_protocol_tlv_t           *tlv;
+    ngx_proxy_protocol_header_t        *header;
+    ngx_proxy_protocol_inet_addrs_t    *in;
+#if (NGX_HAVE_INET6)
+    ngx_proxy_protocol_inet6_addrs_t   *in6;
+#endif
+
+    header = (ngx_proxy_protocol_header_t *) buf;
+
+    if ((size_t) (last - buf) < sizeof(ngx_proxy_protocol_header_t)) {
+        goto truncated;
+    }
+
+    buf += sizeof(ngx_proxy_protocol_header_t);
+
+    version = header->version_command >> 4;
+
+    if (version != 2) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "unknown PROXY protocol version: %ui", version);
+        return NULL;
+    }
+
+    len = ngx_proxy_protocol_parse_uint16(header->len);
+
+    if ((size_t) (last - buf) < len) {
+        goto truncated;
+    }
+
+    end = buf + len;
+
+    command = header->version_command & 0x0f;
+
+    if (command == 0) {
+        ngx_log_debug0(NGX_LOG_DEBUG_CORE, c->log, 0,
+                       "PROXY protocol v2 LOCAL command");
+        return end;
+    }
+
+    if (command != 1) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "unknown PROXY protocol v2 command: %ui", command);
+        return NULL;
+    }
+
+    family = header->family_transport >> 4;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "PROXY protocol v2 family: %ui, transport: %d",
+                   family, (int) (header->family_transport & 0x0f));
+
+    switch (family) {
+
+    case NGX_PROXY_PROTOCOL_AF_INET:
+
+        if ((size_t) (end - buf) < sizeof(ngx_proxy_protocol_inet_addrs_t)) {
+            goto truncated;
+        }
+
+        in = (ngx_proxy_protocol_inet_addrs_t *) buf;
+
+        ngx_memzero(&sockaddr.sockaddr_in, sizeof(struct sockaddr_in));
+        sockaddr.sockaddr_in.sin_family = AF_INET;
+        ngx_memcpy(&sockaddr.sockaddr_in.sin_addr, in->src_addr, 4);
+
+        socklen = sizeof(struct sockaddr_in);
+
+        c->proxy_protocol_port = ngx_proxy_protocol_parse_uint16(in->src_port);
+
+        buf += sizeof(ngx_proxy_protocol_inet_addrs_t);
+
+        break;
+
+#if (NGX_HAVE_INET6)
+
+    case NGX_PROXY_PROTOCOL_AF_INET6:
+
+        if ((size_t) (end - buf) < sizeof(ngx_proxy_protocol_inet6_addrs_t)) {
+            goto truncated;
+        }
+
+        in6 = (ngx_proxy_protocol_inet6_addrs_t *) buf;
+
+        ngx_memzero(&sockaddr.sockaddr_in6, sizeof(struct sockaddr_in6));
+        sockaddr.sockaddr_in6.sin6_family = AF_INET6;
+        ngx_memcpy(&sockaddr.sockaddr_in6.sin6_addr, in6->src_addr, 16);
+
+        socklen = sizeof(struct sockaddr_in6);
+
+        c->proxy_protocol_port =
+                              ngx_proxy_protocol_parse_uint16(in6->src_port);
+
+        buf += sizeof(ngx_proxy_protocol_inet6_addrs_t);
+
+        break;
+
+#endif
+
+    default:
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
+                       "PROXY protocol v2 unsupported address family: %ui",
+                       family);
+        return end;
+    }
+
+    c->proxy_protocol_addr.data = ngx_pnalloc(c->pool, NGX_SOCKADDR_STRLEN);
+    if (c->proxy_protocol_addr.data == NULL) {
+        return NULL;
+    }
+
+    c->proxy_protocol_addr.len = ngx_sock_ntop(&sockaddr.sockaddr, socklen,
+                                               c->proxy_protocol_addr.data,
+                                               NGX_SOCKADDR_STRLEN, 0);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "PROXY protocol v2 address: %V %d",
+                   &c->proxy_protocol_addr, (int) c->proxy_protocol_port);
+
+    if (buf == end) {
+        return end;
+    }
+
+    /* validate the TLVs once, so that lookups may trust the lengths */
+
+    p = buf;
+    n = end - buf;
+
+    while (n) {
+        if (n < sizeof(ngx_proxy_protocol_tlv_t)) {
+            goto invalid;
+        }
+
+        tlv = (ngx_proxy_protocol_tlv_t *) p;
+        len = ngx_proxy_protocol_parse_uint16(tlv->len);
+
+        p += sizeof(ngx_proxy_protocol_tlv_t);
+        n -= sizeof(ngx_proxy_protocol_tlv_t);
+
+        if (n < len) {
+            goto invalid;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, c->log, 0,
+                       "PROXY protocol v2 TLV type: 0x%02xd, len: %uz",
+                       (int) tlv->type, len);
+
+        p += len;
+        n -= len;
+    }
+
+    len = end - buf;
+
+    c->proxy_protocol_tlvs.data = ngx_pnalloc(c->pool, len);
+    if (c->proxy_protocol_tlvs.data == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(c->proxy_protocol_tlvs.data, buf, len);
+    c->proxy_protocol_tlvs.len = len;
+
+    return end;
+
+truncated:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                  "truncated PROXY protocol v2 header");
+
+    return NULL;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                  "broken PROXY protocol v2 TLV");
+
+    return NULL;
+}
+
+
+u_char *
+ngx_proxy_protocol_v2_write(ngx_connection_t *c, u_char *buf, u_char *last)
+{
+    size_t                              len;
+    struct sockaddr_in                 *sin, *lsin;
+    ngx_proxy_protocol_header_t        *header;
+    ngx_proxy_protocol_inet_addrs_t    *in;
+#if (NGX_HAVE_INET6)
+    ngx_proxy_protocol_inet6_addrs_t   *in6;
+#endif
+
+    if (last - buf < NGX_PROXY_PROTOCOL_V2_MAX_HEADER) {
+        return NULL;
+    }
+
+    if (ngx_connection_local_sockaddr(c, NULL, 0) != NGX_OK) {
+        return NULL;
+    }
+
+    header = (ngx_proxy_protocol_header_t *) buf;
+
+    ngx_memcpy(header->signature, ngx_proxy_protocol_v2_signature,
+               sizeof(ngx_proxy_protocol_v2_signature) - 1);
+
+    header->version_command = NGX_PROXY_PROTOCOL_PROXY;
+    header->family_transport = (c->type == SOCK_DGRAM)
+                               ? NGX_PROXY_PROTOCOL_DGRAM
+                               : NGX_PROXY_PROTOCOL_STREAM;
+
+    buf += sizeof(ngx_proxy_protocol_header_t);
+
+    if (c->sockaddr->sa_family == AF_INET
+        && c->local_sockaddr->sa_family == AF_INET)
+    {
+        sin = (struct sockaddr_in *) c->sockaddr;
+        lsin = (struct sockaddr_in *) c->local_sockaddr;
+
+        in = (ngx_proxy_protocol_inet_addrs_t *) buf;
+
+        ngx_memcpy(in->src_addr, &sin->sin_addr, 4);
+        ngx_memcpy(in->dst_addr, &lsin->sin_addr, 4);
+        ngx_memcpy(in->src_port, &sin->sin_port, 2);
+        ngx_memcpy(in->dst_port, &lsin->sin_port, 2);
+
+        header->family_transport |= NGX_PROXY_PROTOCOL_AF_INET << 4;
+        len = sizeof(ngx_proxy_protocol_inet_addrs_t);
+
+#if (NGX_HAVE_INET6)
+
+    } else if ((c->sockaddr->sa_family == AF_INET
+                || c->sockaddr->sa_family == AF_INET6)
+               && (c->local_sockaddr->sa_family == AF_INET
+                   || c->local_sockaddr->sa_family == AF_INET6))
+    {
+        /* IPv4 addresses are mapped if the families differ */
+
+        in6 = (ngx_proxy_protocol_inet6_addrs_t *) buf;
+
+        ngx_proxy_protocol_v2_write_inet6(c->sockaddr, in6->src_addr,
+                                          in6->src_port);
+        ngx_proxy_protocol_v2_write_inet6(c->local_sockaddr, in6->dst_addr,
+                                          in6->dst_port);
+
+        header->family_transport |= NGX_PROXY_PROTOCOL_AF_INET6 << 4;
+        len = sizeof(ngx_proxy_protocol_inet6_addrs_t);
+
+#endif
+
+    } else {
+        header->version_command = NGX_PROXY_PROTOCOL_LOCAL;
+        header->family_transport = 0;
+        len = 0;
+    }
+
+    header->len[0] = (u_char) (len >> 8);
+    header->len[1] = (u_char) len;
+
+    return buf + len;
+}
+
+
+#if (NGX_HAVE_INET6)
+
+static void
+ngx_proxy_protocol_v2_write_inet6(struct sockaddr *sa, u_char *addr,
+    u_char *port)
+{
+    struct sockaddr_in   *sin;
+    struct sockaddr_in6  *sin6;
+
+    if (sa->sa_family == AF_INET6) {
+        sin6 = (struct sockaddr_in6 *) sa;
+
+        ngx_memcpy(addr, &sin6->sin6_addr, 16);
+        ngx_memcpy(port, &sin6->sin6_port, 2);
+
+        return;
+    }
+
+    sin = (struct sockaddr_in *) sa;
+
+    ngx_memzero(addr, 10);
+    addr[10] = 0xff;
+    addr[11] = 0xff;
+    ngx_memcpy(&addr[12], &sin->sin_addr, 4);
+    ngx_memcpy(port, &sin->sin_port, 2);
+}
+
+#endif
+
+
+ngx_int_t
+ngx_proxy_protocol_get_tlv(ngx_connection_t *c, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    u_char                          *p;
+    size_t                           n;
+    uint32_t                         verify;
+    ngx_int_t                        rc, type;
+    ngx_str_t                        ssl, *tlvs;
+    ngx_proxy_protocol_tlv_ssl_t    *tlv_ssl;
+    ngx_proxy_protocol_tlv_entry_t  *te;
+
+    tlvs = &c->proxy_protocol_tlvs;
+
+    p = name->data;
+    n = name->len;
+
+    te = ngx_proxy_protocol_tlv_entries;
+
+    if (n >= 4 && ngx_strncmp(p, "ssl_", 4) == 0) {
+
+        rc = ngx_proxy_protocol_lookup_tlv(c, tlvs,
+                                           NGX_PROXY_PROTOCOL_TLV_SSL, &ssl);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        if (ssl.len < sizeof(ngx_proxy_protocol_tlv_ssl_t)) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "broken PROXY protocol v2 TLV");
+            return NGX_ERROR;
+        }
+
+        p += 4;
+        n -= 4;
+
+        if (n == 6 && ngx_strncmp(p, "verify", 6) == 0) {
+
+            tlv_ssl = (ngx_proxy_protocol_tlv_ssl_t *) ssl.data;
+            verify = ngx_proxy_protocol_parse_uint32(tlv_ssl->verify);
+
+            value->data = ngx_pnalloc(c->pool, NGX_INT32_LEN);
+            if (value->data == NULL) {
+                return NGX_ERROR;
+            }
+
+            value->len = ngx_sprintf(value->data, "%uD", verify)
+                         - value->data;
+
+            return NGX_OK;
+        }
+
+        ssl.data += sizeof(ngx_proxy_protocol_tlv_ssl_t);
+        ssl.len -= sizeof(ngx_proxy_protocol_tlv_ssl_t);
+
+        tlvs = &ssl;
+        te = ngx_proxy_protocol_tlv_ssl_entries;
+    }
+
+    type = ngx_proxy_protocol_tlv_type(p, n, te);
+
+    if (type == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "unknown PROXY protocol TLV \"%V\"", name);
+        return NGX_ERROR;
+    }
+
+    return ngx_proxy_protocol_lookup_tlv(c, tlvs, type, value);
+}
+
+
+ngx_int_t
+ngx_proxy_protocol_check_tlv(ngx_str_t *name)
+{
+    u_char                          *p;
+    size_t                           n;
+    ngx_proxy_protocol_tlv_entry_t  *te;
+
+    p = name->data;
+    n = name->len;
+
+    te = ngx_proxy_protocol_tlv_entries;
+
+    if (n >= 4 && ngx_strncmp(p, "ssl_", 4) == 0) {
+
+        p += 4;
+        n -= 4;
+
+        if (n == 6 && ngx_strncmp(p, "verify", 6) == 0) {
+            return NGX_OK;
+        }
+
+        te = ngx_proxy_protocol_tlv_ssl_entries;
+    }
+
+    if (ngx_proxy_protocol_tlv_type(p, n, te) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_proxy_protocol_tlv_type(u_char *p, size_t n,
+    ngx_proxy_protocol_tlv_entry_t *te)
+{
+    ngx_int_t  type;
+
+    if (n >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+
+        type = ngx_hextoi(p + 2, n - 2);
+        if (type == NGX_ERROR || type > 0xff) {
+            return NGX_ERROR;
+        }
+
+        return type;
+    }
+
+    for ( /* void */ ; te->type; te++) {
+        if (te->name.len == n && ngx_strncmp(te->name.data, p, n) == 0) {
+            return te->type;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_proxy_protocol_lookup_tlv(ngx_connection_t *c, ngx_str_t *tlvs,
+    ngx_uint_t type, ngx_str_t *value)
+{
+    u_char                    *p;
+    size_t                     n, len;
+    ngx_proxy_protocol_tlv_t  *tlv;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "PROXY protocol v2 lookup TLV: 0x%02xi", type);
+
+    p = tlvs->data;
+    n = tlvs->len;
+
+    while (n) {
+        if (n < sizeof(ngx_proxy_protocol_tlv_t)) {
+            goto invalid;
+        }
+
+        tlv = (ngx_proxy_protocol_tlv_t *) p;
+        len = ngx_proxy_protocol_parse_uint16(tlv->len);
+
+        p += sizeof(ngx_proxy_protocol_tlv_t);
+        n -= sizeof(ngx_proxy_protocol_tlv_t);
+
+        if (n < len) {
+            goto invalid;
+        }
+
+        if (tlv->type == type) {
+            value->data = p;
+            value->len = len;
+            return NGX_OK;
+        }
+
+        p += len;
+        n -= len;
+    }
+
+    return NGX_DECLINED;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0, "broken PROXY protocol v2 TLV");
+
+    return NGX_ERROR;
+}
@@ -0,0 +1,1161 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <linux/io_uring.h>
+
+
+/*
+ * The module uses io_uring as a readiness notification mechanism:
+ * every connection has at most one poll request in the ring.  Poll
+ * requests for the events added with NGX_CLEAR_EVENT are multishot and
+ * edge triggered, just like EPOLLET; level triggered events are one-shot
+ * requests rearmed after each notification.  When the set of events
+ * changes, the request is cancelled and a new one is added, so the
+ * readiness is evaluated again as EPOLL_CTL_MOD does.  All submissions
+ * made while handling events are batched and passed to the kernel
+ * together with the wait for the next completions in one io_uring_enter().
+ *
+ * The user data of a poll request is the connection number and the
+ * generation of the request.  The armed poll mask of a connection is kept
+ * in c->read->index, NGX_INVALID_INDEX means that there is no poll request
+ * in the ring, and the generation is kept in c->write->index.  Completions
+ * of cancelled or replaced requests do not match the generation and are
+ * ignored.
+ *
+ * The same ring is used for file AIO reads, their user data is the event
+ * pointer with the highest bit set.
+ */
+
+
+#define NGX_IO_URING_LEVEL    0x10000000
+
+#define NGX_IO_URING_AIO      ((uint64_t) 1 << 63)
+#define NGX_IO_URING_NOTIFY   0xffffffff
+#define NGX_IO_URING_GEN      0x7fffffff
+
+#define ngx_io_uring_data(n, gen)  ((uint64_t) (gen) << 32 | (n))
+
+
+typedef struct {
+    ngx_uint_t  entries;
+} ngx_io_uring_conf_t;
+
+
+typedef struct {
+    unsigned              *sq_head;
+    unsigned              *sq_tail;
+    unsigned              *sq_mask;
+    unsigned              *sq_array;
+    unsigned               sq_entries;
+    unsigned               sq_local_tail;
+    struct io_uring_sqe   *sqes;
+
+    unsigned              *cq_head;
+    unsigned              *cq_tail;
+    unsigned              *cq_mask;
+    struct io_uring_cqe   *cqes;
+
+    void                  *sq_ring;
+    size_t                 sq_ring_size;
+    void                  *cq_ring;
+    size_t                 cq_ring_size;
+    size_t                 sqes_size;
+} ngx_io_uring_t;
+
+
+static ngx_int_t ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_io_uring_setup(ngx_cycle_t *cycle, ngx_uint_t entries);
+static ngx_int_t ngx_io_uring_test_multishot(ngx_cycle_t *cycle);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_io_uring_notify_init(ngx_log_t *log);
+static void ngx_io_uring_notify_handler(ngx_event_t *ev);
+#endif
+static void ngx_io_uring_done(ngx_cycle_t *cycle);
+static ngx_int_t ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_add_connection(ngx_connection_t *c);
+static ngx_int_t ngx_io_uring_del_connection(ngx_connection_t *c,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_arm(ngx_connection_t *c, ngx_uint_t level,
+    ngx_log_t *log);
+static ngx_uint_t ngx_io_uring_number(ngx_connection_t *c);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_io_uring_notify(ngx_event_handler_pt handler);
+#endif
+static ngx_int_t ngx_io_uring_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+static void ngx_io_uring_process_connection(ngx_cycle_t *cycle,
+    struct io_uring_cqe *cqe, ngx_uint_t flags);
+
+static struct io_uring_sqe *ngx_io_uring_get_sqe(ngx_log_t *log);
+static int ngx_io_uring_enter(unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t argsz);
+
+static void *ngx_io_uring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+
+static int                    ring_fd = -1;
+static ngx_io_uring_t         ring;
+static ngx_uint_t             ring_gen;
+
+#if (NGX_HAVE_EVENTFD)
+static int                    notify_fd = -1;
+static ngx_uint_t             notify_count;
+static ngx_event_t            notify_event;
+static ngx_event_t            notify_write_event;
+static ngx_connection_t       notify_conn;
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+ngx_uint_t                    ngx_io_uring_aio;
+#endif
+
+
+static ngx_str_t      io_uring_name = ngx_string("io_uring");
+
+static ngx_command_t  ngx_io_uring_commands[] = {
+
+    { ngx_string("io_uring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_io_uring_conf_t, entries),
+      NULL },
+
+      ngx_null_command
+};
+
+
+ngx_event_module_t  ngx_io_uring_module_ctx = {
+    &io_uring_name,
+    ngx_io_uring_create_conf,            /* create configuration */
+    ngx_io_uring_init_conf,              /* init configuration */
+
+    {
+        ngx_io_uring_add_event,          /* add an event */
+        ngx_io_uring_del_event,          /* delete an event */
+        ngx_io_uring_add_event,          /* enable an event */
+        ngx_io_uring_del_event,          /* disable an event */
+        ngx_io_uring_add_connection,     /* add an connection */
+        ngx_io_uring_del_connection,     /* delete an connection */
+#if (NGX_HAVE_EVENTFD)
+        ngx_io_uring_notify,             /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_io_uring_process_events,     /* process the events */
+        ngx_io_uring_init,               /* init the events */
+        ngx_io_uring_done,               /* done the events */
+    }
+};
+
+ngx_module_t  ngx_io_uring_module = {
+    NGX_MODULE_V1,
+    &ngx_io_uring_module_ctx,            /* module context */
+    ngx_io_uring_commands,               /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * We call io_uring_setup() and io_uring_enter() directly as syscalls
+ * instead of liburing usage, the ring is small enough to be driven here.
+ */
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int
+ngx_io_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+    void *arg, size_t argsz)
+{
+    return syscall(SYS_io_uring_enter, ring_fd, to_submit, min_complete,
+                   flags, arg, argsz);
+}
+
+
+static ngx_int_t
+ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_io_uring_conf_t  *iucf;
+
+    iucf = ngx_event_get_conf(cycle->conf_ctx, ngx_io_uring_module);
+
+    if (ring_fd == -1) {
+        if (ngx_io_uring_setup(cycle, iucf->entries) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_io_uring_test_multishot(cycle) != NGX_OK) {
+            ngx_io_uring_done(cycle);
+            return NGX_ERROR;
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_io_uring_notify_init(cycle->log) != NGX_OK) {
+            ngx_io_uring_module_ctx.actions.notify = NULL;
+        }
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+        ngx_io_uring_aio = 1;
+#endif
+
+#if (NGX_HAVE_EPOLLRDHUP)
+        /* poll requests report POLLRDHUP the same way as epoll does */
+        ngx_use_epoll_rdhup = 1;
+#endif
+    }
+
+    ngx_io = ngx_os_io;
+
+    ngx_event_actions = ngx_io_uring_module_ctx.actions;
+
+    ngx_event_flags = NGX_USE_CLEAR_EVENT
+                      |NGX_USE_GREEDY_EVENT
+                      |NGX_USE_EPOLL_EVENT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_setup(ngx_cycle_t *cycle, ngx_uint_t entries)
+{
+    u_char                  *sq, *cq;
+    unsigned                 i;
+    struct io_uring_params   p;
+
+    ngx_memzero(&p, sizeof(struct io_uring_params));
+
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    ring_fd = io_uring_setup(entries, &p);
+
+    if (ring_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "io_uring_setup(%ui) failed", entries);
+        return NGX_ERROR;
+    }
+
+    if (!(p.features & IORING_FEAT_EXT_ARG)
+        || !(p.features & IORING_FEAT_NODROP))
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "io_uring is not supported by the kernel, "
+                      "Linux 5.13+ is required");
+        goto failed;
+    }
+
+    ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = p.cq_off.cqes
+                        + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.sq_ring_size = ngx_max(ring.sq_ring_size, ring.cq_ring_size);
+        ring.cq_ring_size = 0;
+    }
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+
+    if (ring.sq_ring == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQ_RING) failed");
+        ring.sq_ring = NULL;
+        goto failed;
+    }
+
+    if (ring.cq_ring_size) {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ|PROT_WRITE,
+                            MAP_SHARED|MAP_POPULATE, ring_fd,
+                            IORING_OFF_CQ_RING);
+
+        if (ring.cq_ring == MAP_FAILED) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                          "mmap(IORING_OFF_CQ_RING) failed");
+            ring.cq_ring = NULL;
+            goto failed;
+        }
+
+    } else {
+        ring.cq_ring = ring.sq_ring;
+    }
+
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+    if (ring.sqes == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQES) failed");
+        ring.sqes = NULL;
+        goto failed;
+    }
+
+    sq = ring.sq_ring;
+
+    ring.sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.sq_local_tail = *ring.sq_tail;
+
+    cq = ring.cq_ring;
+
+    ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /* the submission queue entries are always used in order */
+
+    for (i = 0; i < ring.sq_entries; i++) {
+        ring.sq_array[i] = i;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d sq:%ud cq:%ud",
+                   ring_fd, p.sq_entries, p.cq_entries);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_io_uring_done(cycle);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_io_uring_test_multishot(ngx_cycle_t *cycle)
+{
+    int                   s[2];
+    unsigned              head;
+    ngx_int_t             rc;
+    ngx_uint_t            armed, cancelled, done;
+    struct io_uring_sqe  *sqe;
+    struct io_uring_cqe  *cqe;
+
+    /*
+     * a multishot poll request is armed on a writable socket and cancelled
+     * after its first notification; the test waits for its final
+     * completion, so no stale completions are left in the ring
+     */
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, s) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "socketpair() failed");
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+    armed = 0;
+    cancelled = 0;
+    done = 0;
+
+    sqe = ngx_io_uring_get_sqe(cycle->log);
+    if (sqe == NULL) {
+        goto failed;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s[0];
+    sqe->poll32_events = EPOLLOUT;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = 1;
+
+    while (!done) {
+
+        if (armed && !cancelled) {
+            sqe = ngx_io_uring_get_sqe(cycle->log);
+            if (sqe == NULL) {
+                goto failed;
+            }
+
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = 1;
+
+            cancelled = 1;
+        }
+
+        ngx_memory_barrier();
+
+        *ring.sq_tail = ring.sq_local_tail;
+
+        if (ngx_io_uring_enter(ring.sq_local_tail - *ring.sq_head, 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0)
+            == -1)
+        {
+            if (ngx_errno == NGX_EINTR) {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                          "io_uring_enter() failed");
+            goto failed;
+        }
+
+        ngx_memory_barrier();
+
+        for (head = *ring.cq_head; head != *ring.cq_tail; head++) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+
+            if (cqe->user_data != 1) {
+                continue;
+            }
+
+            if (cqe->flags & IORING_CQE_F_MORE) {
+                armed = (cqe->res > 0);
+
+            } else {
+                done = 1;
+            }
+        }
+
+        ngx_memory_barrier();
+
+        *ring.cq_head = head;
+    }
+
+    if (armed) {
+        rc = NGX_OK;
+
+    } else {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "io_uring multishot poll is not supported by the "
+                      "kernel, Linux 5.13+ is required");
+    }
+
+failed:
+
+    if (close(s[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "close() failed");
+    }
+
+    if (close(s[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "close() failed");
+    }
+
+    return rc;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_io_uring_notify_init(ngx_log_t *log)
+{
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    notify_fd = eventfd(0, 0);
+#else
+    notify_fd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_io_uring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+    notify_event.index = NGX_INVALID_INDEX;
+    notify_write_event.index = NGX_INVALID_INDEX;
+
+    notify_conn.fd = notify_fd;
+    notify_conn.read = &notify_event;
+    notify_conn.write = &notify_write_event;
+    notify_conn.log = log;
+
+    if (ngx_io_uring_arm(&notify_conn, 0, log) != NGX_OK) {
+
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    /*
+     * the poll request is edge triggered, so the counter is only read
+     * to prevent its overflow; the armed poll mask is kept in the index
+     * field, hence a separate counter of notifications
+     */
+
+    if (++notify_count == NGX_MAX_UINT32_VALUE) {
+        notify_count = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+#endif
+
+
+static void
+ngx_io_uring_done(ngx_cycle_t *cycle)
+{
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1) {
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+    }
+
+#endif
+
+    if (ring.sqes) {
+        if (munmap(ring.sqes, ring.sqes_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_SQES) failed");
+        }
+    }
+
+    if (ring.cq_ring && ring.cq_ring != ring.sq_ring) {
+        if (munmap(ring.cq_ring, ring.cq_ring_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_CQ_RING) failed");
+        }
+    }
+
+    if (ring.sq_ring) {
+        if (munmap(ring.sq_ring, ring.sq_ring_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_SQ_RING) failed");
+        }
+    }
+
+    if (ring_fd != -1 && close(ring_fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    ring_fd = -1;
+    ngx_memzero(&ring, sizeof(ngx_io_uring_t));
+
+#if (NGX_HAVE_FILE_AIO)
+    ngx_io_uring_aio = 0;
+#endif
+}
+
+
+static ngx_int_t
+ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring add event: fd:%d ev:%i fl:%ui",
+                   c->fd, event, flags);
+
+    ev->active = 1;
+
+    if (ngx_io_uring_arm(c, !(flags & NGX_CLEAR_EVENT), ev->log) != NGX_OK) {
+        ev->active = 0;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ngx_uint_t         level;
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring del event: fd:%d ev:%i fl:%ui",
+                   c->fd, event, flags);
+
+    ev->active = 0;
+
+    /*
+     * unlike epoll, a poll request holds a reference to the file,
+     * so the request is cancelled even if the descriptor is being closed
+     */
+
+    level = (c->read->index != NGX_INVALID_INDEX
+             && (c->read->index & NGX_IO_URING_LEVEL));
+
+    return ngx_io_uring_arm(c, level, ev->log);
+}
+
+
+static ngx_int_t
+ngx_io_uring_add_connection(ngx_connection_t *c)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring add connection: fd:%d", c->fd);
+
+    c->read->active = 1;
+    c->write->active = 1;
+
+    if (ngx_io_uring_arm(c, 0, c->log) != NGX_OK) {
+        c->read->active = 0;
+        c->write->active = 0;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_del_connection(ngx_connection_t *c, ngx_uint_t flags)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring del connection: fd:%d", c->fd);
+
+    c->read->active = 0;
+    c->write->active = 0;
+
+    return ngx_io_uring_arm(c, 0, c->log);
+}
+
+
+/*
+ * brings the poll request of the connection in line with
+ * the state of its read and write events
+ */
+
+static ngx_int_t
+ngx_io_uring_arm(ngx_connection_t *c, ngx_uint_t level, ngx_log_t *log)
+{
+    uint32_t              events;
+    ngx_uint_t            armed;
+    struct io_uring_sqe  *sqe;
+
+    events = 0;
+
+    if (c->read->active) {
+        events |= EPOLLIN|EPOLLRDHUP;
+    }
+
+    if (c->write->active) {
+        events |= EPOLLOUT;
+    }
+
+    if (level) {
+        events |= NGX_IO_URING_LEVEL;
+    }
+
+    armed = c->read->index;
+
+    if (armed == events) {
+        return NGX_OK;
+    }
+
+    if (armed != NGX_INVALID_INDEX) {
+
+        /*
+         * the request is cancelled by its user data: POLL_REMOVE fails
+         * with EALREADY if the request is being completed at the moment
+         */
+
+        sqe = ngx_io_uring_get_sqe(log);
+        if (sqe == NULL) {
+            return NGX_ERROR;
+        }
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = ngx_io_uring_data(ngx_io_uring_number(c),
+                                      c->write->index);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "io_uring poll cancel: fd:%d gen:%ui",
+                       c->fd, c->write->index);
+
+        c->read->index = NGX_INVALID_INDEX;
+    }
+
+    if ((events & ~NGX_IO_URING_LEVEL) == 0) {
+        return NGX_OK;
+    }
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    ring_gen = (ring_gen + 1) & NGX_IO_URING_GEN;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = events & ~NGX_IO_URING_LEVEL;
+    sqe->len = level ? 0 : IORING_POLL_ADD_MULTI;
+    sqe->user_data = ngx_io_uring_data(ngx_io_uring_number(c), ring_gen);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring poll add: fd:%d ev:%08XD gen:%ui",
+                   c->fd, events, ring_gen);
+
+    c->read->index = events;
+    c->write->index = ring_gen;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_io_uring_number(ngx_connection_t *c)
+{
+#if (NGX_HAVE_EVENTFD)
+    if (c == &notify_conn) {
+        return NGX_IO_URING_NOTIFY;
+    }
+#endif
+
+    return c - ngx_cycle->connections;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_io_uring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_io_uring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags)
+{
+    int                              n;
+    unsigned                         head, tail;
+    uint64_t                         data;
+    ngx_err_t                        err;
+    ngx_uint_t                       level;
+    struct timespec                  ts;
+    struct io_uring_cqe             *cqe;
+    struct io_uring_getevents_arg    arg;
+#if (NGX_HAVE_FILE_AIO)
+    ngx_event_t                     *e;
+    ngx_event_aio_t                 *aio;
+#endif
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring timer: %M, submit: %ud",
+                   timer, ring.sq_local_tail - *ring.sq_head);
+
+    ngx_memzero(&arg, sizeof(struct io_uring_getevents_arg));
+
+    if (timer != NGX_TIMER_INFINITE) {
+        ts.tv_sec = timer / 1000;
+        ts.tv_nsec = (timer % 1000) * 1000000;
+        arg.ts = (uintptr_t) &ts;
+    }
+
+    ngx_memory_barrier();
+
+    *ring.sq_tail = ring.sq_local_tail;
+
+    n = ngx_io_uring_enter(ring.sq_local_tail - *ring.sq_head, 1,
+                           IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                           &arg, sizeof(struct io_uring_getevents_arg));
+
+    err = (n == -1) ? ngx_errno : 0;
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (err && err != ETIME && err != NGX_EBUSY) {
+        if (err == NGX_EINTR) {
+
+            if (ngx_event_timer_alarm) {
+                ngx_event_timer_alarm = 0;
+                return NGX_OK;
+            }
+
+            level = NGX_LOG_INFO;
+
+        } else {
+            level = NGX_LOG_ALERT;
+        }
+
+        ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    head = *ring.cq_head;
+    tail = *ring.cq_tail;
+
+    ngx_memory_barrier();
+
+    if (head == tail) {
+        if (timer != NGX_TIMER_INFINITE) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring_enter() returned no events without timeout");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring events: %ud", tail - head);
+
+    while (head != tail) {
+        cqe = &ring.cqes[head & *ring.cq_mask];
+        head++;
+
+        data = cqe->user_data;
+
+        if (data == 0) {
+            /* poll cancellation results */
+            continue;
+        }
+
+#if (NGX_HAVE_FILE_AIO)
+
+        if (data & NGX_IO_URING_AIO) {
+
+            e = (ngx_event_t *) (uintptr_t) (data & ~NGX_IO_URING_AIO);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring aio: %p res:%d", e, cqe->res);
+
+            e->complete = 1;
+            e->active = 0;
+            e->ready = 1;
+
+            aio = e->data;
+            aio->res = cqe->res;
+
+            ngx_post_event(e, &ngx_posted_events);
+
+            continue;
+        }
+
+#endif
+
+        ngx_io_uring_process_connection(cycle, cqe, flags);
+    }
+
+    ngx_memory_barrier();
+
+    *ring.cq_head = head;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_process_connection(ngx_cycle_t *cycle, struct io_uring_cqe *cqe,
+    ngx_uint_t flags)
+{
+    uint32_t           revents;
+    ngx_uint_t         n, gen, rearm, level;
+    ngx_event_t       *rev, *wev;
+    ngx_queue_t       *queue;
+    ngx_connection_t  *c;
+
+    n = (uint32_t) cqe->user_data;
+    gen = (ngx_uint_t) (cqe->user_data >> 32);
+
+#if (NGX_HAVE_EVENTFD)
+    if (n == NGX_IO_URING_NOTIFY) {
+        c = &notify_conn;
+
+    } else
+#endif
+    if (n < cycle->connection_n) {
+        c = &cycle->connections[n];
+
+    } else {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring: unknown completion %uL",
+                      (uint64_t) cqe->user_data);
+        return;
+    }
+
+    rev = c->read;
+    wev = c->write;
+
+    if (c->fd == -1
+        || rev->index == NGX_INVALID_INDEX
+        || wev->index != gen)
+    {
+        /*
+         * the stale event from a cancelled request or from a file
+         * descriptor that was just closed in this iteration
+         */
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: stale event %p gen:%ui", c, gen);
+        return;
+    }
+
+    rearm = 0;
+    level = 0;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+
+        /* the request has been completed, a one-shot or a failed one */
+
+        level = rev->index & NGX_IO_URING_LEVEL;
+        rev->index = NGX_INVALID_INDEX;
+        rearm = 1;
+    }
+
+    if (cqe->res < 0) {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring poll error on fd:%d res:%d",
+                       c->fd, cqe->res);
+
+        revents = EPOLLERR;
+
+    } else {
+        revents = cqe->res;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d ev:%04XD fl:%ud",
+                   c->fd, revents, cqe->flags);
+
+    if ((revents & (EPOLLERR|EPOLLHUP))
+         && (revents & (EPOLLIN|EPOLLOUT)) == 0)
+    {
+        /*
+         * if the error events were returned without EPOLLIN or EPOLLOUT,
+         * then add these flags to handle the events at least in one
+         * active handler
+         */
+
+        revents |= EPOLLIN|EPOLLOUT;
+    }
+
+    if ((revents & EPOLLIN) && rev->active) {
+
+        if (revents & EPOLLRDHUP) {
+            rev->pending_eof = 1;
+        }
+
+        rev->available = 1;
+
+        rev->ready = 1;
+
+        if (flags & NGX_POST_EVENTS) {
+            queue = rev->accept ? &ngx_posted_accept_events
+                                : &ngx_posted_events;
+
+            ngx_post_event(rev, queue);
+
+        } else {
+            rev->handler(rev);
+        }
+    }
+
+    if ((revents & EPOLLOUT) && wev->active) {
+
+        if (c->fd == -1 || wev->index != gen) {
+
+            /*
+             * the connection was closed or its request was replaced
+             * by the read event handler; a new request reports
+             * the readiness again
+             */
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring: stale event %p gen:%ui", c, gen);
+            return;
+        }
+
+        wev->ready = 1;
+#if (NGX_THREADS)
+        wev->complete = 1;
+#endif
+
+        if (flags & NGX_POST_EVENTS) {
+            ngx_post_event(wev, &ngx_posted_events);
+
+        } else {
+            wev->handler(wev);
+        }
+    }
+
+    /*
+     * the request is rearmed unless the handlers have closed
+     * the connection or have already added the events again
+     */
+
+    if (rearm
+        && c->fd != -1
+        && rev->index == NGX_INVALID_INDEX
+        && wev->index == gen)
+    {
+        (void) ngx_io_uring_arm(c, level, cycle->log);
+    }
+}
+
+
+static struct io_uring_sqe *
+ngx_io_uring_get_sqe(ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    if (ring.sq_local_tail - *ring.sq_head == ring.sq_entries) {
+
+        /* the submission queue is full, pass it to the kernel now */
+
+        ngx_memory_barrier();
+
+        *ring.sq_tail = ring.sq_local_tail;
+
+        if (ngx_io_uring_enter(ring.sq_entries, 0, 0, NULL, 0) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "io_uring_enter() failed");
+            return NULL;
+        }
+
+        if (ring.sq_local_tail - *ring.sq_head == ring.sq_entries) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "io_uring submission queue is full");
+            return NULL;
+        }
+    }
+
+    sqe = &ring.sqes[ring.sq_local_tail & *ring.sq_mask];
+    ring.sq_local_tail++;
+
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    return sqe;
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+ngx_int_t
+ngx_io_uring_aio_read(ngx_event_t *ev, ngx_fd_t fd, u_char *buf, size_t size,
+    off_t offset)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(ev->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t) ev | NGX_IO_URING_AIO;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static void *
+ngx_io_uring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_io_uring_conf_t  *iucf;
+
+    iucf = ngx_palloc(cycle->pool, sizeof(ngx_io_uring_conf_t));
+    if (iucf == NULL) {
+        return NULL;
+    }
+
+    iucf->entries = NGX_CONF_UNSET;
+
+    return iucf;
+}
+
+
+static char *
+ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_io_uring_conf_t *iucf = conf;
+
+    ngx_conf_init_uint_value(iucf->entries, 1024);
+
+    return NGX_CONF_OK;
+}
@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_event.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 
 #define NGX_SSL_PASSWORD_BUFFER_SIZE  4096
 
@@ -24,10 +28,23 @@ static int ngx_ssl_verify_callback(int ok, X509_STORE_CTX *x509_store);
 static void ngx_ssl_info_callback(const ngx_ssl_conn_t *ssl_conn, int where,
     int ret);
 static void ngx_ssl_passwords_cleanup(void *data);
+static ngx_int_t ngx_ssl_handshake_done(ngx_connection_t *c);
+static ngx_int_t ngx_ssl_handshake_wait(ngx_connection_t *c, int sslerr);
 static void ngx_ssl_handshake_handler(ngx_event_t *ev);
+#if (NGX_THREADS)
+static ngx_int_t ngx_ssl_thread_handshake(ngx_connection_t *c);
+static void ngx_ssl_handshake_thread_handler(void *data, ngx_log_t *log);
+static void ngx_ssl_handshake_thread_event_handler(ngx_event_t *ev);
+static void ngx_ssl_handshake_busy_handler(ngx_event_t *ev);
+#endif
 static ngx_int_t ngx_ssl_handle_recv(ngx_connection_t *c, int n);
 static void ngx_ssl_write_handler(ngx_event_t *wev);
 static void ngx_ssl_read_handler(ngx_event_t *rev);
+static size_t ngx_ssl_record_size(ngx_connection_t *c);
+#if (NGX_SSL_SENDFILE)
+static ssize_t ngx_ssl_sendfile(ngx_connection_t *c, ngx_buf_t *file,
+    size_t size);
+#endif
 static void ngx_ssl_shutdown_handler(ngx_event_t *ev);
 static void ngx_ssl_connection_error(ngx_connection_t *c, int sslerr,
     ngx_err_t err, char *text);
@@ -44,15 +61,24 @@ static ngx_ssl_session_t *ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 #endif
     u_char *id, int len, int *copy);
 static void ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess);
-static void ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n);
+static void ngx_ssl_session_shard_init(ngx_ssl_session_shard_t *shard,
+    ngx_slab_pool_t *shpool);
+static void ngx_ssl_expire_sessions(ngx_ssl_session_shard_t *shard,
+    ngx_uint_t n);
 static void ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 
 #ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+static ngx_int_t ngx_ssl_session_ticket_shared_keys(ngx_conf_t *cf,
+    ngx_ssl_t *ssl);
 static int ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
     unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx,
     HMAC_CTX *hctx, int enc);
+static ngx_int_t ngx_ssl_get_ticket_key(SSL_CTX *ssl_ctx, u_char *name,
+    ngx_ssl_session_ticket_key_t *key, ngx_log_t *log);
+static ngx_int_t ngx_ssl_rotate_ticket_keys(SSL_CTX *ssl_ctx, ngx_log_t *log);
+static ngx_int_t ngx_ssl_generate_ticket_key(ngx_ssl_session_ticket_key_t *key,
+    ngx_log_t *log);
 #endif
 
 #if OPENSSL_VERSION_NUMBER < 0x10002002L
@@ -109,6 +135,15 @@ int  ngx_ssl_next_certificate_index;
 int  ngx_ssl_stapling_index;
 
 
+#if (NGX_THREADS && defined SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB)
+
+/* the ticket keys are rotated while offloaded handshakes may use them */
+
+static ngx_thread_mutex_t  ngx_ssl_ticket_keys_mutex;
+
+#endif
+
+
 ngx_int_t
 ngx_ssl_init(ngx_log_t *log)
 {
@@ -147,6 +182,12 @@ ngx_ssl_init(ngx_log_t *log)
 #endif
 #endif
 
+#if (NGX_THREADS && defined SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB)
+    if (ngx_thread_mutex_create(&ngx_ssl_ticket_keys_mutex, log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
     ngx_ssl_connection_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
 
     if (ngx_ssl_connection_index == -1) {
@@ -227,6 +268,8 @@ ngx_ssl_create(ngx_ssl_t *ssl, ngx_uint_t protocols, void *data)
     }
 
     ssl->buffer_size = NGX_SSL_BUFSIZE;
+    ssl->dyn_rec_threshold = 0;
+    ssl->dyn_rec_timeout = 0;
 
     /* client side options */
 
@@ -1131,6 +1174,8 @@ ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c, ngx_uint_t flags)
 
     sc->buffer = ((flags & NGX_SSL_BUFFER) != 0);
     sc->buffer_size = ssl->buffer_size;
+    sc->dyn_rec_threshold = ssl->dyn_rec_threshold;
+    sc->dyn_rec_timeout = ssl->dyn_rec_timeout;
 
     sc->session_ctx = ssl->ctx;
 
@@ -1184,6 +1229,18 @@ ngx_ssl_handshake(ngx_connection_t *c)
     int        n, sslerr;
     ngx_err_t  err;
 
+#if (NGX_THREADS)
+    ngx_int_t  rc;
+
+    if (c->ssl->thread_handler) {
+        rc = ngx_ssl_thread_handshake(c);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+#endif
+
     ngx_ssl_clear_error(c->log);
 
     n = SSL_do_handshake(c->ssl->connection);
@@ -1191,162 +1248,364 @@ ngx_ssl_handshake(ngx_connection_t *c)
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_do_handshake: %d", n);
 
     if (n == 1) {
+        return ngx_ssl_handshake_done(c);
+    }
 
-        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    sslerr = SSL_get_error(c->ssl->connection, n);
 
-        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
+
+    if (sslerr == SSL_ERROR_WANT_READ || sslerr == SSL_ERROR_WANT_WRITE) {
+        return ngx_ssl_handshake_wait(c, sslerr);
+    }
+
+    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    c->ssl->no_wait_shutdown = 1;
+    c->ssl->no_send_shutdown = 1;
+    c->read->eof = 1;
+
+    if (sslerr == SSL_ERROR_ZERO_RETURN || ERR_peek_error() == 0) {
+        ngx_connection_error(c, err,
+                             "peer closed connection in SSL handshake");
+
+        return NGX_ERROR;
+    }
+
+    c->read->error = 1;
+
+    ngx_ssl_connection_error(c, sslerr, err, "SSL_do_handshake() failed");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_ssl_handshake_done(ngx_connection_t *c)
+{
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
 #if (NGX_DEBUG)
-        {
-        char         buf[129], *s, *d;
+    {
+    char         buf[129], *s, *d;
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
-        const
+    const
 #endif
-        SSL_CIPHER  *cipher;
+    SSL_CIPHER  *cipher;
 
-        cipher = SSL_get_current_cipher(c->ssl->connection);
+    cipher = SSL_get_current_cipher(c->ssl->connection);
 
-        if (cipher) {
-            SSL_CIPHER_description(cipher, &buf[1], 128);
+    if (cipher) {
+        SSL_CIPHER_description(cipher, &buf[1], 128);
 
-            for (s = &buf[1], d = buf; *s; s++) {
-                if (*s == ' ' && *d == ' ') {
-                    continue;
-                }
-
-                if (*s == LF || *s == CR) {
-                    continue;
-                }
-
-                *++d = *s;
+        for (s = &buf[1], d = buf; *s; s++) {
+            if (*s == ' ' && *d == ' ') {
+                continue;
             }
 
-            if (*d != ' ') {
-                d++;
+            if (*s == LF || *s == CR) {
+                continue;
             }
 
-            *d = '\0';
+            *++d = *s;
+        }
 
-            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                           "SSL: %s, cipher: \"%s\"",
-                           SSL_get_version(c->ssl->connection), &buf[1]);
+        if (*d != ' ') {
+            d++;
+        }
 
-            if (SSL_session_reused(c->ssl->connection)) {
-                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                               "SSL reused session");
-            }
+        *d = '\0';
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL: %s, cipher: \"%s\"",
+                       SSL_get_version(c->ssl->connection), &buf[1]);
 
-        } else {
+        if (SSL_session_reused(c->ssl->connection)) {
             ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                           "SSL no shared ciphers");
-        }
+                           "SSL reused session");
         }
+
+    } else {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL no shared ciphers");
+    }
+    }
 #endif
 
-        c->ssl->handshaked = 1;
+    c->ssl->handshaked = 1;
+
+#if (NGX_SSL_SENDFILE)
+    if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) == 1) {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL kernel TLS send enabled");
+        c->ssl->sendfile = 1;
+    }
+#endif
 
-        c->recv = ngx_ssl_recv;
-        c->send = ngx_ssl_write;
-        c->recv_chain = ngx_ssl_recv_chain;
-        c->send_chain = ngx_ssl_send_chain;
+    c->recv = ngx_ssl_recv;
+    c->send = ngx_ssl_write;
+    c->recv_chain = ngx_ssl_recv_chain;
+    c->send_chain = ngx_ssl_send_chain;
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 #ifdef SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS
 
-        /* initial handshake done, disable renegotiation (CVE-2009-3555) */
-        if (c->ssl->connection->s3) {
-            c->ssl->connection->s3->flags |= SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS;
-        }
+    /* initial handshake done, disable renegotiation (CVE-2009-3555) */
+    if (c->ssl->connection->s3) {
+        c->ssl->connection->s3->flags |= SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS;
+    }
 
 #endif
 #endif
 
-        return NGX_OK;
-    }
-
-    sslerr = SSL_get_error(c->ssl->connection, n);
+    return NGX_OK;
+}
 
-    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
 
+static ngx_int_t
+ngx_ssl_handshake_wait(ngx_connection_t *c, int sslerr)
+{
     if (sslerr == SSL_ERROR_WANT_READ) {
         c->read->ready = 0;
-        c->read->handler = ngx_ssl_handshake_handler;
-        c->write->handler = ngx_ssl_handshake_handler;
 
-        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    } else {
+        c->write->ready = 0;
+    }
 
-        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+    c->read->handler = ngx_ssl_handshake_handler;
+    c->write->handler = ngx_ssl_handshake_handler;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_ssl_handshake_handler(ngx_event_t *ev)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL handshake handler: %d", ev->write);
+
+    if (ev->timedout) {
+        c->ssl->handler(c);
+        return;
+    }
+
+    if (ngx_ssl_handshake(c) == NGX_AGAIN) {
+        return;
+    }
+
+    c->ssl->handler(c);
+}
+
+
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_connection_t  *connection;
+    int                n;
+    int                sslerr;
+    ngx_uint_t         read;
+    ngx_uint_t         write;
+} ngx_ssl_handshake_ctx_t;
+
+
+static ngx_int_t
+ngx_ssl_thread_handshake(ngx_connection_t *c)
+{
+    ngx_int_t                 rc;
+    ngx_thread_task_t        *task;
+    ngx_ssl_handshake_ctx_t  *ctx;
+
+    task = c->ssl->thread_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(c->pool, sizeof(ngx_ssl_handshake_ctx_t));
+        if (task == NULL) {
             return NGX_ERROR;
         }
 
-        return NGX_AGAIN;
+        task->handler = ngx_ssl_handshake_thread_handler;
+
+        c->ssl->thread_task = task;
     }
 
-    if (sslerr == SSL_ERROR_WANT_WRITE) {
-        c->write->ready = 0;
-        c->read->handler = ngx_ssl_handshake_handler;
-        c->write->handler = ngx_ssl_handshake_handler;
+    ctx = task->ctx;
 
-        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-            return NGX_ERROR;
+    if (task->event.complete) {
+        task->event.complete = 0;
+
+        if (ctx->n == 1) {
+            return ngx_ssl_handshake_done(c);
         }
 
-        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        if ((ctx->sslerr == SSL_ERROR_WANT_READ && !ctx->read)
+            || (ctx->sslerr == SSL_ERROR_WANT_WRITE && !ctx->write))
+        {
+            return ngx_ssl_handshake_wait(c, ctx->sslerr);
+        }
+
+        if (ctx->sslerr != SSL_ERROR_WANT_READ
+            && ctx->sslerr != SSL_ERROR_WANT_WRITE)
+        {
+            /* the error has been already logged by the thread */
+
+            c->ssl->no_wait_shutdown = 1;
+            c->ssl->no_send_shutdown = 1;
+            c->read->eof = 1;
+
+            if (ctx->sslerr != SSL_ERROR_ZERO_RETURN) {
+                c->read->error = 1;
+            }
+
             return NGX_ERROR;
         }
 
-        return NGX_AGAIN;
+        /* the socket became ready while the handshake was in the thread */
     }
 
-    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+    ctx->connection = c;
+    ctx->n = 0;
+    ctx->sslerr = 0;
+    ctx->read = 0;
+    ctx->write = 0;
 
-    c->ssl->no_wait_shutdown = 1;
-    c->ssl->no_send_shutdown = 1;
-    c->read->eof = 1;
+    task->event.data = c;
+    task->event.handler = ngx_ssl_handshake_thread_event_handler;
 
-    if (sslerr == SSL_ERROR_ZERO_RETURN || ERR_peek_error() == 0) {
+    c->ssl->in_thread = 1;
+
+    rc = c->ssl->thread_handler(task, c);
+
+    if (rc != NGX_OK) {
+        c->ssl->in_thread = 0;
+        return rc;
+    }
+
+    /*
+     * the connection must not be touched until the task is complete,
+     * so the events are only recorded, and a timeout is handled
+     * in ngx_ssl_handshake_handler() after the completion
+     */
+
+    c->read->handler = ngx_ssl_handshake_busy_handler;
+    c->write->handler = ngx_ssl_handshake_busy_handler;
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_ssl_handshake_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_ssl_handshake_ctx_t *ctx = data;
+
+    ngx_err_t          err;
+    ngx_connection_t  *c;
+
+    c = ctx->connection;
+
+    /*
+     * the OpenSSL error queue is per thread, so the errors
+     * are checked and logged here
+     */
+
+    ngx_ssl_clear_error(c->log);
+
+    ctx->n = SSL_do_handshake(c->ssl->connection);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL_do_handshake: %d in thread", ctx->n);
+
+    if (ctx->n == 1) {
+        return;
+    }
+
+    ctx->sslerr = SSL_get_error(c->ssl->connection, ctx->n);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL_get_error: %d", ctx->sslerr);
+
+    if (ctx->sslerr == SSL_ERROR_WANT_READ
+        || ctx->sslerr == SSL_ERROR_WANT_WRITE)
+    {
+        return;
+    }
+
+    err = (ctx->sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    if (ctx->sslerr == SSL_ERROR_ZERO_RETURN || ERR_peek_error() == 0) {
         ngx_connection_error(c, err,
                              "peer closed connection in SSL handshake");
 
-        return NGX_ERROR;
+        ctx->sslerr = SSL_ERROR_ZERO_RETURN;
+        return;
     }
 
-    c->read->error = 1;
+    ngx_ssl_connection_error(c, ctx->sslerr, err, "SSL_do_handshake() failed");
+}
 
-    ngx_ssl_connection_error(c, sslerr, err, "SSL_do_handshake() failed");
 
-    return NGX_ERROR;
+static void
+ngx_ssl_handshake_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    c->ssl->in_thread = 0;
+
+    c->read->handler = ngx_ssl_handshake_handler;
+    c->write->handler = ngx_ssl_handshake_handler;
+
+    ngx_ssl_handshake_handler(c->read);
 }
 
 
 static void
-ngx_ssl_handshake_handler(ngx_event_t *ev)
+ngx_ssl_handshake_busy_handler(ngx_event_t *ev)
 {
-    ngx_connection_t  *c;
+    ngx_connection_t         *c;
+    ngx_ssl_handshake_ctx_t  *ctx;
 
     c = ev->data;
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "SSL handshake handler: %d", ev->write);
+                   "SSL handshake busy handler: %d", ev->write);
 
     if (ev->timedout) {
-        c->ssl->handler(c);
         return;
     }
 
-    if (ngx_ssl_handshake(c) == NGX_AGAIN) {
-        return;
-    }
+    ctx = c->ssl->thread_task->ctx;
 
-    c->ssl->handler(c);
+    if (ev->write) {
+        ctx->write = 1;
+
+    } else {
+        ctx->read = 1;
+    }
 }
 
+#endif
+
 
 ssize_t
 ngx_ssl_recv_chain(ngx_connection_t *c, ngx_chain_t *cl, off_t limit)
@@ -1597,12 +1856,18 @@ ngx_ssl_write_handler(ngx_event_t *wev)
  *
  * Besides for protocols such as HTTP it is possible to always buffer
  * the output to decrease a SSL overhead some more.
+ *
+ * With dynamic record sizing the first bytes of a connection, and of each
+ * burst after an idle period, are sent in records that fit into a single
+ * TCP segment, so a client may process them without waiting for the rest
+ * of the 16K record.
  */
 
 ngx_chain_t *
 ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
     int          n;
+    u_char      *end;
     ngx_uint_t   flush;
     ssize_t      send, size;
     ngx_buf_t   *buf;
@@ -1615,28 +1880,66 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
                 continue;
             }
 
-            n = ngx_ssl_write(c, in->buf->pos, in->buf->last - in->buf->pos);
+#if (NGX_SSL_SENDFILE)
+            if (c->ssl->sendfile && !ngx_buf_in_memory(in->buf)) {
+                size = (ssize_t) ngx_min(in->buf->file_last
+                                         - in->buf->file_pos,
+                                         (off_t) (NGX_MAX_INT32_VALUE
+                                                  - ngx_pagesize));
 
-            if (n == NGX_ERROR) {
-                return NGX_CHAIN_ERROR;
-            }
+                if (size == 0) {
+                    in = in->next;
+                    continue;
+                }
 
-            if (n == NGX_AGAIN) {
-                return in;
-            }
+                n = ngx_ssl_sendfile(c, in->buf, size);
 
-            in->buf->pos += n;
+                if (n == NGX_ERROR) {
+                    return NGX_CHAIN_ERROR;
+                }
 
-            if (in->buf->pos == in->buf->last) {
-                in = in->next;
-            }
-        }
+                if (n == NGX_AGAIN) {
+                    return in;
+                }
 
-        return in;
-    }
+                in->buf->file_pos += n;
 
+                if (in->buf->file_pos == in->buf->file_last) {
+                    in = in->next;
+                }
 
-    /* the maximum limit size is the maximum int32_t value - the page size */
+                continue;
+            }
+#endif
+
+            size = in->buf->last - in->buf->pos;
+
+            if (c->ssl->dyn_rec_threshold) {
+                size = ngx_min((size_t) size, ngx_ssl_record_size(c));
+            }
+
+            n = ngx_ssl_write(c, in->buf->pos, size);
+
+            if (n == NGX_ERROR) {
+                return NGX_CHAIN_ERROR;
+            }
+
+            if (n == NGX_AGAIN) {
+                return in;
+            }
+
+            in->buf->pos += n;
+
+            if (in->buf->pos == in->buf->last) {
+                in = in->next;
+            }
+        }
+
+        return in;
+    }
+
+
+    /* the maximum limit size is the maximum int32_t value - the page size */
 
     if (limit == 0 || limit > (off_t) (NGX_MAX_INT32_VALUE - ngx_pagesize)) {
         limit = NGX_MAX_INT32_VALUE - ngx_pagesize;
@@ -1669,7 +1972,17 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
     for ( ;; ) {
 
-        while (in && buf->last < buf->end && send < limit) {
+        end = buf->end;
+
+        if (c->ssl->dyn_rec_threshold) {
+            end = buf->start + ngx_ssl_record_size(c);
+
+            if (end < buf->last) {
+                end = buf->last;
+            }
+        }
+
+        while (in && buf->last < end && send < limit) {
             if (in->buf->last_buf || in->buf->flush) {
                 flush = 1;
             }
@@ -1679,10 +1992,17 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
                 continue;
             }
 
+#if (NGX_SSL_SENDFILE)
+            if (c->ssl->sendfile && !ngx_buf_in_memory(in->buf)) {
+                flush = 1;
+                break;
+            }
+#endif
+
             size = in->buf->last - in->buf->pos;
 
-            if (size > buf->end - buf->last) {
-                size = buf->end - buf->last;
+            if (size > end - buf->last) {
+                size = end - buf->last;
             }
 
             if (send + size > limit) {
@@ -1703,12 +2023,53 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             }
         }
 
-        if (!flush && send < limit && buf->last < buf->end) {
+        if (!flush && send < limit && buf->last < end) {
             break;
         }
 
         size = buf->last - buf->pos;
 
+#if (NGX_SSL_SENDFILE)
+
+        /* the kernel encrypts file buffers itself, see ngx_ssl_sendfile() */
+
+        if (size == 0 && in && c->ssl->sendfile
+            && in->buf->in_file && !ngx_buf_in_memory(in->buf))
+        {
+
+            size = (ssize_t) ngx_min(in->buf->file_last - in->buf->file_pos,
+                                     limit - send);
+
+            if (size) {
+                n = ngx_ssl_sendfile(c, in->buf, size);
+
+                if (n == NGX_ERROR) {
+                    return NGX_CHAIN_ERROR;
+                }
+
+                if (n == NGX_AGAIN) {
+                    break;
+                }
+
+                in->buf->file_pos += n;
+                send += n;
+            }
+
+            if (in->buf->file_pos == in->buf->file_last) {
+                in = in->next;
+            }
+
+            if (send == limit) {
+                break;
+            }
+
+            flush = 0;
+
+            continue;
+        }
+
+#endif
+
         if (size == 0) {
             buf->flush = 0;
             c->buffered &= ~NGX_SSL_BUFFERED;
@@ -1785,6 +2146,14 @@ ngx_ssl_write(ngx_connection_t *c, u_char *data, size_t size)
 
         c->sent += n;
 
+        if (c->ssl->dyn_rec_threshold) {
+            if (c->ssl->dyn_rec_sent < c->ssl->dyn_rec_threshold) {
+                c->ssl->dyn_rec_sent += n;
+            }
+
+            c->ssl->dyn_rec_last = ngx_current_msec;
+        }
+
         return n;
     }
 
@@ -1844,6 +2213,117 @@ ngx_ssl_read_handler(ngx_event_t *rev)
 }
 
 
+#if (NGX_SSL_SENDFILE)
+
+static ssize_t
+ngx_ssl_sendfile(ngx_connection_t *c, ngx_buf_t *file, size_t size)
+{
+    int        sslerr;
+    ssize_t    n;
+    ngx_err_t  err;
+
+    ngx_ssl_clear_error(c->log);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL to sendfile: @%O %uz", file->file_pos, size);
+
+    ngx_set_errno(0);
+
+    n = SSL_sendfile(c->ssl->connection, file->file->fd, file->file_pos,
+                     size, 0);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_sendfile: %z", n);
+
+    if (n > 0) {
+
+        if (c->ssl->saved_read_handler) {
+
+            c->read->handler = c->ssl->saved_read_handler;
+            c->ssl->saved_read_handler = NULL;
+            c->read->ready = 1;
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_post_event(c->read, &ngx_posted_events);
+        }
+
+        c->sent += n;
+
+        return n;
+    }
+
+    if (n == 0) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "SSL_sendfile() reported that \"%s\" was truncated "
+                      "at %O", file->file->name.data, file->file_pos);
+
+        return NGX_ERROR;
+    }
+
+    sslerr = SSL_get_error(c->ssl->connection, n);
+
+    if (sslerr == SSL_ERROR_ZERO_RETURN) {
+
+        /*
+         * OpenSSL reports SSL_ERROR_ZERO_RETURN instead of
+         * SSL_ERROR_SYSCALL if sendfile() itself fails
+         */
+
+        sslerr = SSL_ERROR_SYSCALL;
+    }
+
+    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
+
+    if (sslerr == SSL_ERROR_WANT_WRITE
+        || (sslerr == SSL_ERROR_SYSCALL && err == NGX_EAGAIN))
+    {
+        c->write->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    c->ssl->no_wait_shutdown = 1;
+    c->ssl->no_send_shutdown = 1;
+    c->write->error = 1;
+
+    ngx_ssl_connection_error(c, sslerr, err, "SSL_sendfile() failed");
+
+    return NGX_ERROR;
+}
+
+#endif
+
+
+static size_t
+ngx_ssl_record_size(ngx_connection_t *c)
+{
+    ngx_ssl_connection_t  *sc;
+
+    sc = c->ssl;
+
+    if (sc->dyn_rec_sent
+        && (ngx_msec_int_t) (ngx_current_msec - sc->dyn_rec_last)
+           > (ngx_msec_int_t) sc->dyn_rec_timeout)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL dynamic record size reset");
+
+        sc->dyn_rec_sent = 0;
+    }
+
+    if (sc->dyn_rec_sent < sc->dyn_rec_threshold
+        && sc->buffer_size > NGX_SSL_DYN_REC_SIZE)
+    {
+        return NGX_SSL_DYN_REC_SIZE;
+    }
+
+    return sc->buffer_size;
+}
+
+
 void
 ngx_ssl_free_buffer(ngx_connection_t *c)
 {
@@ -2335,8 +2815,10 @@ failed:
 ngx_int_t
 ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
-    size_t                    len;
-    ngx_slab_pool_t          *shpool;
+    u_char                   *p;
+    size_t                    len, size;
+    ngx_uint_t                i, n;
+    ngx_slab_pool_t          *shpool, *sp;
     ngx_ssl_session_cache_t  *cache;
 
     if (data) {
@@ -2351,7 +2833,7 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_OK;
     }
 
-    cache = ngx_slab_alloc(shpool, sizeof(ngx_ssl_session_cache_t));
+    cache = ngx_slab_calloc(shpool, sizeof(ngx_ssl_session_cache_t));
     if (cache == NULL) {
         return NGX_ERROR;
     }
@@ -2359,11 +2841,6 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     shpool->data = cache;
     shm_zone->data = cache;
 
-    ngx_rbtree_init(&cache->session_rbtree, &cache->sentinel,
-                    ngx_ssl_session_rbtree_insert_value);
-
-    ngx_queue_init(&cache->expire_queue);
-
     len = sizeof(" in SSL session shared cache \"\"") + shm_zone->shm.name.len;
 
     shpool->log_ctx = ngx_slab_alloc(shpool, len);
@@ -2376,10 +2853,72 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     shpool->log_nomem = 0;
 
+    /*
+     * the rest of the zone is split into shards selected by a session id
+     * hash, each shard has its own slab pool and mutex, so handshakes
+     * in different workers rarely contend for the same lock; a shard
+     * gets at least 16 pages, and without atomic operations the mutex
+     * would need a lock file per shard, so the whole zone is a single shard
+     */
+
+#if (NGX_HAVE_ATOMIC_OPS)
+    n = ngx_min(NGX_SSL_SESSION_CACHE_SHARDS, shpool->pfree / 16);
+#else
+    n = 0;
+#endif
+
+    if (n < 2) {
+        cache->nshards = 1;
+        ngx_ssl_session_shard_init(&cache->shards[0], shpool);
+        return NGX_OK;
+    }
+
+    size = (shpool->pfree / n - 1) << ngx_pagesize_shift;
+
+    for (i = 0; i < n; i++) {
+
+        p = ngx_slab_alloc(shpool, size);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        sp = (ngx_slab_pool_t *) p;
+
+        sp->end = p + size;
+        sp->min_shift = 3;
+        sp->addr = p;
+
+        if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_slab_init(sp);
+
+        sp->log_ctx = shpool->log_ctx;
+        sp->log_nomem = 0;
+
+        ngx_ssl_session_shard_init(&cache->shards[i], sp);
+    }
+
+    cache->nshards = n;
+
     return NGX_OK;
 }
 
 
+static void
+ngx_ssl_session_shard_init(ngx_ssl_session_shard_t *shard,
+    ngx_slab_pool_t *shpool)
+{
+    shard->shpool = shpool;
+
+    ngx_rbtree_init(&shard->session_rbtree, &shard->sentinel,
+                    ngx_ssl_session_rbtree_insert_value);
+
+    ngx_queue_init(&shard->expire_queue);
+}
+
+
 /*
  * The length of the session id is 16 bytes for SSLv2 sessions and
  * between 1 and 32 bytes for SSLv3/TLSv1, typically 32 bytes.
@@ -2409,6 +2948,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     ngx_connection_t         *c;
     ngx_slab_pool_t          *shpool;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
     u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
 
@@ -2429,12 +2969,27 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     shm_zone = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_cache_index);
 
     cache = shm_zone->data;
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+#if OPENSSL_VERSION_NUMBER >= 0x0090800fL
+
+    session_id = (u_char *) SSL_SESSION_get_id(sess, &session_id_length);
+
+#else
+
+    session_id = sess->session_id;
+    session_id_length = sess->session_id_length;
+
+#endif
+
+    hash = ngx_crc32_short(session_id, session_id_length);
+
+    shard = &cache->shards[hash % cache->nshards];
+    shpool = shard->shpool;
 
     ngx_shmtx_lock(&shpool->mutex);
 
     /* drop one or two expired sessions */
-    ngx_ssl_expire_sessions(cache, shpool, 1);
+    ngx_ssl_expire_sessions(shard, 1);
 
     cached_sess = ngx_slab_alloc_locked(shpool, len);
 
@@ -2442,7 +2997,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, 0);
 
         cached_sess = ngx_slab_alloc_locked(shpool, len);
 
@@ -2458,7 +3013,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, 0);
 
         sess_id = ngx_slab_alloc_locked(shpool, sizeof(ngx_ssl_sess_id_t));
 
@@ -2467,17 +3022,6 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
         }
     }
 
-#if OPENSSL_VERSION_NUMBER >= 0x0090800fL
-
-    session_id = (u_char *) SSL_SESSION_get_id(sess, &session_id_length);
-
-#else
-
-    session_id = sess->session_id;
-    session_id_length = sess->session_id_length;
-
-#endif
-
 #if (NGX_PTR_SIZE == 8)
 
     id = sess_id->sess_id;
@@ -2490,7 +3034,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, 0);
 
         id = ngx_slab_alloc_locked(shpool, session_id_length);
 
@@ -2505,8 +3049,6 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
     ngx_memcpy(id, session_id, session_id_length);
 
-    hash = ngx_crc32_short(session_id, session_id_length);
-
     ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "ssl new session: %08XD:%ud:%d",
                    hash, session_id_length, len);
@@ -2519,9 +3061,9 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
     sess_id->expire = ngx_time() + SSL_CTX_get_timeout(ssl_ctx);
 
-    ngx_queue_insert_head(&cache->expire_queue, &sess_id->queue);
+    ngx_queue_insert_head(&shard->expire_queue, &sess_id->queue);
 
-    ngx_rbtree_insert(&cache->session_rbtree, &sess_id->node);
+    ngx_rbtree_insert(&shard->session_rbtree, &sess_id->node);
 
     ngx_shmtx_unlock(&shpool->mutex);
 
@@ -2564,6 +3106,7 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
     ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_session_t        *sess;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
     u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
     ngx_connection_t         *c;
@@ -2583,12 +3126,13 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 
     sess = NULL;
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shard = &cache->shards[hash % cache->nshards];
+    shpool = shard->shpool;
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    node = shard->session_rbtree.root;
+    sentinel = shard->session_rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -2624,7 +3168,7 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 
             ngx_queue_remove(&sess_id->queue);
 
-            ngx_rbtree_delete(&cache->session_rbtree, node);
+            ngx_rbtree_delete(&shard->session_rbtree, node);
 
             ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -2668,6 +3212,7 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
     ngx_slab_pool_t          *shpool;
     ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
 
     shm_zone = SSL_CTX_get_ex_data(ssl, ngx_ssl_session_cache_index);
@@ -2694,12 +3239,13 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
                    "ssl remove session: %08XD:%ud", hash, len);
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shard = &cache->shards[hash % cache->nshards];
+    shpool = shard->shpool;
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    node = shard->session_rbtree.root;
+    sentinel = shard->session_rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -2723,7 +3269,7 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
 
             ngx_queue_remove(&sess_id->queue);
 
-            ngx_rbtree_delete(&cache->session_rbtree, node);
+            ngx_rbtree_delete(&shard->session_rbtree, node);
 
             ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -2744,22 +3290,23 @@ done:
 
 
 static void
-ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n)
+ngx_ssl_expire_sessions(ngx_ssl_session_shard_t *shard, ngx_uint_t n)
 {
     time_t              now;
     ngx_queue_t        *q;
+    ngx_slab_pool_t    *shpool;
     ngx_ssl_sess_id_t  *sess_id;
 
     now = ngx_time();
+    shpool = shard->shpool;
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&cache->expire_queue)) {
+        if (ngx_queue_empty(&shard->expire_queue)) {
             return;
         }
 
-        q = ngx_queue_last(&cache->expire_queue);
+        q = ngx_queue_last(&shard->expire_queue);
 
         sess_id = ngx_queue_data(q, ngx_ssl_sess_id_t, queue);
 
@@ -2772,7 +3319,7 @@ ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
         ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
                        "expire session: %08Xi", sess_id->node.key);
 
-        ngx_rbtree_delete(&cache->session_rbtree, &sess_id->node);
+        ngx_rbtree_delete(&shard->session_rbtree, &sess_id->node);
 
         ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -2840,7 +3387,7 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
     ngx_ssl_session_ticket_key_t  *key;
 
     if (paths == NULL) {
-        return NGX_OK;
+        return ngx_ssl_session_ticket_shared_keys(cf, ssl);
     }
 
     keys = ngx_array_create(cf->pool, paths->nelts,
@@ -2903,6 +3450,9 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
         ngx_memcpy(key->aes_key, buf + 16, 16);
         ngx_memcpy(key->hmac_key, buf + 32, 16);
 
+        key->expire = 0;
+        key->shared = 0;
+
         if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
             ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
                           ngx_close_file_n " \"%V\" failed", &file.name);
@@ -2941,16 +3491,76 @@ failed:
 }
 
 
+static ngx_int_t
+ngx_ssl_session_ticket_shared_keys(ngx_conf_t *cf, ngx_ssl_t *ssl)
+{
+    ngx_array_t                   *keys;
+    ngx_ssl_session_ticket_key_t  *key;
+
+    /*
+     * without ticket key files the keys are generated at run time and kept
+     * in the shared session cache, so all workers encrypt with the same key;
+     * without the shared cache OpenSSL uses its own per process keys
+     */
+
+    if (SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_session_cache_index) == NULL) {
+        return NGX_OK;
+    }
+
+#ifdef SSL_OP_NO_TICKET
+    if (SSL_CTX_get_options(ssl->ctx) & SSL_OP_NO_TICKET) {
+        return NGX_OK;
+    }
+#endif
+
+    keys = ngx_array_create(cf->pool, 3, sizeof(ngx_ssl_session_ticket_key_t));
+    if (keys == NULL) {
+        return NGX_ERROR;
+    }
+
+    key = ngx_array_push_n(keys, 3);
+    if (key == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the keys are copied from the shared memory on the first use */
+
+    ngx_memzero(key, 3 * sizeof(ngx_ssl_session_ticket_key_t));
+
+    key[0].shared = 1;
+
+    if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_session_ticket_keys_index, keys)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_ex_data() failed");
+        return NGX_ERROR;
+    }
+
+    if (SSL_CTX_set_tlsext_ticket_key_cb(ssl->ctx,
+                                         ngx_ssl_session_ticket_key_callback)
+        == 0)
+    {
+        ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                      "nginx was built with Session Tickets support, however, "
+                      "now it is linked dynamically to an OpenSSL library "
+                      "which has no tlsext support, therefore Session Tickets "
+                      "are not available");
+    }
+
+    return NGX_OK;
+}
+
+
 static int
 ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
     unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx,
     HMAC_CTX *hctx, int enc)
 {
     SSL_CTX                       *ssl_ctx;
-    ngx_uint_t                     i;
-    ngx_array_t                   *keys;
+    ngx_int_t                      i;
     ngx_connection_t              *c;
-    ngx_ssl_session_ticket_key_t  *key;
+    ngx_ssl_session_ticket_key_t   key;
     const EVP_MD                  *digest;
     const EVP_CIPHER              *cipher;
 #if (NGX_DEBUG)
@@ -2967,19 +3577,16 @@ ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
     digest = EVP_sha256();
 #endif
 
-    keys = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_ticket_keys_index);
-    if (keys == NULL) {
-        return -1;
-    }
-
-    key = keys->elts;
-
     if (enc == 1) {
         /* encrypt session ticket */
 
+        if (ngx_ssl_get_ticket_key(ssl_ctx, NULL, &key, c->log) != 0) {
+            return -1;
+        }
+
         ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
                        "ssl session ticket encrypt, key: \"%*s\" (%s session)",
-                       ngx_hex_dump(buf, key[0].name, 16) - buf, buf,
+                       ngx_hex_dump(buf, key.name, 16) - buf, buf,
                        SSL_session_reused(ssl_conn) ? "reused" : "new");
 
         if (RAND_bytes(iv, EVP_CIPHER_iv_length(cipher)) != 1) {
@@ -2987,57 +3594,57 @@ ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
             return -1;
         }
 
-        if (EVP_EncryptInit_ex(ectx, cipher, NULL, key[0].aes_key, iv) != 1) {
+        if (EVP_EncryptInit_ex(ectx, cipher, NULL, key.aes_key, iv) != 1) {
             ngx_ssl_error(NGX_LOG_ALERT, c->log, 0,
                           "EVP_EncryptInit_ex() failed");
             return -1;
         }
 
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
-        if (HMAC_Init_ex(hctx, key[0].hmac_key, 16, digest, NULL) != 1) {
+        if (HMAC_Init_ex(hctx, key.hmac_key, 16, digest, NULL) != 1) {
             ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "HMAC_Init_ex() failed");
             return -1;
         }
 #else
-        HMAC_Init_ex(hctx, key[0].hmac_key, 16, digest, NULL);
+        HMAC_Init_ex(hctx, key.hmac_key, 16, digest, NULL);
 #endif
 
-        ngx_memcpy(name, key[0].name, 16);
+        ngx_memcpy(name, key.name, 16);
 
         return 1;
 
     } else {
         /* decrypt session ticket */
 
-        for (i = 0; i < keys->nelts; i++) {
-            if (ngx_memcmp(name, key[i].name, 16) == 0) {
-                goto found;
-            }
-        }
+        i = ngx_ssl_get_ticket_key(ssl_ctx, name, &key, c->log);
 
-        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                       "ssl session ticket decrypt, key: \"%*s\" not found",
-                       ngx_hex_dump(buf, name, 16) - buf, buf);
+        if (i == NGX_ERROR) {
+            return -1;
+        }
 
-        return 0;
+        if (i == NGX_DECLINED) {
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "ssl session ticket decrypt, key: \"%*s\" "
+                           "not found", ngx_hex_dump(buf, name, 16) - buf, buf);
 
-    found:
+            return 0;
+        }
 
         ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
                        "ssl session ticket decrypt, key: \"%*s\"%s",
-                       ngx_hex_dump(buf, key[i].name, 16) - buf, buf,
+                       ngx_hex_dump(buf, key.name, 16) - buf, buf,
                        (i == 0) ? " (default)" : "");
 
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
-        if (HMAC_Init_ex(hctx, key[i].hmac_key, 16, digest, NULL) != 1) {
+        if (HMAC_Init_ex(hctx, key.hmac_key, 16, digest, NULL) != 1) {
             ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "HMAC_Init_ex() failed");
             return -1;
         }
 #else
-        HMAC_Init_ex(hctx, key[i].hmac_key, 16, digest, NULL);
+        HMAC_Init_ex(hctx, key.hmac_key, 16, digest, NULL);
 #endif
 
-        if (EVP_DecryptInit_ex(ectx, cipher, NULL, key[i].aes_key, iv) != 1) {
+        if (EVP_DecryptInit_ex(ectx, cipher, NULL, key.aes_key, iv) != 1) {
             ngx_ssl_error(NGX_LOG_ALERT, c->log, 0,
                           "EVP_DecryptInit_ex() failed");
             return -1;
@@ -3047,6 +3654,168 @@ ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
     }
 }
 
+
+/*
+ * copies the current key, or the key with the given name, and returns
+ * its index; NGX_DECLINED if there is no such key
+ */
+
+static ngx_int_t
+ngx_ssl_get_ticket_key(SSL_CTX *ssl_ctx, u_char *name,
+    ngx_ssl_session_ticket_key_t *key, ngx_log_t *log)
+{
+    ngx_int_t                      rc;
+    ngx_uint_t                     i;
+    ngx_array_t                   *keys;
+    ngx_ssl_session_ticket_key_t  *k;
+
+#if (NGX_THREADS)
+    if (ngx_thread_mutex_lock(&ngx_ssl_ticket_keys_mutex, log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
+    if (ngx_ssl_rotate_ticket_keys(ssl_ctx, log) != NGX_OK) {
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    keys = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_ticket_keys_index);
+    if (keys == NULL) {
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    k = keys->elts;
+
+    if (name == NULL) {
+        *key = k[0];
+        rc = 0;
+        goto done;
+    }
+
+    rc = NGX_DECLINED;
+
+    for (i = 0; i < keys->nelts; i++) {
+        if (ngx_memcmp(name, k[i].name, 16) == 0) {
+            *key = k[i];
+            rc = i;
+            break;
+        }
+    }
+
+done:
+
+#if (NGX_THREADS)
+    (void) ngx_thread_mutex_unlock(&ngx_ssl_ticket_keys_mutex, log);
+#endif
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_ssl_rotate_ticket_keys(SSL_CTX *ssl_ctx, ngx_log_t *log)
+{
+    time_t                         now;
+    ngx_array_t                   *keys;
+    ngx_shm_zone_t                *shm_zone;
+    ngx_slab_pool_t               *shpool;
+    ngx_ssl_session_cache_t       *cache;
+    ngx_ssl_session_ticket_key_t  *key, *shared;
+
+    keys = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_ticket_keys_index);
+    if (keys == NULL) {
+        return NGX_OK;
+    }
+
+    key = keys->elts;
+    now = ngx_time();
+
+    if (!key[0].shared || key[0].expire > now) {
+        return NGX_OK;
+    }
+
+    /*
+     * the current key has expired in this worker: the shared keys are
+     * rotated by the first worker that notices it, the others just copy
+     * them; the next key is known to all workers in advance, so tickets
+     * encrypted by a worker that has already rotated can be decrypted
+     * by the rest, and the previous key is kept for one more key lifetime
+     * to decrypt tickets issued before the rotation
+     */
+
+    shm_zone = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_cache_index);
+
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    shared = cache->ticket_keys;
+
+    if (shared[0].expire == 0) {
+
+        if (ngx_ssl_generate_ticket_key(&shared[0], log) != NGX_OK
+            || ngx_ssl_generate_ticket_key(&shared[1], log) != NGX_OK
+            || ngx_ssl_generate_ticket_key(&shared[2], log) != NGX_OK)
+        {
+            goto failed;
+        }
+
+        shared[0].expire = now + SSL_CTX_get_timeout(ssl_ctx);
+
+    } else if (shared[0].expire <= now) {
+
+        shared[2] = shared[0];
+        shared[0] = shared[1];
+
+        if (ngx_ssl_generate_ticket_key(&shared[1], log) != NGX_OK) {
+            goto failed;
+        }
+
+        shared[0].expire = now + SSL_CTX_get_timeout(ssl_ctx);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "ssl session ticket keys rotated");
+    }
+
+    /* the caller holds the keys mutex, so no handshake sees a partial copy */
+
+    ngx_memcpy(key, shared, 3 * sizeof(ngx_ssl_session_ticket_key_t));
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_ssl_generate_ticket_key(ngx_ssl_session_ticket_key_t *key, ngx_log_t *log)
+{
+    u_char  buf[48];
+
+    if (RAND_bytes(buf, 48) != 1) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "RAND_bytes() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(key->name, buf, 16);
+    ngx_memcpy(key->aes_key, buf + 16, 16);
+    ngx_memcpy(key->hmac_key, buf + 32, 16);
+
+    key->expire = 0;
+    key->shared = 1;
+
+    return NGX_OK;
+}
+
 #else
 
 ngx_int_t
@@ -3063,6 +3832,34 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
 #endif
 
 
+ngx_int_t
+ngx_ssl_ktls(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
+{
+    if (!enable) {
+        return NGX_OK;
+    }
+
+#if (NGX_SSL_SENDFILE)
+
+    /*
+     * OpenSSL installs the session keys into the kernel after the handshake
+     * if both the kernel and the negotiated cipher support it, and silently
+     * keeps encrypting in user space otherwise
+     */
+
+    SSL_CTX_set_options(ssl->ctx, SSL_OP_ENABLE_KTLS);
+
+#else
+
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "\"ssl_ktls\" ignored, not supported");
+
+#endif
+
+    return NGX_OK;
+}
+
+
 void
 ngx_ssl_cleanup_ctx(void *data)
 {
@@ -58,6 +58,8 @@ typedef struct {
     SSL_CTX                    *ctx;
     ngx_log_t                  *log;
     size_t                      buffer_size;
+    size_t                      dyn_rec_threshold;
+    ngx_msec_t                  dyn_rec_timeout;
 } ngx_ssl_t;
 
 
@@ -69,17 +71,30 @@ typedef struct {
     ngx_buf_t                  *buf;
     size_t                      buffer_size;
 
+    size_t                      dyn_rec_threshold;
+    size_t                      dyn_rec_sent;
+    ngx_msec_t                  dyn_rec_timeout;
+    ngx_msec_t                  dyn_rec_last;
+
     ngx_connection_handler_pt   handler;
 
     ngx_event_handler_pt        saved_read_handler;
     ngx_event_handler_pt        saved_write_handler;
 
+#if (NGX_THREADS)
+    ngx_int_t                 (*thread_handler)(ngx_thread_task_t *task,
+                                                ngx_connection_t *c);
+    ngx_thread_task_t          *thread_task;
+#endif
+
     unsigned                    handshaked:1;
     unsigned                    renegotiation:1;
     unsigned                    buffer:1;
     unsigned                    no_wait_shutdown:1;
     unsigned                    no_send_shutdown:1;
     unsigned                    handshake_buffer_set:1;
+    unsigned                    sendfile:1;
+    unsigned                    in_thread:1;
 } ngx_ssl_connection_t;
 
 
@@ -107,24 +122,39 @@ struct ngx_ssl_sess_id_s {
 };
 
 
-typedef struct {
-    ngx_rbtree_t                session_rbtree;
-    ngx_rbtree_node_t           sentinel;
-    ngx_queue_t                 expire_queue;
-} ngx_ssl_session_cache_t;
-
-
 #ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
 
 typedef struct {
     u_char                      name[16];
     u_char                      aes_key[16];
     u_char                      hmac_key[16];
+    time_t                      expire;
+    unsigned                    shared:1;
 } ngx_ssl_session_ticket_key_t;
 
 #endif
 
 
+#define NGX_SSL_SESSION_CACHE_SHARDS  16
+
+typedef struct {
+    ngx_rbtree_t                session_rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_queue_t                 expire_queue;
+    ngx_slab_pool_t            *shpool;
+} ngx_ssl_session_shard_t;
+
+
+typedef struct {
+    ngx_uint_t                  nshards;
+    ngx_ssl_session_shard_t     shards[NGX_SSL_SESSION_CACHE_SHARDS];
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+    /* the current, the next, and the previous keys */
+    ngx_ssl_session_ticket_key_t  ticket_keys[3];
+#endif
+} ngx_ssl_session_cache_t;
+
+
 #define NGX_SSL_SSLv2    0x0002
 #define NGX_SSL_SSLv3    0x0004
 #define NGX_SSL_TLSv1    0x0008
@@ -132,11 +162,24 @@ typedef struct {
 #define NGX_SSL_TLSv1_2  0x0020
 
 
+#if (defined BIO_get_ktls_send && defined SSL_OP_ENABLE_KTLS)
+#define NGX_SSL_SENDFILE  1
+#endif
+
+
 #define NGX_SSL_BUFFER   1
 #define NGX_SSL_CLIENT   2
 
 #define NGX_SSL_BUFSIZE  16384
 
+/*
+ * a record that fits into a single TCP segment: the 1500 bytes MTU
+ * less IPv6 and TCP headers, 40 bytes of TCP options and up to 31 bytes
+ * of TLS record overhead
+ */
+
+#define NGX_SSL_DYN_REC_SIZE  1369
+
 
 ngx_int_t ngx_ssl_init(ngx_log_t *log);
 ngx_int_t ngx_ssl_create(ngx_ssl_t *ssl, ngx_uint_t protocols, void *data);
@@ -165,6 +208,7 @@ ngx_int_t ngx_ssl_session_cache(ngx_ssl_t *ssl, ngx_str_t *sess_ctx,
 ngx_int_t ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_array_t *paths);
 ngx_int_t ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data);
+ngx_int_t ngx_ssl_ktls(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable);
 ngx_int_t ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c,
     ngx_uint_t flags);
 
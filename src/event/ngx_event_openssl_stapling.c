@@ -503,6 +503,16 @@ ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
         return rc;
     }
 
+    if (c->ssl->in_thread) {
+
+        /*
+         * the staple is updated by the event loop and cannot be used
+         * in a handshake offloaded to a thread pool
+         */
+
+        return rc;
+    }
+
     if (staple->staple.len
         && staple->valid >= ngx_time())
     {
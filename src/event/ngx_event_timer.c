@@ -10,8 +10,65 @@
 #include <ngx_event.h>
 
 
-ngx_rbtree_t              ngx_event_timer_rbtree;
-static ngx_rbtree_node_t  ngx_event_timer_sentinel;
+/*
+ * The timer wheel is a hierarchical wheel of 4 levels by 256 slots.
+ * A slot of the level 0 holds the timers expiring at the same millisecond,
+ * a slot of the level N covers 256^N milliseconds, and its timers are
+ * redistributed to the lower levels when the wheel reaches the slot start,
+ * so the timers keep the millisecond accuracy.  The slots are circular
+ * lists linked via the left and right fields of the timer node, thus
+ * adding and deleting a timer are O(1).  A bitmap of the probably non-empty
+ * slots is kept per level: the bits are set on insertion and cleared
+ * lazily when an empty slot is found during search.
+ */
+
+#define NGX_TIMER_WHEEL_BITS    8
+#define NGX_TIMER_WHEEL_SIZE    (1 << NGX_TIMER_WHEEL_BITS)
+#define NGX_TIMER_WHEEL_MASK    (NGX_TIMER_WHEEL_SIZE - 1)
+#define NGX_TIMER_WHEEL_LEVELS  4
+
+
+typedef struct {
+    /* the timers expiring before "now" have been expired already */
+    ngx_msec_t                now;
+
+    /* the timers added with a time that has already passed */
+    ngx_rbtree_node_t         expired;
+
+    uint64_t                  bitmap[NGX_TIMER_WHEEL_LEVELS]
+                                    [NGX_TIMER_WHEEL_SIZE / 64];
+    ngx_rbtree_node_t         slots[NGX_TIMER_WHEEL_LEVELS]
+                                   [NGX_TIMER_WHEEL_SIZE];
+} ngx_event_timer_wheel_t;
+
+
+#define ngx_event_timer_wheel_link(head, node)                               \
+    (node)->left = (head)->left;                                             \
+    (node)->right = head;                                                    \
+    (head)->left->right = node;                                              \
+    (head)->left = node
+
+#define ngx_event_timer_wheel_unlink(node)                                   \
+    (node)->left->right = (node)->right;                                     \
+    (node)->right->left = (node)->left
+
+#define ngx_event_timer_wheel_empty(head)  ((head)->right == (head))
+
+
+static ngx_msec_t ngx_event_timer_wheel_find(void);
+static void ngx_event_timer_wheel_expire(void);
+static void ngx_event_timer_wheel_cascade(void);
+static ngx_int_t ngx_event_timer_wheel_next(ngx_uint_t level,
+    ngx_uint_t start);
+static void ngx_event_timer_wheel_cancel(void);
+static ngx_int_t ngx_event_timer_wheel_no_timers(void);
+
+
+ngx_rbtree_t                    ngx_event_timer_rbtree;
+static ngx_rbtree_node_t        ngx_event_timer_sentinel;
+
+ngx_uint_t                      ngx_event_timer_wheel;
+static ngx_event_timer_wheel_t  ngx_timer_wheel;
 
 /*
  * the event timer rbtree may contain the duplicate keys, however,
@@ -20,11 +77,38 @@ static ngx_rbtree_node_t  ngx_event_timer_sentinel;
  */
 
 ngx_int_t
-ngx_event_timer_init(ngx_log_t *log)
+ngx_event_timer_init(ngx_log_t *log, ngx_uint_t wheel)
 {
+    ngx_uint_t          i, n;
+    ngx_rbtree_node_t  *head;
+
     ngx_rbtree_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel,
                     ngx_rbtree_insert_timer_value);
 
+    ngx_event_timer_wheel = wheel;
+
+    if (!wheel) {
+        return NGX_OK;
+    }
+
+    ngx_memzero(&ngx_timer_wheel, sizeof(ngx_event_timer_wheel_t));
+
+    ngx_timer_wheel.now = ngx_current_msec;
+
+    head = &ngx_timer_wheel.expired;
+    head->left = head;
+    head->right = head;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_LEVELS; i++) {
+        for (n = 0; n < NGX_TIMER_WHEEL_SIZE; n++) {
+            head = &ngx_timer_wheel.slots[i][n];
+            head->left = head;
+            head->right = head;
+        }
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, log, 0, "event timer wheel");
+
     return NGX_OK;
 }
 
@@ -35,6 +119,10 @@ ngx_event_find_timer(void)
     ngx_msec_int_t      timer;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        return ngx_event_timer_wheel_find();
+    }
+
     if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel) {
         return NGX_TIMER_INFINITE;
     }
@@ -56,6 +144,11 @@ ngx_event_expire_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_expire();
+        return;
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -102,6 +195,11 @@ ngx_event_cancel_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_cancel();
+        return;
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -136,3 +234,374 @@ ngx_event_cancel_timers(void)
         ev->handler(ev);
     }
 }
+
+
+ngx_int_t
+ngx_event_no_timers_left(void)
+{
+    if (ngx_event_timer_wheel) {
+        return ngx_event_timer_wheel_no_timers();
+    }
+
+    if (ngx_event_timer_rbtree.root == ngx_event_timer_rbtree.sentinel) {
+        return NGX_OK;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+void
+ngx_event_timer_wheel_insert(ngx_rbtree_node_t *node)
+{
+    ngx_msec_t          key, delta;
+    ngx_uint_t          level, slot;
+    ngx_rbtree_node_t  *head;
+
+    delta = node->key - ngx_timer_wheel.now;
+
+    if ((ngx_msec_int_t) delta < 0) {
+        head = &ngx_timer_wheel.expired;
+        ngx_event_timer_wheel_link(head, node);
+        return;
+    }
+
+#if (NGX_PTR_SIZE == 8)
+
+    /*
+     * the wheel covers 2^32 milliseconds, a longer timer is placed at
+     * the wheel end and is placed again when the wheel reaches it
+     */
+
+    if (delta > 0xffffffff) {
+        delta = 0xffffffff;
+    }
+
+#endif
+
+    key = ngx_timer_wheel.now + delta;
+
+    for (level = 0; level < NGX_TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < (ngx_msec_t) 1 << (NGX_TIMER_WHEEL_BITS * (level + 1))) {
+            break;
+        }
+    }
+
+    slot = (key >> (NGX_TIMER_WHEEL_BITS * level)) & NGX_TIMER_WHEEL_MASK;
+
+    head = &ngx_timer_wheel.slots[level][slot];
+    ngx_event_timer_wheel_link(head, node);
+
+    ngx_timer_wheel.bitmap[level][slot / 64] |= (uint64_t) 1 << (slot % 64);
+}
+
+
+static ngx_msec_t
+ngx_event_timer_wheel_find(void)
+{
+    ngx_int_t       k;
+    ngx_uint_t      level, shift, found;
+    ngx_msec_t      now, start, min;
+    ngx_msec_int_t  timer;
+
+    if (!ngx_event_timer_wheel_empty(&ngx_timer_wheel.expired)) {
+        return 0;
+    }
+
+    now = ngx_timer_wheel.now;
+    min = 0;
+    found = 0;
+
+    /*
+     * the exact time is known for the level 0 only, for the other levels
+     * the start time of the first non-empty slot is a lower bound; the
+     * slot of the current position of a level above 0 has been already
+     * redistributed and holds the timers of the next wheel round
+     */
+
+    for (level = 0; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+        shift = NGX_TIMER_WHEEL_BITS * level;
+
+        if (level == 0) {
+            k = ngx_event_timer_wheel_next(0, now & NGX_TIMER_WHEEL_MASK);
+
+            if (k == NGX_ERROR) {
+                continue;
+            }
+
+            start = now + k;
+
+        } else {
+            k = ngx_event_timer_wheel_next(level, (now >> shift) + 1);
+
+            if (k == NGX_ERROR) {
+                continue;
+            }
+
+            start = ((now >> shift) + k + 1) << shift;
+        }
+
+        if (!found || (ngx_msec_int_t) (start - min) < 0) {
+            min = start;
+            found = 1;
+        }
+    }
+
+    if (!found) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    timer = (ngx_msec_int_t) (min - ngx_current_msec);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+static void
+ngx_event_timer_wheel_expire(void)
+{
+    ngx_int_t           k;
+    ngx_uint_t          slot, n;
+    ngx_msec_t          next;
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *node, *head;
+
+    for ( ;; ) {
+
+        head = &ngx_timer_wheel.expired;
+
+        if (ngx_event_timer_wheel_empty(head)) {
+
+            if ((ngx_msec_int_t) (ngx_current_msec - ngx_timer_wheel.now) < 0)
+            {
+                return;
+            }
+
+            slot = ngx_timer_wheel.now & NGX_TIMER_WHEEL_MASK;
+
+            head = &ngx_timer_wheel.slots[0][slot];
+
+            if (ngx_event_timer_wheel_empty(head)) {
+
+                /* skip to the next non-empty slot or to the round end */
+
+                k = ngx_event_timer_wheel_next(0, slot);
+
+                if (k == NGX_ERROR || slot + k > NGX_TIMER_WHEEL_MASK) {
+                    n = NGX_TIMER_WHEEL_SIZE - slot;
+
+                } else {
+                    n = k;
+                }
+
+                next = ngx_timer_wheel.now + n;
+
+                if ((ngx_msec_int_t) (next - ngx_current_msec) > 0) {
+                    next = ngx_current_msec + 1;
+                }
+
+                ngx_timer_wheel.now = next;
+
+                if ((next & NGX_TIMER_WHEEL_MASK) == 0) {
+                    ngx_event_timer_wheel_cascade();
+                }
+
+                continue;
+            }
+        }
+
+        node = head->right;
+
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "event timer del: %d: %M",
+                       ngx_event_ident(ev->data), ev->timer.key);
+
+        ngx_event_timer_wheel_unlink(node);
+
+#if (NGX_DEBUG)
+        ev->timer.left = NULL;
+        ev->timer.right = NULL;
+        ev->timer.parent = NULL;
+#endif
+
+        ev->timer_set = 0;
+
+        ev->timedout = 1;
+
+        ev->handler(ev);
+    }
+}
+
+
+/*
+ * redistributes the timers of the slots which start at the current
+ * position, it is called as soon as the wheel reaches a level 0 round start
+ */
+
+static void
+ngx_event_timer_wheel_cascade(void)
+{
+    ngx_uint_t          level, slot;
+    ngx_rbtree_node_t  *head, *node, list;
+
+    for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+
+        slot = (ngx_timer_wheel.now >> (NGX_TIMER_WHEEL_BITS * level))
+               & NGX_TIMER_WHEEL_MASK;
+
+        head = &ngx_timer_wheel.slots[level][slot];
+
+        if (!ngx_event_timer_wheel_empty(head)) {
+
+            list.left = head->left;
+            list.right = head->right;
+            list.left->right = &list;
+            list.right->left = &list;
+
+            head->left = head;
+            head->right = head;
+
+            while (!ngx_event_timer_wheel_empty(&list)) {
+                node = list.right;
+                ngx_event_timer_wheel_unlink(node);
+                ngx_event_timer_wheel_insert(node);
+            }
+        }
+
+        if (slot != 0) {
+            break;
+        }
+    }
+}
+
+
+/*
+ * returns the offset of the first non-empty slot of the level
+ * starting from the "start" slot, or NGX_ERROR if the level is empty
+ */
+
+static ngx_int_t
+ngx_event_timer_wheel_next(ngx_uint_t level, ngx_uint_t start)
+{
+    uint64_t            *bitmap, bits;
+    ngx_uint_t           k, slot;
+    ngx_rbtree_node_t   *head;
+
+    bitmap = ngx_timer_wheel.bitmap[level];
+
+    k = 0;
+
+    while (k < NGX_TIMER_WHEEL_SIZE) {
+        slot = (start + k) & NGX_TIMER_WHEEL_MASK;
+
+        bits = bitmap[slot / 64] >> (slot % 64);
+
+        if (bits == 0) {
+            k += 64 - slot % 64;
+            continue;
+        }
+
+        if ((bits & 1) == 0) {
+            k++;
+            continue;
+        }
+
+        head = &ngx_timer_wheel.slots[level][slot];
+
+        if (!ngx_event_timer_wheel_empty(head)) {
+            return k;
+        }
+
+        bitmap[slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+
+        k++;
+    }
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_event_timer_wheel_cancel(void)
+{
+    ngx_uint_t          level, slot;
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *head, *node, *next, list;
+
+    /* the cancelable timers are collected first as handlers may add timers */
+
+    list.left = &list;
+    list.right = &list;
+
+    head = &ngx_timer_wheel.expired;
+    level = 0;
+    slot = 0;
+
+    for ( ;; ) {
+
+        for (node = head->right; node != head; node = next) {
+            next = node->right;
+
+            ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+            if (ev->cancelable) {
+                ngx_event_timer_wheel_unlink(node);
+                ngx_event_timer_wheel_link(&list, node);
+            }
+        }
+
+        if (level == NGX_TIMER_WHEEL_LEVELS) {
+            break;
+        }
+
+        head = &ngx_timer_wheel.slots[level][slot];
+
+        if (++slot == NGX_TIMER_WHEEL_SIZE) {
+            slot = 0;
+            level++;
+        }
+    }
+
+    while (!ngx_event_timer_wheel_empty(&list)) {
+        node = list.right;
+
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "event timer cancel: %d: %M",
+                       ngx_event_ident(ev->data), ev->timer.key);
+
+        ngx_event_timer_wheel_unlink(node);
+
+#if (NGX_DEBUG)
+        ev->timer.left = NULL;
+        ev->timer.right = NULL;
+        ev->timer.parent = NULL;
+#endif
+
+        ev->timer_set = 0;
+
+        ev->handler(ev);
+    }
+}
+
+
+static ngx_int_t
+ngx_event_timer_wheel_no_timers(void)
+{
+    ngx_uint_t  level;
+
+    if (!ngx_event_timer_wheel_empty(&ngx_timer_wheel.expired)) {
+        return NGX_AGAIN;
+    }
+
+    for (level = 0; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+        if (ngx_event_timer_wheel_next(level, 0) != NGX_ERROR) {
+            return NGX_AGAIN;
+        }
+    }
+
+    return NGX_OK;
+}
@@ -629,7 +629,7 @@ ngx_http_gzip_filter_deflate_start(ngx_http_request_t *r,
     }
 
     ctx->last_out = &ctx->out;
-    ctx->crc32 = crc32(0L, Z_NULL, 0);
+    ngx_crc32_init(ctx->crc32);
     ctx->flush = Z_NO_FLUSH;
 
     return NGX_OK;
@@ -719,8 +719,8 @@ ngx_http_gzip_filter_add_data(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 
     if (ctx->zstream.avail_in) {
 
-        ctx->crc32 = crc32(ctx->crc32, ctx->zstream.next_in,
-                           ctx->zstream.avail_in);
+        ngx_crc32_update(&ctx->crc32, ctx->zstream.next_in,
+                         ctx->zstream.avail_in);
 
     } else if (ctx->flush == Z_NO_FLUSH) {
         return NGX_AGAIN;
@@ -907,6 +907,8 @@ ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
     ctx->zin = ctx->zstream.total_in;
     ctx->zout = 10 + ctx->zstream.total_out + 8;
 
+    ngx_crc32_final(ctx->crc32);
+
     rc = deflateEnd(&ctx->zstream);
 
     if (rc != Z_OK) {
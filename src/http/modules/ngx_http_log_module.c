@@ -13,6 +13,10 @@
 #include <zlib.h>
 #endif
 
+#if (NGX_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
 
 typedef struct ngx_http_log_op_s  ngx_http_log_op_t;
 
@@ -31,10 +35,35 @@ struct ngx_http_log_op_s {
 };
 
 
+/*
+ * a binary log consists of records prefixed with 4-byte little-endian
+ * length, a record is either a schema or data; numbers are varints,
+ * a string is varint (length + 1) followed by the bytes, 0 stands
+ * for a variable not found
+ */
+
+#define NGX_HTTP_LOG_VARINT_LEN     10
+#define NGX_HTTP_LOG_RECORD_LEN     (4 + 1 + NGX_HTTP_LOG_VARINT_LEN)
+
+#define NGX_HTTP_LOG_SCHEMA         'S'
+#define NGX_HTTP_LOG_DATA           'D'
+
+#define NGX_HTTP_LOG_STRING         's'
+#define NGX_HTTP_LOG_NUMBER         'u'
+#define NGX_HTTP_LOG_MSEC           'm'
+
+
 typedef struct {
     ngx_str_t                   name;
     ngx_array_t                *flushes;
     ngx_array_t                *ops;        /* array of ngx_http_log_op_t */
+
+    ngx_uint_t                  nfields;
+    ngx_array_t                *fields;     /* array of u_char */
+    uint32_t                    id;
+    ngx_str_t                   schema;
+
+    unsigned                    binary:1;
 } ngx_http_log_fmt_t;
 
 
@@ -44,6 +73,38 @@ typedef struct {
 } ngx_http_log_main_conf_t;
 
 
+#define NGX_HTTP_LOG_RING_FLUSH  100
+
+
+/*
+ * a ring is written by its worker only and is drained by the logger
+ * process, the head and the tail are kept in different cache lines
+ */
+
+typedef struct {
+    ngx_atomic_t                head;
+    ngx_atomic_t                dropped;
+    u_char                      pad0[NGX_CPU_CACHE_LINE
+                                     - 2 * sizeof(ngx_atomic_t)];
+    ngx_atomic_t                tail;
+    ngx_atomic_t                lock;
+    u_char                      pad1[NGX_CPU_CACHE_LINE
+                                     - 2 * sizeof(ngx_atomic_t)];
+} ngx_http_log_ring_sh_t;
+
+
+typedef struct {
+    ngx_shm_t                   shm;
+    size_t                      size;       /* of a ring, a power of 2 */
+    ngx_uint_t                  n;          /* one ring per worker */
+} ngx_http_log_ring_t;
+
+
+#define ngx_http_log_ring_sh(ring, i)                                         \
+    ((ngx_http_log_ring_sh_t *) ((ring)->shm.addr                             \
+        + (i) * (sizeof(ngx_http_log_ring_sh_t) + (ring)->size)))
+
+
 typedef struct {
     u_char                     *start;
     u_char                     *pos;
@@ -52,6 +113,11 @@ typedef struct {
     ngx_event_t                *event;
     ngx_msec_t                  flush;
     ngx_int_t                   gzip;
+
+    ngx_http_log_ring_t        *ring;
+
+    /* incremented when the file is reopened */
+    ngx_uint_t                  generation;
 } ngx_http_log_buf_t;
 
 
@@ -69,6 +135,7 @@ typedef struct {
     ngx_syslog_peer_t          *syslog_peer;
     ngx_http_log_fmt_t         *format;
     ngx_http_complex_value_t   *filter;
+    ngx_uint_t                  schema;     /* file generation */
 } ngx_http_log_t;
 
 
@@ -87,9 +154,13 @@ typedef struct {
     ngx_str_t                   name;
     size_t                      len;
     ngx_http_log_op_run_pt      run;
+    ngx_http_log_op_run_pt      binary;
+    u_char                      type;
 } ngx_http_log_var_t;
 
 
+static u_char *ngx_http_log_record(ngx_http_request_t *r,
+    ngx_http_log_t *log, u_char *buf);
 static void ngx_http_log_write(ngx_http_request_t *r, ngx_http_log_t *log,
     u_char *buf, size_t len);
 static ssize_t ngx_http_log_script_write(ngx_http_request_t *r,
@@ -103,9 +174,22 @@ static void *ngx_http_log_gzip_alloc(void *opaque, u_int items, u_int size);
 static void ngx_http_log_gzip_free(void *opaque, void *address);
 #endif
 
+static void ngx_http_log_write_file(ngx_open_file_t *file, u_char *buf,
+    size_t len, ngx_log_t *log);
 static void ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_http_log_reopen(ngx_open_file_t *file, ngx_log_t *log);
 static void ngx_http_log_flush_handler(ngx_event_t *ev);
 
+static void ngx_http_log_ring_append(ngx_http_request_t *r,
+    ngx_http_log_t *log, u_char *buf, size_t len);
+static ngx_int_t ngx_http_log_ring_put(ngx_http_log_ring_sh_t *sh,
+    size_t size, u_char *buf, size_t len);
+static size_t ngx_http_log_ring_drain(ngx_open_file_t *file, ngx_uint_t i,
+    ngx_log_t *log);
+static ngx_uint_t ngx_http_log_ring_lock(ngx_http_log_ring_sh_t *sh);
+static ngx_msec_t ngx_http_log_ring_handler(void *data);
+static void ngx_http_log_ring_flush_handler(ngx_event_t *ev);
+
 static u_char *ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 static u_char *ngx_http_log_time(ngx_http_request_t *r, u_char *buf,
@@ -125,6 +209,28 @@ static u_char *ngx_http_log_body_bytes_sent(ngx_http_request_t *r,
 static u_char *ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 
+static ngx_uint_t ngx_http_log_get_status(ngx_http_request_t *r);
+
+static u_char *ngx_http_log_binary_text(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_msec(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_request_time(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_status(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_bytes_sent(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_body_bytes_sent(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_request_length(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static size_t ngx_http_log_binary_variable_getlen(ngx_http_request_t *r,
+    uintptr_t data);
+static u_char *ngx_http_log_binary_variable(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_varint(u_char *p, uint64_t n);
+
 static ngx_int_t ngx_http_log_variable_compile(ngx_conf_t *cf,
     ngx_http_log_op_t *op, ngx_str_t *value);
 static size_t ngx_http_log_variable_getlen(ngx_http_request_t *r,
@@ -132,6 +238,9 @@ static size_t ngx_http_log_variable_getlen(ngx_http_request_t *r,
 static u_char *ngx_http_log_variable(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 static uintptr_t ngx_http_log_escape(u_char *dst, u_char *src, size_t size);
+#if (NGX_HAVE_SSE2)
+static ngx_inline ngx_uint_t ngx_http_log_escape_mask(u_char *p);
+#endif
 
 
 static void *ngx_http_log_create_main_conf(ngx_conf_t *cf);
@@ -140,13 +249,22 @@ static char *ngx_http_log_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static char *ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static ngx_http_log_buf_t *ngx_http_log_file_buffer(ngx_conf_t *cf,
+    ngx_open_file_t *file);
 static char *ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_log_compile_format(ngx_conf_t *cf,
-    ngx_array_t *flushes, ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s);
+    ngx_http_log_fmt_t *fmt, ngx_array_t *args, ngx_uint_t s);
+static ngx_int_t ngx_http_log_add_field(ngx_conf_t *cf,
+    ngx_http_log_fmt_t *fmt, ngx_str_t *name, u_char type);
+static ngx_int_t ngx_http_log_binary_schema(ngx_conf_t *cf,
+    ngx_http_log_fmt_t *fmt);
 static char *ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_log_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_log_init_module(ngx_cycle_t *cycle);
+static void ngx_http_log_ring_cleanup(void *data);
+static ngx_int_t ngx_http_log_init_process(ngx_cycle_t *cycle);
 
 
 static ngx_command_t  ngx_http_log_commands[] = {
@@ -158,6 +276,13 @@ static ngx_command_t  ngx_http_log_commands[] = {
       0,
       NULL },
 
+    { ngx_string("binary_log_format"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_log_set_format,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("access_log"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
                         |NGX_HTTP_LMT_CONF|NGX_CONF_1MORE,
@@ -198,8 +323,8 @@ ngx_module_t  ngx_http_log_module = {
     ngx_http_log_commands,                 /* module directives */
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
-    NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_log_init_module,              /* init module */
+    ngx_http_log_init_process,             /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -218,22 +343,31 @@ static ngx_str_t  ngx_http_combined_fmt =
 
 
 static ngx_http_log_var_t  ngx_http_log_vars[] = {
-    { ngx_string("pipe"), 1, ngx_http_log_pipe },
+    { ngx_string("pipe"), 1, ngx_http_log_pipe, NULL, NGX_HTTP_LOG_STRING },
     { ngx_string("time_local"), sizeof("28/Sep/1970:12:00:00 +0600") - 1,
-                          ngx_http_log_time },
+                          ngx_http_log_time, NULL, NGX_HTTP_LOG_STRING },
     { ngx_string("time_iso8601"), sizeof("1970-09-28T12:00:00+06:00") - 1,
-                          ngx_http_log_iso8601 },
-    { ngx_string("msec"), NGX_TIME_T_LEN + 4, ngx_http_log_msec },
+                          ngx_http_log_iso8601, NULL, NGX_HTTP_LOG_STRING },
+    { ngx_string("msec"), NGX_TIME_T_LEN + 4, ngx_http_log_msec,
+                          ngx_http_log_binary_msec, NGX_HTTP_LOG_MSEC },
     { ngx_string("request_time"), NGX_TIME_T_LEN + 4,
-                          ngx_http_log_request_time },
-    { ngx_string("status"), NGX_INT_T_LEN, ngx_http_log_status },
-    { ngx_string("bytes_sent"), NGX_OFF_T_LEN, ngx_http_log_bytes_sent },
+                          ngx_http_log_request_time,
+                          ngx_http_log_binary_request_time, NGX_HTTP_LOG_MSEC },
+    { ngx_string("status"), NGX_INT_T_LEN, ngx_http_log_status,
+                          ngx_http_log_binary_status, NGX_HTTP_LOG_NUMBER },
+    { ngx_string("bytes_sent"), NGX_OFF_T_LEN, ngx_http_log_bytes_sent,
+                          ngx_http_log_binary_bytes_sent,
+                          NGX_HTTP_LOG_NUMBER },
     { ngx_string("body_bytes_sent"), NGX_OFF_T_LEN,
-                          ngx_http_log_body_bytes_sent },
+                          ngx_http_log_body_bytes_sent,
+                          ngx_http_log_binary_body_bytes_sent,
+                          NGX_HTTP_LOG_NUMBER },
     { ngx_string("request_length"), NGX_SIZE_T_LEN,
-                          ngx_http_log_request_length },
+                          ngx_http_log_request_length,
+                          ngx_http_log_binary_request_length,
+                          NGX_HTTP_LOG_NUMBER },
 
-    { ngx_null_string, 0, NULL }
+    { ngx_null_string, 0, NULL, NULL, 0 }
 };
 
 
@@ -296,6 +430,8 @@ ngx_http_log_handler(ngx_http_request_t *r)
             }
         }
 
+        buffer = log[l].file ? log[l].file->data : NULL;
+
         if (log[l].syslog_peer) {
 
             /* length of syslog's PRI and HEADER message parts */
@@ -306,11 +442,18 @@ ngx_http_log_handler(ngx_http_request_t *r)
             goto alloc_line;
         }
 
-        len += NGX_LINEFEED_SIZE;
+        if (log[l].format->binary) {
+            len += NGX_HTTP_LOG_RECORD_LEN;
 
-        buffer = log[l].file ? log[l].file->data : NULL;
+            if (log[l].schema != buffer->generation) {
+                len += log[l].format->schema.len;
+            }
 
-        if (buffer) {
+        } else {
+            len += NGX_LINEFEED_SIZE;
+        }
+
+        if (buffer && buffer->start) {
 
             if (len > (size_t) (buffer->last - buffer->pos)) {
 
@@ -328,11 +471,7 @@ ngx_http_log_handler(ngx_http_request_t *r)
                     ngx_add_timer(buffer->event, buffer->flush);
                 }
 
-                for (i = 0; i < log[l].format->ops->nelts; i++) {
-                    p = op[i].run(r, p, &op[i]);
-                }
-
-                ngx_linefeed(p);
+                p = ngx_http_log_record(r, &log[l], p);
 
                 buffer->pos = p;
 
@@ -351,17 +490,13 @@ ngx_http_log_handler(ngx_http_request_t *r)
             return NGX_ERROR;
         }
 
-        p = line;
-
         if (log[l].syslog_peer) {
-            p = ngx_syslog_add_header(log[l].syslog_peer, line);
-        }
 
-        for (i = 0; i < log[l].format->ops->nelts; i++) {
-            p = op[i].run(r, p, &op[i]);
-        }
+            p = ngx_syslog_add_header(log[l].syslog_peer, line);
 
-        if (log[l].syslog_peer) {
+            for (i = 0; i < log[l].format->ops->nelts; i++) {
+                p = op[i].run(r, p, &op[i]);
+            }
 
             size = p - line;
 
@@ -380,7 +515,12 @@ ngx_http_log_handler(ngx_http_request_t *r)
             continue;
         }
 
-        ngx_linefeed(p);
+        p = ngx_http_log_record(r, &log[l], line);
+
+        if (buffer && buffer->ring) {
+            ngx_http_log_ring_append(r, &log[l], line, p - line);
+            continue;
+        }
 
         ngx_http_log_write(r, &log[l], line, p - line);
     }
@@ -389,6 +529,59 @@ ngx_http_log_handler(ngx_http_request_t *r)
 }
 
 
+static u_char *
+ngx_http_log_record(ngx_http_request_t *r, ngx_http_log_t *log, u_char *buf)
+{
+    u_char              *p;
+    size_t               len;
+    ngx_uint_t           i;
+    ngx_http_log_op_t   *op;
+    ngx_http_log_buf_t  *buffer;
+    ngx_http_log_fmt_t  *fmt;
+
+    fmt = log->format;
+    op = fmt->ops->elts;
+
+    if (!fmt->binary) {
+
+        for (i = 0; i < fmt->ops->nelts; i++) {
+            buf = op[i].run(r, buf, &op[i]);
+        }
+
+        ngx_linefeed(buf);
+
+        return buf;
+    }
+
+    /* a schema precedes the first record in a newly opened file */
+
+    buffer = log->file->data;
+
+    if (log->schema != buffer->generation) {
+        buf = ngx_cpymem(buf, fmt->schema.data, fmt->schema.len);
+        log->schema = buffer->generation;
+    }
+
+    p = buf + 4;
+
+    *p++ = NGX_HTTP_LOG_DATA;
+    p = ngx_http_log_varint(p, fmt->id);
+
+    for (i = 0; i < fmt->ops->nelts; i++) {
+        p = op[i].run(r, p, &op[i]);
+    }
+
+    len = p - buf - 4;
+
+    buf[0] = (u_char) len;
+    buf[1] = (u_char) (len >> 8);
+    buf[2] = (u_char) (len >> 16);
+    buf[3] = (u_char) (len >> 24);
+
+    return p;
+}
+
+
 static void
 ngx_http_log_write(ngx_http_request_t *r, ngx_http_log_t *log, u_char *buf,
     size_t len)
@@ -698,28 +891,22 @@ ngx_http_log_gzip_free(void *opaque, void *address)
 
 
 static void
-ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
+ngx_http_log_write_file(ngx_open_file_t *file, u_char *buf, size_t len,
+    ngx_log_t *log)
 {
-    size_t               len;
     ssize_t              n;
+#if (NGX_ZLIB)
     ngx_http_log_buf_t  *buffer;
 
     buffer = file->data;
 
-    len = buffer->pos - buffer->start;
-
-    if (len == 0) {
-        return;
-    }
-
-#if (NGX_ZLIB)
     if (buffer->gzip) {
-        n = ngx_http_log_gzip(file->fd, buffer->start, len, buffer->gzip, log);
+        n = ngx_http_log_gzip(file->fd, buf, len, buffer->gzip, log);
     } else {
-        n = ngx_write_fd(file->fd, buffer->start, len);
+        n = ngx_write_fd(file->fd, buf, len);
     }
 #else
-    n = ngx_write_fd(file->fd, buffer->start, len);
+    n = ngx_write_fd(file->fd, buf, len);
 #endif
 
     if (n == -1) {
@@ -732,6 +919,41 @@ ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
                       ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
                       file->name.data, n, len);
     }
+}
+
+
+static void
+ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
+{
+    size_t               len;
+    ngx_http_log_buf_t  *buffer;
+
+    buffer = file->data;
+
+    if (buffer->ring) {
+
+        /*
+         * a worker drains its own ring on exit and before reopening
+         * logs, the logger process drains all rings by itself
+         */
+
+        if (ngx_process == NGX_PROCESS_WORKER) {
+            (void) ngx_http_log_ring_drain(file, ngx_worker, log);
+
+        } else if (ngx_process == NGX_PROCESS_SINGLE) {
+            (void) ngx_http_log_ring_handler(file);
+        }
+
+        return;
+    }
+
+    len = buffer->pos - buffer->start;
+
+    if (len == 0) {
+        return;
+    }
+
+    ngx_http_log_write_file(file, buffer->start, len, log);
 
     buffer->pos = buffer->start;
 
@@ -741,6 +963,20 @@ ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
 }
 
 
+static void
+ngx_http_log_reopen(ngx_open_file_t *file, ngx_log_t *log)
+{
+    ngx_http_log_buf_t  *buffer;
+
+    ngx_http_log_flush(file, log);
+
+    /* binary logs write the schema again into a reopened file */
+
+    buffer = file->data;
+    buffer->generation++;
+}
+
+
 static void
 ngx_http_log_flush_handler(ngx_event_t *ev)
 {
@@ -764,6 +1000,212 @@ ngx_http_log_flush_handler(ngx_event_t *ev)
 }
 
 
+static void
+ngx_http_log_ring_append(ngx_http_request_t *r, ngx_http_log_t *log,
+    u_char *buf, size_t len)
+{
+    ngx_int_t                rc;
+    ngx_uint_t               i;
+    ngx_http_log_buf_t      *buffer;
+    ngx_http_log_ring_t     *ring;
+    ngx_http_log_ring_sh_t  *sh;
+
+    buffer = log->file->data;
+    ring = buffer->ring;
+
+    i = ngx_worker % ring->n;
+    sh = ngx_http_log_ring_sh(ring, i);
+
+    rc = ngx_http_log_ring_put(sh, ring->size, buf, len);
+
+    if (rc == NGX_DECLINED && ngx_process == NGX_PROCESS_SINGLE) {
+
+        /* there is no logger process to wait for */
+
+        (void) ngx_http_log_ring_drain(log->file, i, r->connection->log);
+
+        rc = ngx_http_log_ring_put(sh, ring->size, buf, len);
+    }
+
+    if (rc == NGX_DECLINED) {
+        (void) ngx_atomic_fetch_add(&sh->dropped, 1);
+    }
+
+    if (ngx_exiting) {
+
+        /* the logger process is gone once graceful shutdown is started */
+
+        (void) ngx_http_log_ring_drain(log->file, i, r->connection->log);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_log_ring_put(ngx_http_log_ring_sh_t *sh, size_t size, u_char *buf,
+    size_t len)
+{
+    u_char            *data;
+    size_t             n;
+    ngx_atomic_uint_t  head, pos;
+
+    head = sh->head;
+
+    if (len > size - (head - sh->tail)) {
+        return NGX_DECLINED;
+    }
+
+    data = (u_char *) sh + sizeof(ngx_http_log_ring_sh_t);
+
+    pos = head & (size - 1);
+    n = ngx_min(len, size - pos);
+
+    ngx_memcpy(data + pos, buf, n);
+    ngx_memcpy(data, buf + n, len - n);
+
+    /* the record must be visible before the new head */
+
+    ngx_memory_barrier();
+
+    sh->head = head + len;
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_http_log_ring_drain(ngx_open_file_t *file, ngx_uint_t i, ngx_log_t *log)
+{
+    u_char                  *data;
+    size_t                   len, n;
+    ngx_atomic_uint_t        head, tail, pos, dropped;
+    ngx_http_log_buf_t      *buffer;
+    ngx_http_log_ring_t     *ring;
+    ngx_http_log_ring_sh_t  *sh;
+
+    buffer = file->data;
+    ring = buffer->ring;
+
+    sh = ngx_http_log_ring_sh(ring, i);
+
+    if (!ngx_http_log_ring_lock(sh)) {
+        return 0;
+    }
+
+    head = sh->head;
+    tail = sh->tail;
+
+    ngx_memory_barrier();
+
+    len = head - tail;
+
+    if (len) {
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http log ring %ui of \"%s\": %uz",
+                       i, file->name.data, len);
+
+        data = (u_char *) sh + sizeof(ngx_http_log_ring_sh_t);
+
+        pos = tail & (ring->size - 1);
+        n = ngx_min(len, ring->size - pos);
+
+        ngx_http_log_write_file(file, data + pos, n, log);
+
+        if (n < len) {
+            ngx_http_log_write_file(file, data, len - n, log);
+        }
+
+        /* the records must be read before they may be overwritten */
+
+        ngx_memory_barrier();
+
+        sh->tail = head;
+    }
+
+    dropped = sh->dropped;
+
+    if (dropped) {
+        (void) ngx_atomic_fetch_add(&sh->dropped,
+                                    - (ngx_atomic_int_t) dropped);
+
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "%uA records dropped by worker %ui, "
+                      "access_log ring of \"%s\" is full",
+                      dropped, i, file->name.data);
+    }
+
+    ngx_unlock(&sh->lock);
+
+    return len;
+}
+
+
+static ngx_uint_t
+ngx_http_log_ring_lock(ngx_http_log_ring_sh_t *sh)
+{
+#if !(NGX_WIN32)
+    ngx_pid_t  pid;
+#endif
+
+    if (ngx_atomic_cmp_set(&sh->lock, 0, ngx_pid)) {
+        return 1;
+    }
+
+#if !(NGX_WIN32)
+
+    /* take over the lock of a logger process which has crashed */
+
+    pid = (ngx_pid_t) sh->lock;
+
+    if (pid && kill(pid, 0) == -1 && ngx_errno == NGX_ESRCH) {
+        return ngx_atomic_cmp_set(&sh->lock, pid, ngx_pid);
+    }
+
+#endif
+
+    return 0;
+}
+
+
+static ngx_msec_t
+ngx_http_log_ring_handler(void *data)
+{
+    ngx_open_file_t *file = data;
+
+    size_t               len;
+    ngx_uint_t           i;
+    ngx_http_log_buf_t  *buffer;
+
+    buffer = file->data;
+
+    len = 0;
+
+    for (i = 0; i < buffer->ring->n; i++) {
+        len += ngx_http_log_ring_drain(file, i, ngx_cycle->log);
+    }
+
+    /* the logger process may afford to wait for the disk */
+
+    if (len && ngx_process == NGX_PROCESS_HELPER
+        && ngx_fsync(file->fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_fsync_n " \"%s\" failed", file->name.data);
+    }
+
+    return buffer->flush;
+}
+
+
+static void
+ngx_http_log_ring_flush_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "http log ring flush handler");
+
+    ngx_add_timer(ev, ngx_http_log_ring_handler(ev->data));
+}
+
+
 static u_char *
 ngx_http_log_copy_short(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
@@ -849,22 +1291,26 @@ ngx_http_log_request_time(ngx_http_request_t *r, u_char *buf,
 static u_char *
 ngx_http_log_status(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
 {
-    ngx_uint_t  status;
+    return ngx_sprintf(buf, "%03ui", ngx_http_log_get_status(r));
+}
 
-    if (r->err_status) {
-        status = r->err_status;
 
-    } else if (r->headers_out.status) {
-        status = r->headers_out.status;
+static ngx_uint_t
+ngx_http_log_get_status(ngx_http_request_t *r)
+{
+    if (r->err_status) {
+        return r->err_status;
+    }
 
-    } else if (r->http_version == NGX_HTTP_VERSION_9) {
-        status = 9;
+    if (r->headers_out.status) {
+        return r->headers_out.status;
+    }
 
-    } else {
-        status = 0;
+    if (r->http_version == NGX_HTTP_VERSION_9) {
+        return 9;
     }
 
-    return ngx_sprintf(buf, "%03ui", status);
+    return 0;
 }
 
 
@@ -882,28 +1328,160 @@ ngx_http_log_bytes_sent(ngx_http_request_t *r, u_char *buf,
  */
 
 static u_char *
-ngx_http_log_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
+ngx_http_log_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    off_t  length;
+
+    length = r->connection->sent - r->header_size;
+
+    if (length > 0) {
+        return ngx_sprintf(buf, "%O", length);
+    }
+
+    *buf = '0';
+
+    return buf + 1;
+}
+
+
+static u_char *
+ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%O", r->request_length);
+}
+
+
+static u_char *
+ngx_http_log_binary_text(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    u_char                  *p;
+    ngx_http_log_op_run_pt   run;
+
+    /* the text of the log variables is shorter than 127 bytes */
+
+    run = (ngx_http_log_op_run_pt) op->data;
+
+    p = run(r, buf + 1, op);
+
+    *buf = (u_char) (p - buf);
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_log_binary_msec(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+
+    return ngx_http_log_varint(buf, (uint64_t) tp->sec * 1000 + tp->msec);
+}
+
+
+static u_char *
+ngx_http_log_binary_request_time(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    ngx_time_t      *tp;
+    ngx_msec_int_t   ms;
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    ms = ngx_max(ms, 0);
+
+    return ngx_http_log_varint(buf, ms);
+}
+
+
+static u_char *
+ngx_http_log_binary_status(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_http_log_varint(buf, ngx_http_log_get_status(r));
+}
+
+
+static u_char *
+ngx_http_log_binary_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_http_log_varint(buf, r->connection->sent);
+}
+
+
+static u_char *
+ngx_http_log_binary_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    off_t  length;
+
+    length = r->connection->sent - r->header_size;
+
+    return ngx_http_log_varint(buf, length > 0 ? length : 0);
+}
+
+
+static u_char *
+ngx_http_log_binary_request_length(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_http_log_varint(buf, r->request_length);
+}
+
+
+static size_t
+ngx_http_log_binary_variable_getlen(ngx_http_request_t *r, uintptr_t data)
+{
+    ngx_http_variable_value_t  *value;
+
+    value = ngx_http_get_indexed_variable(r, data);
+
+    if (value == NULL || value->not_found) {
+        return 1;
+    }
+
+    return NGX_HTTP_LOG_VARINT_LEN + value->len;
+}
+
+
+static u_char *
+ngx_http_log_binary_variable(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
 {
-    off_t  length;
+    ngx_http_variable_value_t  *value;
 
-    length = r->connection->sent - r->header_size;
+    value = ngx_http_get_indexed_variable(r, op->data);
 
-    if (length > 0) {
-        return ngx_sprintf(buf, "%O", length);
+    if (value == NULL || value->not_found) {
+        *buf = 0;
+        return buf + 1;
     }
 
-    *buf = '0';
+    buf = ngx_http_log_varint(buf, (uint64_t) value->len + 1);
 
-    return buf + 1;
+    return ngx_cpymem(buf, value->data, value->len);
 }
 
 
 static u_char *
-ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
+ngx_http_log_varint(u_char *p, uint64_t n)
 {
-    return ngx_sprintf(buf, "%O", r->request_length);
+    while (n >= 0x80) {
+        *p++ = (u_char) (n | 0x80);
+        n >>= 7;
+    }
+
+    *p++ = (u_char) n;
+
+    return p;
 }
 
 
@@ -972,6 +1550,9 @@ static uintptr_t
 ngx_http_log_escape(u_char *dst, u_char *src, size_t size)
 {
     ngx_uint_t      n;
+#if (NGX_HAVE_SSE2)
+    ngx_uint_t      mask;
+#endif
     static u_char   hex[] = "0123456789ABCDEF";
 
     static uint32_t   escape[] = {
@@ -999,6 +1580,20 @@ ngx_http_log_escape(u_char *dst, u_char *src, size_t size)
 
         n = 0;
 
+#if (NGX_HAVE_SSE2)
+
+        while (size >= 16) {
+
+            for (mask = ngx_http_log_escape_mask(src); mask; n++) {
+                mask &= mask - 1;
+            }
+
+            src += 16;
+            size -= 16;
+        }
+
+#endif
+
         while (size) {
             if (escape[*src >> 5] & (1U << (*src & 0x1f))) {
                 n++;
@@ -1010,6 +1605,37 @@ ngx_http_log_escape(u_char *dst, u_char *src, size_t size)
         return (uintptr_t) n;
     }
 
+#if (NGX_HAVE_SSE2)
+
+    while (size >= 16) {
+
+        mask = ngx_http_log_escape_mask(src);
+
+        if (mask == 0) {
+            dst = ngx_cpymem(dst, src, 16);
+            src += 16;
+            size -= 16;
+            continue;
+        }
+
+        for (n = 0; n < 16; n++) {
+            if (mask & (1 << n)) {
+                *dst++ = '\\';
+                *dst++ = 'x';
+                *dst++ = hex[*src >> 4];
+                *dst++ = hex[*src & 0xf];
+                src++;
+
+            } else {
+                *dst++ = *src++;
+            }
+        }
+
+        size -= 16;
+    }
+
+#endif
+
     while (size) {
         if (escape[*src >> 5] & (1U << (*src & 0x1f))) {
             *dst++ = '\\';
@@ -1028,6 +1654,33 @@ ngx_http_log_escape(u_char *dst, u_char *src, size_t size)
 }
 
 
+#if (NGX_HAVE_SSE2)
+
+/*
+ * returns the bit mask of the characters to be escaped among the
+ * 16 bytes at p: the control characters and the bytes with the high
+ * bit set are less than 0x20 as signed, quote, backslash and DEL are
+ * compared directly
+ */
+
+static ngx_inline ngx_uint_t
+ngx_http_log_escape_mask(u_char *p)
+{
+    __m128i  v, m;
+
+    v = _mm_loadu_si128((__m128i *) p);
+
+    m = _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+
+    return (ngx_uint_t) _mm_movemask_epi8(m);
+}
+
+#endif
+
+
 static void *
 ngx_http_log_create_main_conf(ngx_conf_t *cf)
 {
@@ -1051,6 +1704,8 @@ ngx_http_log_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    ngx_memzero(fmt, sizeof(ngx_http_log_fmt_t));
+
     ngx_str_set(&fmt->name, "combined");
 
     fmt->flushes = NULL;
@@ -1145,12 +1800,14 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_log_loc_conf_t *llcf = conf;
 
+    size_t                             ring;
     ssize_t                            size;
     ngx_int_t                          gzip;
     ngx_uint_t                         i, n;
     ngx_msec_t                         flush;
     ngx_str_t                         *value, name, s;
     ngx_http_log_t                    *log;
+    ngx_logger_t                      *logger;
     ngx_syslog_peer_t                 *peer;
     ngx_http_log_buf_t                *buffer;
     ngx_http_log_fmt_t                *fmt;
@@ -1187,7 +1844,6 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     ngx_memzero(log, sizeof(ngx_http_log_t));
 
-
     if (ngx_strncmp(value[1].data, "syslog:", 7) == 0) {
 
         peer = ngx_pcalloc(cf->pool, sizeof(ngx_syslog_peer_t));
@@ -1267,9 +1923,18 @@ process_formats:
         return NGX_CONF_ERROR;
     }
 
+    if (log->format->binary && (log->syslog_peer || log->script)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "binary log format \"%V\" can be used only "
+                           "with a log file without variables in name",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
     size = 0;
     flush = 0;
     gzip = 0;
+    ring = 0;
 
     for (i = 3; i < cf->args->nelts; i++) {
 
@@ -1307,10 +1972,6 @@ process_formats:
             && (value[i].len == 4 || value[i].data[4] == '='))
         {
 #if (NGX_ZLIB)
-            if (size == 0) {
-                size = 64 * 1024;
-            }
-
             if (value[i].len == 4) {
                 gzip = Z_BEST_SPEED;
                 continue;
@@ -1336,6 +1997,27 @@ process_formats:
 #endif
         }
 
+        if (ngx_strncmp(value[i].data, "ring=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            ring = ngx_parse_size(&s);
+
+            if (ring == (size_t) NGX_ERROR || ring == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ring size \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            /* a ring size is rounded up to a power of 2 */
+
+            for (n = ngx_pagesize; n < ring; n <<= 1) { /* void */ }
+
+            ring = n;
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "if=", 3) == 0) {
             s.len = value[i].len - 3;
             s.data = value[i].data + 3;
@@ -1364,14 +2046,38 @@ process_formats:
         return NGX_CONF_ERROR;
     }
 
-    if (flush && size == 0) {
+    if (ring) {
+
+        if (log->format->binary) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "binary log format \"%V\" cannot be used "
+                               "with \"ring\"", &name);
+            return NGX_CONF_ERROR;
+        }
+
+        if (size) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"buffer\" and \"ring\" cannot be used "
+                               "together");
+            return NGX_CONF_ERROR;
+        }
+
+        if (flush == 0) {
+            flush = NGX_HTTP_LOG_RING_FLUSH;
+        }
+
+    } else if (gzip && size == 0) {
+        size = 64 * 1024;
+    }
+
+    if (flush && size == 0 && ring == 0) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "no buffer is defined for access_log \"%V\"",
                            &value[1]);
         return NGX_CONF_ERROR;
     }
 
-    if (size) {
+    if (size || ring) {
 
         if (log->script) {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
@@ -1385,10 +2091,12 @@ process_formats:
             return NGX_CONF_ERROR;
         }
 
-        if (log->file->data) {
-            buffer = log->file->data;
+        buffer = log->file->data;
+
+        if (buffer && (buffer->start || buffer->ring)) {
 
             if (buffer->last - buffer->start != size
+                || (buffer->ring ? buffer->ring->size : 0) != ring
                 || buffer->flush != flush
                 || buffer->gzip != gzip)
             {
@@ -1402,18 +2110,20 @@ process_formats:
             return NGX_CONF_OK;
         }
 
-        buffer = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_buf_t));
+        buffer = ngx_http_log_file_buffer(cf, log->file);
         if (buffer == NULL) {
             return NGX_CONF_ERROR;
         }
 
-        buffer->start = ngx_pnalloc(cf->pool, size);
-        if (buffer->start == NULL) {
-            return NGX_CONF_ERROR;
-        }
+        if (size) {
+            buffer->start = ngx_pnalloc(cf->pool, size);
+            if (buffer->start == NULL) {
+                return NGX_CONF_ERROR;
+            }
 
-        buffer->pos = buffer->start;
-        buffer->last = buffer->start + size;
+            buffer->pos = buffer->start;
+            buffer->last = buffer->start + size;
+        }
 
         if (flush) {
             buffer->event = ngx_pcalloc(cf->pool, sizeof(ngx_event_t));
@@ -1422,23 +2132,75 @@ process_formats:
             }
 
             buffer->event->data = log->file;
-            buffer->event->handler = ngx_http_log_flush_handler;
+            buffer->event->handler = ring ? ngx_http_log_ring_flush_handler
+                                          : ngx_http_log_flush_handler;
             buffer->event->log = &cf->cycle->new_log;
             buffer->event->cancelable = 1;
 
             buffer->flush = flush;
         }
 
+        if (ring) {
+
+            /* the rings are allocated in ngx_http_log_init_module() */
+
+            buffer->ring = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_ring_t));
+            if (buffer->ring == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            buffer->ring->size = ring;
+
+            logger = ngx_array_push(&cf->cycle->loggers);
+            if (logger == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            logger->handler = ngx_http_log_ring_handler;
+            logger->data = log->file;
+        }
+
         buffer->gzip = gzip;
 
-        log->file->flush = ngx_http_log_flush;
-        log->file->data = buffer;
+        return NGX_CONF_OK;
+    }
+
+    if (log->format->binary) {
+
+        /* an unbuffered binary log tracks reopening of the file */
+
+        if (ngx_http_log_file_buffer(cf, log->file) == NULL) {
+            return NGX_CONF_ERROR;
+        }
     }
 
     return NGX_CONF_OK;
 }
 
 
+static ngx_http_log_buf_t *
+ngx_http_log_file_buffer(ngx_conf_t *cf, ngx_open_file_t *file)
+{
+    ngx_http_log_buf_t  *buffer;
+
+    if (file->data) {
+        return file->data;
+    }
+
+    buffer = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_buf_t));
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    buffer->generation = 1;
+
+    file->flush = ngx_http_log_reopen;
+    file->data = buffer;
+
+    return buffer;
+}
+
+
 static char *
 ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -1456,7 +2218,7 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             && ngx_strcmp(fmt[i].name.data, value[1].data) == 0)
         {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "duplicate \"log_format\" name \"%V\"",
+                               "duplicate \"%V\" name \"%V\"", &cmd->name,
                                &value[1]);
             return NGX_CONF_ERROR;
         }
@@ -1467,7 +2229,10 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    ngx_memzero(fmt, sizeof(ngx_http_log_fmt_t));
+
     fmt->name = value[1];
+    fmt->binary = (cmd->name.len == sizeof("binary_log_format") - 1) ? 1 : 0;
 
     fmt->flushes = ngx_array_create(cf->pool, 4, sizeof(ngx_int_t));
     if (fmt->flushes == NULL) {
@@ -1479,22 +2244,49 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    return ngx_http_log_compile_format(cf, fmt->flushes, fmt->ops, cf->args, 2);
+    if (fmt->binary) {
+        fmt->fields = ngx_array_create(cf->pool, 64, sizeof(u_char));
+        if (fmt->fields == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ngx_http_log_compile_format(cf, fmt, cf->args, 2) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (fmt->binary) {
+
+        if (fmt->nfields == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "binary log format \"%V\" has no variables",
+                               &fmt->name);
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_http_log_binary_schema(cf, fmt) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
 }
 
 
 static char *
-ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
-    ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s)
+ngx_http_log_compile_format(ngx_conf_t *cf, ngx_http_log_fmt_t *fmt,
+    ngx_array_t *args, ngx_uint_t s)
 {
     u_char              *data, *p, ch;
     size_t               i, len;
     ngx_str_t           *value, var;
     ngx_int_t           *flush;
     ngx_uint_t           bracket;
+    ngx_array_t         *ops;
     ngx_http_log_op_t   *op;
     ngx_http_log_var_t  *v;
 
+    ops = fmt->ops;
     value = args->elts;
 
     for ( /* void */ ; s < args->nelts; s++) {
@@ -1571,6 +2363,26 @@ ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
                         op->run = v->run;
                         op->data = 0;
 
+                        if (!fmt->binary) {
+                            goto found;
+                        }
+
+                        if (v->binary) {
+                            op->len = NGX_HTTP_LOG_VARINT_LEN;
+                            op->run = v->binary;
+
+                        } else {
+                            op->len = v->len + 1;
+                            op->run = ngx_http_log_binary_text;
+                            op->data = (uintptr_t) v->run;
+                        }
+
+                        if (ngx_http_log_add_field(cf, fmt, &var, v->type)
+                            != NGX_OK)
+                        {
+                            return NGX_CONF_ERROR;
+                        }
+
                         goto found;
                     }
                 }
@@ -1579,9 +2391,9 @@ ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
                     return NGX_CONF_ERROR;
                 }
 
-                if (flushes) {
+                if (fmt->flushes) {
 
-                    flush = ngx_array_push(flushes);
+                    flush = ngx_array_push(fmt->flushes);
                     if (flush == NULL) {
                         return NGX_CONF_ERROR;
                     }
@@ -1589,6 +2401,18 @@ ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
                     *flush = op->data; /* variable index */
                 }
 
+                if (fmt->binary) {
+                    op->getlen = ngx_http_log_binary_variable_getlen;
+                    op->run = ngx_http_log_binary_variable;
+
+                    if (ngx_http_log_add_field(cf, fmt, &var,
+                                               NGX_HTTP_LOG_STRING)
+                        != NGX_OK)
+                    {
+                        return NGX_CONF_ERROR;
+                    }
+                }
+
             found:
 
                 continue;
@@ -1602,6 +2426,46 @@ ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
 
             len = &value[s].data[i] - data;
 
+            if (fmt->binary) {
+
+                /* binary records have no room for text between fields */
+
+                for (p = data; p < &value[s].data[i]; p++) {
+                    if (*p != ' ' && *p != '\t' && *p != CR && *p != LF) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                           "text \"%*s\" in binary log format",
+                                           len, data);
+                        return NGX_CONF_ERROR;
+                    }
+                }
+
+                ops->nelts--;
+                continue;
+            }
+
+            if (len && ops->nelts > 1
+                && (op[-1].run == ngx_http_log_copy_short
+                    || op[-1].run == ngx_http_log_copy_long))
+            {
+                /*
+                 * literals of adjacent format strings are merged
+                 * into one copy operation
+                 */
+
+                p = ngx_pnalloc(cf->pool, op[-1].len + len);
+                if (p == NULL) {
+                    return NGX_CONF_ERROR;
+                }
+
+                ngx_memcpy(op[-1].run(NULL, p, &op[-1]), data, len);
+
+                ops->nelts--;
+                op--;
+
+                data = p;
+                len += op->len;
+            }
+
             if (len) {
 
                 op->len = len;
@@ -1641,6 +2505,68 @@ invalid:
 }
 
 
+static ngx_int_t
+ngx_http_log_add_field(ngx_conf_t *cf, ngx_http_log_fmt_t *fmt,
+    ngx_str_t *name, u_char type)
+{
+    u_char  *p, *last;
+
+    p = ngx_array_push_n(fmt->fields, 1 + NGX_HTTP_LOG_VARINT_LEN + name->len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    *p++ = type;
+    p = ngx_http_log_varint(p, name->len);
+    p = ngx_cpymem(p, name->data, name->len);
+
+    last = (u_char *) fmt->fields->elts + fmt->fields->nelts;
+    fmt->fields->nelts -= last - p;
+
+    fmt->nfields++;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_log_binary_schema(ngx_conf_t *cf, ngx_http_log_fmt_t *fmt)
+{
+    u_char  *p, *start;
+    size_t   len;
+
+    /* the same fields produce the same schema id in any configuration */
+
+    fmt->id = ngx_crc32_long(fmt->fields->elts, fmt->fields->nelts);
+
+    start = ngx_pnalloc(cf->pool, NGX_HTTP_LOG_RECORD_LEN
+                                  + NGX_HTTP_LOG_VARINT_LEN
+                                  + fmt->fields->nelts);
+    if (start == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = start + 4;
+
+    *p++ = NGX_HTTP_LOG_SCHEMA;
+    p = ngx_http_log_varint(p, fmt->id);
+    p = ngx_http_log_varint(p, fmt->nfields);
+    p = ngx_cpymem(p, fmt->fields->elts, fmt->fields->nelts);
+
+    len = p - start - 4;
+
+    start[0] = (u_char) len;
+    start[1] = (u_char) (len >> 8);
+    start[2] = (u_char) (len >> 16);
+    start[3] = (u_char) (len >> 24);
+
+    fmt->schema.len = p - start;
+    fmt->schema.data = start;
+
+    return NGX_OK;
+}
+
+
 static char *
 ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -1774,7 +2700,7 @@ ngx_http_log_init(ngx_conf_t *cf)
         *value = ngx_http_combined_fmt;
         fmt = lmcf->formats.elts;
 
-        if (ngx_http_log_compile_format(cf, NULL, fmt->ops, &a, 0)
+        if (ngx_http_log_compile_format(cf, fmt, &a, 0)
             != NGX_CONF_OK)
         {
             return NGX_ERROR;
@@ -1792,3 +2718,99 @@ ngx_http_log_init(ngx_conf_t *cf)
 
     return NGX_OK;
 }
+
+
+static ngx_int_t
+ngx_http_log_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t            i;
+    ngx_logger_t         *logger;
+    ngx_core_conf_t      *ccf;
+    ngx_open_file_t      *file;
+    ngx_pool_cleanup_t   *cln;
+    ngx_http_log_buf_t   *buffer;
+    ngx_http_log_ring_t  *ring;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    logger = cycle->loggers.elts;
+
+    for (i = 0; i < cycle->loggers.nelts; i++) {
+
+        if (logger[i].handler != ngx_http_log_ring_handler) {
+            continue;
+        }
+
+        file = logger[i].data;
+        buffer = file->data;
+        ring = buffer->ring;
+
+        /*
+         * the rings are allocated for each cycle anew, so the workers
+         * of the old cycle keep logging to their own rings on reload
+         */
+
+        ring->n = ccf->worker_processes;
+
+        ring->shm.size = ring->n * (sizeof(ngx_http_log_ring_sh_t)
+                                    + ring->size);
+        ring->shm.name = file->name;
+        ring->shm.log = cycle->log;
+
+        if (ngx_shm_alloc(&ring->shm) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        cln = ngx_pool_cleanup_add(cycle->pool, 0);
+        if (cln == NULL) {
+            ngx_shm_free(&ring->shm);
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_log_ring_cleanup;
+        cln->data = ring;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_log_ring_cleanup(void *data)
+{
+    ngx_http_log_ring_t  *ring = data;
+
+    ngx_shm_free(&ring->shm);
+}
+
+
+static ngx_int_t
+ngx_http_log_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t           i;
+    ngx_logger_t        *logger;
+    ngx_open_file_t     *file;
+    ngx_http_log_buf_t  *buffer;
+
+    if (ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    /* without the logger process the rings are drained by timer */
+
+    logger = cycle->loggers.elts;
+
+    for (i = 0; i < cycle->loggers.nelts; i++) {
+
+        if (logger[i].handler != ngx_http_log_ring_handler) {
+            continue;
+        }
+
+        file = logger[i].data;
+        buffer = file->data;
+
+        ngx_add_timer(buffer->event, buffer->flush);
+    }
+
+    return NGX_OK;
+}
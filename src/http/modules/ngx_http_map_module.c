@@ -347,8 +347,29 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 #if (NGX_PCRE)
 
     if (ctx.regexes.nelts) {
+        ngx_uint_t          i;
+        ngx_http_regex_t  **regex;
+
         map->map.regex = ctx.regexes.elts;
         map->map.nregex = ctx.regexes.nelts;
+
+        regex = ngx_palloc(pool, map->map.nregex * sizeof(ngx_http_regex_t *));
+        if (regex == NULL) {
+            ngx_destroy_pool(pool);
+            return NGX_CONF_ERROR;
+        }
+
+        for (i = 0; i < map->map.nregex; i++) {
+            regex[i] = map->map.regex[i].regex;
+        }
+
+        if (ngx_http_regex_set_compile(cf, &map->map.regex_set, regex,
+                                       map->map.nregex)
+            != NGX_OK)
+        {
+            ngx_destroy_pool(pool);
+            return NGX_CONF_ERROR;
+        }
     }
 
 #endif
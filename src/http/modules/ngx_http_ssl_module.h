@@ -28,6 +28,15 @@ typedef struct {
 
     size_t                          buffer_size;
 
+    size_t                          dyn_rec_threshold;
+    ngx_msec_t                      dyn_rec_timeout;
+
+    ngx_flag_t                      ktls;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t              *thread_pool;
+#endif
+
     ssize_t                         builtin_session_cache;
 
     time_t                          session_timeout;
@@ -0,0 +1,558 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * The balancer picks two random peers and selects the one with the lower
+ * cost, that is, the average response time multiplied by the number of
+ * active connections and divided by the weight.  The average is kept in
+ * the peer itself, so it is shared by worker processes if the upstream
+ * group is in a shared memory zone.
+ */
+
+#define NGX_HTTP_UPSTREAM_EWMA_TRIES  20
+
+
+typedef struct {
+    time_t                              decay;
+
+    /* the index of the primary peers, built on first use */
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_rr_peer_t       **peer;
+} ngx_http_upstream_ewma_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t    rrp;
+    ngx_http_upstream_ewma_srv_conf_t  *conf;
+    ngx_msec_t                          start;
+} ngx_http_upstream_ewma_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_ewma(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_init_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_ewma_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstream_free_ewma_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static ngx_http_upstream_rr_peer_t *ngx_http_upstream_ewma_choose(
+    ngx_http_upstream_ewma_peer_data_t *ep, time_t now, ngx_uint_t *p);
+static ngx_http_upstream_rr_peer_t *ngx_http_upstream_ewma_scan(
+    ngx_http_upstream_ewma_peer_data_t *ep, time_t now, ngx_uint_t *p);
+static ngx_uint_t ngx_http_upstream_ewma_usable(
+    ngx_http_upstream_rr_peer_data_t *rrp, ngx_http_upstream_rr_peer_t *peer,
+    ngx_uint_t i, time_t now);
+static ngx_uint_t ngx_http_upstream_ewma_better(
+    ngx_http_upstream_rr_peer_t *one, ngx_http_upstream_rr_peer_t *two,
+    time_t now, time_t decay);
+static ngx_int_t ngx_http_upstream_ewma_index(
+    ngx_http_upstream_ewma_srv_conf_t *ecf,
+    ngx_http_upstream_rr_peers_t *peers);
+
+static void *ngx_http_upstream_ewma_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_ewma_commands[] = {
+
+    { ngx_string("ewma"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_upstream_ewma,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_ewma_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_ewma_create_conf,    /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_ewma_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_ewma_module_ctx,    /* module context */
+    ngx_http_upstream_ewma_commands,       /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_ewma(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "init ewma");
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_ewma_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_ewma_srv_conf_t   *ecf;
+    ngx_http_upstream_ewma_peer_data_t  *ep;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init ewma peer");
+
+    ecf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_ewma_module);
+
+    /*
+     * the peers are copied to a shared memory zone after configuration,
+     * so the index is built here, when the final peers are known
+     */
+
+    if (ecf->peers != us->peer.data) {
+        if (ngx_http_upstream_ewma_index(ecf, us->peer.data) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ep = ngx_palloc(r->pool, sizeof(ngx_http_upstream_ewma_peer_data_t));
+    if (ep == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &ep->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ep->conf = ecf;
+    ep->start = 0;
+
+    r->upstream->peer.get = ngx_http_upstream_get_ewma_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_ewma_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_ewma_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_ewma_peer_data_t  *ep = data;
+
+    time_t                             now;
+    uintptr_t                          m;
+    ngx_int_t                          rc;
+    ngx_uint_t                         i, n, p;
+    ngx_http_upstream_rr_peer_t       *peer, *best;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+
+    rrp = &ep->rrp;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get ewma peer, try: %ui", pc->tries);
+
+    ep->start = ngx_current_msec;
+
+    if (rrp->peers->single) {
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    peers = rrp->peers;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    if (peers == ep->conf->peers && peers->number > 1) {
+        best = ngx_http_upstream_ewma_choose(ep, now, &p);
+
+    } else {
+        best = ngx_http_upstream_ewma_scan(ep, now, &p);
+    }
+
+    if (best == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get ewma peer, no peer found");
+
+        goto failed;
+    }
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    best->conns++;
+
+    rrp->current = best;
+
+    n = p / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+    rrp->tried[n] |= m;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+
+failed:
+
+    if (peers->next) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get ewma peer, backup servers");
+
+        rrp->peers = peers->next;
+
+        n = (rrp->peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        for (i = 0; i < n; i++) {
+            rrp->tried[i] = 0;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        rc = ngx_http_upstream_get_ewma_peer(pc, ep);
+
+        if (rc != NGX_BUSY) {
+            return rc;
+        }
+
+        ngx_http_upstream_rr_peers_wlock(peers);
+    }
+
+    /* all peers failed, mark them as live for quick recovery */
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        peer->fails = 0;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_http_upstream_free_ewma_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_ewma_peer_data_t  *ep = data;
+
+    ngx_msec_t                     elapsed;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    /*
+     * failed attempts are accounted by max_fails and fail_timeout,
+     * their time does not reflect the time the peer takes to respond
+     */
+
+    if (!(state & NGX_PEER_FAILED)) {
+        peer = ep->rrp.current;
+        peers = ep->rrp.peers;
+
+        elapsed = ngx_current_msec - ep->start;
+
+        ngx_http_upstream_rr_peers_rlock(peers);
+        ngx_http_upstream_rr_peer_lock(peers, peer);
+
+        /* the average is kept scaled by 8, as the smoothed TCP RTT */
+
+        if (peer->response_time == 0) {
+            peer->response_time = elapsed << 3;
+
+        } else {
+            peer->response_time += elapsed - (peer->response_time >> 3);
+        }
+
+        peer->response_checked = ngx_time();
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "free ewma peer %p %M avg: %M",
+                       peer, elapsed, peer->response_time >> 3);
+
+        ngx_http_upstream_rr_peer_unlock(peers, peer);
+        ngx_http_upstream_rr_peers_unlock(peers);
+    }
+
+    ngx_http_upstream_free_round_robin_peer(pc, &ep->rrp, state);
+}
+
+
+static ngx_http_upstream_rr_peer_t *
+ngx_http_upstream_ewma_choose(ngx_http_upstream_ewma_peer_data_t *ep,
+    time_t now, ngx_uint_t *p)
+{
+    ngx_uint_t                     i, j, n, tries;
+    ngx_http_upstream_rr_peer_t   *one, *two;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    peers = ep->rrp.peers;
+    n = peers->number;
+
+    for (tries = 0; tries < NGX_HTTP_UPSTREAM_EWMA_TRIES; tries++) {
+
+        i = ngx_random() % n;
+        j = ngx_random() % (n - 1);
+
+        if (j >= i) {
+            j++;
+        }
+
+        one = ep->conf->peer[i];
+        two = ep->conf->peer[j];
+
+        if (!ngx_http_upstream_ewma_usable(&ep->rrp, one, i, now)) {
+
+            if (!ngx_http_upstream_ewma_usable(&ep->rrp, two, j, now)) {
+                continue;
+            }
+
+            *p = j;
+            return two;
+        }
+
+        if (!ngx_http_upstream_ewma_usable(&ep->rrp, two, j, now)
+            || ngx_http_upstream_ewma_better(one, two, now, ep->conf->decay))
+        {
+            *p = i;
+            return one;
+        }
+
+        *p = j;
+        return two;
+    }
+
+    /* most of the peers are not usable */
+
+    return ngx_http_upstream_ewma_scan(ep, now, p);
+}
+
+
+static ngx_http_upstream_rr_peer_t *
+ngx_http_upstream_ewma_scan(ngx_http_upstream_ewma_peer_data_t *ep,
+    time_t now, ngx_uint_t *p)
+{
+    ngx_uint_t                    i;
+    ngx_http_upstream_rr_peer_t  *peer, *best;
+
+    best = NULL;
+
+    for (peer = ep->rrp.peers->peer, i = 0;
+         peer;
+         peer = peer->next, i++)
+    {
+        if (!ngx_http_upstream_ewma_usable(&ep->rrp, peer, i, now)) {
+            continue;
+        }
+
+        if (best == NULL
+            || ngx_http_upstream_ewma_better(peer, best, now, ep->conf->decay))
+        {
+            best = peer;
+            *p = i;
+        }
+    }
+
+    return best;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_ewma_usable(ngx_http_upstream_rr_peer_data_t *rrp,
+    ngx_http_upstream_rr_peer_t *peer, ngx_uint_t i, time_t now)
+{
+    uintptr_t   m;
+    ngx_uint_t  n;
+
+    n = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    if (rrp->tried[n] & m) {
+        return 0;
+    }
+
+    if (peer->down) {
+        return 0;
+    }
+
+    if (peer->max_fails
+        && peer->fails >= peer->max_fails
+        && now - peer->checked <= peer->fail_timeout)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_ewma_better(ngx_http_upstream_rr_peer_t *one,
+    ngx_http_upstream_rr_peer_t *two, time_t now, time_t decay)
+{
+    time_t      d1, d2;
+    uint64_t    c1, c2;
+    ngx_msec_t  t1, t2;
+
+    /*
+     * the average of a peer without recent responses is halved each
+     * decay period, so a peer once slow is eventually tried again
+     */
+
+    t1 = one->response_time;
+    t2 = two->response_time;
+
+    d1 = (now - one->response_checked) / decay;
+    d2 = (now - two->response_checked) / decay;
+
+    t1 = (d1 < 16) ? t1 >> d1 : 0;
+    t2 = (d2 < 16) ? t2 >> d2 : 0;
+
+    c1 = (uint64_t) (t1 + 1) * (one->conns + 1) * two->weight;
+    c2 = (uint64_t) (t2 + 1) * (two->conns + 1) * one->weight;
+
+    return c1 < c2;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_ewma_index(ngx_http_upstream_ewma_srv_conf_t *ecf,
+    ngx_http_upstream_rr_peers_t *peers)
+{
+    size_t                        size;
+    ngx_uint_t                    i;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    size = peers->number * sizeof(ngx_http_upstream_rr_peer_t *);
+
+    ecf->peer = ngx_palloc(ngx_cycle->pool, size);
+    if (ecf->peer == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        ecf->peer[i] = peer;
+    }
+
+    ecf->peers = peers;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_upstream_ewma_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_ewma_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_ewma_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->peers = NULL;
+     *     conf->peer = NULL;
+     */
+
+    conf->decay = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_ewma_srv_conf_t  *ecf = conf;
+
+    ngx_str_t                     *value, s;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    ecf->decay = 10;
+
+    if (cf->args->nelts == 2) {
+        value = cf->args->elts;
+
+        if (ngx_strncmp(value[1].data, "decay=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[1].len - 6;
+        s.data = &value[1].data[6];
+
+        ecf->decay = ngx_parse_time(&s, 1);
+
+        if (ecf->decay == (time_t) NGX_ERROR || ecf->decay == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid decay \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_ewma;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    return NGX_CONF_OK;
+}
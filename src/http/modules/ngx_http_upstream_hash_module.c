@@ -18,6 +18,7 @@ typedef struct {
 
 typedef struct {
     ngx_uint_t                          number;
+    uint32_t                           *hash;
     ngx_http_upstream_chash_point_t     point[1];
 } ngx_http_upstream_chash_points_t;
 
@@ -25,6 +26,7 @@ typedef struct {
 typedef struct {
     ngx_http_complex_value_t            key;
     ngx_http_upstream_chash_points_t   *points;
+    ngx_uint_t                          bound;
 } ngx_http_upstream_hash_srv_conf_t;
 
 
@@ -53,6 +55,9 @@ static int ngx_libc_cdecl
     ngx_http_upstream_chash_cmp_points(const void *one, const void *two);
 static ngx_uint_t ngx_http_upstream_find_chash_point(
     ngx_http_upstream_chash_points_t *points, uint32_t hash);
+static ngx_uint_t ngx_http_upstream_chash_overloaded(
+    ngx_http_upstream_rr_peer_t *peer, ngx_uint_t bound, ngx_uint_t conns,
+    ngx_uint_t weight);
 static ngx_int_t ngx_http_upstream_init_chash_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us);
 static ngx_int_t ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc,
@@ -66,7 +71,7 @@ static char *ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_http_upstream_hash_commands[] = {
 
     { ngx_string("hash"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE123,
       ngx_http_upstream_hash,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -391,6 +396,17 @@ ngx_http_upstream_init_chash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
 
     points->number = i + 1;
 
+    /* a flat copy of the point hashes for lookups */
+
+    points->hash = ngx_palloc(cf->pool, points->number * sizeof(uint32_t));
+    if (points->hash == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < points->number; i++) {
+        points->hash[i] = points->point[i].hash;
+    }
+
     hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
     hcf->points = points;
 
@@ -422,31 +438,43 @@ static ngx_uint_t
 ngx_http_upstream_find_chash_point(ngx_http_upstream_chash_points_t *points,
     uint32_t hash)
 {
-    ngx_uint_t                        i, j, k;
-    ngx_http_upstream_chash_point_t  *point;
+    uint32_t    *base;
+    ngx_uint_t   n, half;
 
-    /* find first point >= hash */
+    /*
+     * find first point >= hash; the loop has a fixed number of
+     * iterations and the comparison compiles to a conditional move
+     */
 
-    point = &points->point[0];
+    base = points->hash;
+    n = points->number;
 
-    i = 0;
-    j = points->number;
+    while (n > 1) {
+        half = n / 2;
+        base = (base[half - 1] < hash) ? base + half : base;
+        n -= half;
+    }
 
-    while (i < j) {
-        k = (i + j) / 2;
+    return (base - points->hash) + (*base < hash);
+}
 
-        if (hash > point[k].hash) {
-            i = k + 1;
 
-        } else if (hash < point[k].hash) {
-            j = k;
+static ngx_uint_t
+ngx_http_upstream_chash_overloaded(ngx_http_upstream_rr_peer_t *peer,
+    ngx_uint_t bound, ngx_uint_t conns, ngx_uint_t weight)
+{
+    ngx_uint_t  capacity;
 
-        } else {
-            return k;
-        }
-    }
+    /*
+     * consistent hashing with bounded loads: a peer may have at most
+     * ceil(bound * (conns + 1) * peer weight / total weight) requests,
+     * where bound is a percentage of the average load
+     */
+
+    capacity = (bound * (conns + 1) * peer->weight + 100 * weight - 1)
+               / (100 * weight);
 
-    return i;
+    return peer->conns >= capacity;
 }
 
 
@@ -488,8 +516,9 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     intptr_t                            m;
     ngx_str_t                          *server;
     ngx_int_t                           total;
-    ngx_uint_t                          i, n, best_i;
-    ngx_http_upstream_rr_peer_t        *peer, *best;
+    ngx_uint_t                          i, n, best_i, fallback_i;
+    ngx_uint_t                          conns, weight;
+    ngx_http_upstream_rr_peer_t        *peer, *best, *fallback;
     ngx_http_upstream_chash_point_t    *point;
     ngx_http_upstream_chash_points_t   *points;
     ngx_http_upstream_hash_srv_conf_t  *hcf;
@@ -508,6 +537,26 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     points = hcf->points;
     point = &points->point[0];
 
+    fallback = NULL;
+    fallback_i = 0;
+    conns = 0;
+    weight = 0;
+
+    if (hcf->bound) {
+
+        /* the counters are shared if the upstream is in a zone */
+
+        for (peer = hp->rrp.peers->peer; peer; peer = peer->next) {
+
+            if (peer->down) {
+                continue;
+            }
+
+            conns += peer->conns;
+            weight += peer->weight;
+        }
+    }
+
     for ( ;; ) {
         server = point[hp->hash % points->number].server;
 
@@ -549,6 +598,21 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
+            if (hcf->bound
+                && weight
+                && ngx_http_upstream_chash_overloaded(peer, hcf->bound,
+                                                      conns, weight))
+            {
+                /* spill to the next point, or use it if all are loaded */
+
+                if (fallback == NULL) {
+                    fallback = peer;
+                    fallback_i = i;
+                }
+
+                continue;
+            }
+
             peer->current_weight += peer->effective_weight;
             total += peer->effective_weight;
 
@@ -571,6 +635,13 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
         hp->tries++;
 
         if (hp->tries >= points->number) {
+
+            if (fallback) {
+                best = fallback;
+                best_i = fallback_i;
+                goto found;
+            }
+
             pc->name = hp->rrp.peers->name;
             ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
             return NGX_BUSY;
@@ -613,6 +684,7 @@ ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->bound = 0;
 
     return conf;
 }
@@ -623,6 +695,7 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_upstream_hash_srv_conf_t  *hcf = conf;
 
+    ngx_int_t                          n;
     ngx_str_t                         *value;
     ngx_http_upstream_srv_conf_t      *uscf;
     ngx_http_compile_complex_value_t   ccv;
@@ -664,5 +737,24 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (cf->args->nelts == 4) {
+
+        if (ngx_strncmp(value[3].data, "bounded=", 8) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[3]);
+            return NGX_CONF_ERROR;
+        }
+
+        n = ngx_atofp(value[3].data + 8, value[3].len - 8, 2);
+
+        if (n == NGX_ERROR || n < 100) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid bound \"%V\"", &value[3]);
+            return NGX_CONF_ERROR;
+        }
+
+        hcf->bound = n;
+    }
+
     return NGX_CONF_OK;
 }
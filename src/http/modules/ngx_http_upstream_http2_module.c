@@ -0,0 +1,3344 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_HTTP2_BLOCK_SIZE                                    \
+    (NGX_HTTP_V2_FRAME_HEADER_SIZE + NGX_HTTP_V2_DEFAULT_FRAME_SIZE)
+
+#define NGX_HTTP_UPSTREAM_HTTP2_MAX_FREE      16
+#define NGX_HTTP_UPSTREAM_HTTP2_BACKLOG       65536
+#define NGX_HTTP_UPSTREAM_HTTP2_MAX_BLOCK     65536
+#define NGX_HTTP_UPSTREAM_HTTP2_MAX_SID       0x7fffffff
+
+#define NGX_HTTP_UPSTREAM_HTTP2_PREFACE                                       \
+    "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+/* static table indices */
+#define NGX_HTTP_UPSTREAM_HTTP2_AUTHORITY_INDEX   1
+#define NGX_HTTP_UPSTREAM_HTTP2_METHOD_INDEX      2
+#define NGX_HTTP_UPSTREAM_HTTP2_PATH_INDEX        4
+
+/* indexed header fields */
+#define NGX_HTTP_UPSTREAM_HTTP2_GET               0x82
+#define NGX_HTTP_UPSTREAM_HTTP2_POST              0x83
+#define NGX_HTTP_UPSTREAM_HTTP2_ROOT              0x84
+#define NGX_HTTP_UPSTREAM_HTTP2_SCHEME_HTTP       0x86
+
+
+typedef struct ngx_http_upstream_http2_block_s  ngx_http_upstream_http2_block_t;
+
+
+struct ngx_http_upstream_http2_block_s {
+    ngx_http_upstream_http2_block_t  *next;
+    u_char                           *pos;
+    u_char                           *last;
+    u_char                            start[NGX_HTTP_UPSTREAM_HTTP2_BLOCK_SIZE];
+};
+
+
+typedef struct {
+    ngx_http_upstream_http2_block_t   *first;
+    ngx_http_upstream_http2_block_t   *last;
+    size_t                             size;
+} ngx_http_upstream_http2_bufs_t;
+
+
+typedef struct {
+    ngx_uint_t                         streams;
+    size_t                             window;
+
+    ngx_queue_t                        connections;
+
+    ngx_http_upstream_init_pt          original_init_upstream;
+    ngx_http_upstream_init_peer_pt     original_init_peer;
+
+} ngx_http_upstream_http2_srv_conf_t;
+
+
+typedef struct {
+    ngx_http_upstream_http2_srv_conf_t  *conf;
+
+    ngx_queue_t                        queue;
+    ngx_connection_t                  *connection;
+    ngx_pool_t                        *pool;
+    ngx_log_t                         *log;
+
+    ngx_peer_connection_t              peer;
+    socklen_t                          socklen;
+    ngx_sockaddr_t                     sockaddr;
+
+    ngx_queue_t                        streams;
+    ngx_uint_t                         nstreams;
+    ngx_uint_t                         max_streams;
+    ngx_uint_t                         next_sid;
+
+    ssize_t                            send_window;
+    size_t                             init_window;
+    size_t                             recv_unacked;
+
+    ngx_http_upstream_http2_bufs_t     out;
+    ngx_http_upstream_http2_block_t   *free;
+    ngx_uint_t                         nfree;
+
+    ngx_buf_t                         *recv;
+
+    /* current frame */
+    size_t                             length;
+    size_t                             padding;
+    ngx_uint_t                         sid;
+    ngx_uint_t                         flags;
+
+    /* header block being collected */
+    u_char                            *block;
+    size_t                             block_len;
+    size_t                             block_size;
+    ngx_uint_t                         block_sid;
+    ngx_uint_t                         block_flags;
+
+    unsigned                           queued:1;
+    unsigned                           connected:1;
+    unsigned                           goaway:1;
+    unsigned                           closed:1;
+    unsigned                           data:1;
+    unsigned                           continuation:1;
+
+} ngx_http_upstream_http2_conn_t;
+
+
+typedef struct {
+    ngx_http_upstream_http2_conn_t    *h2;
+    ngx_http_request_t                *request;
+
+    ngx_queue_t                        queue;
+
+    ngx_connection_t                   connection;
+    ngx_event_t                        read;
+    ngx_event_t                        write;
+
+    ngx_uint_t                         sid;
+    ssize_t                            send_window;
+    size_t                             recv_window;
+    size_t                             recv_unacked;
+
+    /* request from the proxied module */
+    ngx_buf_t                         *head;
+    ngx_uint_t                         crlf;
+    off_t                              rest;
+    ngx_http_chunked_t                *chunked;
+
+    /* response to the proxied module */
+    ngx_http_upstream_http2_bufs_t     in;
+
+    unsigned                           headers_sent:1;
+    unsigned                           out_closed:1;
+    unsigned                           in_headers:1;
+    unsigned                           in_closed:1;
+    unsigned                           blocked:1;
+    unsigned                           error:1;
+
+} ngx_http_upstream_http2_stream_t;
+
+
+typedef struct {
+    ngx_http_upstream_http2_srv_conf_t  *conf;
+
+    ngx_http_request_t                *request;
+    ngx_http_upstream_http2_stream_t  *stream;
+
+    void                              *data;
+
+    ngx_event_get_peer_pt              original_get_peer;
+    ngx_event_free_peer_pt             original_free_peer;
+
+#if (NGX_HTTP_SSL)
+    ngx_event_set_peer_session_pt      original_set_session;
+    ngx_event_save_peer_session_pt     original_save_session;
+#endif
+
+    unsigned                           multiplex:1;
+
+} ngx_http_upstream_http2_peer_data_t;
+
+
+typedef struct {
+    ngx_uint_t                         status;
+    ngx_str_t                          reason;
+} ngx_http_upstream_http2_reason_t;
+
+
+#define ngx_http_upstream_http2_stream(c)                                     \
+    ((ngx_http_upstream_http2_stream_t *)                                     \
+         ((u_char *) (c) - offsetof(ngx_http_upstream_http2_stream_t,          \
+                                    connection)))
+
+
+static ngx_int_t ngx_http_upstream_init_http2_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_http2_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstream_free_http2_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_upstream_http2_set_session(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_http_upstream_http2_save_session(ngx_peer_connection_t *pc,
+    void *data);
+#endif
+
+static ngx_http_upstream_http2_conn_t *ngx_http_upstream_http2_connect(
+    ngx_http_upstream_http2_peer_data_t *hp, ngx_peer_connection_t *pc,
+    ngx_int_t *rc);
+static ngx_http_upstream_http2_stream_t *ngx_http_upstream_http2_open_stream(
+    ngx_http_upstream_http2_conn_t *h2, ngx_peer_connection_t *pc,
+    ngx_http_request_t *r);
+static void ngx_http_upstream_http2_release_stream(
+    ngx_http_upstream_http2_stream_t *s);
+static void ngx_http_upstream_http2_close(ngx_http_upstream_http2_conn_t *h2);
+static void ngx_http_upstream_http2_destroy(
+    ngx_http_upstream_http2_conn_t *h2);
+
+static void ngx_http_upstream_http2_read_handler(ngx_event_t *rev);
+static void ngx_http_upstream_http2_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_http_upstream_http2_send(
+    ngx_http_upstream_http2_conn_t *h2);
+static ngx_int_t ngx_http_upstream_http2_process(
+    ngx_http_upstream_http2_conn_t *h2);
+static ngx_int_t ngx_http_upstream_http2_process_data(
+    ngx_http_upstream_http2_conn_t *h2);
+static ngx_int_t ngx_http_upstream_http2_process_frame(
+    ngx_http_upstream_http2_conn_t *h2, ngx_uint_t type, u_char *pos,
+    size_t len);
+static ngx_int_t ngx_http_upstream_http2_process_headers(
+    ngx_http_upstream_http2_conn_t *h2, ngx_uint_t type, u_char *pos,
+    size_t len);
+static ngx_int_t ngx_http_upstream_http2_process_settings(
+    ngx_http_upstream_http2_conn_t *h2, u_char *pos, size_t len);
+static ngx_int_t ngx_http_upstream_http2_decode_headers(
+    ngx_http_upstream_http2_conn_t *h2, ngx_http_upstream_http2_stream_t *s);
+static ngx_int_t ngx_http_upstream_http2_status_line(
+    ngx_http_upstream_http2_conn_t *h2, ngx_http_upstream_http2_stream_t *s,
+    ngx_uint_t status);
+static ngx_int_t ngx_http_upstream_http2_parse_int(u_char **pos, u_char *end,
+    ngx_uint_t prefix, ngx_uint_t *value);
+static ngx_int_t ngx_http_upstream_http2_parse_string(u_char **pos,
+    u_char *end, ngx_str_t *str, u_char **tmp, ngx_log_t *log);
+
+static ssize_t ngx_http_upstream_http2_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_http_upstream_http2_recv_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static void ngx_http_upstream_http2_consumed(
+    ngx_http_upstream_http2_stream_t *s, size_t size);
+static ssize_t ngx_http_upstream_http2_send_buf(ngx_connection_t *c,
+    u_char *buf, size_t size);
+static ngx_chain_t *ngx_http_upstream_http2_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static ngx_int_t ngx_http_upstream_http2_collect_head(
+    ngx_http_upstream_http2_stream_t *s, ngx_buf_t *b);
+static ngx_int_t ngx_http_upstream_http2_send_headers(
+    ngx_http_upstream_http2_stream_t *s);
+static ngx_int_t ngx_http_upstream_http2_send_body(
+    ngx_http_upstream_http2_stream_t *s, ngx_buf_t *b);
+static ssize_t ngx_http_upstream_http2_send_data(
+    ngx_http_upstream_http2_stream_t *s, u_char *pos, size_t len,
+    ngx_uint_t last);
+static u_char *ngx_http_upstream_http2_write_field(u_char *p,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp);
+static u_char *ngx_http_upstream_http2_frame(
+    ngx_http_upstream_http2_conn_t *h2, size_t len, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_upstream_http2_window_update(
+    ngx_http_upstream_http2_conn_t *h2, ngx_uint_t sid, size_t window);
+static ngx_int_t ngx_http_upstream_http2_rst_stream(
+    ngx_http_upstream_http2_conn_t *h2, ngx_uint_t sid, ngx_uint_t status);
+static ngx_int_t ngx_http_upstream_http2_stream_error(
+    ngx_http_upstream_http2_stream_t *s, ngx_uint_t status);
+static ngx_int_t ngx_http_upstream_http2_connection_error(
+    ngx_http_upstream_http2_conn_t *h2, ngx_uint_t status);
+static ngx_http_upstream_http2_stream_t *ngx_http_upstream_http2_find_stream(
+    ngx_http_upstream_http2_conn_t *h2, ngx_uint_t sid);
+static void ngx_http_upstream_http2_post(ngx_http_upstream_http2_stream_t *s,
+    ngx_event_t *ev);
+static void ngx_http_upstream_http2_wake(ngx_http_upstream_http2_conn_t *h2);
+
+static ngx_http_upstream_http2_block_t *ngx_http_upstream_http2_alloc_block(
+    ngx_http_upstream_http2_conn_t *h2);
+static void ngx_http_upstream_http2_free_block(
+    ngx_http_upstream_http2_conn_t *h2, ngx_http_upstream_http2_block_t *b);
+static u_char *ngx_http_upstream_http2_reserve(
+    ngx_http_upstream_http2_conn_t *h2, ngx_http_upstream_http2_bufs_t *bufs,
+    size_t size);
+static ngx_int_t ngx_http_upstream_http2_copy(
+    ngx_http_upstream_http2_conn_t *h2, ngx_http_upstream_http2_bufs_t *bufs,
+    u_char *data, size_t len);
+static size_t ngx_http_upstream_http2_read_bufs(
+    ngx_http_upstream_http2_conn_t *h2, ngx_http_upstream_http2_bufs_t *bufs,
+    u_char *buf, size_t size);
+static void ngx_http_upstream_http2_free_bufs(
+    ngx_http_upstream_http2_conn_t *h2, ngx_http_upstream_http2_bufs_t *bufs);
+
+static void *ngx_http_upstream_http2_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_http2(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_http2_commands[] = {
+
+    { ngx_string("http2"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      ngx_http_upstream_http2,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_http2_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_http2_create_conf,   /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_http2_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_http2_module_ctx,   /* module context */
+    ngx_http_upstream_http2_commands,      /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/* HTTP/2 has no reason phrase, the common ones are restored */
+
+static ngx_http_upstream_http2_reason_t  ngx_http_upstream_http2_reasons[] = {
+    { 200, ngx_string("OK") },
+    { 201, ngx_string("Created") },
+    { 202, ngx_string("Accepted") },
+    { 204, ngx_string("No Content") },
+    { 206, ngx_string("Partial Content") },
+    { 301, ngx_string("Moved Permanently") },
+    { 302, ngx_string("Moved Temporarily") },
+    { 303, ngx_string("See Other") },
+    { 304, ngx_string("Not Modified") },
+    { 307, ngx_string("Temporary Redirect") },
+    { 308, ngx_string("Permanent Redirect") },
+    { 400, ngx_string("Bad Request") },
+    { 401, ngx_string("Unauthorized") },
+    { 403, ngx_string("Forbidden") },
+    { 404, ngx_string("Not Found") },
+    { 405, ngx_string("Not Allowed") },
+    { 413, ngx_string("Request Entity Too Large") },
+    { 416, ngx_string("Requested Range Not Satisfiable") },
+    { 429, ngx_string("Too Many Requests") },
+    { 500, ngx_string("Internal Server Error") },
+    { 502, ngx_string("Bad Gateway") },
+    { 503, ngx_string("Service Temporarily Unavailable") },
+    { 504, ngx_string("Gateway Time-out") },
+    { 0, ngx_null_string }
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_http2(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_http2_srv_conf_t  *hcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "init http2 upstream");
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_http2_module);
+
+    /*
+     * streams use fake connections allocated from a request pool
+     * and share the socket, so nothing may cache them as keepalive ones
+     */
+
+    if (us->peer.init_upstream != ngx_http_upstream_init_http2) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"http2\" cannot be combined with another "
+                      "connection cache in upstream \"%V\" in %s:%ui",
+                      &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    if (hcf->original_init_upstream(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hcf->original_init_peer = us->peer.init;
+
+    us->peer.init = ngx_http_upstream_init_http2_peer;
+
+    ngx_queue_init(&hcf->connections);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_http2_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_t                  *u;
+    ngx_http_upstream_http2_srv_conf_t   *hcf;
+    ngx_http_upstream_http2_peer_data_t  *hp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init http2 peer");
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_http2_module);
+
+    hp = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_http2_peer_data_t));
+    if (hp == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (hcf->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    u = r->upstream;
+
+    hp->conf = hcf;
+    hp->request = r;
+    hp->data = u->peer.data;
+    hp->original_get_peer = u->peer.get;
+    hp->original_free_peer = u->peer.free;
+
+    /*
+     * streams are multiplexed over cleartext connections only, and
+     * the shared socket is never added to the event module on behalf
+     * of a stream, which requires edge-triggered notifications
+     */
+
+    hp->multiplex = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ? 1 : 0;
+
+#if (NGX_HTTP_SSL)
+    if (u->ssl) {
+        hp->multiplex = 0;
+    }
+#endif
+
+    u->peer.data = hp;
+    u->peer.get = ngx_http_upstream_get_http2_peer;
+    u->peer.free = ngx_http_upstream_free_http2_peer;
+
+#if (NGX_HTTP_SSL)
+    hp->original_set_session = u->peer.set_session;
+    hp->original_save_session = u->peer.save_session;
+    u->peer.set_session = ngx_http_upstream_http2_set_session;
+    u->peer.save_session = ngx_http_upstream_http2_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_http2_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_http2_peer_data_t  *hp = data;
+
+    ngx_int_t                          rc;
+    ngx_queue_t                       *q, *connections;
+    ngx_http_upstream_http2_conn_t    *h2;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get http2 peer");
+
+    /* ask balancer */
+
+    rc = hp->original_get_peer(pc, hp->data);
+
+    if (rc != NGX_OK || !hp->multiplex) {
+        return rc;
+    }
+
+    /* search for a connection to the peer with a free stream slot */
+
+    connections = &hp->conf->connections;
+
+    for (q = ngx_queue_head(connections);
+         q != ngx_queue_sentinel(connections);
+         q = ngx_queue_next(q))
+    {
+        h2 = ngx_queue_data(q, ngx_http_upstream_http2_conn_t, queue);
+
+        if (h2->nstreams < h2->max_streams
+            && ngx_memn2cmp((u_char *) &h2->sockaddr, (u_char *) pc->sockaddr,
+                            h2->socklen, pc->socklen)
+               == 0)
+        {
+            goto found;
+        }
+    }
+
+    h2 = ngx_http_upstream_http2_connect(hp, pc, &rc);
+    if (h2 == NULL) {
+        return rc;
+    }
+
+found:
+
+    s = ngx_http_upstream_http2_open_stream(h2, pc, hp->request);
+    if (s == NULL) {
+        if (h2->nstreams == 0) {
+            ngx_http_upstream_http2_close(h2);
+        }
+
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get http2 peer: using connection %p, %ui of %ui streams",
+                   h2->connection, h2->nstreams, h2->max_streams);
+
+    hp->stream = s;
+
+    pc->connection = &s->connection;
+    pc->cached = 0;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_upstream_free_http2_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_http2_peer_data_t  *hp = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free http2 peer");
+
+    if (hp->stream) {
+        ngx_http_upstream_http2_release_stream(hp->stream);
+
+        hp->stream = NULL;
+        pc->connection = NULL;
+    }
+
+    hp->original_free_peer(pc, hp->data, state);
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_upstream_http2_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_http2_peer_data_t  *hp = data;
+
+    return hp->original_set_session(pc, hp->data);
+}
+
+
+static void
+ngx_http_upstream_http2_save_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_http2_peer_data_t  *hp = data;
+
+    hp->original_save_session(pc, hp->data);
+}
+
+#endif
+
+
+static ngx_http_upstream_http2_conn_t *
+ngx_http_upstream_http2_connect(ngx_http_upstream_http2_peer_data_t *hp,
+    ngx_peer_connection_t *pc, ngx_int_t *rc)
+{
+    int                              tcp_nodelay;
+    u_char                          *p;
+    ngx_log_t                       *log;
+    ngx_pool_t                      *pool;
+    ngx_connection_t                *c;
+    ngx_http_upstream_http2_conn_t  *h2;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        *rc = NGX_ERROR;
+        return NULL;
+    }
+
+    h2 = ngx_pcalloc(pool, sizeof(ngx_http_upstream_http2_conn_t));
+    if (h2 == NULL) {
+        goto failed;
+    }
+
+    log = ngx_palloc(pool, sizeof(ngx_log_t));
+    if (log == NULL) {
+        goto failed;
+    }
+
+    *log = *ngx_cycle->log;
+    pool->log = log;
+
+    h2->recv = ngx_create_temp_buf(pool, NGX_HTTP_UPSTREAM_HTTP2_BLOCK_SIZE);
+    if (h2->recv == NULL) {
+        goto failed;
+    }
+
+    h2->conf = hp->conf;
+    h2->pool = pool;
+    h2->log = log;
+
+    ngx_memcpy(&h2->sockaddr, pc->sockaddr, pc->socklen);
+    h2->socklen = pc->socklen;
+
+    h2->peer.sockaddr = &h2->sockaddr.sockaddr;
+    h2->peer.socklen = h2->socklen;
+    h2->peer.name = pc->name;
+    h2->peer.get = ngx_event_get_peer;
+    h2->peer.log = log;
+    h2->peer.log_error = NGX_ERROR_ERR;
+    h2->peer.local = pc->local;
+    h2->peer.rcvbuf = pc->rcvbuf;
+
+    *rc = ngx_event_connect_peer(&h2->peer);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "http2 upstream connect: %i", *rc);
+
+    if (*rc != NGX_OK && *rc != NGX_AGAIN) {
+        if (*rc == NGX_BUSY) {
+            *rc = NGX_DECLINED;
+        }
+
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    c = h2->peer.connection;
+
+    c->data = h2;
+    c->pool = pool;
+    c->log = log;
+    c->read->log = log;
+    c->write->log = log;
+
+    c->read->handler = ngx_http_upstream_http2_read_handler;
+    c->write->handler = ngx_http_upstream_http2_write_handler;
+
+    h2->connection = c;
+
+    tcp_nodelay = 1;
+
+    if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                   (const void *) &tcp_nodelay, sizeof(int))
+        == -1)
+    {
+        ngx_connection_error(c, ngx_socket_errno,
+                             "setsockopt(TCP_NODELAY) failed");
+    }
+
+    ngx_queue_init(&h2->streams);
+
+    h2->max_streams = hp->conf->streams;
+    h2->next_sid = 1;
+    h2->send_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    h2->init_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+
+    /* connection preface, SETTINGS and connection window */
+
+    p = ngx_http_upstream_http2_reserve(h2, &h2->out,
+                                      sizeof(NGX_HTTP_UPSTREAM_HTTP2_PREFACE)
+                                      - 1);
+    if (p == NULL) {
+        goto close;
+    }
+
+    ngx_memcpy(p, NGX_HTTP_UPSTREAM_HTTP2_PREFACE,
+               sizeof(NGX_HTTP_UPSTREAM_HTTP2_PREFACE) - 1);
+
+    p = ngx_http_upstream_http2_frame(h2,
+                                      3 * NGX_HTTP_V2_SETTINGS_PARAM_SIZE,
+                                      NGX_HTTP_V2_SETTINGS_FRAME,
+                                      NGX_HTTP_V2_NO_FLAG, 0);
+    if (p == NULL) {
+        goto close;
+    }
+
+    /* responses are decoded with the static table only */
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING);
+    p = ngx_http_v2_write_uint32(p, 0);
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_V2_ENABLE_PUSH_SETTING);
+    p = ngx_http_v2_write_uint32(p, 0);
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING);
+    (void) ngx_http_v2_write_uint32(p, hp->conf->window);
+
+    if (ngx_http_upstream_http2_window_update(h2, 0, NGX_HTTP_V2_MAX_WINDOW
+                                              - NGX_HTTP_V2_DEFAULT_WINDOW)
+        != NGX_OK)
+    {
+        goto close;
+    }
+
+    ngx_queue_insert_head(&hp->conf->connections, &h2->queue);
+    h2->queued = 1;
+
+    if (*rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, hp->request->upstream->conf->connect_timeout);
+        return h2;
+    }
+
+    h2->connected = 1;
+
+    if (ngx_http_upstream_http2_send(h2) == NGX_ERROR) {
+        ngx_http_upstream_http2_close(h2);
+        *rc = NGX_DECLINED;
+        return NULL;
+    }
+
+    return h2;
+
+close:
+
+    ngx_http_upstream_http2_close(h2);
+
+    *rc = NGX_ERROR;
+    return NULL;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    *rc = NGX_ERROR;
+    return NULL;
+}
+
+
+static ngx_http_upstream_http2_stream_t *
+ngx_http_upstream_http2_open_stream(ngx_http_upstream_http2_conn_t *h2,
+    ngx_peer_connection_t *pc, ngx_http_request_t *r)
+{
+    ngx_connection_t                  *fc;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    s = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_http2_stream_t));
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->h2 = h2;
+    s->request = r;
+    s->send_window = h2->init_window;
+    s->recv_window = h2->conf->window;
+
+    /*
+     * the stream is presented to ngx_http_upstream as a connection of its
+     * own: it shares the socket for getsockopt() only, its events are
+     * marked active so that they are never added to the event module, and
+     * they are posted by the connection handlers instead
+     */
+
+    fc = &s->connection;
+
+    fc->fd = h2->connection->fd;
+    fc->read = &s->read;
+    fc->write = &s->write;
+    fc->pool = r->pool;
+    fc->log = pc->log;
+
+    fc->recv = ngx_http_upstream_http2_recv;
+    fc->send = ngx_http_upstream_http2_send_buf;
+    fc->recv_chain = ngx_http_upstream_http2_recv_chain;
+    fc->send_chain = ngx_http_upstream_http2_send_chain;
+
+    fc->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+    fc->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+
+    fc->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    s->read.data = fc;
+    s->read.log = pc->log;
+    s->read.active = 1;
+
+    s->write.data = fc;
+    s->write.log = pc->log;
+    s->write.write = 1;
+    s->write.active = 1;
+    s->write.ready = 1;
+
+    ngx_queue_insert_tail(&h2->streams, &s->queue);
+    h2->nstreams++;
+
+    h2->connection->idle = 0;
+
+    return s;
+}
+
+
+static void
+ngx_http_upstream_http2_release_stream(ngx_http_upstream_http2_stream_t *s)
+{
+    ngx_int_t                        rc;
+    ngx_http_upstream_http2_conn_t  *h2;
+
+    h2 = s->h2;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                   "http2 upstream release stream %ui, %ui left",
+                   s->sid, h2->nstreams - 1);
+
+    if (s->read.timer_set) {
+        ngx_del_timer(&s->read);
+    }
+
+    if (s->write.timer_set) {
+        ngx_del_timer(&s->write);
+    }
+
+    if (s->read.posted) {
+        ngx_delete_posted_event(&s->read);
+    }
+
+    if (s->write.posted) {
+        ngx_delete_posted_event(&s->write);
+    }
+
+    rc = NGX_OK;
+
+    if (s->sid && !s->error && !(s->in_closed && s->out_closed)
+        && h2->connection)
+    {
+        rc = ngx_http_upstream_http2_rst_stream(h2, s->sid,
+                                                NGX_HTTP_V2_CANCEL);
+        if (rc == NGX_OK) {
+            rc = ngx_http_upstream_http2_send(h2);
+        }
+    }
+
+    ngx_http_upstream_http2_free_bufs(h2, &s->in);
+
+    ngx_queue_remove(&s->queue);
+    h2->nstreams--;
+
+    if (h2->closed) {
+        if (h2->nstreams == 0) {
+            ngx_http_upstream_http2_destroy(h2);
+        }
+
+        return;
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_http_upstream_http2_close(h2);
+        return;
+    }
+
+    if (h2->nstreams == 0) {
+
+        if (!h2->queued || ngx_terminate || ngx_exiting) {
+            ngx_http_upstream_http2_close(h2);
+            return;
+        }
+
+        h2->connection->idle = 1;
+    }
+}
+
+
+static void
+ngx_http_upstream_http2_close(ngx_http_upstream_http2_conn_t *h2)
+{
+    ngx_queue_t                       *q;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2->log, 0,
+                   "close http2 upstream connection %p, %ui streams",
+                   h2->connection, h2->nstreams);
+
+    if (h2->queued) {
+        ngx_queue_remove(&h2->queue);
+        h2->queued = 0;
+    }
+
+    h2->closed = 1;
+
+    if (h2->connection) {
+        ngx_close_connection(h2->connection);
+        h2->connection = NULL;
+    }
+
+    for (q = ngx_queue_head(&h2->streams);
+         q != ngx_queue_sentinel(&h2->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+
+        s->error = 1;
+
+        ngx_http_upstream_http2_post(s, &s->read);
+        ngx_http_upstream_http2_post(s, &s->write);
+    }
+
+    if (h2->nstreams == 0) {
+        ngx_http_upstream_http2_destroy(h2);
+    }
+}
+
+
+static void
+ngx_http_upstream_http2_destroy(ngx_http_upstream_http2_conn_t *h2)
+{
+    ngx_http_upstream_http2_block_t  *b;
+
+    ngx_http_upstream_http2_free_bufs(h2, &h2->out);
+
+    while (h2->free) {
+        b = h2->free;
+        h2->free = b->next;
+        ngx_free(b);
+    }
+
+    if (h2->block) {
+        ngx_free(h2->block);
+    }
+
+    ngx_destroy_pool(h2->pool);
+}
+
+
+static void
+ngx_http_upstream_http2_read_handler(ngx_event_t *rev)
+{
+    size_t                           n;
+    ssize_t                          size;
+    ngx_buf_t                       *b;
+    ngx_connection_t                *c;
+    ngx_http_upstream_http2_conn_t  *h2;
+
+    c = rev->data;
+    h2 = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream read handler");
+
+    if (c->close) {
+        ngx_http_upstream_http2_close(h2);
+        return;
+    }
+
+    b = h2->recv;
+
+    for ( ;; ) {
+
+        size = c->recv(c, b->last, b->end - b->last);
+
+        if (size == NGX_AGAIN) {
+            break;
+        }
+
+        if (size == 0 || size == NGX_ERROR) {
+
+            if (size == 0 && h2->nstreams) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream prematurely closed http2 connection "
+                              "with %ui active streams", h2->nstreams);
+            }
+
+            ngx_http_upstream_http2_close(h2);
+            return;
+        }
+
+        b->last += size;
+
+        if (ngx_http_upstream_http2_process(h2) != NGX_OK) {
+            ngx_http_upstream_http2_close(h2);
+            return;
+        }
+
+        n = b->last - b->pos;
+
+        if (n == 0) {
+            b->pos = b->start;
+            b->last = b->start;
+
+        } else if (b->pos != b->start) {
+            ngx_memmove(b->start, b->pos, n);
+            b->pos = b->start;
+            b->last = b->start + n;
+        }
+    }
+
+    if (ngx_http_upstream_http2_send(h2) == NGX_ERROR) {
+        ngx_http_upstream_http2_close(h2);
+        return;
+    }
+
+    if (!h2->queued && h2->nstreams == 0) {
+        ngx_http_upstream_http2_close(h2);
+        return;
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_upstream_http2_close(h2);
+    }
+}
+
+
+static void
+ngx_http_upstream_http2_write_handler(ngx_event_t *wev)
+{
+    int                              err;
+    socklen_t                        len;
+    ngx_connection_t                *c;
+    ngx_http_upstream_http2_conn_t  *h2;
+
+    c = wev->data;
+    h2 = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream write handler");
+
+    if (!h2->connected) {
+
+        if (wev->timedout) {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                          "upstream timed out while connecting to %V",
+                          h2->peer.name);
+            ngx_http_upstream_http2_close(h2);
+            return;
+        }
+
+        if (wev->timer_set) {
+            ngx_del_timer(wev);
+        }
+
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            ngx_http_upstream_http2_close(h2);
+            return;
+        }
+
+        h2->connected = 1;
+    }
+
+    if (ngx_http_upstream_http2_send(h2) == NGX_ERROR) {
+        ngx_http_upstream_http2_close(h2);
+        return;
+    }
+
+    if (h2->out.size < NGX_HTTP_UPSTREAM_HTTP2_BACKLOG) {
+        ngx_http_upstream_http2_wake(h2);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_send(ngx_http_upstream_http2_conn_t *h2)
+{
+    ssize_t                           n;
+    ngx_connection_t                 *c;
+    ngx_http_upstream_http2_block_t  *b;
+
+    c = h2->connection;
+
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (!h2->connected) {
+        return NGX_AGAIN;
+    }
+
+    while (h2->out.first) {
+        b = h2->out.first;
+
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        b->pos += n;
+        h2->out.size -= n;
+
+        if (b->pos == b->last) {
+            h2->out.first = b->next;
+
+            if (h2->out.first == NULL) {
+                h2->out.last = NULL;
+            }
+
+            ngx_http_upstream_http2_free_block(h2, b);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_process(ngx_http_upstream_http2_conn_t *h2)
+{
+    u_char                            *p;
+    size_t                             length;
+    uint32_t                           head;
+    ngx_buf_t                         *b;
+    ngx_uint_t                         type, flags, sid, padded;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    b = h2->recv;
+
+    for ( ;; ) {
+
+        if (h2->data) {
+            if (ngx_http_upstream_http2_process_data(h2) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (h2->data) {
+                return NGX_OK;
+            }
+
+            continue;
+        }
+
+        if (b->last - b->pos < NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+            return NGX_OK;
+        }
+
+        p = b->pos;
+
+        head = ngx_http_v2_parse_uint32(p);
+
+        length = ngx_http_v2_parse_length(head);
+        type = ngx_http_v2_parse_type(head);
+        flags = p[4];
+        sid = ngx_http_v2_parse_sid(&p[5]);
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, h2->log, 0,
+                       "http2 upstream frame type:%ui f:%Xi l:%uz sid:%ui",
+                       type, flags, length, sid);
+
+        if (length > NGX_HTTP_V2_DEFAULT_FRAME_SIZE) {
+            ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                          "upstream sent too large http2 frame: %uz",
+                          length);
+            return NGX_ERROR;
+        }
+
+        if (h2->continuation
+            && (type != NGX_HTTP_V2_CONTINUATION_FRAME
+                || sid != h2->block_sid))
+        {
+            ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                          "upstream sent http2 frame of type %ui "
+                          "instead of CONTINUATION", type);
+            return NGX_ERROR;
+        }
+
+        if (type != NGX_HTTP_V2_DATA_FRAME) {
+
+            if ((size_t) (b->last - b->pos)
+                < NGX_HTTP_V2_FRAME_HEADER_SIZE + length)
+            {
+                return NGX_OK;
+            }
+
+            p = b->pos + NGX_HTTP_V2_FRAME_HEADER_SIZE;
+            b->pos = p + length;
+
+            h2->sid = sid;
+            h2->flags = flags;
+
+            if (ngx_http_upstream_http2_process_frame(h2, type, p, length)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        /* DATA frame, the payload is consumed as it arrives */
+
+        padded = (flags & NGX_HTTP_V2_PADDED_FLAG) ? 1 : 0;
+
+        if (padded) {
+            if (b->last - b->pos < NGX_HTTP_V2_FRAME_HEADER_SIZE + 1) {
+                return NGX_OK;
+            }
+
+            h2->padding = p[NGX_HTTP_V2_FRAME_HEADER_SIZE];
+
+            if (h2->padding >= length) {
+                ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                              "upstream sent DATA frame with incorrect "
+                              "padding: %uz in %uz", h2->padding, length);
+                return NGX_ERROR;
+            }
+
+        } else {
+            h2->padding = 0;
+        }
+
+        if (sid == 0) {
+            ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                          "upstream sent DATA frame with incorrect "
+                          "identifier");
+            return NGX_ERROR;
+        }
+
+        b->pos += NGX_HTTP_V2_FRAME_HEADER_SIZE + padded;
+
+        h2->data = 1;
+        h2->length = length - padded - h2->padding;
+        h2->sid = sid;
+        h2->flags = flags;
+
+        if (length > NGX_HTTP_V2_MAX_WINDOW - h2->recv_unacked) {
+            ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                          "upstream violated connection flow control, "
+                          "received DATA frame length %uz, available "
+                          "window %uz", length,
+                          NGX_HTTP_V2_MAX_WINDOW - h2->recv_unacked);
+
+            return ngx_http_upstream_http2_connection_error(h2,
+                                                NGX_HTTP_V2_FLOW_CTRL_ERROR);
+        }
+
+        h2->recv_unacked += length;
+
+        s = ngx_http_upstream_http2_find_stream(h2, sid);
+
+        if (s && !s->error) {
+
+            if (length > s->recv_window) {
+                ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                              "upstream violated stream flow control, "
+                              "received DATA frame length %uz, available "
+                              "window %uz", length, s->recv_window);
+
+                if (ngx_http_upstream_http2_stream_error(s,
+                                                  NGX_HTTP_V2_FLOW_CTRL_ERROR)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+            } else {
+                s->recv_window -= length;
+
+                /*
+                 * padding is never read by the stream,
+                 * return its window at once
+                 */
+
+                s->recv_unacked += padded + h2->padding;
+            }
+        }
+
+        if (h2->recv_unacked >= NGX_HTTP_V2_MAX_WINDOW / 4) {
+            if (ngx_http_upstream_http2_window_update(h2, 0, h2->recv_unacked)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            h2->recv_unacked = 0;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_process_data(ngx_http_upstream_http2_conn_t *h2)
+{
+    size_t                             n;
+    ngx_buf_t                         *b;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    b = h2->recv;
+
+    if (h2->length) {
+        n = ngx_min(h2->length, (size_t) (b->last - b->pos));
+
+        if (n == 0) {
+            return NGX_OK;
+        }
+
+        s = ngx_http_upstream_http2_find_stream(h2, h2->sid);
+
+        if (s && !s->in_closed && !s->error) {
+
+            if (!s->in_headers) {
+                ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                              "upstream sent DATA frame before response "
+                              "header in stream %ui", s->sid);
+
+                if (ngx_http_upstream_http2_stream_error(s,
+                                                  NGX_HTTP_V2_PROTOCOL_ERROR)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+            } else {
+                if (ngx_http_upstream_http2_copy(h2, &s->in, b->pos, n)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                ngx_http_upstream_http2_post(s, &s->read);
+            }
+        }
+
+        b->pos += n;
+        h2->length -= n;
+
+        if (h2->length) {
+            return NGX_OK;
+        }
+    }
+
+    if (h2->padding) {
+        n = ngx_min(h2->padding, (size_t) (b->last - b->pos));
+
+        b->pos += n;
+        h2->padding -= n;
+
+        if (h2->padding) {
+            return NGX_OK;
+        }
+    }
+
+    h2->data = 0;
+
+    if (h2->flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        s = ngx_http_upstream_http2_find_stream(h2, h2->sid);
+
+        if (s && !s->in_closed) {
+            s->in_closed = 1;
+            ngx_http_upstream_http2_post(s, &s->read);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_process_frame(ngx_http_upstream_http2_conn_t *h2,
+    ngx_uint_t type, u_char *pos, size_t len)
+{
+    u_char                            *p;
+    size_t                             window;
+    ngx_uint_t                         status, last;
+    ngx_queue_t                       *q;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    switch (type) {
+
+    case NGX_HTTP_V2_HEADERS_FRAME:
+    case NGX_HTTP_V2_CONTINUATION_FRAME:
+        return ngx_http_upstream_http2_process_headers(h2, type, pos, len);
+
+    case NGX_HTTP_V2_SETTINGS_FRAME:
+
+        if (h2->sid) {
+            break;
+        }
+
+        if (h2->flags & NGX_HTTP_V2_ACK_FLAG) {
+            return NGX_OK;
+        }
+
+        return ngx_http_upstream_http2_process_settings(h2, pos, len);
+
+    case NGX_HTTP_V2_PING_FRAME:
+
+        if (len != NGX_HTTP_V2_PING_SIZE || h2->sid) {
+            break;
+        }
+
+        if (h2->flags & NGX_HTTP_V2_ACK_FLAG) {
+            return NGX_OK;
+        }
+
+        p = ngx_http_upstream_http2_frame(h2, NGX_HTTP_V2_PING_SIZE,
+                                          NGX_HTTP_V2_PING_FRAME,
+                                          NGX_HTTP_V2_ACK_FLAG, 0);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(p, pos, NGX_HTTP_V2_PING_SIZE);
+
+        return NGX_OK;
+
+    case NGX_HTTP_V2_RST_STREAM_FRAME:
+
+        if (len != NGX_HTTP_V2_RST_STREAM_SIZE || h2->sid == 0) {
+            break;
+        }
+
+        s = ngx_http_upstream_http2_find_stream(h2, h2->sid);
+
+        if (s == NULL || s->error) {
+            return NGX_OK;
+        }
+
+        status = ngx_http_v2_parse_uint32(pos);
+
+        s->out_closed = 1;
+
+        if (!s->in_closed) {
+            ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                          "upstream reset http2 stream %ui with code %ui",
+                          s->sid, status);
+
+            s->error = 1;
+
+            ngx_http_upstream_http2_post(s, &s->read);
+            ngx_http_upstream_http2_post(s, &s->write);
+        }
+
+        return NGX_OK;
+
+    case NGX_HTTP_V2_GOAWAY_FRAME:
+
+        if (len < NGX_HTTP_V2_GOAWAY_SIZE || h2->sid) {
+            break;
+        }
+
+        last = ngx_http_v2_parse_sid(pos);
+        status = ngx_http_v2_parse_uint32(&pos[4]);
+
+        if (status == NGX_HTTP_V2_NO_ERROR) {
+            ngx_log_error(NGX_LOG_INFO, h2->log, 0,
+                          "upstream sent GOAWAY, last stream %ui", last);
+
+        } else {
+            ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                          "upstream sent GOAWAY with code %ui, "
+                          "last stream %ui", status, last);
+        }
+
+        h2->goaway = 1;
+
+        if (h2->queued) {
+            ngx_queue_remove(&h2->queue);
+            h2->queued = 0;
+        }
+
+        /* streams above the last one were not processed and can be retried */
+
+        for (q = ngx_queue_head(&h2->streams);
+             q != ngx_queue_sentinel(&h2->streams);
+             q = ngx_queue_next(q))
+        {
+            s = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+
+            if ((s->sid == 0 || s->sid > last) && !s->error) {
+                s->error = 1;
+
+                ngx_http_upstream_http2_post(s, &s->read);
+                ngx_http_upstream_http2_post(s, &s->write);
+            }
+        }
+
+        return NGX_OK;
+
+    case NGX_HTTP_V2_WINDOW_UPDATE_FRAME:
+
+        if (len != NGX_HTTP_V2_WINDOW_UPDATE_SIZE) {
+            break;
+        }
+
+        window = ngx_http_v2_parse_window(pos);
+
+        if (h2->sid == 0) {
+
+            if (window == 0) {
+                ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                              "upstream sent WINDOW_UPDATE frame "
+                              "with incorrect window increment 0");
+
+                return ngx_http_upstream_http2_connection_error(h2,
+                                                NGX_HTTP_V2_PROTOCOL_ERROR);
+            }
+
+            if (window > (size_t) (NGX_HTTP_V2_MAX_WINDOW - h2->send_window)) {
+                ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                              "upstream violated connection flow control, "
+                              "window increment %uz is not allowed", window);
+
+                return ngx_http_upstream_http2_connection_error(h2,
+                                                NGX_HTTP_V2_FLOW_CTRL_ERROR);
+            }
+
+            h2->send_window += window;
+
+        } else {
+            s = ngx_http_upstream_http2_find_stream(h2, h2->sid);
+
+            if (s == NULL || s->error) {
+                return NGX_OK;
+            }
+
+            if (window == 0) {
+                ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                              "upstream sent WINDOW_UPDATE frame "
+                              "with incorrect window increment 0 "
+                              "in stream %ui", s->sid);
+
+                return ngx_http_upstream_http2_stream_error(s,
+                                                NGX_HTTP_V2_PROTOCOL_ERROR);
+            }
+
+            if (window > (size_t) (NGX_HTTP_V2_MAX_WINDOW - s->send_window)) {
+                ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                              "upstream violated flow control of stream %ui, "
+                              "window increment %uz is not allowed",
+                              s->sid, window);
+
+                return ngx_http_upstream_http2_stream_error(s,
+                                                NGX_HTTP_V2_FLOW_CTRL_ERROR);
+            }
+
+            s->send_window += window;
+        }
+
+        ngx_http_upstream_http2_wake(h2);
+
+        return NGX_OK;
+
+    case NGX_HTTP_V2_PUSH_PROMISE_FRAME:
+
+        ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                      "upstream sent PUSH_PROMISE while push is disabled");
+        return NGX_ERROR;
+
+    default:
+
+        /* PRIORITY and unknown frames are ignored */
+
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                  "upstream sent invalid http2 frame of type %ui", type);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_process_headers(ngx_http_upstream_http2_conn_t *h2,
+    ngx_uint_t type, u_char *pos, size_t len)
+{
+    u_char                            *p;
+    size_t                             size, padding;
+    ngx_int_t                          rc;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    if (type == NGX_HTTP_V2_HEADERS_FRAME) {
+
+        if (h2->sid == 0 || (h2->sid & 1) == 0) {
+            ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                          "upstream sent HEADERS frame with incorrect "
+                          "identifier %ui", h2->sid);
+            return NGX_ERROR;
+        }
+
+        if (h2->flags & NGX_HTTP_V2_PADDED_FLAG) {
+            if (len == 0) {
+                goto invalid;
+            }
+
+            padding = *pos++;
+            len--;
+
+            if (padding > len) {
+                goto invalid;
+            }
+
+            len -= padding;
+        }
+
+        if (h2->flags & NGX_HTTP_V2_PRIORITY_FLAG) {
+            if (len < NGX_HTTP_V2_PRIORITY_SIZE) {
+                goto invalid;
+            }
+
+            pos += NGX_HTTP_V2_PRIORITY_SIZE;
+            len -= NGX_HTTP_V2_PRIORITY_SIZE;
+        }
+
+        h2->block_len = 0;
+        h2->block_sid = h2->sid;
+        h2->block_flags = h2->flags;
+
+    } else if (!h2->continuation) {
+        ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                      "upstream sent unexpected CONTINUATION frame");
+        return NGX_ERROR;
+    }
+
+    /* collect the header block, an oversized one is only accounted */
+
+    if (h2->block_len + len > NGX_HTTP_UPSTREAM_HTTP2_MAX_BLOCK) {
+        h2->block_len = NGX_HTTP_UPSTREAM_HTTP2_MAX_BLOCK + 1;
+
+    } else {
+
+        if (h2->block_len + len > h2->block_size) {
+            size = ngx_max(h2->block_size * 2, h2->block_len + len);
+            size = ngx_max(size, 4096);
+
+            p = ngx_alloc(size, h2->log);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            if (h2->block) {
+                ngx_memcpy(p, h2->block, h2->block_len);
+                ngx_free(h2->block);
+            }
+
+            h2->block = p;
+            h2->block_size = size;
+        }
+
+        ngx_memcpy(h2->block + h2->block_len, pos, len);
+        h2->block_len += len;
+    }
+
+    if (!(h2->flags & NGX_HTTP_V2_END_HEADERS_FLAG)) {
+        h2->continuation = 1;
+        return NGX_OK;
+    }
+
+    h2->continuation = 0;
+
+    s = ngx_http_upstream_http2_find_stream(h2, h2->block_sid);
+
+    if (s == NULL || s->in_closed || s->error) {
+        return NGX_OK;
+    }
+
+    if (h2->block_len > NGX_HTTP_UPSTREAM_HTTP2_MAX_BLOCK) {
+        ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                      "upstream sent too large header block in stream %ui",
+                      s->sid);
+        rc = NGX_DECLINED;
+
+    } else {
+        rc = ngx_http_upstream_http2_decode_headers(h2, s);
+    }
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+        s->error = 1;
+
+        ngx_http_upstream_http2_post(s, &s->read);
+        ngx_http_upstream_http2_post(s, &s->write);
+
+        return ngx_http_upstream_http2_rst_stream(h2, s->sid,
+                                                  NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    if (h2->block_flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        s->in_closed = 1;
+    }
+
+    ngx_http_upstream_http2_post(s, &s->read);
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                  "upstream sent HEADERS frame with incorrect length %uz",
+                  len);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_process_settings(ngx_http_upstream_http2_conn_t *h2,
+    u_char *pos, size_t len)
+{
+    u_char                            *p;
+    ssize_t                            delta;
+    ngx_uint_t                         id, value;
+    ngx_queue_t                       *q;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    if (len % NGX_HTTP_V2_SETTINGS_PARAM_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                      "upstream sent SETTINGS frame with incorrect "
+                      "length %uz", len);
+        return NGX_ERROR;
+    }
+
+    for (p = pos; p < pos + len; p += NGX_HTTP_V2_SETTINGS_PARAM_SIZE) {
+        id = ngx_http_v2_parse_uint16(p);
+        value = ngx_http_v2_parse_uint32(&p[2]);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2->log, 0,
+                       "http2 upstream setting %ui:%ui", id, value);
+
+        switch (id) {
+
+        case NGX_HTTP_V2_MAX_STREAMS_SETTING:
+
+            h2->max_streams = ngx_min(value, h2->conf->streams);
+            break;
+
+        case NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING:
+
+            if (value > NGX_HTTP_V2_MAX_WINDOW) {
+                ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                              "upstream sent SETTINGS frame with incorrect "
+                              "INITIAL_WINDOW_SIZE value %ui", value);
+                return NGX_ERROR;
+            }
+
+            delta = value - h2->init_window;
+            h2->init_window = value;
+
+            for (q = ngx_queue_head(&h2->streams);
+                 q != ngx_queue_sentinel(&h2->streams);
+                 q = ngx_queue_next(q))
+            {
+                s = ngx_queue_data(q, ngx_http_upstream_http2_stream_t,
+                                   queue);
+
+                if (delta > 0
+                    && s->send_window > (ssize_t) (NGX_HTTP_V2_MAX_WINDOW
+                                                   - delta))
+                {
+                    ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                                  "upstream INITIAL_WINDOW_SIZE change "
+                                  "overflows window of stream %ui", s->sid);
+
+                    return ngx_http_upstream_http2_connection_error(h2,
+                                                NGX_HTTP_V2_FLOW_CTRL_ERROR);
+                }
+
+                s->send_window += delta;
+            }
+
+            ngx_http_upstream_http2_wake(h2);
+            break;
+
+        default:
+
+            /* frames are never sent larger than the default size */
+
+            break;
+        }
+    }
+
+    if (ngx_http_upstream_http2_frame(h2, 0, NGX_HTTP_V2_SETTINGS_FRAME,
+                                      NGX_HTTP_V2_ACK_FLAG, 0)
+        == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_decode_headers(ngx_http_upstream_http2_conn_t *h2,
+    ngx_http_upstream_http2_stream_t *s)
+{
+    u_char                *p, *end, *tmp, ch;
+    size_t                 i;
+    ngx_int_t              status;
+    ngx_str_t              name, value;
+    ngx_uint_t             index, size, prefix, trailers, start;
+    ngx_http_v2_header_t  *entry;
+
+    tmp = ngx_pnalloc(s->request->pool, h2->block_len * 2);
+    if (tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = h2->block;
+    end = p + h2->block_len;
+
+    trailers = s->in_headers;
+    status = 0;
+    start = 1;
+
+    while (p < end) {
+
+        ch = *p;
+
+        if (ch & 0x80) {
+            /* indexed header field */
+
+            if (ngx_http_upstream_http2_parse_int(&p, end, 7, &index)
+                != NGX_OK)
+            {
+                goto failed;
+            }
+
+            entry = ngx_http_v2_get_static_header(index);
+
+            if (entry == NULL) {
+                goto index;
+            }
+
+            name = entry->name;
+            value = entry->value;
+
+        } else if ((ch & 0xe0) == 0x20) {
+            /* dynamic table size update, the table size advertised is 0 */
+
+            if (ngx_http_upstream_http2_parse_int(&p, end, 5, &size)
+                != NGX_OK)
+            {
+                goto failed;
+            }
+
+            if (size > 0) {
+                ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                              "upstream sent invalid table size update: %ui",
+                              size);
+
+                return ngx_http_upstream_http2_connection_error(h2,
+                                                NGX_HTTP_V2_COMP_ERROR);
+            }
+
+            continue;
+
+        } else {
+            /* literal header field, stored entries are evicted at once */
+
+            prefix = (ch & 0x40) ? 6 : 4;
+
+            if (ngx_http_upstream_http2_parse_int(&p, end, prefix, &index)
+                != NGX_OK)
+            {
+                goto failed;
+            }
+
+            if (index) {
+                entry = ngx_http_v2_get_static_header(index);
+
+                if (entry == NULL) {
+                    goto index;
+                }
+
+                name = entry->name;
+
+            } else if (ngx_http_upstream_http2_parse_string(&p, end, &name,
+                                                            &tmp, h2->log)
+                       != NGX_OK)
+            {
+                goto failed;
+            }
+
+            if (ngx_http_upstream_http2_parse_string(&p, end, &value, &tmp,
+                                                     h2->log)
+                != NGX_OK)
+            {
+                goto failed;
+            }
+        }
+
+        if (trailers) {
+            continue;
+        }
+
+        for (i = 0; i < name.len; i++) {
+            ch = name.data[i];
+
+            if (ch <= 0x20 || ch == 0x7f || (ch == ':' && i > 0)
+                || (ch >= 'A' && ch <= 'Z'))
+            {
+                goto invalid;
+            }
+        }
+
+        for (i = 0; i < value.len; i++) {
+            ch = value.data[i];
+
+            if (ch == '\0' || ch == CR || ch == LF) {
+                goto invalid;
+            }
+        }
+
+        if (name.len && name.data[0] == ':') {
+
+            if (!start) {
+                goto invalid;
+            }
+
+            if (name.len == sizeof(":status") - 1
+                && ngx_strncmp(name.data, ":status", name.len) == 0)
+            {
+                status = ngx_atoi(value.data, value.len);
+
+                if (value.len != 3 || status < 100 || status > 999) {
+                    goto invalid;
+                }
+            }
+
+            continue;
+        }
+
+        if (start) {
+            start = 0;
+
+            if (status == 0) {
+                goto invalid;
+            }
+
+            if (status < 200) {
+                /* informational responses are not passed */
+                return NGX_OK;
+            }
+
+            if (ngx_http_upstream_http2_status_line(h2, s, status)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        /* the framing is carried by HTTP/2 itself */
+
+        if ((name.len == sizeof("connection") - 1
+             && ngx_strncmp(name.data, "connection", name.len) == 0)
+            || (name.len == sizeof("transfer-encoding") - 1
+                && ngx_strncmp(name.data, "transfer-encoding", name.len) == 0))
+        {
+            continue;
+        }
+
+        if (ngx_http_upstream_http2_copy(h2, &s->in, name.data, name.len)
+               != NGX_OK
+            || ngx_http_upstream_http2_copy(h2, &s->in, (u_char *) ": ", 2)
+               != NGX_OK
+            || ngx_http_upstream_http2_copy(h2, &s->in, value.data, value.len)
+               != NGX_OK
+            || ngx_http_upstream_http2_copy(h2, &s->in, (u_char *) CRLF, 2)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (trailers) {
+        return NGX_OK;
+    }
+
+    if (start) {
+
+        if (status == 0) {
+            goto invalid;
+        }
+
+        if (status < 200) {
+            return NGX_OK;
+        }
+
+        if (ngx_http_upstream_http2_status_line(h2, s, status) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_http_upstream_http2_copy(h2, &s->in, (u_char *) CRLF, 2)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    s->in_headers = 1;
+
+    return NGX_OK;
+
+index:
+
+    ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                  "upstream sent invalid hpack table index: %ui", index);
+
+    return ngx_http_upstream_http2_connection_error(h2,
+                                                    NGX_HTTP_V2_COMP_ERROR);
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, h2->log, 0,
+                  "upstream sent invalid header block encoding");
+
+    return ngx_http_upstream_http2_connection_error(h2,
+                                                    NGX_HTTP_V2_COMP_ERROR);
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                  "upstream sent invalid header in stream %ui", s->sid);
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_status_line(ngx_http_upstream_http2_conn_t *h2,
+    ngx_http_upstream_http2_stream_t *s, ngx_uint_t status)
+{
+    u_char                            *p, line[64];
+    ngx_http_upstream_http2_reason_t  *r;
+
+    for (r = ngx_http_upstream_http2_reasons; r->status; r++) {
+        if (r->status == status) {
+            break;
+        }
+    }
+
+    p = ngx_sprintf(line, "HTTP/1.1 %03ui %V" CRLF, status, &r->reason);
+
+    return ngx_http_upstream_http2_copy(h2, &s->in, line, p - line);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_parse_int(u_char **pos, u_char *end,
+    ngx_uint_t prefix, ngx_uint_t *value)
+{
+    u_char      *p, octet;
+    ngx_uint_t   mask, shift, n;
+
+    p = *pos;
+    mask = ngx_http_v2_prefix(prefix);
+
+    n = *p++ & mask;
+
+    if (n == mask) {
+
+        for (shift = 0; /* void */ ; shift += 7) {
+
+            if (p == end || shift > (NGX_HTTP_V2_INT_OCTETS - 1) * 7) {
+                return NGX_ERROR;
+            }
+
+            octet = *p++;
+            n += (ngx_uint_t) (octet & 0x7f) << shift;
+
+            if (!(octet & 0x80)) {
+                break;
+            }
+        }
+    }
+
+    *pos = p;
+    *value = n;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_parse_string(u_char **pos, u_char *end,
+    ngx_str_t *str, u_char **tmp, ngx_log_t *log)
+{
+    u_char      *p, state, *dst;
+    ngx_uint_t   huff, len;
+
+    p = *pos;
+
+    if (p == end) {
+        return NGX_ERROR;
+    }
+
+    huff = *p & 0x80;
+
+    if (ngx_http_upstream_http2_parse_int(&p, end, 7, &len) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (len > (size_t) (end - p)) {
+        return NGX_ERROR;
+    }
+
+    if (huff) {
+        state = 0;
+        dst = *tmp;
+
+        if (ngx_http_v2_huff_decode(&state, p, len, &dst, 1, log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        str->data = *tmp;
+        str->len = dst - *tmp;
+
+        *tmp = dst;
+
+    } else {
+        str->data = p;
+        str->len = len;
+    }
+
+    *pos = p + len;
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_http_upstream_http2_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t                             n;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    s = ngx_http_upstream_http2_stream(c);
+
+    if (s->in.size) {
+        n = ngx_http_upstream_http2_read_bufs(s->h2, &s->in, buf, size);
+
+        ngx_http_upstream_http2_consumed(s, n);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http2 upstream recv: %uz of %uz", n, size);
+
+        return n;
+    }
+
+    c->read->ready = 0;
+
+    if (s->error) {
+        c->read->error = 1;
+        return NGX_ERROR;
+    }
+
+    if (s->in_closed) {
+        c->read->eof = 1;
+        return 0;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_http_upstream_http2_recv_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    size_t                             n, size, total;
+    ngx_buf_t                         *b;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    s = ngx_http_upstream_http2_stream(c);
+
+    if (s->in.size == 0) {
+        return ngx_http_upstream_http2_recv(c, NULL, 0);
+    }
+
+    total = 0;
+
+    for ( /* void */ ; in && s->in.size; in = in->next) {
+        b = in->buf;
+
+        size = b->end - b->last;
+
+        if (limit && (off_t) (total + size) > limit) {
+            size = (size_t) limit - total;
+        }
+
+        n = ngx_http_upstream_http2_read_bufs(s->h2, &s->in, b->last, size);
+        total += n;
+
+        if (n < size || (limit && (off_t) total >= limit)) {
+            break;
+        }
+    }
+
+    ngx_http_upstream_http2_consumed(s, total);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream recv chain: %uz", total);
+
+    return total;
+}
+
+
+static void
+ngx_http_upstream_http2_consumed(ngx_http_upstream_http2_stream_t *s,
+    size_t size)
+{
+    ngx_http_upstream_http2_conn_t  *h2;
+
+    h2 = s->h2;
+
+    if (s->in.size == 0 && !s->in_closed && !s->error) {
+        s->read.ready = 0;
+    }
+
+    if (s->in_closed || s->error || h2->connection == NULL) {
+        return;
+    }
+
+    s->recv_unacked += size;
+
+    if (s->recv_unacked < h2->conf->window / 2) {
+        return;
+    }
+
+    if (ngx_http_upstream_http2_window_update(h2, s->sid, s->recv_unacked)
+        != NGX_OK
+        || ngx_http_upstream_http2_send(h2) == NGX_ERROR)
+    {
+        ngx_http_upstream_http2_close(h2);
+        return;
+    }
+
+    s->recv_window += s->recv_unacked;
+    s->recv_unacked = 0;
+}
+
+
+static ssize_t
+ngx_http_upstream_http2_send_buf(ngx_connection_t *c, u_char *buf,
+    size_t size)
+{
+    ngx_buf_t     b;
+    ngx_chain_t   cl, *rc;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.pos = buf;
+    b.last = buf + size;
+    b.temporary = 1;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    rc = ngx_http_upstream_http2_send_chain(c, &cl, 0);
+
+    if (rc == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (b.pos == buf && size) {
+        return NGX_AGAIN;
+    }
+
+    return b.pos - buf;
+}
+
+
+static ngx_chain_t *
+ngx_http_upstream_http2_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    ngx_buf_t                         *b;
+    ngx_int_t                          rc;
+    ngx_http_upstream_http2_conn_t    *h2;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    s = ngx_http_upstream_http2_stream(c);
+    h2 = s->h2;
+
+    if (s->error || h2->closed) {
+        c->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    /*
+     * the HTTP/1.x request produced by the proxied module is converted
+     * to HEADERS and DATA frames as it is sent
+     */
+
+    for ( /* void */ ; in; in = in->next) {
+        b = in->buf;
+
+        if (!ngx_buf_in_memory(b)) {
+
+            if (ngx_buf_special(b)) {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "http2 upstream cannot send file buffers");
+            return NGX_CHAIN_ERROR;
+        }
+
+        while (b->pos < b->last) {
+
+            if (!s->headers_sent) {
+                rc = ngx_http_upstream_http2_collect_head(s, b);
+
+                if (rc == NGX_ERROR) {
+                    return NGX_CHAIN_ERROR;
+                }
+
+                if (rc == NGX_OK
+                    && ngx_http_upstream_http2_send_headers(s) != NGX_OK)
+                {
+                    return NGX_CHAIN_ERROR;
+                }
+
+                continue;
+            }
+
+            if (s->out_closed) {
+                b->pos = b->last;
+                break;
+            }
+
+            rc = ngx_http_upstream_http2_send_body(s, b);
+
+            if (rc == NGX_ERROR) {
+                return NGX_CHAIN_ERROR;
+            }
+
+            if (rc == NGX_AGAIN) {
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                               "http2 upstream stream %ui blocked", s->sid);
+
+                s->blocked = 1;
+                c->write->ready = 0;
+
+                goto send;
+            }
+        }
+    }
+
+send:
+
+    rc = ngx_http_upstream_http2_send(h2);
+
+    if (rc == NGX_ERROR) {
+        ngx_http_upstream_http2_close(h2);
+        return NGX_CHAIN_ERROR;
+    }
+
+    /*
+     * the backlog was drained without blocking, so no write event
+     * will follow to wake the streams blocked on it
+     */
+
+    if (rc == NGX_OK && h2->out.size < NGX_HTTP_UPSTREAM_HTTP2_BACKLOG) {
+        ngx_http_upstream_http2_wake(h2);
+    }
+
+    return in;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_collect_head(ngx_http_upstream_http2_stream_t *s,
+    ngx_buf_t *b)
+{
+    u_char      *p, ch;
+    ngx_buf_t   *h, *nh;
+
+    h = s->head;
+
+    if (h == NULL) {
+        h = ngx_create_temp_buf(s->request->pool,
+                                ngx_max(b->last - b->pos, 1024));
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        s->head = h;
+    }
+
+    for (p = b->pos; p < b->last; p++) {
+        ch = *p;
+
+        if (h->last == h->end) {
+            nh = ngx_create_temp_buf(s->request->pool, 2 * (h->end - h->pos));
+            if (nh == NULL) {
+                return NGX_ERROR;
+            }
+
+            nh->last = ngx_cpymem(nh->pos, h->pos, h->last - h->pos);
+
+            h = nh;
+            s->head = h;
+        }
+
+        *h->last++ = ch;
+
+        /* the header ends with an empty line */
+
+        switch (s->crlf) {
+
+        case 0:
+        case 2:
+            s->crlf = (ch == CR) ? s->crlf + 1 : 0;
+            break;
+
+        case 1:
+            s->crlf = (ch == LF) ? 2 : (ch == CR) ? 1 : 0;
+            break;
+
+        default: /* 3 */
+            if (ch == LF) {
+                b->pos = p + 1;
+                return NGX_OK;
+            }
+
+            s->crlf = (ch == CR) ? 1 : 0;
+            break;
+        }
+    }
+
+    b->pos = b->last;
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_send_headers(ngx_http_upstream_http2_stream_t *s)
+{
+    u_char                          *p, *end, *line, *eol, *colon, *block,
+                                    *pos, *tmp;
+    size_t                           len, max, n, rest;
+    ngx_str_t                        method, uri, host, *name, *value;
+    ngx_uint_t                       i, type, flags, last;
+    ngx_array_t                      headers;
+    ngx_keyval_t                    *kv;
+    ngx_http_request_t              *r;
+    ngx_http_upstream_http2_conn_t  *h2;
+
+    r = s->request;
+    h2 = s->h2;
+
+    if (h2->goaway || h2->closed) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&headers, r->pool, 16, sizeof(ngx_keyval_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    p = s->head->pos;
+    end = s->head->last;
+
+    ngx_str_null(&host);
+    s->rest = 0;
+
+    /* request line */
+
+    eol = ngx_strlchr(p, end, LF);
+    line = ngx_strlchr(p, eol, ' ');
+
+    if (line == NULL) {
+        goto invalid;
+    }
+
+    method.data = p;
+    method.len = line - p;
+
+    uri.data = line + 1;
+    line = ngx_strlchr(uri.data, eol, ' ');
+
+    if (line == NULL) {
+        goto invalid;
+    }
+
+    uri.len = line - uri.data;
+
+    /* header lines */
+
+    for (p = eol + 1; p < end; p = eol + 1) {
+        eol = ngx_strlchr(p, end, LF);
+
+        if (eol == NULL) {
+            goto invalid;
+        }
+
+        line = (eol > p && eol[-1] == CR) ? eol - 1 : eol;
+
+        if (line == p) {
+            break;
+        }
+
+        colon = ngx_strlchr(p, line, ':');
+
+        if (colon == NULL || colon == p) {
+            goto invalid;
+        }
+
+        kv = ngx_array_push(&headers);
+        if (kv == NULL) {
+            return NGX_ERROR;
+        }
+
+        kv->key.data = p;
+        kv->key.len = colon - p;
+
+        for (p = colon + 1; p < line && (*p == ' ' || *p == '\t'); p++) {
+            /* void */
+        }
+
+        while (line > p && (line[-1] == ' ' || line[-1] == '\t')) {
+            line--;
+        }
+
+        kv->value.data = p;
+        kv->value.len = line - p;
+
+        ngx_strlow(kv->key.data, kv->key.data, kv->key.len);
+    }
+
+    /* the size of the header block and of the largest string */
+
+    len = 3 + NGX_HTTP_V2_INT_OCTETS + method.len
+          + 1 + NGX_HTTP_V2_INT_OCTETS + uri.len;
+    max = ngx_max(method.len, uri.len);
+
+    kv = headers.elts;
+
+    for (i = 0; i < headers.nelts; i++) {
+        name = &kv[i].key;
+        value = &kv[i].value;
+
+        if (name->len == sizeof("host") - 1
+            && ngx_strncmp(name->data, "host", name->len) == 0)
+        {
+            host = *value;
+
+        } else if (name->len == sizeof("content-length") - 1
+                   && ngx_strncmp(name->data, "content-length", name->len)
+                      == 0)
+        {
+            s->rest = ngx_atoof(value->data, value->len);
+
+            if (s->rest == NGX_ERROR) {
+                goto invalid;
+            }
+
+        } else if (name->len == sizeof("transfer-encoding") - 1
+                   && ngx_strncmp(name->data, "transfer-encoding", name->len)
+                      == 0)
+        {
+            if (value->len != sizeof("chunked") - 1
+                || ngx_strncasecmp(value->data, (u_char *) "chunked",
+                                   value->len)
+                   != 0)
+            {
+                goto invalid;
+            }
+
+            s->chunked = ngx_pcalloc(r->pool, sizeof(ngx_http_chunked_t));
+            if (s->chunked == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        len += 1 + NGX_HTTP_V2_INT_OCTETS + name->len
+               + NGX_HTTP_V2_INT_OCTETS + value->len;
+
+        max = ngx_max(max, ngx_max(name->len, value->len));
+    }
+
+    block = ngx_pnalloc(r->pool, len);
+    if (block == NULL) {
+        return NGX_ERROR;
+    }
+
+    tmp = ngx_pnalloc(r->pool, max);
+    if (tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    pos = block;
+
+    if (method.len == 3 && ngx_strncmp(method.data, "GET", 3) == 0) {
+        *pos++ = NGX_HTTP_UPSTREAM_HTTP2_GET;
+
+    } else if (method.len == 4 && ngx_strncmp(method.data, "POST", 4) == 0) {
+        *pos++ = NGX_HTTP_UPSTREAM_HTTP2_POST;
+
+    } else {
+        pos = ngx_http_upstream_http2_write_field(pos,
+                                          NGX_HTTP_UPSTREAM_HTTP2_METHOD_INDEX,
+                                          NULL, &method, tmp);
+    }
+
+    *pos++ = NGX_HTTP_UPSTREAM_HTTP2_SCHEME_HTTP;
+
+    if (uri.len == 1 && uri.data[0] == '/') {
+        *pos++ = NGX_HTTP_UPSTREAM_HTTP2_ROOT;
+
+    } else {
+        pos = ngx_http_upstream_http2_write_field(pos,
+                                            NGX_HTTP_UPSTREAM_HTTP2_PATH_INDEX,
+                                            NULL, &uri, tmp);
+    }
+
+    if (host.len) {
+        pos = ngx_http_upstream_http2_write_field(pos,
+                                       NGX_HTTP_UPSTREAM_HTTP2_AUTHORITY_INDEX,
+                                       NULL, &host, tmp);
+    }
+
+    for (i = 0; i < headers.nelts; i++) {
+        name = &kv[i].key;
+        value = &kv[i].value;
+
+        /* connection-specific fields are not allowed in HTTP/2 */
+
+        switch (name->len) {
+
+        case 2:
+            if (ngx_strncmp(name->data, "te", 2) == 0
+                && !(value->len == sizeof("trailers") - 1
+                     && ngx_strncasecmp(value->data, (u_char *) "trailers",
+                                        value->len)
+                        == 0))
+            {
+                continue;
+            }
+
+            break;
+
+        case 4:
+            if (ngx_strncmp(name->data, "host", 4) == 0) {
+                continue;
+            }
+
+            break;
+
+        case 7:
+            if (ngx_strncmp(name->data, "upgrade", 7) == 0) {
+                continue;
+            }
+
+            break;
+
+        case 10:
+            if (ngx_strncmp(name->data, "connection", 10) == 0
+                || ngx_strncmp(name->data, "keep-alive", 10) == 0)
+            {
+                continue;
+            }
+
+            break;
+
+        case 16:
+            if (ngx_strncmp(name->data, "proxy-connection", 16) == 0) {
+                continue;
+            }
+
+            break;
+
+        case 17:
+            if (ngx_strncmp(name->data, "transfer-encoding", 17) == 0) {
+                continue;
+            }
+
+            break;
+        }
+
+        pos = ngx_http_upstream_http2_write_field(pos, 0, name, value, tmp);
+    }
+
+    last = (s->chunked == NULL && s->rest == 0);
+
+    s->sid = h2->next_sid;
+    h2->next_sid += 2;
+
+    if (h2->next_sid > NGX_HTTP_UPSTREAM_HTTP2_MAX_SID && h2->queued) {
+        ngx_queue_remove(&h2->queue);
+        h2->queued = 0;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                   "http2 upstream stream %ui: \"%V %V\", header block %uz",
+                   s->sid, &method, &uri, (size_t) (pos - block));
+
+    /* HEADERS and CONTINUATION frames */
+
+    type = NGX_HTTP_V2_HEADERS_FRAME;
+    flags = last ? NGX_HTTP_V2_END_STREAM_FLAG : NGX_HTTP_V2_NO_FLAG;
+
+    p = block;
+    rest = pos - block;
+
+    for ( ;; ) {
+        n = ngx_min(rest, NGX_HTTP_V2_DEFAULT_FRAME_SIZE);
+
+        if (n == rest) {
+            flags |= NGX_HTTP_V2_END_HEADERS_FLAG;
+        }
+
+        pos = ngx_http_upstream_http2_frame(h2, n, type, flags, s->sid);
+        if (pos == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(pos, p, n);
+
+        p += n;
+        rest -= n;
+
+        if (rest == 0) {
+            break;
+        }
+
+        type = NGX_HTTP_V2_CONTINUATION_FRAME;
+        flags = NGX_HTTP_V2_NO_FLAG;
+    }
+
+    s->headers_sent = 1;
+    s->out_closed = last;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ALERT, s->connection.log, 0,
+                  "http2 upstream cannot convert request header");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_send_body(ngx_http_upstream_http2_stream_t *s,
+    ngx_buf_t *b)
+{
+    size_t               size;
+    ssize_t              n;
+    ngx_int_t            rc;
+    ngx_http_chunked_t  *ctx;
+
+    ctx = s->chunked;
+
+    if (ctx == NULL) {
+        size = b->last - b->pos;
+
+        if ((off_t) size > s->rest) {
+            size = (size_t) s->rest;
+        }
+
+        n = ngx_http_upstream_http2_send_data(s, b->pos, size,
+                                              (off_t) size == s->rest);
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        b->pos += n;
+        s->rest -= n;
+
+        if (s->rest == 0) {
+            b->pos = b->last;
+        }
+
+        return ((size_t) n < size) ? NGX_AGAIN : NGX_OK;
+    }
+
+    rc = ngx_http_parse_chunked(s->request, b, ctx);
+
+    switch (rc) {
+
+    case NGX_OK:
+
+        /* a chunk has been parsed successfully */
+
+        size = b->last - b->pos;
+
+        if ((off_t) size > ctx->size) {
+            size = (size_t) ctx->size;
+        }
+
+        n = ngx_http_upstream_http2_send_data(s, b->pos, size, 0);
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        b->pos += n;
+        ctx->size -= n;
+
+        return ((size_t) n < size) ? NGX_AGAIN : NGX_OK;
+
+    case NGX_DONE:
+
+        b->pos = b->last;
+
+        if (ngx_http_upstream_http2_send_data(s, NULL, 0, 1) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+
+    case NGX_AGAIN:
+        return NGX_OK;
+
+    default: /* NGX_ERROR */
+
+        ngx_log_error(NGX_LOG_ALERT, s->connection.log, 0,
+                      "http2 upstream cannot parse chunked request body");
+
+        return NGX_ERROR;
+    }
+}
+
+
+static ssize_t
+ngx_http_upstream_http2_send_data(ngx_http_upstream_http2_stream_t *s,
+    u_char *pos, size_t len, ngx_uint_t last)
+{
+    u_char                          *p;
+    size_t                           size, sent;
+    ssize_t                          window;
+    ngx_uint_t                       flags;
+    ngx_http_upstream_http2_conn_t  *h2;
+
+    h2 = s->h2;
+
+    if (len == 0 && !last) {
+        return 0;
+    }
+
+    sent = 0;
+
+    for ( ;; ) {
+        size = len - sent;
+
+        if (size) {
+            window = ngx_min(s->send_window, h2->send_window);
+
+            if (window <= 0
+                || h2->out.size >= NGX_HTTP_UPSTREAM_HTTP2_BACKLOG)
+            {
+                break;
+            }
+
+            size = ngx_min(size, (size_t) window);
+            size = ngx_min(size, NGX_HTTP_V2_DEFAULT_FRAME_SIZE);
+        }
+
+        flags = (last && sent + size == len) ? NGX_HTTP_V2_END_STREAM_FLAG
+                                             : NGX_HTTP_V2_NO_FLAG;
+
+        p = ngx_http_upstream_http2_frame(h2, size, NGX_HTTP_V2_DATA_FRAME,
+                                          flags, s->sid);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(p, pos + sent, size);
+
+        sent += size;
+
+        s->send_window -= size;
+        h2->send_window -= size;
+
+        if (flags) {
+            s->out_closed = 1;
+            break;
+        }
+
+        if (sent == len) {
+            break;
+        }
+    }
+
+    return sent;
+}
+
+
+static u_char *
+ngx_http_upstream_http2_write_field(u_char *p, ngx_uint_t index,
+    ngx_str_t *name, ngx_str_t *value, u_char *tmp)
+{
+    *p = NGX_HTTP_V2_FIELD_NOT_INDEXED;
+
+    if (index) {
+        p = ngx_http_v2_write_int(p, ngx_http_v2_prefix(4), index);
+
+    } else {
+        p = ngx_http_v2_write_name(p + 1, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_value(p, value->data, value->len, tmp);
+}
+
+
+static u_char *
+ngx_http_upstream_http2_frame(ngx_http_upstream_http2_conn_t *h2, size_t len,
+    ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid)
+{
+    u_char  *p;
+
+    p = ngx_http_upstream_http2_reserve(h2, &h2->out,
+                                        NGX_HTTP_V2_FRAME_HEADER_SIZE + len);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    p = ngx_http_v2_write_uint32(p, len << 8 | type);
+    *p++ = (u_char) flags;
+    p = ngx_http_v2_write_sid(p, sid);
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_window_update(ngx_http_upstream_http2_conn_t *h2,
+    ngx_uint_t sid, size_t window)
+{
+    u_char  *p;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2->log, 0,
+                   "http2 upstream send WINDOW_UPDATE frame sid:%ui, "
+                   "window:%uz", sid, window);
+
+    p = ngx_http_upstream_http2_frame(h2, NGX_HTTP_V2_WINDOW_UPDATE_SIZE,
+                                      NGX_HTTP_V2_WINDOW_UPDATE_FRAME,
+                                      NGX_HTTP_V2_NO_FLAG, sid);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_http_v2_write_uint32(p, window);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_rst_stream(ngx_http_upstream_http2_conn_t *h2,
+    ngx_uint_t sid, ngx_uint_t status)
+{
+    u_char  *p;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2->log, 0,
+                   "http2 upstream send RST_STREAM frame sid:%ui, status:%ui",
+                   sid, status);
+
+    p = ngx_http_upstream_http2_frame(h2, NGX_HTTP_V2_RST_STREAM_SIZE,
+                                      NGX_HTTP_V2_RST_STREAM_FRAME,
+                                      NGX_HTTP_V2_NO_FLAG, sid);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_http_v2_write_uint32(p, status);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_stream_error(ngx_http_upstream_http2_stream_t *s,
+    ngx_uint_t status)
+{
+    s->error = 1;
+    s->out_closed = 1;
+
+    ngx_http_upstream_http2_post(s, &s->read);
+    ngx_http_upstream_http2_post(s, &s->write);
+
+    return ngx_http_upstream_http2_rst_stream(s->h2, s->sid, status);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_connection_error(ngx_http_upstream_http2_conn_t *h2,
+    ngx_uint_t status)
+{
+    u_char  *p;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2->log, 0,
+                   "http2 upstream send GOAWAY frame, status:%ui", status);
+
+    /* the GOAWAY frame is sent if possible, the connection is closed anyway */
+
+    p = ngx_http_upstream_http2_frame(h2, NGX_HTTP_V2_GOAWAY_SIZE,
+                                      NGX_HTTP_V2_GOAWAY_FRAME,
+                                      NGX_HTTP_V2_NO_FLAG, 0);
+    if (p != NULL) {
+        p = ngx_http_v2_write_sid(p, 0);
+        (void) ngx_http_v2_write_uint32(p, status);
+
+        (void) ngx_http_upstream_http2_send(h2);
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_http_upstream_http2_stream_t *
+ngx_http_upstream_http2_find_stream(ngx_http_upstream_http2_conn_t *h2,
+    ngx_uint_t sid)
+{
+    ngx_queue_t                       *q;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    for (q = ngx_queue_head(&h2->streams);
+         q != ngx_queue_sentinel(&h2->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+
+        if (s->sid == sid) {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_upstream_http2_post(ngx_http_upstream_http2_stream_t *s,
+    ngx_event_t *ev)
+{
+    ev->ready = 1;
+
+    if (!ev->posted) {
+        ngx_post_event(ev, &ngx_posted_events);
+    }
+}
+
+
+static void
+ngx_http_upstream_http2_wake(ngx_http_upstream_http2_conn_t *h2)
+{
+    ngx_queue_t                       *q;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    for (q = ngx_queue_head(&h2->streams);
+         q != ngx_queue_sentinel(&h2->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+
+        if (s->blocked && s->send_window > 0 && h2->send_window > 0) {
+            s->blocked = 0;
+            ngx_http_upstream_http2_post(s, &s->write);
+        }
+    }
+}
+
+
+static ngx_http_upstream_http2_block_t *
+ngx_http_upstream_http2_alloc_block(ngx_http_upstream_http2_conn_t *h2)
+{
+    ngx_http_upstream_http2_block_t  *b;
+
+    b = h2->free;
+
+    if (b) {
+        h2->free = b->next;
+        h2->nfree--;
+
+    } else {
+        b = ngx_alloc(sizeof(ngx_http_upstream_http2_block_t), h2->log);
+        if (b == NULL) {
+            return NULL;
+        }
+    }
+
+    b->next = NULL;
+    b->pos = b->start;
+    b->last = b->start;
+
+    return b;
+}
+
+
+static void
+ngx_http_upstream_http2_free_block(ngx_http_upstream_http2_conn_t *h2,
+    ngx_http_upstream_http2_block_t *b)
+{
+    if (h2->nfree >= NGX_HTTP_UPSTREAM_HTTP2_MAX_FREE) {
+        ngx_free(b);
+        return;
+    }
+
+    b->next = h2->free;
+    h2->free = b;
+    h2->nfree++;
+}
+
+
+static u_char *
+ngx_http_upstream_http2_reserve(ngx_http_upstream_http2_conn_t *h2,
+    ngx_http_upstream_http2_bufs_t *bufs, size_t size)
+{
+    u_char                           *p;
+    ngx_http_upstream_http2_block_t  *b;
+
+    b = bufs->last;
+
+    if (b == NULL
+        || (size_t) (b->start + NGX_HTTP_UPSTREAM_HTTP2_BLOCK_SIZE - b->last)
+           < size)
+    {
+        b = ngx_http_upstream_http2_alloc_block(h2);
+        if (b == NULL) {
+            return NULL;
+        }
+
+        if (bufs->last) {
+            bufs->last->next = b;
+
+        } else {
+            bufs->first = b;
+        }
+
+        bufs->last = b;
+    }
+
+    p = b->last;
+
+    b->last += size;
+    bufs->size += size;
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_copy(ngx_http_upstream_http2_conn_t *h2,
+    ngx_http_upstream_http2_bufs_t *bufs, u_char *data, size_t len)
+{
+    size_t                            n;
+    ngx_http_upstream_http2_block_t  *b;
+
+    while (len) {
+        b = bufs->last;
+
+        n = b ? (size_t) (b->start + NGX_HTTP_UPSTREAM_HTTP2_BLOCK_SIZE
+                          - b->last)
+              : 0;
+
+        if (n == 0) {
+            n = NGX_HTTP_UPSTREAM_HTTP2_BLOCK_SIZE;
+        }
+
+        n = ngx_min(n, len);
+
+        if (ngx_http_upstream_http2_reserve(h2, bufs, n) == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(bufs->last->last - n, data, n);
+
+        data += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_http_upstream_http2_read_bufs(ngx_http_upstream_http2_conn_t *h2,
+    ngx_http_upstream_http2_bufs_t *bufs, u_char *buf, size_t size)
+{
+    size_t                            n, total;
+    ngx_http_upstream_http2_block_t  *b;
+
+    total = 0;
+
+    while (bufs->first && total < size) {
+        b = bufs->first;
+
+        n = ngx_min((size_t) (b->last - b->pos), size - total);
+
+        buf = ngx_cpymem(buf, b->pos, n);
+
+        b->pos += n;
+        total += n;
+
+        if (b->pos == b->last) {
+            bufs->first = b->next;
+
+            if (bufs->first == NULL) {
+                bufs->last = NULL;
+            }
+
+            ngx_http_upstream_http2_free_block(h2, b);
+        }
+    }
+
+    bufs->size -= total;
+
+    return total;
+}
+
+
+static void
+ngx_http_upstream_http2_free_bufs(ngx_http_upstream_http2_conn_t *h2,
+    ngx_http_upstream_http2_bufs_t *bufs)
+{
+    ngx_http_upstream_http2_block_t  *b;
+
+    while (bufs->first) {
+        b = bufs->first;
+        bufs->first = b->next;
+
+        ngx_http_upstream_http2_free_block(h2, b);
+    }
+
+    bufs->last = NULL;
+    bufs->size = 0;
+}
+
+
+static void *
+ngx_http_upstream_http2_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_http2_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_http2_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->original_init_upstream = NULL;
+     *     conf->original_init_peer = NULL;
+     *     conf->streams = 0;
+     *     conf->window = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_http2(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_http2_srv_conf_t  *hcf = conf;
+
+    ssize_t                        size;
+    ngx_int_t                      n;
+    ngx_str_t                     *value, s;
+    ngx_uint_t                     i;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (hcf->streams) {
+        return "is duplicate";
+    }
+
+    hcf->streams = 128;
+    hcf->window = NGX_HTTP_V2_DEFAULT_WINDOW;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "streams=", 8) == 0) {
+
+            n = ngx_atoi(value[i].data + 8, value[i].len - 8);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->streams = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "window=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR || size < NGX_HTTP_V2_DEFAULT_FRAME_SIZE
+                || size > NGX_HTTP_V2_MAX_WINDOW)
+            {
+                goto invalid;
+            }
+
+            hcf->window = size;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->keepalive) {
+        return "cannot be used with \"keepalive\"";
+    }
+
+    uscf->http2 = 1;
+
+    hcf->original_init_upstream = uscf->peer.init_upstream
+                                  ? uscf->peer.init_upstream
+                                  : ngx_http_upstream_init_round_robin;
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_http2;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
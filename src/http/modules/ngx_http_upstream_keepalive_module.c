@@ -8,11 +8,30 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#if !(NGX_WIN32)
+#include <ngx_channel.h>
+#endif
+
+
+typedef struct {
+    ngx_atomic_t                       last;
+    ngx_atomic_t                       want[NGX_MAX_PROCESSES];
+} ngx_http_upstream_keepalive_shctx_t;
+
+
+typedef struct {
+    ngx_array_t                        shared;
+    ngx_shm_zone_t                    *shm_zone;
+    ngx_http_upstream_keepalive_shctx_t  *sh;
+} ngx_http_upstream_keepalive_main_conf_t;
 
 
 typedef struct {
     ngx_uint_t                         max_cached;
 
+    ngx_http_upstream_keepalive_main_conf_t  *shared;
+    ngx_uint_t                         index;
+
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
 
@@ -70,6 +89,21 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
     void *data);
 #endif
 
+#if !(NGX_WIN32)
+static void ngx_http_upstream_keepalive_want(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_peer_connection_t *pc);
+static ngx_int_t ngx_http_upstream_keepalive_pass(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_peer_connection_t *pc);
+static void ngx_http_upstream_keepalive_receive(ngx_channel_t *ch,
+    ngx_log_t *log);
+#endif
+
+static ngx_int_t ngx_http_upstream_keepalive_init_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle);
+static void *ngx_http_upstream_keepalive_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_keepalive_init_main_conf(ngx_conf_t *cf,
+    void *conf);
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -78,7 +112,7 @@ static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
 
     { ngx_string("keepalive"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
       ngx_http_upstream_keepalive,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -92,8 +126,10 @@ static ngx_http_module_t  ngx_http_upstream_keepalive_module_ctx = {
     NULL,                                  /* preconfiguration */
     NULL,                                  /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_upstream_keepalive_create_main_conf,
+                                           /* create main configuration */
+    ngx_http_upstream_keepalive_init_main_conf,
+                                           /* init main configuration */
 
     ngx_http_upstream_keepalive_create_conf, /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -110,7 +146,7 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_keepalive_init_process, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -247,6 +283,12 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         }
     }
 
+#if !(NGX_WIN32)
+    if (kp->conf->shared) {
+        ngx_http_upstream_keepalive_want(kp->conf, pc);
+    }
+#endif
+
     return NGX_OK;
 
 found:
@@ -314,6 +356,16 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         goto invalid;
     }
 
+#if !(NGX_WIN32)
+    if (kp->conf->shared
+        && ngx_http_upstream_keepalive_pass(kp->conf, pc) == NGX_OK)
+    {
+        ngx_http_upstream_keepalive_close(c);
+        pc->connection = NULL;
+        goto invalid;
+    }
+#endif
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
@@ -466,6 +518,373 @@ ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
 #endif
 
 
+#if !(NGX_WIN32)
+
+static void
+ngx_http_upstream_keepalive_want(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_peer_connection_t *pc)
+{
+    ngx_atomic_uint_t                     hash, last;
+    ngx_http_upstream_keepalive_shctx_t  *sh;
+
+    /*
+     * a worker which had to open a new connection advertises the peer
+     * in the shared zone, so that a worker with a spare idle connection
+     * to the same peer can pass it over the channel
+     */
+
+    if (ngx_process != NGX_PROCESS_WORKER || ngx_exiting) {
+        return;
+    }
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    if (pc->sockaddr->sa_family == AF_UNIX) {
+        return;
+    }
+#endif
+
+    sh = &kcf->shared->sh[kcf->index];
+
+    hash = ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen) | 1;
+
+    if (sh->want[ngx_process_slot] != hash) {
+        sh->want[ngx_process_slot] = hash;
+    }
+
+    for ( ;; ) {
+        last = sh->last;
+
+        if (last > (ngx_atomic_uint_t) ngx_process_slot
+            || ngx_atomic_cmp_set(&sh->last, last, ngx_process_slot + 1))
+        {
+            break;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_pass(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_peer_connection_t *pc)
+{
+    ngx_int_t                             s;
+    ngx_uint_t                            i;
+    ngx_queue_t                          *q;
+    ngx_channel_t                         ch;
+    ngx_connection_t                     *c;
+    ngx_atomic_uint_t                     hash, last;
+    ngx_http_upstream_keepalive_cache_t  *item;
+    ngx_http_upstream_keepalive_shctx_t  *sh;
+
+    c = pc->connection;
+
+    /* the SSL state cannot be passed along with the socket */
+
+#if (NGX_HTTP_SSL)
+    if (c->ssl) {
+        return NGX_DECLINED;
+    }
+#endif
+
+    if (c->read->ready || ngx_process != NGX_PROCESS_WORKER) {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    if (pc->sockaddr->sa_family == AF_UNIX) {
+        return NGX_DECLINED;
+    }
+#endif
+
+    /* only a spare connection is passed, one is kept for ourselves */
+
+    for (q = ngx_queue_head(&kcf->cache);
+         q != ngx_queue_sentinel(&kcf->cache);
+         q = ngx_queue_next(q))
+    {
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
+                         item->socklen, pc->socklen)
+            == 0)
+        {
+            goto spare;
+        }
+    }
+
+    return NGX_DECLINED;
+
+spare:
+
+    sh = &kcf->shared->sh[kcf->index];
+
+    hash = ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen) | 1;
+    last = sh->last;
+
+    for (i = 0; i < last; i++) {
+        s = (ngx_process_slot + 1 + i) % last;
+
+        if (s == ngx_process_slot
+            || sh->want[s] != hash
+            || ngx_processes[s].channel[0] == -1)
+        {
+            continue;
+        }
+
+        if (!ngx_atomic_cmp_set(&sh->want[s], hash, 0)) {
+            continue;
+        }
+
+        /* the slot field carries the index of the upstream */
+
+        ch.command = NGX_CMD_PASS_CONNECTION;
+        ch.pid = ngx_pid;
+        ch.slot = kcf->index;
+        ch.fd = c->fd;
+
+        if (ngx_write_channel(ngx_processes[s].channel[0], &ch,
+                              sizeof(ngx_channel_t), pc->log)
+            != NGX_OK)
+        {
+            return NGX_DECLINED;
+        }
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "free keepalive peer: passing connection %p "
+                       "to %P s:%i", c, ngx_processes[s].pid, s);
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_upstream_keepalive_receive(ngx_channel_t *ch, ngx_log_t *log)
+{
+    socklen_t                                 socklen;
+    ngx_queue_t                              *q;
+    ngx_sockaddr_t                            sockaddr;
+    ngx_connection_t                         *c;
+    ngx_http_upstream_keepalive_cache_t      *item;
+    ngx_http_upstream_keepalive_srv_conf_t   *kcf, **kcfp;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    kmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                          ngx_http_upstream_keepalive_module);
+
+    if (kmcf == NULL
+        || ngx_exiting
+        || ch->slot < 0
+        || (ngx_uint_t) ch->slot >= kmcf->shared.nelts)
+    {
+        goto failed;
+    }
+
+    kcfp = kmcf->shared.elts;
+    kcf = kcfp[ch->slot];
+
+    socklen = sizeof(ngx_sockaddr_t);
+
+    if (getpeername(ch->fd, &sockaddr.sockaddr, &socklen) == -1) {
+        ngx_log_error(NGX_LOG_INFO, log, ngx_socket_errno,
+                      "getpeername() of passed connection failed");
+        goto failed;
+    }
+
+    c = ngx_get_connection(ch->fd, ngx_cycle->log);
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->pool = ngx_create_pool(128, ngx_cycle->log);
+    if (c->pool == NULL) {
+        ngx_free_connection(c);
+        goto failed;
+    }
+
+    c->type = SOCK_STREAM;
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
+    c->sendfile = 1;
+    c->log_error = NGX_ERROR_ERR;
+
+    c->read->log = c->log;
+    c->write->log = c->log;
+    c->write->ready = 1;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    if (ngx_add_conn) {
+        if (ngx_add_conn(c) == NGX_ERROR) {
+            ngx_destroy_pool(c->pool);
+            ngx_close_connection(c);
+            return;
+        }
+
+    } else if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_destroy_pool(c->pool);
+        ngx_close_connection(c);
+        return;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "keepalive: got connection %p fd:%d from %P",
+                   c, c->fd, ch->pid);
+
+    if (ngx_queue_empty(&kcf->free)) {
+
+        q = ngx_queue_last(&kcf->cache);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+        ngx_http_upstream_keepalive_close(item->connection);
+
+    } else {
+        q = ngx_queue_head(&kcf->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+    }
+
+    ngx_queue_insert_head(&kcf->cache, q);
+
+    item->connection = c;
+
+    c->write->handler = ngx_http_upstream_keepalive_dummy_handler;
+    c->read->handler = ngx_http_upstream_keepalive_close_handler;
+
+    c->data = item;
+    c->idle = 1;
+
+    item->socklen = socklen;
+    ngx_memcpy(&item->sockaddr, &sockaddr, socklen);
+
+    return;
+
+failed:
+
+    if (close(ch->fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "close() passed connection failed");
+    }
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_upstream_keepalive_main_conf_t  *okmcf = data;
+
+    size_t                                    size;
+    ngx_slab_pool_t                          *shpool;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    kmcf = shm_zone->data;
+
+    if (okmcf) {
+        kmcf->sh = okmcf->sh;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        kmcf->sh = shpool->data;
+        return NGX_OK;
+    }
+
+    size = sizeof(ngx_http_upstream_keepalive_shctx_t) * kmcf->shared.nelts;
+
+    kmcf->sh = ngx_slab_calloc(shpool, size);
+    if (kmcf->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = kmcf->sh;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle)
+{
+#if !(NGX_WIN32)
+
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    kmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                          ngx_http_upstream_keepalive_module);
+
+    if (kmcf && kmcf->shared.nelts) {
+        ngx_channel_connection_handler = ngx_http_upstream_keepalive_receive;
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_upstream_keepalive_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    kmcf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_keepalive_main_conf_t));
+    if (kmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&kmcf->shared, cf->pool, 4,
+                       sizeof(ngx_http_upstream_keepalive_srv_conf_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return kmcf;
+}
+
+
+static char *
+ngx_http_upstream_keepalive_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf = conf;
+
+    size_t     size;
+    ngx_str_t  name;
+
+    if (kmcf->shared.nelts == 0) {
+        return NGX_CONF_OK;
+    }
+
+    ngx_str_set(&name, "upstream_keepalive");
+
+    size = 8 * ngx_pagesize
+           + sizeof(ngx_http_upstream_keepalive_shctx_t) * kmcf->shared.nelts;
+
+    kmcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                           &ngx_http_upstream_keepalive_module);
+    if (kmcf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    kmcf->shm_zone->init = ngx_http_upstream_keepalive_init_zone;
+    kmcf->shm_zone->data = kmcf;
+
+    return NGX_CONF_OK;
+}
+
+
 static void *
 ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
 {
@@ -483,6 +902,8 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
      *     conf->max_cached = 0;
+     *     conf->shared = NULL;
+     *     conf->index = 0;
      */
 
     return conf;
@@ -492,8 +913,9 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
 static char *
 ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_upstream_srv_conf_t            *uscf;
-    ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
+    ngx_http_upstream_srv_conf_t             *uscf;
+    ngx_http_upstream_keepalive_srv_conf_t   *kcf = conf;
+    ngx_http_upstream_keepalive_srv_conf_t  **kcfp;
 
     ngx_int_t    n;
     ngx_str_t   *value;
@@ -502,6 +924,12 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return "is duplicate";
     }
 
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->http2) {
+        return "cannot be used with \"http2\"";
+    }
+
     /* read options */
 
     value = cf->args->elts;
@@ -517,7 +945,33 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     kcf->max_cached = n;
 
-    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strcmp(value[2].data, "shared") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+#if (NGX_WIN32)
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"shared\" is not supported on this platform");
+        return NGX_CONF_ERROR;
+#else
+        kcf->shared = ngx_http_conf_get_module_main_conf(cf,
+                                           ngx_http_upstream_keepalive_module);
+
+        kcfp = ngx_array_push(&kcf->shared->shared);
+        if (kcfp == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *kcfp = kcf;
+        kcf->index = kcf->shared->shared.nelts - 1;
+#endif
+    }
+
+    uscf->keepalive = 1;
 
     kcf->original_init_upstream = uscf->peer.init_upstream
                                   ? uscf->peer.init_upstream
@@ -10,10 +10,63 @@
 #include <ngx_http.h>
 
 
+/*
+ * The tournament tree keeps the primary peers ordered by the number of
+ * connections relative to the weight, so the least loaded peer is found
+ * at the root and a change of a peer's connections costs O(log n).
+ * Peers with equal load are ordered by the pass value, which advances
+ * by a stride inversely proportional to the weight on each selection,
+ * thus ties are resolved in the weighted round-robin fashion.
+ *
+ * The tree is private to a worker process, so it is only used when
+ * the upstream group is not in a shared memory zone.
+ */
+
+#define NGX_HTTP_UPSTREAM_LC_NONE    ((ngx_uint_t) -1)
+#define NGX_HTTP_UPSTREAM_LC_STRIDE  65536
+
+
+typedef struct {
+    ngx_http_upstream_rr_peers_t         *peers;
+    ngx_uint_t                            number;
+    ngx_uint_t                           *node;
+    uint64_t                             *pass;
+} ngx_http_upstream_least_conn_tree_t;
+
+
+typedef struct {
+    ngx_http_upstream_least_conn_tree_t  *tree;
+} ngx_http_upstream_least_conn_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t      rrp;
+    ngx_http_upstream_least_conn_tree_t  *tree;
+} ngx_http_upstream_least_conn_peer_data_t;
+
+
 static ngx_int_t ngx_http_upstream_init_least_conn_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us);
 static ngx_int_t ngx_http_upstream_get_least_conn_peer(
     ngx_peer_connection_t *pc, void *data);
+static void ngx_http_upstream_free_least_conn_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+static ngx_int_t ngx_http_upstream_least_conn_init_tree(ngx_conf_t *cf,
+    ngx_http_upstream_least_conn_srv_conf_t *lcf,
+    ngx_http_upstream_rr_peers_t *peers);
+static ngx_uint_t ngx_http_upstream_least_conn_less(
+    ngx_http_upstream_least_conn_tree_t *tree, ngx_uint_t one,
+    ngx_uint_t two);
+static void ngx_http_upstream_least_conn_update(
+    ngx_http_upstream_least_conn_tree_t *tree, ngx_uint_t i);
+static ngx_uint_t ngx_http_upstream_least_conn_find(
+    ngx_http_upstream_least_conn_tree_t *tree,
+    ngx_http_upstream_rr_peer_data_t *rrp, ngx_uint_t node, ngx_uint_t best,
+    time_t now);
+
+static void *ngx_http_upstream_least_conn_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_least_conn(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 
@@ -38,7 +91,7 @@ static ngx_http_module_t  ngx_http_upstream_least_conn_module_ctx = {
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
 
-    NULL,                                  /* create server configuration */
+    ngx_http_upstream_least_conn_create_conf, /* create server configuration */
     NULL,                                  /* merge server configuration */
 
     NULL,                                  /* create location configuration */
@@ -66,6 +119,8 @@ static ngx_int_t
 ngx_http_upstream_init_least_conn(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
 {
+    ngx_http_upstream_least_conn_srv_conf_t  *lcf;
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
                    "init least conn");
 
@@ -75,6 +130,69 @@ ngx_http_upstream_init_least_conn(ngx_conf_t *cf,
 
     us->peer.init = ngx_http_upstream_init_least_conn_peer;
 
+    lcf = ngx_http_conf_upstream_srv_conf(us,
+                                          ngx_http_upstream_least_conn_module);
+
+    if (us->shm_zone == NULL) {
+        if (ngx_http_upstream_least_conn_init_tree(cf, lcf, us->peer.data)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_least_conn_init_tree(ngx_conf_t *cf,
+    ngx_http_upstream_least_conn_srv_conf_t *lcf,
+    ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t                            i, n, l, r;
+    ngx_http_upstream_least_conn_tree_t  *tree;
+
+    if (peers->single) {
+        return NGX_OK;
+    }
+
+    tree = ngx_palloc(cf->pool, sizeof(ngx_http_upstream_least_conn_tree_t));
+    if (tree == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (n = 1; n < peers->number; n <<= 1) { /* void */ }
+
+    tree->peers = peers;
+    tree->number = n;
+
+    tree->node = ngx_palloc(cf->pool, 2 * n * sizeof(ngx_uint_t));
+    if (tree->node == NULL) {
+        return NGX_ERROR;
+    }
+
+    tree->pass = ngx_pcalloc(cf->pool, n * sizeof(uint64_t));
+    if (tree->pass == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the leaves, down peers are never selected */
+
+    for (i = 0; i < n; i++) {
+        tree->node[n + i] = (i < peers->number && !peers->peer[i].down)
+                            ? i : NGX_HTTP_UPSTREAM_LC_NONE;
+    }
+
+    for (i = n - 1; i > 0; i--) {
+        l = tree->node[2 * i];
+        r = tree->node[2 * i + 1];
+
+        tree->node[i] = ngx_http_upstream_least_conn_less(tree, r, l) ? r : l;
+    }
+
+    lcf->tree = tree;
+
     return NGX_OK;
 }
 
@@ -83,15 +201,35 @@ static ngx_int_t
 ngx_http_upstream_init_least_conn_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us)
 {
+    ngx_http_upstream_least_conn_srv_conf_t   *lcf;
+    ngx_http_upstream_least_conn_peer_data_t  *lcp;
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "init least conn peer");
 
+    lcp = ngx_palloc(r->pool,
+                     sizeof(ngx_http_upstream_least_conn_peer_data_t));
+    if (lcp == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &lcp->rrp;
+
     if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
         return NGX_ERROR;
     }
 
+    lcf = ngx_http_conf_upstream_srv_conf(us,
+                                          ngx_http_upstream_least_conn_module);
+
+    lcp->tree = lcf->tree;
+
     r->upstream->peer.get = ngx_http_upstream_get_least_conn_peer;
 
+    if (lcp->tree) {
+        r->upstream->peer.free = ngx_http_upstream_free_least_conn_peer;
+    }
+
     return NGX_OK;
 }
 
@@ -99,14 +237,18 @@ ngx_http_upstream_init_least_conn_peer(ngx_http_request_t *r,
 static ngx_int_t
 ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
 {
-    ngx_http_upstream_rr_peer_data_t  *rrp = data;
+    ngx_http_upstream_least_conn_peer_data_t  *lcp = data;
+
+    time_t                                now;
+    uintptr_t                             m;
+    ngx_int_t                             rc, total;
+    ngx_uint_t                            i, n, p, many;
+    ngx_http_upstream_rr_peer_t          *peer, *best;
+    ngx_http_upstream_rr_peers_t         *peers;
+    ngx_http_upstream_rr_peer_data_t     *rrp;
+    ngx_http_upstream_least_conn_tree_t  *tree;
 
-    time_t                         now;
-    uintptr_t                      m;
-    ngx_int_t                      rc, total;
-    ngx_uint_t                     i, n, p, many;
-    ngx_http_upstream_rr_peer_t   *peer, *best;
-    ngx_http_upstream_rr_peers_t  *peers;
+    rrp = &lcp->rrp;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get least conn peer, try: %ui", pc->tries);
@@ -132,6 +274,27 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
     p = 0;
 #endif
 
+    tree = lcp->tree;
+
+    if (tree && tree->peers == peers) {
+
+        p = ngx_http_upstream_least_conn_find(tree, rrp, 1,
+                                              NGX_HTTP_UPSTREAM_LC_NONE, now);
+
+        if (p == NGX_HTTP_UPSTREAM_LC_NONE) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                           "get least conn peer, no peer found");
+
+            goto failed;
+        }
+
+        best = &peers->peer[p];
+
+        tree->pass[p] += NGX_HTTP_UPSTREAM_LC_STRIDE / best->weight + 1;
+
+        goto found;
+    }
+
     for (peer = peers->peer, i = 0;
          peer;
          peer = peer->next, i++)
@@ -226,6 +389,8 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
 
     best->current_weight -= total;
 
+found:
+
     if (now - best->checked > best->fail_timeout) {
         best->checked = now;
     }
@@ -238,6 +403,10 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
 
     rrp->current = best;
 
+    if (tree && tree->peers == peers) {
+        ngx_http_upstream_least_conn_update(tree, p);
+    }
+
     n = p / (8 * sizeof(uintptr_t));
     m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
 
@@ -264,7 +433,7 @@ failed:
 
         ngx_http_upstream_rr_peers_unlock(peers);
 
-        rc = ngx_http_upstream_get_least_conn_peer(pc, rrp);
+        rc = ngx_http_upstream_get_least_conn_peer(pc, lcp);
 
         if (rc != NGX_BUSY) {
             return rc;
@@ -287,6 +456,131 @@ failed:
 }
 
 
+static void
+ngx_http_upstream_free_least_conn_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_least_conn_peer_data_t  *lcp = data;
+
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    peer = lcp->rrp.current;
+
+    ngx_http_upstream_free_round_robin_peer(pc, &lcp->rrp, state);
+
+    if (lcp->tree->peers == lcp->rrp.peers) {
+        ngx_http_upstream_least_conn_update(lcp->tree,
+                                (ngx_uint_t) (peer - lcp->rrp.peers->peer));
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_least_conn_less(ngx_http_upstream_least_conn_tree_t *tree,
+    ngx_uint_t one, ngx_uint_t two)
+{
+    ngx_http_upstream_rr_peer_t  *a, *b;
+
+    if (one == NGX_HTTP_UPSTREAM_LC_NONE) {
+        return 0;
+    }
+
+    if (two == NGX_HTTP_UPSTREAM_LC_NONE) {
+        return 1;
+    }
+
+    a = &tree->peers->peer[one];
+    b = &tree->peers->peer[two];
+
+    if (a->conns * b->weight != b->conns * a->weight) {
+        return a->conns * b->weight < b->conns * a->weight;
+    }
+
+    if (tree->pass[one] != tree->pass[two]) {
+        return tree->pass[one] < tree->pass[two];
+    }
+
+    return one < two;
+}
+
+
+static void
+ngx_http_upstream_least_conn_update(ngx_http_upstream_least_conn_tree_t *tree,
+    ngx_uint_t i)
+{
+    ngx_uint_t  l, r;
+
+    for (i = (tree->number + i) / 2; i; i /= 2) {
+        l = tree->node[2 * i];
+        r = tree->node[2 * i + 1];
+
+        tree->node[i] = ngx_http_upstream_least_conn_less(tree, r, l) ? r : l;
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_least_conn_find(ngx_http_upstream_least_conn_tree_t *tree,
+    ngx_http_upstream_rr_peer_data_t *rrp, ngx_uint_t node, ngx_uint_t best,
+    time_t now)
+{
+    uintptr_t                     m;
+    ngx_uint_t                    i, n;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    /*
+     * the node holds the least loaded peer of its subtree, if it cannot
+     * be used, the subtree is searched further unless its best peer is
+     * already worse than the one found so far
+     */
+
+    i = tree->node[node];
+
+    if (!ngx_http_upstream_least_conn_less(tree, i, best)) {
+        return best;
+    }
+
+    peer = &tree->peers->peer[i];
+
+    n = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    if (!(rrp->tried[n] & m)
+        && !(peer->max_fails
+             && peer->fails >= peer->max_fails
+             && now - peer->checked <= peer->fail_timeout))
+    {
+        return i;
+    }
+
+    if (node >= tree->number) {
+        return best;
+    }
+
+    best = ngx_http_upstream_least_conn_find(tree, rrp, 2 * node, best, now);
+
+    return ngx_http_upstream_least_conn_find(tree, rrp, 2 * node + 1, best,
+                                             now);
+}
+
+
+static void *
+ngx_http_upstream_least_conn_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_least_conn_srv_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool,
+                      sizeof(ngx_http_upstream_least_conn_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->tree = NULL;
+
+    return conf;
+}
+
+
 static char *
 ngx_http_upstream_least_conn(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -10,6 +10,16 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_LOCATION_CACHE_MIN  8
+
+
+typedef struct {
+    ngx_http_location_queue_t     **locations;
+    ngx_array_t                     nodes;
+    ngx_array_t                     names;
+} ngx_http_location_tree_ctx_t;
+
+
 static char *ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static ngx_int_t ngx_http_init_phases(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf);
@@ -41,11 +51,10 @@ static ngx_int_t ngx_http_cmp_locations(const ngx_queue_t *one,
     const ngx_queue_t *two);
 static ngx_int_t ngx_http_join_exact_locations(ngx_conf_t *cf,
     ngx_queue_t *locations);
-static void ngx_http_create_locations_list(ngx_queue_t *locations,
-    ngx_queue_t *q);
-static ngx_http_location_tree_node_t *
-    ngx_http_create_locations_tree(ngx_conf_t *cf, ngx_queue_t *locations,
-    size_t prefix);
+static ngx_http_location_tree_t *ngx_http_create_locations_tree(
+    ngx_conf_t *cf, ngx_queue_t *locations);
+static ngx_int_t ngx_http_add_location_node(ngx_http_location_tree_ctx_t *ctx,
+    ngx_uint_t index, ngx_uint_t lo, ngx_uint_t hi, size_t prefix);
 
 static ngx_int_t ngx_http_optimize_servers(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf, ngx_array_t *ports);
@@ -676,6 +685,7 @@ ngx_http_init_locations(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
 #if (NGX_PCRE)
     ngx_uint_t                   r;
     ngx_queue_t                 *regex;
+    ngx_http_regex_t           **re;
 #endif
 
     locations = pclcf->locations;
@@ -773,18 +783,30 @@ ngx_http_init_locations(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
 
         pclcf->regex_locations = clcfp;
 
-        for (q = regex;
+        re = ngx_palloc(cf->temp_pool, r * sizeof(ngx_http_regex_t *));
+        if (re == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (q = regex, n = 0;
              q != ngx_queue_sentinel(locations);
-             q = ngx_queue_next(q))
+             q = ngx_queue_next(q), n++)
         {
             lq = (ngx_http_location_queue_t *) q;
 
             *(clcfp++) = lq->exact;
+            re[n] = lq->exact->regex;
         }
 
         *clcfp = NULL;
 
         ngx_queue_split(locations, regex, &tail);
+
+        if (ngx_http_regex_set_compile(cf, &pclcf->regex_set, re, r)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
     }
 
 #endif
@@ -828,9 +850,7 @@ ngx_http_init_static_location_trees(ngx_conf_t *cf,
         return NGX_ERROR;
     }
 
-    ngx_http_create_locations_list(locations, ngx_queue_head(locations));
-
-    pclcf->static_locations = ngx_http_create_locations_tree(cf, locations, 0);
+    pclcf->static_locations = ngx_http_create_locations_tree(cf, locations);
     if (pclcf->static_locations == NULL) {
         return NGX_ERROR;
     }
@@ -878,8 +898,6 @@ ngx_http_add_location(ngx_conf_t *cf, ngx_queue_t **locations,
     lq->file_name = cf->conf_file->file.name.data;
     lq->line = cf->conf_file->line;
 
-    ngx_queue_init(&lq->list);
-
     ngx_queue_insert_tail(*locations, &lq->queue);
 
     return NGX_OK;
@@ -1000,140 +1018,217 @@ ngx_http_join_exact_locations(ngx_conf_t *cf, ngx_queue_t *locations)
 }
 
 
-static void
-ngx_http_create_locations_list(ngx_queue_t *locations, ngx_queue_t *q)
+static ngx_http_location_tree_t *
+ngx_http_create_locations_tree(ngx_conf_t *cf, ngx_queue_t *locations)
 {
-    u_char                     *name;
-    size_t                      len;
-    ngx_queue_t                *x, tail;
-    ngx_http_location_queue_t  *lq, *lx;
+    u_char                         *p, *names;
+    size_t                          size;
+    ngx_uint_t                      i, n;
+    ngx_queue_t                    *q;
+    ngx_http_location_tree_t       *tree;
+    ngx_http_location_tree_ctx_t    ctx;
+    ngx_http_location_tree_node_t  *node;
 
-    if (q == ngx_queue_last(locations)) {
-        return;
-    }
+    n = 0;
 
-    lq = (ngx_http_location_queue_t *) q;
+    for (q = ngx_queue_head(locations);
+         q != ngx_queue_sentinel(locations);
+         q = ngx_queue_next(q))
+    {
+        n++;
+    }
 
-    if (lq->inclusive == NULL) {
-        ngx_http_create_locations_list(locations, ngx_queue_next(q));
-        return;
+    ctx.locations = ngx_palloc(cf->temp_pool,
+                               n * sizeof(ngx_http_location_queue_t *));
+    if (ctx.locations == NULL) {
+        return NULL;
     }
 
-    len = lq->name->len;
-    name = lq->name->data;
+    i = 0;
 
-    for (x = ngx_queue_next(q);
-         x != ngx_queue_sentinel(locations);
-         x = ngx_queue_next(x))
+    for (q = ngx_queue_head(locations);
+         q != ngx_queue_sentinel(locations);
+         q = ngx_queue_next(q))
     {
-        lx = (ngx_http_location_queue_t *) x;
+        ctx.locations[i++] = (ngx_http_location_queue_t *) q;
+    }
 
-        if (len > lx->name->len
-            || ngx_filename_cmp(name, lx->name->data, len) != 0)
-        {
-            break;
-        }
+    if (ngx_array_init(&ctx.nodes, cf->temp_pool, 2 * n,
+                       sizeof(ngx_http_location_tree_node_t))
+        != NGX_OK)
+    {
+        return NULL;
     }
 
-    q = ngx_queue_next(q);
+    if (ngx_array_init(&ctx.names, cf->temp_pool, 16 * n, 1) != NGX_OK) {
+        return NULL;
+    }
+
+    if (ngx_array_push(&ctx.nodes) == NULL) {
+        return NULL;
+    }
+
+    if (ngx_http_add_location_node(&ctx, 0, 0, n, 0) != NGX_OK) {
+        return NULL;
+    }
+
+    /* the keys are padded to be loaded 16 bytes at a time */
+
+    size = sizeof(ngx_http_location_tree_t)
+           + ctx.nodes.nelts * sizeof(ngx_http_location_tree_node_t)
+           + ctx.nodes.nelts + 16 + ctx.names.nelts;
 
-    if (q == x) {
-        ngx_http_create_locations_list(locations, x);
-        return;
+    p = ngx_palloc(cf->pool, size);
+    if (p == NULL) {
+        return NULL;
     }
 
-    ngx_queue_split(locations, q, &tail);
-    ngx_queue_add(&lq->list, &tail);
+    tree = (ngx_http_location_tree_t *) p;
+    p += sizeof(ngx_http_location_tree_t);
+
+    tree->nodes = (ngx_http_location_tree_node_t *) p;
+    p = ngx_cpymem(p, ctx.nodes.elts,
+                   ctx.nodes.nelts * sizeof(ngx_http_location_tree_node_t));
+
+    node = ctx.nodes.elts;
+    names = ctx.names.elts;
 
-    if (x == ngx_queue_sentinel(locations)) {
-        ngx_http_create_locations_list(&lq->list, ngx_queue_head(&lq->list));
-        return;
+    tree->keys = p;
+
+    for (i = 0; i < ctx.nodes.nelts; i++) {
+        *p++ = node[i].len ? names[node[i].name] : '\0';
     }
 
-    ngx_queue_split(&lq->list, x, &tail);
-    ngx_queue_add(locations, &tail);
+    ngx_memzero(p, 16);
+    p += 16;
+
+    tree->names = p;
+    ngx_memcpy(p, names, ctx.names.nelts);
 
-    ngx_http_create_locations_list(&lq->list, ngx_queue_head(&lq->list));
+    tree->cache = NULL;
 
-    ngx_http_create_locations_list(locations, x);
+    if (n >= NGX_HTTP_LOCATION_CACHE_MIN) {
+        size = NGX_HTTP_LOCATION_CACHE_SIZE * sizeof(ngx_http_location_cache_t);
+
+        tree->cache = ngx_pcalloc(cf->pool, size);
+        if (tree->cache == NULL) {
+            return NULL;
+        }
+    }
+
+    return tree;
 }
 
 
 /*
- * to keep cache locality for left leaf nodes, allocate nodes in following
- * order: node, left subtree, right subtree, inclusive subtree
+ * a node gets the common part of the sorted names from lo to hi,
+ * the names are split by the next character between its children,
+ * which are allocated together before their own subtrees
  */
 
-static ngx_http_location_tree_node_t *
-ngx_http_create_locations_tree(ngx_conf_t *cf, ngx_queue_t *locations,
-    size_t prefix)
+static ngx_int_t
+ngx_http_add_location_node(ngx_http_location_tree_ctx_t *ctx,
+    ngx_uint_t index, ngx_uint_t lo, ngx_uint_t hi, size_t prefix)
 {
-    size_t                          len;
-    ngx_queue_t                    *q, tail;
+    u_char                         *p, c;
+    size_t                          i, len;
+    ngx_str_t                      *first, *last;
+    ngx_uint_t                      j, k, n, child;
     ngx_http_location_queue_t      *lq;
     ngx_http_location_tree_node_t  *node;
 
-    q = ngx_queue_middle(locations);
+    first = ctx->locations[lo]->name;
+    last = ctx->locations[hi - 1]->name;
 
-    lq = (ngx_http_location_queue_t *) q;
-    len = lq->name->len - prefix;
+    len = ngx_min(first->len, last->len);
 
-    node = ngx_palloc(cf->pool,
-                      offsetof(ngx_http_location_tree_node_t, name) + len);
-    if (node == NULL) {
-        return NULL;
+    for (i = prefix; i < len; i++) {
+        if (ngx_http_location_char(first->data[i])
+            != ngx_http_location_char(last->data[i]))
+        {
+            break;
+        }
     }
 
-    node->left = NULL;
-    node->right = NULL;
-    node->tree = NULL;
-    node->exact = lq->exact;
-    node->inclusive = lq->inclusive;
+    len = i - prefix;
 
-    node->auto_redirect = (u_char) ((lq->exact && lq->exact->auto_redirect)
-                           || (lq->inclusive && lq->inclusive->auto_redirect));
+    if (len) {
+        p = ngx_array_push_n(&ctx->names, len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
 
-    node->len = (u_char) len;
-    ngx_memcpy(node->name, &lq->name->data[prefix], len);
+        for (i = 0; i < len; i++) {
+            p[i] = ngx_http_location_char(first->data[prefix + i]);
+        }
+    }
 
-    ngx_queue_split(locations, q, &tail);
+    node = (ngx_http_location_tree_node_t *) ctx->nodes.elts + index;
 
-    if (ngx_queue_empty(locations)) {
-        /*
-         * ngx_queue_split() insures that if left part is empty,
-         * then right one is empty too
-         */
-        goto inclusive;
-    }
+    node->exact = NULL;
+    node->inclusive = NULL;
+    node->name = (uint32_t) (ctx->names.nelts - len);
+    node->len = (uint32_t) len;
+    node->auto_redirect = 0;
 
-    node->left = ngx_http_create_locations_tree(cf, locations, prefix);
-    if (node->left == NULL) {
-        return NULL;
-    }
+    prefix += len;
+
+    lq = ctx->locations[lo];
 
-    ngx_queue_remove(q);
+    if (lq->name->len == prefix) {
+        node->exact = lq->exact;
+        node->inclusive = lq->inclusive;
 
-    if (ngx_queue_empty(&tail)) {
-        goto inclusive;
+        node->auto_redirect = (u_char)
+                      ((lq->exact && lq->exact->auto_redirect)
+                       || (lq->inclusive && lq->inclusive->auto_redirect));
+        lo++;
     }
 
-    node->right = ngx_http_create_locations_tree(cf, &tail, prefix);
-    if (node->right == NULL) {
-        return NULL;
+    n = 0;
+
+    for (j = lo; j < hi; j = k) {
+        c = ngx_http_location_char(ctx->locations[j]->name->data[prefix]);
+
+        for (k = j + 1; k < hi; k++) {
+            if (ngx_http_location_char(ctx->locations[k]->name->data[prefix])
+                != c)
+            {
+                break;
+            }
+        }
+
+        n++;
     }
 
-inclusive:
+    child = ctx->nodes.nelts;
 
-    if (ngx_queue_empty(&lq->list)) {
-        return node;
+    if (n && ngx_array_push_n(&ctx->nodes, n) == NULL) {
+        return NGX_ERROR;
     }
 
-    node->tree = ngx_http_create_locations_tree(cf, &lq->list, prefix + len);
-    if (node->tree == NULL) {
-        return NULL;
+    node = (ngx_http_location_tree_node_t *) ctx->nodes.elts + index;
+
+    node->child = (uint32_t) child;
+    node->nchild = (uint16_t) n;
+
+    for (j = lo; j < hi; j = k) {
+        c = ngx_http_location_char(ctx->locations[j]->name->data[prefix]);
+
+        for (k = j + 1; k < hi; k++) {
+            if (ngx_http_location_char(ctx->locations[k]->name->data[prefix])
+                != c)
+            {
+                break;
+            }
+        }
+
+        if (ngx_http_add_location_node(ctx, child++, j, k, prefix) != NGX_OK) {
+            return NGX_ERROR;
+        }
     }
 
-    return node;
+    return NGX_OK;
 }
 
 
@@ -1324,6 +1419,7 @@ ngx_http_add_address(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
 #if (NGX_PCRE)
     addr->nregex = 0;
     addr->regex = NULL;
+    addr->regex_set = NULL;
 #endif
     addr->default_server = cscf;
     addr->servers.elts = NULL;
@@ -1430,6 +1526,7 @@ ngx_http_server_names(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf,
     ngx_http_core_srv_conf_t  **cscfp;
 #if (NGX_PCRE)
     ngx_uint_t                  regex, i;
+    ngx_http_regex_t          **re;
 
     regex = 0;
 #endif
@@ -1549,6 +1646,11 @@ ngx_http_server_names(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf,
         return NGX_ERROR;
     }
 
+    re = ngx_palloc(cf->temp_pool, regex * sizeof(ngx_http_regex_t *));
+    if (re == NULL) {
+        return NGX_ERROR;
+    }
+
     i = 0;
 
     for (s = 0; s < addr->servers.nelts; s++) {
@@ -1557,11 +1659,18 @@ ngx_http_server_names(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf,
 
         for (n = 0; n < cscfp[s]->server_names.nelts; n++) {
             if (name[n].regex) {
+                re[i] = name[n].regex;
                 addr->regex[i++] = name[n];
             }
         }
     }
 
+    if (ngx_http_regex_set_compile(cf, &addr->regex_set, re, regex)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
 #endif
 
     return NGX_OK;
@@ -1832,6 +1941,7 @@ ngx_http_add_addrs(ngx_conf_t *cf, ngx_http_port_t *hport,
 #if (NGX_PCRE)
         vn->nregex = addr[i].nregex;
         vn->regex = addr[i].regex;
+        vn->regex_set = addr[i].regex_set;
 #endif
     }
 
@@ -1897,6 +2007,7 @@ ngx_http_add_addrs6(ngx_conf_t *cf, ngx_http_port_t *hport,
 #if (NGX_PCRE)
         vn->nregex = addr[i].nregex;
         vn->regex = addr[i].regex;
+        vn->regex_set = addr[i].regex_set;
 #endif
     }
 
@@ -29,6 +29,9 @@
 
 #define NGX_HTTP_CACHE_VERSION       3
 
+#define NGX_HTTP_CACHE_INDEX_MAGIC   0x58444943  /* "CIDX" */
+#define NGX_HTTP_CACHE_INDEX_VERSION 1
+
 
 typedef struct {
     ngx_uint_t                       status;
@@ -50,7 +53,8 @@ typedef struct {
     unsigned                         exists:1;
     unsigned                         updating:1;
     unsigned                         deleting:1;
-                                     /* 11 unused bits */
+    unsigned                         protected:1;
+                                     /* 10 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -131,15 +135,52 @@ typedef struct {
 } ngx_http_file_cache_header_t;
 
 
+/* the keys zone index file: the header followed by nelts entries */
+
+typedef struct {
+    uint32_t                         magic;
+    uint32_t                         version;
+    uint32_t                         clean;
+    uint32_t                         bsize;
+    u_char                           level[4];
+    uint32_t                         reserved;
+    uint64_t                         time;
+    uint64_t                         nelts;
+} ngx_http_file_cache_index_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    uint64_t                         fs_size;
+} ngx_http_file_cache_index_entry_t;
+
+
+#define NGX_HTTP_CACHE_MAX_SHARDS    64
+
+
 typedef struct {
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
     ngx_queue_t                      queue;
-    ngx_atomic_t                     cold;
-    ngx_atomic_t                     loading;
+    ngx_queue_t                      protected;
+    ngx_uint_t                       nprotected;
     off_t                            size;
     ngx_uint_t                       count;
+    ngx_shmtx_sh_t                   lock;
+    ngx_shmtx_t                      mutex;
+} ngx_http_file_cache_shard_t;
+
+
+typedef struct {
+    ngx_http_file_cache_shard_t     *shards;
+    ngx_uint_t                       nshards;
+    ngx_atomic_t                     cold;
+    ngx_atomic_t                     loading;
     ngx_uint_t                       watermark;
+    time_t                           start;
+    u_char                          *sketch;
+    ngx_uint_t                       sketch_width;
+    ngx_atomic_t                     sketch_adds;
 } ngx_http_file_cache_sh_t;
 
 
@@ -157,12 +198,19 @@ struct ngx_http_file_cache_s {
 
     time_t                           fail_time;
 
+    ngx_uint_t                       nshards;
+    ngx_uint_t                       shard;
+
+    ngx_uint_t                       admission;
+
     ngx_uint_t                       files;
     ngx_uint_t                       loader_files;
     ngx_msec_t                       last;
     ngx_msec_t                       loader_sleep;
     ngx_msec_t                       loader_threshold;
 
+    ngx_str_t                        index;
+
     ngx_shm_zone_t                  *shm_zone;
 };
 
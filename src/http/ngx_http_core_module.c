@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
 
 typedef struct {
     u_char    *name;
@@ -23,7 +27,13 @@ typedef struct {
 
 static ngx_int_t ngx_http_core_find_location(ngx_http_request_t *r);
 static ngx_int_t ngx_http_core_find_static_location(ngx_http_request_t *r,
-    ngx_http_location_tree_node_t *node);
+    ngx_http_location_tree_t *tree);
+static ngx_int_t ngx_http_core_lookup_static_location(ngx_http_request_t *r,
+    ngx_http_location_tree_t *tree);
+static ngx_uint_t ngx_http_core_location_child(ngx_http_location_tree_t *tree,
+    ngx_http_location_tree_node_t *node, u_char c);
+static ngx_int_t ngx_http_core_location_cmp(u_char *uri, u_char *name,
+    size_t n);
 
 static ngx_int_t ngx_http_core_preconfiguration(ngx_conf_t *cf);
 static ngx_int_t ngx_http_core_postconfiguration(ngx_conf_t *cf);
@@ -1505,7 +1515,7 @@ ngx_http_core_find_location(ngx_http_request_t *r)
     ngx_http_core_loc_conf_t  *pclcf;
 #if (NGX_PCRE)
     ngx_int_t                  n;
-    ngx_uint_t                 noregex;
+    ngx_uint_t                 i, noregex;
     ngx_http_core_loc_conf_t  *clcf, **clcfp;
 
     noregex = 0;
@@ -1538,7 +1548,20 @@ ngx_http_core_find_location(ngx_http_request_t *r)
 
     if (noregex == 0 && pclcf->regex_locations) {
 
-        for (clcfp = pclcf->regex_locations; *clcfp; clcfp++) {
+        for (clcfp = pclcf->regex_locations, i = 0; *clcfp; clcfp++, i++) {
+
+            n = ngx_http_regex_set_skip(pclcf->regex_set, i, &r->uri,
+                                        r->connection->log);
+
+            if (n == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (n) {
+                clcfp += n - 1;
+                i += n - 1;
+                continue;
+            }
 
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "test location: ~ \"%V\"", &(*clcfp)->name);
@@ -1577,81 +1600,231 @@ ngx_http_core_find_location(ngx_http_request_t *r)
 
 static ngx_int_t
 ngx_http_core_find_static_location(ngx_http_request_t *r,
-    ngx_http_location_tree_node_t *node)
+    ngx_http_location_tree_t *tree)
 {
-    u_char     *uri;
-    size_t      len, n;
-    ngx_int_t   rc, rv;
+    size_t                      len;
+    ngx_int_t                   rc;
+    ngx_uint_t                  key;
+    ngx_http_location_cache_t  *lc;
+
+    if (tree == NULL) {
+        return NGX_DECLINED;
+    }
+
+    len = r->uri.len;
+
+    if (tree->cache == NULL
+        || len == 0 || len > NGX_HTTP_LOCATION_CACHE_LEN)
+    {
+        return ngx_http_core_lookup_static_location(r, tree);
+    }
+
+    key = ngx_hash(ngx_hash(len, r->uri.data[len - 1]), r->uri.data[len / 2]);
+    lc = &tree->cache[key % NGX_HTTP_LOCATION_CACHE_SIZE];
+
+    if (lc->len == len && ngx_memcmp(lc->uri, r->uri.data, len) == 0) {
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "cached location: %i", lc->rc);
+
+        if (lc->rc != NGX_DECLINED) {
+            r->loc_conf = lc->loc_conf;
+        }
+
+        return lc->rc;
+    }
+
+    rc = ngx_http_core_lookup_static_location(r, tree);
+
+    lc->loc_conf = r->loc_conf;
+    lc->rc = rc;
+    lc->len = (u_char) len;
+    ngx_memcpy(lc->uri, r->uri.data, len);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_core_lookup_static_location(ngx_http_request_t *r,
+    ngx_http_location_tree_t *tree)
+{
+    u_char                         *uri, *name;
+    size_t                          len;
+    ngx_int_t                       rv;
+    ngx_uint_t                      i;
+    ngx_http_location_tree_node_t  *node, *child;
 
     len = r->uri.len;
     uri = r->uri.data;
 
     rv = NGX_DECLINED;
 
+    node = tree->nodes;
+
     for ( ;; ) {
 
-        if (node == NULL) {
-            return rv;
-        }
+        name = tree->names + node->name;
 
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "test location: \"%*s\"",
-                       (size_t) node->len, node->name);
+                       "test location: \"%*s\"", (size_t) node->len, name);
 
-        n = (len <= (size_t) node->len) ? len : node->len;
+        if (len < node->len) {
 
-        rc = ngx_filename_cmp(uri, node->name, n);
+            if (len + 1 == node->len && node->auto_redirect
+                && ngx_http_core_location_cmp(uri, name, len) == 0)
+            {
+                r->loc_conf = (node->exact) ? node->exact->loc_conf:
+                                              node->inclusive->loc_conf;
+                return NGX_DONE;
+            }
 
-        if (rc != 0) {
-            node = (rc < 0) ? node->left : node->right;
+            return rv;
+        }
 
-            continue;
+        if (ngx_http_core_location_cmp(uri, name, node->len) != 0) {
+            return rv;
         }
 
-        if (len > (size_t) node->len) {
+        uri += node->len;
+        len -= node->len;
 
-            if (node->inclusive) {
+        if (len == 0) {
+
+            if (node->exact) {
+                r->loc_conf = node->exact->loc_conf;
+                return NGX_OK;
+            }
 
+            if (node->inclusive) {
                 r->loc_conf = node->inclusive->loc_conf;
-                rv = NGX_AGAIN;
+                return NGX_AGAIN;
+            }
 
-                node = node->tree;
-                uri += n;
-                len -= n;
+            /* the uri is a shared part of names, "uri/" may redirect */
 
-                continue;
+            child = &tree->nodes[node->child];
+
+            for (i = 0; i < node->nchild; i++) {
+                if (child[i].len == 1 && child[i].auto_redirect) {
+                    r->loc_conf = (child[i].exact)
+                                  ? child[i].exact->loc_conf
+                                  : child[i].inclusive->loc_conf;
+                    return NGX_DONE;
+                }
             }
 
-            /* exact only */
+            return rv;
+        }
+
+        if (node->inclusive) {
+            r->loc_conf = node->inclusive->loc_conf;
+            rv = NGX_AGAIN;
+        }
+
+        i = ngx_http_core_location_child(tree, node,
+                                         ngx_http_location_char(*uri));
+        if (i == 0) {
+            return rv;
+        }
+
+        node = &tree->nodes[i];
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_core_location_child(ngx_http_location_tree_t *tree,
+    ngx_http_location_tree_node_t *node, u_char c)
+{
+    u_char      *keys;
+    ngx_uint_t   i;
+#if (NGX_HAVE_SSE2)
+    ngx_uint_t   mask;
+    __m128i      key;
+#endif
+
+    /* the root is never a child, so 0 means that there is no child */
+
+    keys = tree->keys + node->child;
+
+#if (NGX_HAVE_SSE2)
+
+    key = _mm_set1_epi8((char) c);
+
+    /* keys beyond the children are padded or belong to other nodes */
 
-            node = node->right;
+    for (i = 0; i < node->nchild; i += 16) {
 
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(key,
+                                 _mm_loadu_si128((__m128i *) &keys[i])));
+        if (mask == 0) {
             continue;
         }
 
-        if (len == (size_t) node->len) {
+        while ((mask & 1) == 0) {
+            mask >>= 1;
+            i++;
+        }
 
-            if (node->exact) {
-                r->loc_conf = node->exact->loc_conf;
-                return NGX_OK;
+        return (i < node->nchild) ? node->child + i : 0;
+    }
 
-            } else {
-                r->loc_conf = node->inclusive->loc_conf;
-                return NGX_AGAIN;
-            }
+#else
+
+    for (i = 0; i < node->nchild; i++) {
+        if (keys[i] == c) {
+            return node->child + i;
         }
+    }
+
+#endif
 
-        /* len < node->len */
+    return 0;
+}
 
-        if (len + 1 == (size_t) node->len && node->auto_redirect) {
 
-            r->loc_conf = (node->exact) ? node->exact->loc_conf:
-                                          node->inclusive->loc_conf;
-            rv = NGX_DONE;
+static ngx_int_t
+ngx_http_core_location_cmp(u_char *uri, u_char *name, size_t n)
+{
+#if (NGX_HAVE_CASELESS_FILESYSTEM)
+
+    /* names are stored in lowercase */
+
+    while (n--) {
+        if (ngx_tolower(*uri) != *name) {
+            return 1;
         }
 
-        node = node->left;
+        uri++;
+        name++;
     }
+
+    return 0;
+
+#else
+
+#if (NGX_HAVE_SSE2)
+
+    while (n >= 16) {
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(
+                              _mm_loadu_si128((__m128i *) uri),
+                              _mm_loadu_si128((__m128i *) name)))
+            != 0xffff)
+        {
+            return 1;
+        }
+
+        uri += 16;
+        name += 16;
+        n -= 16;
+    }
+
+#endif
+
+    return ngx_memcmp(uri, name, n);
+
+#endif
 }
 
 
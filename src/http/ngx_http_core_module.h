@@ -53,7 +53,7 @@
 #define NGX_HTTP_KEEPALIVE_DISABLE_SAFARI  0x0008
 
 
-typedef struct ngx_http_location_tree_node_s  ngx_http_location_tree_node_t;
+typedef struct ngx_http_location_tree_s  ngx_http_location_tree_t;
 typedef struct ngx_http_core_loc_conf_s  ngx_http_core_loc_conf_t;
 
 
@@ -225,6 +225,9 @@ typedef struct {
 
     ngx_uint_t                 nregex;
     ngx_http_server_name_t    *regex;
+#if (NGX_PCRE)
+    ngx_http_regex_set_t      *regex_set;
+#endif
 } ngx_http_virtual_names_t;
 
 
@@ -284,6 +287,7 @@ typedef struct {
 #if (NGX_PCRE)
     ngx_uint_t                 nregex;
     ngx_http_server_name_t    *regex;
+    ngx_http_regex_set_t      *regex_set;
 #endif
 
     /* the default server configuration for this address:port */
@@ -332,9 +336,10 @@ struct ngx_http_core_loc_conf_s {
 #endif
 #endif
 
-    ngx_http_location_tree_node_t   *static_locations;
+    ngx_http_location_tree_t        *static_locations;
 #if (NGX_PCRE)
     ngx_http_core_loc_conf_t       **regex_locations;
+    ngx_http_regex_set_t            *regex_set;
 #endif
 
     /* pointer to the modules' loc_conf */
@@ -460,21 +465,52 @@ typedef struct {
     ngx_str_t                       *name;
     u_char                          *file_name;
     ngx_uint_t                       line;
-    ngx_queue_t                      list;
 } ngx_http_location_queue_t;
 
 
-struct ngx_http_location_tree_node_s {
-    ngx_http_location_tree_node_t   *left;
-    ngx_http_location_tree_node_t   *right;
-    ngx_http_location_tree_node_t   *tree;
+/*
+ * static locations form a radix tree stored in one array, children
+ * of a node are adjacent and the first bytes of their names are kept
+ * in the separate keys array to look up a child without touching nodes
+ */
 
+typedef struct {
     ngx_http_core_loc_conf_t        *exact;
     ngx_http_core_loc_conf_t        *inclusive;
 
+    uint32_t                         name;     /* offset in names */
+    uint32_t                         len;
+    uint32_t                         child;    /* index of the first child */
+    uint16_t                         nchild;
     u_char                           auto_redirect;
+} ngx_http_location_tree_node_t;
+
+
+#if (NGX_HAVE_CASELESS_FILESYSTEM)
+#define ngx_http_location_char(c)     ngx_tolower(c)
+#else
+#define ngx_http_location_char(c)     (c)
+#endif
+
+
+#define NGX_HTTP_LOCATION_CACHE_SIZE  8
+#define NGX_HTTP_LOCATION_CACHE_LEN   47
+
+typedef struct {
+    void                           **loc_conf;
+    ngx_int_t                        rc;
     u_char                           len;
-    u_char                           name[1];
+    u_char                           uri[NGX_HTTP_LOCATION_CACHE_LEN];
+} ngx_http_location_cache_t;
+
+
+struct ngx_http_location_tree_s {
+    ngx_http_location_tree_node_t   *nodes;
+    u_char                          *keys;
+    u_char                          *names;
+
+    /* the last lookups, private to a worker process after fork() */
+    ngx_http_location_cache_t       *cache;
 };
 
 
@@ -32,10 +32,23 @@ static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
+static ngx_http_file_cache_shard_t *
+    ngx_http_file_cache_shard(ngx_http_file_cache_t *cache, u_char *key);
 static ngx_http_file_cache_node_t *
-    ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
+    ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *shard,
+    u_char *key);
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_uint_t ngx_http_file_cache_sketch(ngx_http_file_cache_t *cache,
+    u_char *key, ngx_uint_t add);
+static ngx_int_t ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_uint_t freq);
+static void ngx_http_file_cache_queue_insert(ngx_http_file_cache_shard_t *shard,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t protect);
+static void ngx_http_file_cache_queue_remove(ngx_http_file_cache_shard_t *shard,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_queue_t *ngx_http_file_cache_queue_last(
+    ngx_http_file_cache_shard_t *shard);
 static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
     size_t len, u_char *hash);
 static void ngx_http_file_cache_vary_header(ngx_http_request_t *r,
@@ -47,9 +60,16 @@ static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
 static void ngx_http_file_cache_cleanup(void *data);
 static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *name);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
-    ngx_queue_t *q, u_char *name);
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q, u_char *name);
+static void ngx_http_file_cache_size(ngx_http_file_cache_t *cache,
+    off_t *size, ngx_uint_t *count);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_index_save(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_saver(void *data);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx,
@@ -84,9 +104,11 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_file_cache_t  *ocache = data;
 
-    size_t                  len;
-    ngx_uint_t              n;
-    ngx_http_file_cache_t  *cache;
+    u_char                       *file;
+    size_t                        len;
+    ngx_uint_t                    n;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     cache = shm_zone->data;
 
@@ -110,6 +132,20 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
+        if (cache->nshards != ocache->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different shards",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        if (cache->admission != ocache->admission) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different admission",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
         cache->sh = ocache->sh;
 
         cache->shpool = ocache->shpool;
@@ -140,16 +176,70 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->data = cache->sh;
 
-    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
-                    ngx_http_file_cache_rbtree_insert_value);
+    cache->sh->shards = ngx_slab_calloc(cache->shpool,
+                          cache->nshards * sizeof(ngx_http_file_cache_shard_t));
+    if (cache->sh->shards == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->sh->nshards = cache->nshards;
+
+    for (n = 0; n < cache->nshards; n++) {
+        shard = &cache->sh->shards[n];
+
+        ngx_rbtree_init(&shard->rbtree, &shard->sentinel,
+                        ngx_http_file_cache_rbtree_insert_value);
+
+        ngx_queue_init(&shard->queue);
+        ngx_queue_init(&shard->protected);
 
-    ngx_queue_init(&cache->sh->queue);
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        file = NULL;
+
+#else
+
+        len = ngx_cycle->lock_file.len + shm_zone->shm.name.len
+              + 1 + NGX_INT_T_LEN + 1;
+
+        file = ngx_slab_alloc(cache->shpool, len);
+        if (file == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) ngx_sprintf(file, "%V%V.%ui%Z", &ngx_cycle->lock_file,
+                           &shm_zone->shm.name, n);
+
+#endif
+
+        if (ngx_shmtx_create(&shard->mutex, &shard->lock, file) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
-    cache->sh->size = 0;
-    cache->sh->count = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
+    cache->sh->start = ngx_time();
+
+    if (cache->admission) {
+
+        /*
+         * the frequency sketch has 4 rows of 4-bit counters, with about
+         * one counter per node the zone may hold
+         */
+
+        for (n = 64; n * 2 <= shm_zone->shm.size / 128; n *= 2) {
+            /* void */
+        }
+
+        cache->sh->sketch = ngx_slab_calloc(cache->shpool, 4 * n / 2);
+        if (cache->sh->sketch == NULL) {
+            return NGX_ERROR;
+        }
+
+        cache->sh->sketch_width = n;
+    }
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
@@ -401,8 +491,9 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_msec_t                 now, timer;
-    ngx_http_file_cache_t     *cache;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (!c->lock) {
         return NGX_DECLINED;
@@ -411,8 +502,9 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
     now = ngx_current_msec;
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
     timer = c->node->lock_time - now;
 
@@ -423,7 +515,7 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->lock_time = c->node->lock_time;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache lock u:%d wt:%M",
@@ -480,9 +572,10 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
 static void
 ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_uint_t              wait;
-    ngx_msec_t              now, timer;
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                    wait;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     now = ngx_current_msec;
 
@@ -496,9 +589,10 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
     }
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
     wait = 0;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
     timer = c->node->lock_time - now;
 
@@ -506,7 +600,7 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
         wait = 1;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     if (wait) {
         ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
@@ -531,6 +625,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_int_t                      rc;
     ngx_uint_t                     i;
     ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_shard_t   *shard;
     ngx_http_file_cache_header_t  *h;
 
     n = ngx_http_file_cache_aio_read(r, c);
@@ -611,10 +706,11 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     r->cached = 1;
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
     if (cache->sh->cold) {
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->mutex);
 
         if (!c->node->exists) {
             c->node->uses = 1;
@@ -623,17 +719,17 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             c->node->uniq = c->uniq;
             c->node->fs_size = c->fs_size;
 
-            cache->sh->size += c->fs_size;
+            shard->size += c->fs_size;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
     }
 
     now = ngx_time();
 
     if (c->valid_sec < now) {
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->mutex);
 
         if (c->node->updating) {
             rc = NGX_HTTP_CACHE_UPDATING;
@@ -645,7 +741,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             rc = NGX_HTTP_CACHE_STALE;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
 
         ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http file cache expired: %i %T %T",
@@ -814,19 +910,30 @@ ngx_http_cache_thread_event_handler(ngx_event_t *ev)
 static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_int_t                     rc;
+    ngx_uint_t                    freq, admitted;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->key);
+
+    freq = 0;
+    admitted = 0;
+
+    ngx_shmtx_lock(&shard->mutex);
 
     fcn = c->node;
 
     if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
+        fcn = ngx_http_file_cache_lookup(shard, c->key);
+
+        if (cache->admission) {
+            freq = ngx_http_file_cache_sketch(cache, c->key, 1);
+        }
     }
 
     if (fcn) {
-        ngx_queue_remove(&fcn->queue);
+        ngx_http_file_cache_queue_remove(shard, fcn);
 
         if (c->node == NULL) {
             fcn->uses++;
@@ -861,19 +968,40 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         goto done;
     }
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
-                                 sizeof(ngx_http_file_cache_node_t));
+    if (cache->admission && !cache->sh->cold) {
+
+        /*
+         * the sketch counts uses of keys without nodes, and a new node
+         * should not replace a more frequently used one
+         */
+
+        if (freq < c->min_uses
+            || ngx_http_file_cache_admit(cache, shard, freq) != NGX_OK)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "http file cache not admitted: %ui", freq);
+
+            rc = NGX_AGAIN;
+            goto failed;
+        }
+
+        admitted = 1;
+    }
+
+    /* the shard lock is always taken before the slab pool one */
+
+    fcn = ngx_slab_calloc(cache->shpool, sizeof(ngx_http_file_cache_node_t));
     if (fcn == NULL) {
         ngx_http_file_cache_set_watermark(cache);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
 
         (void) ngx_http_file_cache_forced_expire(cache);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->mutex);
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
+        fcn = ngx_slab_calloc(cache->shpool,
+                              sizeof(ngx_http_file_cache_node_t));
         if (fcn == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                           "could not allocate node%s", cache->shpool->log_ctx);
@@ -882,21 +1010,21 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         }
     }
 
-    cache->sh->count++;
+    shard->count++;
 
     ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
     ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
                NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    ngx_rbtree_insert(&shard->rbtree, &fcn->node);
 
-    fcn->uses = 1;
+    fcn->uses = admitted ? freq : 1;
     fcn->count = 1;
 
 renew:
 
-    rc = NGX_DECLINED;
+    rc = admitted ? NGX_OK : NGX_DECLINED;
 
     fcn->valid_msec = 0;
     fcn->error = 0;
@@ -910,7 +1038,8 @@ done:
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_http_file_cache_queue_insert(shard, fcn,
+                                     cache->admission && fcn->exists);
 
     c->uniq = fcn->uniq;
     c->error = fcn->error;
@@ -918,7 +1047,7 @@ done:
 
 failed:
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     return rc;
 }
@@ -959,8 +1088,25 @@ ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
 }
 
 
+static ngx_http_file_cache_shard_t *
+ngx_http_file_cache_shard(ngx_http_file_cache_t *cache, u_char *key)
+{
+    uint32_t  hash;
+
+    /*
+     * the shard is selected by the key bytes that are not used
+     * as the rbtree key, so nodes are spread evenly within a shard
+     */
+
+    ngx_memcpy(&hash, &key[NGX_HTTP_CACHE_KEY_LEN - sizeof(uint32_t)],
+               sizeof(uint32_t));
+
+    return &cache->sh->shards[hash % cache->sh->nshards];
+}
+
+
 static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *shard, u_char *key)
 {
     ngx_int_t                    rc;
     ngx_rbtree_key_t             node_key;
@@ -969,8 +1115,8 @@ ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
 
     ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    node = shard->rbtree.root;
+    sentinel = shard->rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -1047,6 +1193,185 @@ ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
 }
 
 
+static ngx_uint_t
+ngx_http_file_cache_sketch(ngx_http_file_cache_t *cache, u_char *key,
+    ngx_uint_t add)
+{
+    u_char       *p[4];
+    uint32_t      hash;
+    ngx_uint_t    i, n, min, shift[4], width;
+    ngx_atomic_t  adds;
+
+    /*
+     * a count-min sketch: each row is indexed by its own 32 bits of
+     * the md5 key; the counters are updated without locking, and lost
+     * updates only make estimates lower
+     */
+
+    width = cache->sh->sketch_width;
+    min = 15;
+
+    for (i = 0; i < 4; i++) {
+        ngx_memcpy(&hash, &key[i * sizeof(uint32_t)], sizeof(uint32_t));
+
+        n = hash & (width - 1);
+
+        p[i] = cache->sh->sketch + i * width / 2 + n / 2;
+        shift[i] = (n & 1) * 4;
+
+        n = (*p[i] >> shift[i]) & 0x0f;
+
+        if (n < min) {
+            min = n;
+        }
+    }
+
+    if (!add || min == 15) {
+        return min;
+    }
+
+    /* conservative update: only the smallest counters are incremented */
+
+    for (i = 0; i < 4; i++) {
+        if (((*p[i] >> shift[i]) & 0x0f) == min) {
+            *p[i] = (u_char) (*p[i] + (1 << shift[i]));
+        }
+    }
+
+    adds = ngx_atomic_fetch_add(&cache->sh->sketch_adds, 1);
+
+    if (adds == 10 * width) {
+
+        /* aging: all counters are halved after each 10 * width uses */
+
+        for (n = 0; n < 4 * width / 2; n++) {
+            cache->sh->sketch[n] = (cache->sh->sketch[n] >> 1) & 0x77;
+        }
+
+        cache->sh->sketch_adds = 0;
+    }
+
+    return min + 1;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_uint_t freq)
+{
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[NGX_HTTP_CACHE_KEY_LEN];
+
+    if ((off_t) (shard->size * cache->sh->nshards) < cache->max_size
+        && shard->count * cache->sh->nshards < cache->sh->watermark)
+    {
+        return NGX_OK;
+    }
+
+    /* the shard is full: compare with the entry to be evicted next */
+
+    if (!ngx_queue_empty(&shard->queue)) {
+        q = ngx_queue_last(&shard->queue);
+
+    } else if (!ngx_queue_empty(&shard->protected)) {
+        q = ngx_queue_last(&shard->protected);
+
+    } else {
+        return NGX_OK;
+    }
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    if (freq > ngx_http_file_cache_sketch(cache, key, 0)) {
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_file_cache_queue_insert(ngx_http_file_cache_shard_t *shard,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t protect)
+{
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *last;
+
+    if (!protect) {
+        ngx_queue_insert_head(&shard->queue, &fcn->queue);
+        return;
+    }
+
+    /*
+     * segmented LRU: entries used again while on disk are moved to
+     * the protected segment, which takes up to 80% of a shard; the
+     * least recently used protected entries go back to probation
+     */
+
+    ngx_queue_insert_head(&shard->protected, &fcn->queue);
+
+    fcn->protected = 1;
+    shard->nprotected++;
+
+    if (shard->nprotected > shard->count - shard->count / 5) {
+        q = ngx_queue_last(&shard->protected);
+        last = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_queue_remove(q);
+        last->protected = 0;
+        shard->nprotected--;
+
+        ngx_queue_insert_head(&shard->queue, q);
+    }
+}
+
+
+static void
+ngx_http_file_cache_queue_remove(ngx_http_file_cache_shard_t *shard,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_queue_remove(&fcn->queue);
+
+    if (fcn->protected) {
+        fcn->protected = 0;
+        shard->nprotected--;
+    }
+}
+
+
+static ngx_queue_t *
+ngx_http_file_cache_queue_last(ngx_http_file_cache_shard_t *shard)
+{
+    ngx_queue_t                 *q, *p;
+    ngx_http_file_cache_node_t  *fcn, *pcn;
+
+    /* the entry which was inactive for the longest time */
+
+    if (ngx_queue_empty(&shard->protected)) {
+        return ngx_queue_empty(&shard->queue) ? NULL
+                                              : ngx_queue_last(&shard->queue);
+    }
+
+    p = ngx_queue_last(&shard->protected);
+
+    if (ngx_queue_empty(&shard->queue)) {
+        return p;
+    }
+
+    q = ngx_queue_last(&shard->queue);
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    pcn = ngx_queue_data(p, ngx_http_file_cache_node_t, queue);
+
+    return (pcn->expire < fcn->expire) ? p : q;
+}
+
+
 static void
 ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
     u_char *hash)
@@ -1202,7 +1527,8 @@ ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
 static ngx_int_t
 ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                    "http file cache reopen");
@@ -1215,13 +1541,14 @@ ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
     }
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
     c->node->count--;
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     c->secondary = 1;
     c->file.name.len = 0;
@@ -1299,7 +1626,8 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 static ngx_int_t
 ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (!c->secondary) {
         return NGX_OK;
@@ -1317,17 +1645,18 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
      */
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache main key");
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
     c->node->count--;
     c->node->updating = 0;
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     c->file.name.len = 0;
 
@@ -1348,13 +1677,14 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 void
 ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    off_t                         fs_size;
+    ngx_int_t                     rc;
+    ngx_file_uniq_t               uniq;
+    ngx_file_info_t               fi;
+    ngx_http_cache_t             *c;
+    ngx_ext_rename_file_t         ext;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     c = r->cache;
 
@@ -1400,14 +1730,16 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
         }
     }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->key);
+
+    ngx_shmtx_lock(&shard->mutex);
 
     c->node->count--;
     c->node->error = 0;
     c->node->uniq = uniq;
     c->node->body_start = c->body_start;
 
-    cache->sh->size += fs_size - c->node->fs_size;
+    shard->size += fs_size - c->node->fs_size;
     c->node->fs_size = fs_size;
 
     if (rc == NGX_OK) {
@@ -1416,7 +1748,7 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 
     c->node->updating = 0;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 }
 
 
@@ -1606,19 +1938,21 @@ ngx_http_cache_send(ngx_http_request_t *r)
 void
 ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (c->updated || c->node == NULL) {
         return;
     }
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                    "http file cache free, fd: %d", c->file.fd);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
     fcn = c->node;
     fcn->count--;
@@ -1636,14 +1970,14 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
         }
 
     } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+        ngx_http_file_cache_queue_remove(shard, fcn);
+        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+        ngx_slab_free(cache->shpool, fcn);
+        shard->count--;
         c->node = NULL;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     c->updated = 1;
     c->updating = 0;
@@ -1692,13 +2026,14 @@ ngx_http_file_cache_cleanup(void *data)
 static time_t
 ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 {
-    u_char                      *name;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
+    u_char                       *name;
+    size_t                        len;
+    time_t                        wait;
+    ngx_uint_t                    n, k, start, tries;
+    ngx_path_t                   *path;
+    ngx_queue_t                  *q, *queue;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                    "http file cache forced expire");
@@ -1714,37 +2049,67 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
     ngx_memcpy(name, path->name.data, path->name.len);
 
     wait = 10;
-    tries = 20;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    /*
+     * each call starts from the next shard, so entries are forcibly
+     * expired from all shards in turn
+     */
 
-    for (q = ngx_queue_last(&cache->sh->queue);
-         q != ngx_queue_sentinel(&cache->sh->queue);
-         q = ngx_queue_prev(q))
-    {
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    start = cache->shard++;
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+    for (n = 0; n < cache->sh->nshards; n++) {
+
+        shard = &cache->sh->shards[(start + n) % cache->sh->nshards];
+
+        tries = 20;
+
+        ngx_shmtx_lock(&shard->mutex);
+
+        /* the probation segment is evicted first */
+
+        queue = &shard->queue;
+
+        for (k = 0; k < 2; k++) {
+
+            for (q = ngx_queue_last(queue);
+                 q != ngx_queue_sentinel(queue);
+                 q = ngx_queue_prev(q))
+            {
+                fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+                ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                   "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
                   fcn->count, fcn->exists,
                   fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
+                if (fcn->count == 0) {
+                    ngx_http_file_cache_delete(cache, shard, q, name);
+                    wait = 0;
 
-        } else {
-            if (--tries) {
-                continue;
+                } else {
+                    if (--tries) {
+                        continue;
+                    }
+
+                    wait = 1;
+                }
+
+                break;
             }
 
-            wait = 1;
+            if (wait == 0 || tries == 0) {
+                break;
+            }
+
+            queue = &shard->protected;
         }
 
-        break;
-    }
+        ngx_shmtx_unlock(&shard->mutex);
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        if (wait == 0) {
+            break;
+        }
+    }
 
     ngx_free(name);
 
@@ -1755,13 +2120,11 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 static time_t
 ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    u_char      *name;
+    size_t       len;
+    time_t       wait, next;
+    ngx_uint_t   n, start;
+    ngx_path_t  *path;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                    "http file cache expire");
@@ -1776,9 +2139,43 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
     ngx_memcpy(name, path->name.data, path->name.len);
 
+    next = 10;
+    start = cache->shard++;
+
+    for (n = 0; n < cache->sh->nshards; n++) {
+
+        wait = ngx_http_file_cache_expire_shard(cache,
+                   &cache->sh->shards[(start + n) % cache->sh->nshards], name);
+
+        if (wait < next) {
+            next = wait;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
+    }
+
+    ngx_free(name);
+
+    return next;
+}
+
+
+static time_t
+ngx_http_file_cache_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
     now = ngx_time();
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
     for ( ;; ) {
 
@@ -1787,13 +2184,13 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
             break;
         }
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
+        q = ngx_http_file_cache_queue_last(shard);
+
+        if (q == NULL) {
             wait = 10;
             break;
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
-
         fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
         wait = fcn->expire - now;
@@ -1809,7 +2206,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
                        fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
         if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
+            ngx_http_file_cache_delete(cache, shard, q, name);
             continue;
         }
 
@@ -1831,24 +2228,23 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
         ngx_queue_remove(q);
         fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        ngx_queue_insert_head(fcn->protected ? &shard->protected
+                                             : &shard->queue, q);
 
         ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                       "ignore long locked inactive cache entry %*s, count:%d",
                       (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-
-    ngx_free(name);
+    ngx_shmtx_unlock(&shard->mutex);
 
     return wait;
 }
 
 
 static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q, u_char *name)
 {
     u_char                      *p;
     size_t                       len;
@@ -1858,7 +2254,7 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
     fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
     if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+        shard->size -= fcn->fs_size;
 
         path = cache->path;
         p = name + path->name.len + 1 + path->len;
@@ -1870,7 +2266,7 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
 
         fcn->count++;
         fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
 
         len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
         ngx_create_hashed_filename(path, name, len);
@@ -1883,16 +2279,39 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
                           ngx_delete_file_n " \"%s\" failed", name);
         }
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->mutex);
         fcn->count--;
         fcn->deleting = 0;
     }
 
     if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+        ngx_http_file_cache_queue_remove(shard, fcn);
+        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+        ngx_slab_free(cache->shpool, fcn);
+        shard->count--;
+    }
+}
+
+
+static void
+ngx_http_file_cache_size(ngx_http_file_cache_t *cache, off_t *size,
+    ngx_uint_t *count)
+{
+    ngx_uint_t                    n;
+    ngx_http_file_cache_shard_t  *shard;
+
+    *size = 0;
+    *count = 0;
+
+    for (n = 0; n < cache->sh->nshards; n++) {
+        shard = &cache->sh->shards[n];
+
+        ngx_shmtx_lock(&shard->mutex);
+
+        *size += shard->size;
+        *count += shard->count;
+
+        ngx_shmtx_unlock(&shard->mutex);
     }
 }
 
@@ -1912,14 +2331,10 @@ ngx_http_file_cache_manager(void *data)
     cache->files = 0;
 
     for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_http_file_cache_size(cache, &size, &count);
 
-        size = cache->sh->size;
-        count = cache->sh->count;
         watermark = cache->sh->watermark;
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
-
         ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                        "http file cache size: %O c:%ui w:%i",
                        size, count, (ngx_int_t) watermark);
@@ -1946,6 +2361,9 @@ ngx_http_file_cache_loader(void *data)
 {
     ngx_http_file_cache_t  *cache = data;
 
+    off_t           size;
+    ngx_int_t       rc;
+    ngx_uint_t      count;
     ngx_tree_ctx_t  tree;
 
     if (!cache->sh->cold || cache->sh->loading) {
@@ -1959,6 +2377,19 @@ ngx_http_file_cache_loader(void *data)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                    "http file cache loader");
 
+    if (cache->index.len) {
+        rc = ngx_http_file_cache_index_load(cache);
+
+        if (rc == NGX_ABORT) {
+            cache->sh->loading = 0;
+            return;
+        }
+
+        if (rc == NGX_OK) {
+            goto done;
+        }
+    }
+
     tree.init_handler = NULL;
     tree.file_handler = ngx_http_file_cache_manage_file;
     tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
@@ -1976,13 +2407,17 @@ ngx_http_file_cache_loader(void *data)
         return;
     }
 
+done:
+
     cache->sh->cold = 0;
     cache->sh->loading = 0;
 
+    ngx_http_file_cache_size(cache, &size, &count);
+
     ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
                   "http file cache: %V %.3fM, bsize: %uz",
                   &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  ((double) size * cache->bsize) / (1024 * 1024),
                   cache->bsize);
 }
 
@@ -2002,6 +2437,14 @@ ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 
     cache = ctx->data;
 
+    if (cache->index.len
+        && path->len >= cache->index.len
+        && ngx_strncmp(path->data, cache->index.data, cache->index.len) == 0)
+    {
+        /* the index file and its temporary copy */
+        return NGX_OK;
+    }
+
     if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
         (void) ngx_http_file_cache_delete_file(ctx, path);
     }
@@ -2051,6 +2494,359 @@ ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache)
+{
+    off_t                                size, offset;
+    ssize_t                              n;
+    ngx_int_t                            rc;
+    ngx_uint_t                           i, k, nelts;
+    ngx_file_t                           file;
+    ngx_file_info_t                      fi;
+    ngx_http_cache_t                     c;
+    ngx_http_file_cache_index_entry_t   *entry;
+    ngx_http_file_cache_index_header_t   h;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = cache->index;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", file.name.data);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    entry = NULL;
+    rc = NGX_DECLINED;
+
+    n = ngx_read_file(&file, (u_char *) &h, sizeof(h), 0);
+
+    if (n != sizeof(h)) {
+        goto stale;
+    }
+
+    if (h.magic != NGX_HTTP_CACHE_INDEX_MAGIC
+        || h.version != NGX_HTTP_CACHE_INDEX_VERSION
+        || h.bsize != cache->bsize)
+    {
+        goto stale;
+    }
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        if (h.level[i] != cache->path->level[i]) {
+            goto stale;
+        }
+    }
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto failed;
+    }
+
+    size = sizeof(h) + h.nelts * sizeof(ngx_http_file_cache_index_entry_t);
+
+    if (ngx_file_size(&fi) != size) {
+        goto stale;
+    }
+
+    /*
+     * an index written after this zone was created belongs to another
+     * instance, e.g., an old binary, whose changes may be not seen here
+     */
+
+    if ((time_t) h.time > cache->sh->start) {
+        h.clean = 0;
+    }
+
+    /*
+     * files may have been removed since a stale index was written,
+     * its entries are not loaded to keep the size accounting right
+     */
+
+    if (!h.clean) {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "http file cache: %V index is stale",
+                      &cache->path->name);
+        goto failed;
+    }
+
+    /* the index will be stale as soon as the cache is changed */
+
+    h.clean = 0;
+
+    if (ngx_write_file(&file, (u_char *) &h, sizeof(h), 0) == NGX_ERROR) {
+        goto failed;
+    }
+
+    entry = ngx_alloc(4096 * sizeof(ngx_http_file_cache_index_entry_t),
+                      ngx_cycle->log);
+    if (entry == NULL) {
+        goto failed;
+    }
+
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+
+    offset = sizeof(h);
+
+    for (i = 0; i < h.nelts; i += nelts) {
+
+        if (ngx_quit || ngx_terminate) {
+            rc = NGX_ABORT;
+            goto failed;
+        }
+
+        nelts = ngx_min(h.nelts - i, 4096);
+        size = nelts * sizeof(ngx_http_file_cache_index_entry_t);
+
+        n = ngx_read_file(&file, (u_char *) entry, size, offset);
+
+        if (n != size) {
+            goto stale;
+        }
+
+        offset += size;
+
+        for (k = 0; k < nelts; k++) {
+            ngx_memcpy(c.key, entry[k].key, NGX_HTTP_CACHE_KEY_LEN);
+            c.fs_size = entry[k].fs_size;
+
+            if (ngx_http_file_cache_add(cache, &c) != NGX_OK) {
+
+                /* let the tree walk remove files that do not fit */
+
+                goto failed;
+            }
+        }
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V index of %uL entries loaded",
+                  &cache->path->name, h.nelts);
+
+    rc = NGX_OK;
+
+    goto failed;
+
+stale:
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V index is invalid",
+                  &cache->path->name);
+
+failed:
+
+    if (entry) {
+        ngx_free(entry);
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_file_cache_index_save(ngx_http_file_cache_t *cache)
+{
+    u_char                              *p, *temp;
+    off_t                                offset;
+    size_t                               size;
+    ngx_uint_t                           i, k, n, nelts;
+    ngx_file_t                           file;
+    ngx_queue_t                         *q, *queue;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_shard_t         *shard;
+    ngx_http_file_cache_index_entry_t   *entry;
+    ngx_http_file_cache_index_header_t   h;
+#if !(NGX_WIN32)
+    ngx_core_conf_t                     *ccf;
+#endif
+
+    if (cache->sh->cold) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index save");
+
+    temp = ngx_alloc(cache->index.len + sizeof(".tmp"), ngx_cycle->log);
+    if (temp == NULL) {
+        return;
+    }
+
+    p = ngx_cpymem(temp, cache->index.data, cache->index.len);
+    ngx_memcpy(p, ".tmp", sizeof(".tmp"));
+
+    /* the file may be left by a process with other credentials */
+
+    (void) ngx_delete_file(temp);
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name.len = cache->index.len + sizeof(".tmp") - 1;
+    file.name.data = temp;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                            NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", temp);
+        ngx_free(temp);
+        return;
+    }
+
+#if !(NGX_WIN32)
+
+    /* the master process saves the index on exit for worker processes */
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                           ngx_core_module);
+
+    if (ccf->user != (ngx_uid_t) NGX_CONF_UNSET_UINT
+        && fchown(file.fd, ccf->user, -1) == -1)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      "fchown(\"%s\", %d) failed", temp, ccf->user);
+        goto failed;
+    }
+
+#endif
+
+    offset = sizeof(ngx_http_file_cache_index_header_t);
+    nelts = 0;
+
+    for (i = 0; i < cache->sh->nshards; i++) {
+        shard = &cache->sh->shards[i];
+
+        /*
+         * entries are copied under the shard lock and written without it;
+         * the least recently used entries go first, and the protected
+         * ones after them, so the loader restores the inactive queue order
+         */
+
+        ngx_shmtx_lock(&shard->mutex);
+
+        entry = ngx_alloc((shard->count + 1)
+                          * sizeof(ngx_http_file_cache_index_entry_t),
+                          ngx_cycle->log);
+        if (entry == NULL) {
+            ngx_shmtx_unlock(&shard->mutex);
+            goto failed;
+        }
+
+        n = 0;
+        queue = &shard->queue;
+
+        for (k = 0; k < 2; k++) {
+
+            for (q = ngx_queue_last(queue);
+                 q != ngx_queue_sentinel(queue) && n <= shard->count;
+                 q = ngx_queue_prev(q))
+            {
+                fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+                if (!fcn->exists || fcn->deleting) {
+                    continue;
+                }
+
+                ngx_memcpy(entry[n].key, &fcn->node.key,
+                           sizeof(ngx_rbtree_key_t));
+                ngx_memcpy(&entry[n].key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                           NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+                entry[n].fs_size = fcn->fs_size;
+
+                n++;
+            }
+
+            queue = &shard->protected;
+        }
+
+        ngx_shmtx_unlock(&shard->mutex);
+
+        size = n * sizeof(ngx_http_file_cache_index_entry_t);
+
+        if (n && ngx_write_file(&file, (u_char *) entry, size, offset)
+                 == NGX_ERROR)
+        {
+            ngx_free(entry);
+            goto failed;
+        }
+
+        ngx_free(entry);
+
+        offset += size;
+        nelts += n;
+    }
+
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_index_header_t));
+
+    h.magic = NGX_HTTP_CACHE_INDEX_MAGIC;
+    h.version = NGX_HTTP_CACHE_INDEX_VERSION;
+    h.clean = 1;
+    h.bsize = cache->bsize;
+    h.time = ngx_time();
+    h.nelts = nelts;
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        h.level[i] = (u_char) cache->path->level[i];
+    }
+
+    if (ngx_write_file(&file, (u_char *) &h, sizeof(h), 0) == NGX_ERROR) {
+        goto failed;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp);
+    }
+
+    if (ngx_rename_file(temp, cache->index.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      temp, cache->index.data);
+
+        (void) ngx_delete_file(temp);
+    }
+
+    ngx_free(temp);
+
+    return;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp);
+    }
+
+    (void) ngx_delete_file(temp);
+
+    ngx_free(temp);
+}
+
+
+static void
+ngx_http_file_cache_saver(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    ngx_http_file_cache_index_save(cache);
+}
+
+
 static ngx_int_t
 ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
 {
@@ -2097,16 +2893,19 @@ ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
 static ngx_int_t
 ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+    fcn = ngx_http_file_cache_lookup(shard, c->key);
 
     if (fcn == NULL) {
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
+        fcn = ngx_slab_calloc(cache->shpool,
+                              sizeof(ngx_http_file_cache_node_t));
         if (fcn == NULL) {
             ngx_http_file_cache_set_watermark(cache);
 
@@ -2116,34 +2915,34 @@ ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
                            "could not allocate node%s", cache->shpool->log_ctx);
             }
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
+            ngx_shmtx_unlock(&shard->mutex);
             return NGX_ERROR;
         }
 
-        cache->sh->count++;
+        shard->count++;
 
         ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
         ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
                    NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        ngx_rbtree_insert(&shard->rbtree, &fcn->node);
 
         fcn->uses = 1;
         fcn->exists = 1;
         fcn->fs_size = c->fs_size;
 
-        cache->sh->size += c->fs_size;
+        shard->size += c->fs_size;
 
     } else {
-        ngx_queue_remove(&fcn->queue);
+        ngx_http_file_cache_queue_remove(shard, fcn);
     }
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_queue_insert_head(&shard->queue, &fcn->queue);
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     return NGX_OK;
 }
@@ -2167,7 +2966,20 @@ ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 static void
 ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
 {
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+    ngx_uint_t  n, count;
+
+    /*
+     * the caller holds a shard lock, so other shards are not locked
+     * to avoid lock ordering problems; an approximate count is enough
+     */
+
+    count = 0;
+
+    for (n = 0; n < cache->sh->nshards; n++) {
+        count += cache->sh->shards[n].count;
+    }
+
+    cache->sh->watermark = count - count / 8;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                    "http file cache watermark: %ui", cache->sh->watermark);
@@ -2211,9 +3023,9 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size_t                  len;
     ssize_t                 size;
     ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files;
+    ngx_int_t               loader_files, shards;
     ngx_msec_t              loader_sleep, loader_threshold;
-    ngx_uint_t              i, n, use_temp_path;
+    ngx_uint_t              i, n, use_temp_path, index, admission;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
 
@@ -2228,11 +3040,14 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     use_temp_path = 1;
+    index = 0;
+    admission = 0;
 
     inactive = 600;
     loader_files = 100;
     loader_sleep = 50;
     loader_threshold = 200;
+    shards = 1;
 
     name.len = 0;
     size = 0;
@@ -2308,6 +3123,44 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            if (ngx_strcmp(&value[i].data[6], "on") == 0) {
+                index = 1;
+
+            } else if (ngx_strcmp(&value[i].data[6], "off") == 0) {
+                index = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "admission=", 10) == 0) {
+
+            if (ngx_strcmp(&value[i].data[10], "on") == 0) {
+                admission = 1;
+
+            } else if (ngx_strcmp(&value[i].data[10], "off") == 0) {
+                admission = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid admission value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
 
             name.data = value[i].data + 10;
@@ -2405,6 +3258,20 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards == NGX_ERROR || shards == 0
+                || shards > NGX_HTTP_CACHE_MAX_SHARDS)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -2426,6 +3293,23 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->loader_sleep = loader_sleep;
     cache->loader_threshold = loader_threshold;
 
+    if (index) {
+        len = cache->path->name.len + sizeof("/index") - 1;
+
+        p = ngx_pnalloc(cf->pool, len + 1);
+        if (p == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        cache->index.len = len;
+        cache->index.data = p;
+
+        p = ngx_cpymem(p, cache->path->name.data, cache->path->name.len);
+        ngx_memcpy(p, "/index", sizeof("/index"));
+
+        cache->path->saver = ngx_http_file_cache_saver;
+    }
+
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
@@ -2478,6 +3362,8 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     cache->inactive = inactive;
     cache->max_size = max_size;
+    cache->nshards = shards;
+    cache->admission = admission;
 
     caches = (ngx_array_t *) (confp + cmd->offset);
 
@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_HAVE_SSE42)
+#include <nmmintrin.h>
+#endif
+
 
 static uint32_t  usual[] = {
     0xffffdbfe, /* 1111 1111 1111 1111  1101 1011 1111 1110 */
@@ -98,6 +102,60 @@ static uint32_t  usual[] = {
 #endif
 
 
+#if (NGX_HAVE_SSE42)
+
+/*
+ * The SSE4.2 string instructions are used to skip over runs of bytes
+ * that do not change the parser state, 16 bytes at a time.  The sets
+ * are padded to 16 bytes as they are loaded as a whole; the scanners
+ * stop short of the last 16 bytes of a buffer, the state machine
+ * handles the tail and any byte that needs an attention.
+ */
+
+static u_char *ngx_http_parse_scan_any(u_char *p, u_char *last,
+    u_char *set, int n);
+static u_char *ngx_http_parse_scan_ranges(u_char *p, u_char *last,
+    u_char *set, int n);
+
+
+/* the bytes that are not in the "usual" bitmap */
+
+static u_char  ngx_http_parse_uri_set[16] = {
+    '\0', LF, CR, ' ', '#', '%', '+', '.', '/', '?',
+#if (NGX_WIN32)
+    '\\'
+#endif
+};
+
+#if (NGX_WIN32)
+#define NGX_HTTP_PARSE_URI_SET_LEN   11
+#else
+#define NGX_HTTP_PARSE_URI_SET_LEN   10
+#endif
+
+static u_char  ngx_http_parse_args_set[16] = {
+    '\0', LF, CR, ' ', '#'
+};
+
+static u_char  ngx_http_parse_value_set[16] = {
+    '\0', LF, CR
+};
+
+static u_char  ngx_http_parse_name_set[16] = "azAZ09--__";
+
+
+#define ngx_http_parse_skip(p, last, set, n)                                  \
+    if ((ngx_cpu_features & NGX_CPU_SSE42) && last - p > 16) {                \
+        p = ngx_http_parse_scan_any(p + 1, last, set, n) - 1;                 \
+    }
+
+#else
+
+#define ngx_http_parse_skip(p, last, set, n)
+
+#endif
+
+
 /* gcc, icc, msvc and others compile these switches as an jump table */
 
 ngx_int_t
@@ -541,6 +599,8 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_check_uri:
 
             if (usual[ch >> 5] & (1U << (ch & 0x1f))) {
+                ngx_http_parse_skip(p, b->last, ngx_http_parse_uri_set,
+                                    NGX_HTTP_PARSE_URI_SET_LEN);
                 break;
             }
 
@@ -627,6 +687,7 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_uri:
 
             if (usual[ch >> 5] & (1U << (ch & 0x1f))) {
+                ngx_http_parse_skip(p, b->last, ngx_http_parse_args_set, 5);
                 break;
             }
 
@@ -837,6 +898,9 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
 {
     u_char      c, ch, *p;
     ngx_uint_t  hash, i;
+#if (NGX_HAVE_SSE42)
+    u_char     *m;
+#endif
     enum {
         sw_start = 0,
         sw_name,
@@ -926,6 +990,35 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
                 hash = ngx_hash(hash, c);
                 r->lowcase_header[i++] = c;
                 i &= (NGX_HTTP_LC_HEADER_LEN - 1);
+
+#if (NGX_HAVE_SSE42)
+                if ((ngx_cpu_features & NGX_CPU_SSE42) && b->last - p > 16) {
+
+                    /*
+                     * find the end of the run of valid name characters,
+                     * then hash and lowercase it without the state switch
+                     */
+
+                    m = ngx_http_parse_scan_ranges(p + 1, b->last,
+                                                   ngx_http_parse_name_set,
+                                                   allow_underscores ? 10 : 8);
+
+                    for (p++; p < m; p++) {
+                        c = lowcase[*p];
+
+                        if (c == '\0') {
+                            c = '_';
+                        }
+
+                        hash = ngx_hash(hash, c);
+                        r->lowcase_header[i++] = c;
+                        i &= (NGX_HTTP_LC_HEADER_LEN - 1);
+                    }
+
+                    p--;
+                }
+#endif
+
                 break;
             }
 
@@ -1020,6 +1113,29 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
                 goto done;
             case '\0':
                 return NGX_HTTP_PARSE_INVALID_HEADER;
+#if (NGX_HAVE_SSE42)
+            default:
+                if ((ngx_cpu_features & NGX_CPU_SSE42) && b->last - p > 16) {
+
+                    /*
+                     * spaces inside the value are skipped as well,
+                     * the trailing ones are found by looking back
+                     */
+
+                    p = ngx_http_parse_scan_any(p + 1, b->last,
+                                                ngx_http_parse_value_set, 3);
+
+                    for (m = p; *(m - 1) == ' '; m--) { /* void */ }
+
+                    if (m != p) {
+                        r->header_end = m;
+                        state = sw_space_after_value;
+                    }
+
+                    p--;
+                }
+                break;
+#endif
             }
             break;
 
@@ -2377,3 +2493,58 @@ invalid:
 
     return NGX_ERROR;
 }
+
+
+#if (NGX_HAVE_SSE42)
+
+__attribute__((target("sse4.2")))
+static u_char *
+ngx_http_parse_scan_any(u_char *p, u_char *last, u_char *set, int n)
+{
+    int      i;
+    __m128i  s, v;
+
+    s = _mm_loadu_si128((const __m128i *) set);
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+
+        i = _mm_cmpestri(s, n, v, 16, _SIDD_UBYTE_OPS|_SIDD_CMP_EQUAL_ANY);
+
+        if (i != 16) {
+            return p + i;
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+
+__attribute__((target("sse4.2")))
+static u_char *
+ngx_http_parse_scan_ranges(u_char *p, u_char *last, u_char *set, int n)
+{
+    int      i;
+    __m128i  s, v;
+
+    s = _mm_loadu_si128((const __m128i *) set);
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+
+        i = _mm_cmpestri(s, n, v, 16, _SIDD_UBYTE_OPS|_SIDD_CMP_RANGES
+                                      |_SIDD_NEGATIVE_POLARITY);
+
+        if (i != 16) {
+            return p + i;
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+#endif
@@ -61,6 +61,13 @@ static u_char *ngx_http_log_error_handler(ngx_http_request_t *r,
 #if (NGX_HTTP_SSL)
 static void ngx_http_ssl_handshake(ngx_event_t *rev);
 static void ngx_http_ssl_handshake_handler(ngx_connection_t *c);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_ssl_thread_handler(ngx_thread_task_t *task,
+    ngx_connection_t *c);
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+static ngx_int_t ngx_http_ssl_save_servername(ngx_connection_t *c);
+#endif
+#endif
 #endif
 
 
@@ -575,7 +582,7 @@ ngx_http_create_request(ngx_connection_t *c)
     }
 
 #if (NGX_HTTP_SSL)
-    if (c->ssl) {
+    if (c->ssl && !c->ssl->sendfile) {
         r->main_filter_need_in_memory = 1;
     }
 #endif
@@ -719,6 +726,12 @@ ngx_http_ssl_handshake(ngx_event_t *rev)
                 return;
             }
 
+#if (NGX_THREADS)
+            if (sscf->thread_pool) {
+                c->ssl->thread_handler = ngx_http_ssl_thread_handler;
+            }
+#endif
+
             rc = ngx_ssl_handshake(c);
 
             if (rc == NGX_AGAIN) {
@@ -758,6 +771,15 @@ ngx_http_ssl_handshake_handler(ngx_connection_t *c)
 {
     if (c->ssl->handshaked) {
 
+#if (NGX_THREADS && defined SSL_CTRL_SET_TLSEXT_HOSTNAME)
+
+        if (ngx_http_ssl_save_servername(c) != NGX_OK) {
+            ngx_http_close_connection(c);
+            return;
+        }
+
+#endif
+
         /*
          * The majority of browsers do not send the "close notify" alert.
          * Among them are MSIE, old Mozilla, Netscape 4, Konqueror,
@@ -820,18 +842,50 @@ ngx_http_ssl_handshake_handler(ngx_connection_t *c)
     ngx_http_close_connection(c);
 }
 
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_ssl_thread_handler(ngx_thread_task_t *task, ngx_connection_t *c)
+{
+    ngx_http_connection_t    *hc;
+    ngx_http_ssl_srv_conf_t  *sscf;
+
+    hc = c->data;
+
+    /* the server might have been changed by SNI */
+
+    sscf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_ssl_module);
+
+    if (sscf->thread_pool == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_thread_task_post(sscf->thread_pool, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
 #ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
 
 int
 ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
 {
     ngx_str_t                  host;
+    ngx_uint_t                 alloc;
     const char                *servername;
     ngx_connection_t          *c;
     ngx_http_connection_t     *hc;
     ngx_http_ssl_srv_conf_t   *sscf;
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
+#if (NGX_THREADS)
+    u_char                     name[TLSEXT_MAXLEN_host_name];
+#endif
 
     servername = SSL_get_servername(ssl_conn, TLSEXT_NAMETYPE_host_name);
 
@@ -856,11 +910,34 @@ ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
 
     host.data = (u_char *) servername;
 
-    if (ngx_http_validate_host(&host, c->pool, 1) != NGX_OK) {
-        return SSL_TLSEXT_ERR_NOACK;
+    hc = c->data;
+    alloc = 1;
+
+#if (NGX_THREADS)
+
+    if (c->ssl->in_thread) {
+
+        /*
+         * the connection pool must not be used in a thread, so the name
+         * is lowercased on stack, and it is saved to the pool after
+         * the handshake by ngx_http_ssl_handshake_handler()
+         */
+
+        if (host.len > TLSEXT_MAXLEN_host_name) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+
+        ngx_strlow(name, host.data, host.len);
+        host.data = name;
+
+        alloc = 0;
     }
 
-    hc = c->data;
+#endif
+
+    if (ngx_http_validate_host(&host, c->pool, alloc) != NGX_OK) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
 
     if (ngx_http_find_virtual_server(c, hc->addr_conf->virtual_names, &host,
                                      NULL, &cscf)
@@ -869,12 +946,17 @@ ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
         return SSL_TLSEXT_ERR_NOACK;
     }
 
-    hc->ssl_servername = ngx_palloc(c->pool, sizeof(ngx_str_t));
-    if (hc->ssl_servername == NULL) {
-        return SSL_TLSEXT_ERR_NOACK;
-    }
+    if (alloc) {
+        hc->ssl_servername = ngx_palloc(c->pool, sizeof(ngx_str_t));
+        if (hc->ssl_servername == NULL) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
 
-    *hc->ssl_servername = host;
+        *hc->ssl_servername = host;
+
+    } else {
+        hc->ssl_servername_pending = 1;
+    }
 
     hc->conf_ctx = cscf->ctx;
 
@@ -909,6 +991,50 @@ ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
     return SSL_TLSEXT_ERR_OK;
 }
 
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_ssl_save_servername(ngx_connection_t *c)
+{
+    ngx_str_t               host;
+    const char             *servername;
+    ngx_http_connection_t  *hc;
+
+    hc = c->data;
+
+    if (!hc->ssl_servername_pending) {
+        return NGX_OK;
+    }
+
+    hc->ssl_servername_pending = 0;
+
+    servername = SSL_get_servername(c->ssl->connection,
+                                    TLSEXT_NAMETYPE_host_name);
+
+    if (servername == NULL) {
+        return NGX_OK;
+    }
+
+    host.len = ngx_strlen(servername);
+    host.data = (u_char *) servername;
+
+    if (ngx_http_validate_host(&host, c->pool, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hc->ssl_servername = ngx_palloc(c->pool, sizeof(ngx_str_t));
+    if (hc->ssl_servername == NULL) {
+        return NGX_ERROR;
+    }
+
+    *hc->ssl_servername = host;
+
+    return NGX_OK;
+}
+
+#endif
+
 #endif
 
 #endif
@@ -2127,6 +2253,18 @@ ngx_http_find_virtual_server(ngx_connection_t *c,
 
             for (i = 0; i < virtual_names->nregex; i++) {
 
+                n = ngx_http_regex_set_skip(virtual_names->regex_set, i,
+                                            host, c->log);
+
+                if (n == NGX_ERROR) {
+                    return NGX_ERROR;
+                }
+
+                if (n) {
+                    i += n - 1;
+                    continue;
+                }
+
                 n = ngx_regex_exec(sn[i].regex->regex, host, NULL, 0);
 
                 if (n == NGX_REGEX_NO_MATCHED) {
@@ -2156,6 +2294,18 @@ ngx_http_find_virtual_server(ngx_connection_t *c,
 
         for (i = 0; i < virtual_names->nregex; i++) {
 
+            n = ngx_http_regex_set_skip(virtual_names->regex_set, i, host,
+                                        c->log);
+
+            if (n == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (n) {
+                i += n - 1;
+                continue;
+            }
+
             n = ngx_http_regex_exec(r, sn[i].regex, host);
 
             if (n == NGX_DECLINED) {
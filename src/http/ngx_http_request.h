@@ -317,6 +317,7 @@ typedef struct {
 
 #if (NGX_HTTP_SSL)
     unsigned                          ssl:1;
+    unsigned                          ssl_servername_pending:1;
 #endif
     unsigned                          proxy_protocol:1;
 } ngx_http_connection_t;
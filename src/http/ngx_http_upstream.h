@@ -125,6 +125,9 @@ struct ngx_http_upstream_srv_conf_s {
     in_port_t                        default_port;
     ngx_uint_t                       no_port;  /* unsigned no_port:1 */
 
+    unsigned                         keepalive:1;
+    unsigned                         http2:1;
+
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_shm_zone_t                  *shm_zone;
 #endif
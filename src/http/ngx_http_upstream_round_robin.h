@@ -35,6 +35,9 @@ struct ngx_http_upstream_rr_peer_s {
     ngx_uint_t                      max_fails;
     time_t                          fail_timeout;
 
+    ngx_msec_t                      response_time;
+    time_t                          response_checked;
+
     ngx_uint_t                      down;          /* unsigned  down:1; */
 
 #if (NGX_HTTP_SSL)
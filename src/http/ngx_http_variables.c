@@ -60,6 +60,8 @@ static ngx_int_t ngx_http_variable_proxy_protocol_addr(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_variable_proxy_protocol_port(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_variable_proxy_protocol_tlv(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_variable_server_addr(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_variable_server_port(ngx_http_request_t *r,
@@ -650,6 +652,18 @@ ngx_http_get_variable(ngx_http_request_t *r, ngx_str_t *name, ngx_uint_t key)
         return NULL;
     }
 
+    if (name->len >= 19
+        && ngx_strncmp(name->data, "proxy_protocol_tlv_", 19) == 0)
+    {
+        if (ngx_http_variable_proxy_protocol_tlv(r, vv, (uintptr_t) name)
+            == NGX_OK)
+        {
+            return vv;
+        }
+
+        return NULL;
+    }
+
     vv->not_found = 1;
 
     return vv;
@@ -1263,6 +1277,39 @@ ngx_http_variable_proxy_protocol_port(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_variable_proxy_protocol_tlv(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_str_t *name = (ngx_str_t *) data;
+
+    ngx_int_t  rc;
+    ngx_str_t  tlv, value;
+
+    tlv.len = name->len - (sizeof("proxy_protocol_tlv_") - 1);
+    tlv.data = name->data + sizeof("proxy_protocol_tlv_") - 1;
+
+    rc = ngx_proxy_protocol_get_tlv(r->connection, &tlv, &value);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = value.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = value.data;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_variable_server_addr(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -2299,6 +2346,18 @@ ngx_http_map_find(ngx_http_request_t *r, ngx_http_map_t *map, ngx_str_t *match)
 
         for (i = 0; i < map->nregex; i++) {
 
+            n = ngx_http_regex_set_skip(map->regex_set, i, match,
+                                        r->connection->log);
+
+            if (n == NGX_ERROR) {
+                return NULL;
+            }
+
+            if (n) {
+                i += n - 1;
+                continue;
+            }
+
             n = ngx_http_regex_exec(r, reg[i].regex, match);
 
             if (n == NGX_OK) {
@@ -2359,6 +2418,7 @@ ngx_http_regex_compile(ngx_conf_t *cf, ngx_regex_compile_t *rc)
     re->regex = rc->regex;
     re->ncaptures = rc->captures;
     re->name = rc->pattern;
+    re->options = rc->options;
 
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
     cmcf->ncaptures = ngx_max(cmcf->ncaptures, re->ncaptures);
@@ -2472,6 +2532,230 @@ ngx_http_regex_exec(ngx_http_request_t *r, ngx_http_regex_t *re, ngx_str_t *s)
     return NGX_OK;
 }
 
+
+static ngx_uint_t
+ngx_http_regex_set_combinable(ngx_str_t *pattern)
+{
+    u_char  *p, *last;
+
+    /*
+     * the regexes with backreferences, subroutine calls, conditions,
+     * verbs, and comments cannot be joined as their meaning depends
+     * on the group numbers or on the rest of the pattern
+     */
+
+    p = pattern->data;
+    last = p + pattern->len;
+
+    while (p < last) {
+
+        switch (*p) {
+
+        case '\\':
+            if (p + 1 < last
+                && ((p[1] >= '1' && p[1] <= '9')
+                    || p[1] == 'g' || p[1] == 'k' || p[1] == 'Q'))
+            {
+                return 0;
+            }
+
+            p += 2;
+            continue;
+
+        case '#':
+            return 0;
+
+        case '(':
+            if (p + 1 < last && p[1] == '*') {
+                return 0;
+            }
+
+            if (p + 2 < last && p[1] == '?') {
+
+                switch (p[2]) {
+
+                case '(':
+                case '&':
+                case 'R':
+                case '+':
+                    return 0;
+
+                case 'P':
+                    if (p + 3 < last && (p[3] == '=' || p[3] == '>')) {
+                        return 0;
+                    }
+
+                    break;
+
+                case '-':
+                    if (p + 3 < last && p[3] >= '0' && p[3] <= '9') {
+                        return 0;
+                    }
+
+                    break;
+
+                default:
+                    if (p[2] >= '0' && p[2] <= '9') {
+                        return 0;
+                    }
+                }
+            }
+
+            break;
+        }
+
+        p++;
+    }
+
+    return 1;
+}
+
+
+ngx_int_t
+ngx_http_regex_set_compile(ngx_conf_t *cf, ngx_http_regex_set_t **set,
+    ngx_http_regex_t **regex, ngx_uint_t n)
+{
+    u_char                *p;
+    size_t                 len;
+    ngx_uint_t             i, j, k, nelts;
+    ngx_regex_compile_t    rc;
+    ngx_http_regex_set_t  *rs;
+    u_char                 errstr[NGX_MAX_CONF_ERRSTR];
+
+    *set = NULL;
+
+    if (n < 2) {
+        return NGX_OK;
+    }
+
+    rs = ngx_pcalloc(cf->pool, (n + NGX_HTTP_REGEX_SET_SIZE - 1)
+                               / NGX_HTTP_REGEX_SET_SIZE
+                               * sizeof(ngx_http_regex_set_t));
+    if (rs == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0, k = 0; i < n; i += nelts, k++) {
+
+        nelts = ngx_min(n - i, NGX_HTTP_REGEX_SET_SIZE);
+
+        rs[k].nelts = nelts;
+
+        /* "(?J)", "(?:(?i)" and ")|" for each regex, and "\0" */
+
+        len = sizeof("(?J)") - 1 + 1;
+
+        for (j = i; j < i + nelts; j++) {
+
+            if (!ngx_http_regex_set_combinable(&regex[j]->name)) {
+                break;
+            }
+
+            len += sizeof("(?:(?i))|") - 1 + regex[j]->name.len;
+        }
+
+        if (j < i + nelts) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                           "regex \"%V\" cannot be joined",
+                           &regex[j]->name);
+            continue;
+        }
+
+        p = ngx_pnalloc(cf->pool, len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+        rc.pattern.data = p;
+        rc.pool = cf->pool;
+        rc.err.len = NGX_MAX_CONF_ERRSTR;
+        rc.err.data = errstr;
+
+        /* the same names may be used in different regexes */
+
+        p = ngx_cpymem(p, "(?J)", sizeof("(?J)") - 1);
+
+        for (j = i; j < i + nelts; j++) {
+
+            if (j != i) {
+                *p++ = '|';
+            }
+
+            p = ngx_cpymem(p, "(?:", sizeof("(?:") - 1);
+
+            if (regex[j]->options & NGX_REGEX_CASELESS) {
+                p = ngx_cpymem(p, "(?i)", sizeof("(?i)") - 1);
+            }
+
+            p = ngx_cpymem(p, regex[j]->name.data, regex[j]->name.len);
+            *p++ = ')';
+        }
+
+        *p = '\0';
+
+        rc.pattern.len = p - rc.pattern.data;
+
+        if (ngx_regex_compile(&rc) != NGX_OK) {
+
+            /* the regexes are still tried one by one */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                           "regex set not compiled: %V", &rc.err);
+            continue;
+        }
+
+        rs[k].regex = rc.regex;
+    }
+
+    *set = rs;
+
+    return NGX_OK;
+}
+
+
+/*
+ * returns the number of the regexes starting from "i" which are known
+ * not to match, or 0 if the regex "i" has to be tried
+ */
+
+ngx_int_t
+ngx_http_regex_set_skip(ngx_http_regex_set_t *set, ngx_uint_t i,
+    ngx_str_t *s, ngx_log_t *log)
+{
+    ngx_int_t  rc;
+
+    if (set == NULL || i % NGX_HTTP_REGEX_SET_SIZE) {
+        return 0;
+    }
+
+    set += i / NGX_HTTP_REGEX_SET_SIZE;
+
+    if (set->regex == NULL) {
+        return 0;
+    }
+
+    rc = ngx_regex_exec(set->regex, s, NULL, 0);
+
+    if (rc == NGX_REGEX_NO_MATCHED) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "regex set %ui does not match \"%V\"",
+                       i / NGX_HTTP_REGEX_SET_SIZE, s);
+
+        return set->nelts;
+    }
+
+    if (rc < 0) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      ngx_regex_exec_n " failed: %i on \"%V\" using "
+                      "regex set %ui", rc, s, i / NGX_HTTP_REGEX_SET_SIZE);
+        return NGX_ERROR;
+    }
+
+    return 0;
+}
+
 #endif
 
 
@@ -2530,6 +2814,7 @@ ngx_int_t
 ngx_http_variables_init_vars(ngx_conf_t *cf)
 {
     ngx_uint_t                  i, n;
+    ngx_str_t                   tlv;
     ngx_hash_key_t             *key;
     ngx_hash_init_t             hash;
     ngx_http_variable_t        *v, *av;
@@ -2625,6 +2910,25 @@ ngx_http_variables_init_vars(ngx_conf_t *cf)
             continue;
         }
 
+        if (v[i].name.len >= 19
+            && ngx_strncmp(v[i].name.data, "proxy_protocol_tlv_", 19) == 0)
+        {
+            tlv.len = v[i].name.len - 19;
+            tlv.data = v[i].name.data + 19;
+
+            if (ngx_proxy_protocol_check_tlv(&tlv) != NGX_OK) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "unknown PROXY protocol TLV in \"%V\" variable",
+                              &v[i].name);
+                return NGX_ERROR;
+            }
+
+            v[i].get_handler = ngx_http_variable_proxy_protocol_tlv;
+            v[i].data = (uintptr_t) &v[i].name;
+
+            continue;
+        }
+
         ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
                       "unknown \"%V\" variable", &v[i].name);
 
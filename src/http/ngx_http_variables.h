@@ -71,9 +71,23 @@ typedef struct {
     ngx_http_regex_variable_t    *variables;
     ngx_uint_t                    nvariables;
     ngx_str_t                     name;
+    ngx_int_t                     options;
 } ngx_http_regex_t;
 
 
+/*
+ * a set is one regex combined from up to NGX_HTTP_REGEX_SET_SIZE
+ * consecutive regexes of a list, it only tells that none of them matches
+ */
+
+#define NGX_HTTP_REGEX_SET_SIZE  64
+
+typedef struct {
+    ngx_regex_t                  *regex;
+    ngx_uint_t                    nelts;
+} ngx_http_regex_set_t;
+
+
 typedef struct {
     ngx_http_regex_t             *regex;
     void                         *value;
@@ -84,6 +98,10 @@ ngx_http_regex_t *ngx_http_regex_compile(ngx_conf_t *cf,
     ngx_regex_compile_t *rc);
 ngx_int_t ngx_http_regex_exec(ngx_http_request_t *r, ngx_http_regex_t *re,
     ngx_str_t *s);
+ngx_int_t ngx_http_regex_set_compile(ngx_conf_t *cf,
+    ngx_http_regex_set_t **set, ngx_http_regex_t **regex, ngx_uint_t n);
+ngx_int_t ngx_http_regex_set_skip(ngx_http_regex_set_t *set, ngx_uint_t i,
+    ngx_str_t *s, ngx_log_t *log);
 
 #endif
 
@@ -93,6 +111,7 @@ typedef struct {
 #if (NGX_PCRE)
     ngx_http_map_regex_t         *regex;
     ngx_uint_t                    nregex;
+    ngx_http_regex_set_t         *regex_set;
 #endif
 } ngx_http_map_t;
 
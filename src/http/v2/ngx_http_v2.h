@@ -26,6 +26,8 @@
 
 #define NGX_HTTP_V2_FRAME_HEADER_SIZE    9
 
+#define NGX_HTTP_V2_TABLE_SIZE           4096
+
 /* frame types */
 #define NGX_HTTP_V2_DATA_FRAME           0x0
 #define NGX_HTTP_V2_HEADERS_FRAME        0x1
@@ -49,6 +51,42 @@
 #define NGX_HTTP_V2_MAX_WINDOW           ((1U << 31) - 1)
 #define NGX_HTTP_V2_DEFAULT_WINDOW       65535
 
+/* errors */
+#define NGX_HTTP_V2_NO_ERROR             0x0
+#define NGX_HTTP_V2_PROTOCOL_ERROR       0x1
+#define NGX_HTTP_V2_INTERNAL_ERROR       0x2
+#define NGX_HTTP_V2_FLOW_CTRL_ERROR      0x3
+#define NGX_HTTP_V2_SETTINGS_TIMEOUT     0x4
+#define NGX_HTTP_V2_STREAM_CLOSED        0x5
+#define NGX_HTTP_V2_SIZE_ERROR           0x6
+#define NGX_HTTP_V2_REFUSED_STREAM       0x7
+#define NGX_HTTP_V2_CANCEL               0x8
+#define NGX_HTTP_V2_COMP_ERROR           0x9
+#define NGX_HTTP_V2_CONNECT_ERROR        0xa
+#define NGX_HTTP_V2_ENHANCE_YOUR_CALM    0xb
+#define NGX_HTTP_V2_INADEQUATE_SECURITY  0xc
+#define NGX_HTTP_V2_HTTP_1_1_REQUIRED    0xd
+
+/* frame sizes */
+#define NGX_HTTP_V2_RST_STREAM_SIZE      4
+#define NGX_HTTP_V2_PRIORITY_SIZE        5
+#define NGX_HTTP_V2_PING_SIZE            8
+#define NGX_HTTP_V2_GOAWAY_SIZE          8
+#define NGX_HTTP_V2_WINDOW_UPDATE_SIZE   4
+
+#define NGX_HTTP_V2_STREAM_ID_SIZE       4
+
+#define NGX_HTTP_V2_SETTINGS_PARAM_SIZE  6
+
+/* settings fields */
+#define NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING    0x1
+#define NGX_HTTP_V2_ENABLE_PUSH_SETTING          0x2
+#define NGX_HTTP_V2_MAX_STREAMS_SETTING          0x3
+#define NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING     0x4
+#define NGX_HTTP_V2_MAX_FRAME_SIZE_SETTING       0x5
+
+#define NGX_HTTP_V2_DEFAULT_FRAME_SIZE   (1 << 14)
+
 
 typedef struct ngx_http_v2_connection_s   ngx_http_v2_connection_t;
 typedef struct ngx_http_v2_node_s         ngx_http_v2_node_t;
@@ -110,6 +148,34 @@ typedef struct {
 } ngx_http_v2_hpack_t;
 
 
+typedef struct {
+    uint32_t                         hash;
+    uint32_t                         name_hash;
+    size_t                           name_len;
+    size_t                           value_len;
+    ngx_uint_t                       offset;
+    u_char                          *data;
+} ngx_http_v2_hpack_entry_t;
+
+
+typedef struct {
+    ngx_http_v2_hpack_entry_t       *entries;
+
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+    ngx_uint_t                       stored;
+    ngx_uint_t                       total;
+
+    size_t                           size;
+    size_t                           free;
+    size_t                           update;
+    u_char                          *storage;
+    u_char                          *pos;
+
+    unsigned                         size_update:1;
+} ngx_http_v2_hpack_enc_t;
+
+
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
@@ -127,6 +193,7 @@ struct ngx_http_v2_connection_s {
     ngx_http_v2_state_t              state;
 
     ngx_http_v2_hpack_t              hpack;
+    ngx_http_v2_hpack_enc_t          hpack_enc;
 
     ngx_pool_t                      *pool;
 
@@ -275,10 +342,16 @@ ngx_int_t ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c);
 
 ngx_int_t ngx_http_v2_get_indexed_header(ngx_http_v2_connection_t *h2c,
     ngx_uint_t index, ngx_uint_t name_only);
+ngx_http_v2_header_t *ngx_http_v2_get_static_header(ngx_uint_t index);
 ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
+void ngx_http_v2_table_encoder_size(ngx_http_v2_connection_t *h2c,
+    size_t size);
+ngx_int_t ngx_http_v2_table_encode(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t add, ngx_uint_t *index);
+
 
 ngx_int_t ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len,
     u_char **dst, ngx_uint_t last, ngx_log_t *log);
@@ -286,6 +359,27 @@ size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
     ngx_uint_t lower);
 
 
+u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
+    u_char *tmp, ngx_uint_t lower);
+u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
+    ngx_uint_t value);
+
+
+#define ngx_http_v2_write_name(dst, src, len, tmp)                            \
+    ngx_http_v2_string_encode(dst, src, len, tmp, 1)
+#define ngx_http_v2_write_value(dst, src, len, tmp)                           \
+    ngx_http_v2_string_encode(dst, src, len, tmp, 0)
+
+#define NGX_HTTP_V2_ENCODE_RAW            0
+#define NGX_HTTP_V2_ENCODE_HUFF           0x80
+
+#define NGX_HTTP_V2_FIELD_INDEXED         0x80
+#define NGX_HTTP_V2_FIELD_INC_INDEXED     0x40
+#define NGX_HTTP_V2_FIELD_SIZE_UPDATE     0x20
+#define NGX_HTTP_V2_FIELD_NEVER_INDEXED   0x10
+#define NGX_HTTP_V2_FIELD_NOT_INDEXED     0x00
+
+
 #define ngx_http_v2_prefix(bits)  ((1 << (bits)) - 1)
 
 
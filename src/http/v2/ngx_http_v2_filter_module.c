@@ -23,15 +23,10 @@
     (ngx_http_v2_integer_octets(sizeof(h) - 1) + sizeof(h) - 1)
 
 #define ngx_http_v2_indexed(i)      (128 + (i))
-#define ngx_http_v2_inc_indexed(i)  (64 + (i))
 
-#define ngx_http_v2_write_name(dst, src, len, tmp)                            \
-    ngx_http_v2_string_encode(dst, src, len, tmp, 1)
-#define ngx_http_v2_write_value(dst, src, len, tmp)                           \
-    ngx_http_v2_string_encode(dst, src, len, tmp, 0)
-
-#define NGX_HTTP_V2_ENCODE_RAW            0
-#define NGX_HTTP_V2_ENCODE_HUFF           0x80
+#define NGX_HTTP_V2_FIELD_INDEX           0
+#define NGX_HTTP_V2_FIELD_NO_INDEX        1
+#define NGX_HTTP_V2_FIELD_NEVER_INDEX     2
 
 #define NGX_HTTP_V2_STATUS_INDEX          8
 #define NGX_HTTP_V2_STATUS_200_INDEX      8
@@ -51,10 +46,9 @@
 #define NGX_HTTP_V2_VARY_INDEX            59
 
 
-static u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
-    u_char *tmp, ngx_uint_t lower);
-static u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
-    ngx_uint_t value);
+static u_char *ngx_http_v2_write_field(ngx_http_request_t *r, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, ngx_uint_t mode,
+    u_char *tmp);
 static ngx_http_v2_out_frame_t *ngx_http_v2_create_headers_frame(
     ngx_http_request_t *r, u_char *pos, u_char *end);
 
@@ -126,9 +120,9 @@ static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_int_t
 ngx_http_v2_header_filter(ngx_http_request_t *r)
 {
-    u_char                     status, *pos, *start, *p, *tmp;
+    u_char                     status, *pos, *start, *p, *tmp, *low;
     size_t                     len, tmp_len;
-    ngx_str_t                  host, location;
+    ngx_str_t                  host, location, name, value;
     ngx_uint_t                 i, port;
     ngx_list_part_t           *part;
     ngx_table_elt_t           *header;
@@ -137,17 +131,26 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     ngx_http_v2_out_frame_t   *frame;
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
+    ngx_http_v2_hpack_enc_t   *enc;
     u_char                     addr[NGX_SOCKADDR_STRLEN];
-
-    static const u_char nginx[5] = "\x84\xaa\x63\x55\xe7";
+    u_char                     code[NGX_INT_T_LEN];
+    u_char                     length[NGX_OFF_T_LEN];
+    u_char                     date[sizeof("Wed, 31 Dec 1986 18:00:00 GMT")];
+
+    static ngx_str_t  status_name = ngx_string(":status");
+    static ngx_str_t  server_name = ngx_string("server");
+    static ngx_str_t  date_name = ngx_string("date");
+    static ngx_str_t  content_type_name = ngx_string("content-type");
+    static ngx_str_t  content_length_name = ngx_string("content-length");
+    static ngx_str_t  last_modified_name = ngx_string("last-modified");
+    static ngx_str_t  location_name = ngx_string("location");
+    static ngx_str_t  nginx = ngx_string("nginx");
+    static ngx_str_t  nginx_ver = ngx_string(NGINX_VER);
 #if (NGX_HTTP_GZIP)
-    static const u_char accept_encoding[12] =
-        "\x8b\x84\x84\x2d\x69\x5b\x05\x44\x3c\x86\xaa\x6f";
+    static ngx_str_t  vary_name = ngx_string("vary");
+    static ngx_str_t  accept_encoding = ngx_string("Accept-Encoding");
 #endif
 
-    static size_t nginx_ver_len = ngx_http_v2_literal_size(NGINX_VER);
-    static u_char nginx_ver[ngx_http_v2_literal_size(NGINX_VER)];
-
     if (!r->stream) {
         return ngx_http_next_header_filter(r);
     }
@@ -227,20 +230,36 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
     }
 
-    len = status ? 1 : 1 + ngx_http_v2_literal_size("418");
+    /*
+     * an index of the dynamic table, as well as a static index
+     * with a 4-bit prefix, may take more than one octet
+     */
+
+    len = status ? 1 : NGX_HTTP_V2_INT_OCTETS
+                       + ngx_http_v2_literal_size("418");
+
+    enc = &r->stream->connection->hpack_enc;
+
+    if (enc->size_update) {
+        len += 2 * NGX_HTTP_V2_INT_OCTETS;
+    }
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     if (r->headers_out.server == NULL) {
-        len += 1 + (clcf->server_tokens ? nginx_ver_len : sizeof(nginx));
+        len += NGX_HTTP_V2_INT_OCTETS
+               + (clcf->server_tokens ? ngx_http_v2_literal_size(NGINX_VER)
+                                      : ngx_http_v2_literal_size("nginx"));
     }
 
     if (r->headers_out.date == NULL) {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += NGX_HTTP_V2_INT_OCTETS
+               + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     if (r->headers_out.content_type.len) {
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
+        len += NGX_HTTP_V2_INT_OCTETS + NGX_HTTP_V2_INT_OCTETS
+               + r->headers_out.content_type.len;
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -252,13 +271,15 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     if (r->headers_out.content_length == NULL
         && r->headers_out.content_length_n >= 0)
     {
-        len += 1 + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
+        len += NGX_HTTP_V2_INT_OCTETS
+               + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += NGX_HTTP_V2_INT_OCTETS
+               + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -334,7 +355,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
         r->headers_out.location->hash = 0;
 
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
+        len += NGX_HTTP_V2_INT_OCTETS + NGX_HTTP_V2_INT_OCTETS
+               + r->headers_out.location->value.len;
     }
 
     tmp_len = len;
@@ -342,7 +364,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 #if (NGX_HTTP_GZIP)
     if (r->gzip_vary) {
         if (clcf->gzip_vary) {
-            len += 1 + sizeof(accept_encoding);
+            len += NGX_HTTP_V2_INT_OCTETS
+                   + ngx_http_v2_literal_size("Accept-Encoding");
 
         } else {
             r->gzip_vary = 0;
@@ -396,14 +419,32 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     }
 
     tmp = ngx_palloc(r->pool, tmp_len);
+    low = ngx_pnalloc(r->pool, tmp_len);
     pos = ngx_pnalloc(r->pool, len);
 
-    if (pos == NULL || tmp == NULL) {
+    if (pos == NULL || tmp == NULL || low == NULL) {
         return NGX_ERROR;
     }
 
     start = pos;
 
+    if (enc->size_update) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 output table size update: %uz, %uz",
+                       enc->update, enc->size);
+
+        if (enc->update < enc->size) {
+            *pos = NGX_HTTP_V2_FIELD_SIZE_UPDATE;
+            pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5),
+                                        enc->update);
+        }
+
+        *pos = NGX_HTTP_V2_FIELD_SIZE_UPDATE;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5), enc->size);
+
+        enc->size_update = 0;
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 output header: \":status: %03ui\"",
                    r->headers_out.status);
@@ -412,9 +453,15 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         *pos++ = status;
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
-        *pos++ = NGX_HTTP_V2_ENCODE_RAW | 3;
-        pos = ngx_sprintf(pos, "%03ui", r->headers_out.status);
+        value.data = code;
+        value.len = ngx_sprintf(code, "%03ui", r->headers_out.status) - code;
+
+        pos = ngx_http_v2_write_field(r, pos, NGX_HTTP_V2_STATUS_INDEX,
+                                      &status_name, &value,
+                                      NGX_HTTP_V2_FIELD_INDEX, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
     if (r->headers_out.server == NULL) {
@@ -422,19 +469,12 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"server: %s\"",
                        clcf->server_tokens ? NGINX_VER : "nginx");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
-
-        if (clcf->server_tokens) {
-            if (nginx_ver[0] == '\0') {
-                p = ngx_http_v2_write_value(nginx_ver, (u_char *) NGINX_VER,
-                                            sizeof(NGINX_VER) - 1, tmp);
-                nginx_ver_len = p - nginx_ver;
-            }
-
-            pos = ngx_cpymem(pos, nginx_ver, nginx_ver_len);
-
-        } else {
-            pos = ngx_cpymem(pos, nginx, sizeof(nginx));
+        pos = ngx_http_v2_write_field(r, pos, NGX_HTTP_V2_SERVER_INDEX,
+                                      &server_name,
+                                      clcf->server_tokens ? &nginx_ver : &nginx,
+                                      NGX_HTTP_V2_FIELD_INDEX, tmp);
+        if (pos == NULL) {
+            goto failed;
         }
     }
 
@@ -443,13 +483,17 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"date: %V\"",
                        &ngx_cached_http_time);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
-        pos = ngx_http_v2_write_value(pos, ngx_cached_http_time.data,
-                                      ngx_cached_http_time.len, tmp);
+        value = ngx_cached_http_time;
+
+        pos = ngx_http_v2_write_field(r, pos, NGX_HTTP_V2_DATE_INDEX,
+                                      &date_name, &value,
+                                      NGX_HTTP_V2_FIELD_INDEX, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
     if (r->headers_out.content_type.len) {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -459,7 +503,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
             p = ngx_pnalloc(r->pool, len);
             if (p == NULL) {
-                return NGX_ERROR;
+                goto failed;
             }
 
             p = ngx_cpymem(p, r->headers_out.content_type.data,
@@ -480,8 +524,13 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        pos = ngx_http_v2_write_value(pos, r->headers_out.content_type.data,
-                                      r->headers_out.content_type.len, tmp);
+        pos = ngx_http_v2_write_field(r, pos, NGX_HTTP_V2_CONTENT_TYPE_INDEX,
+                                      &content_type_name,
+                                      &r->headers_out.content_type,
+                                      NGX_HTTP_V2_FIELD_INDEX, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
     if (r->headers_out.content_length == NULL
@@ -491,30 +540,34 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-length: %O\"",
                        r->headers_out.content_length_n);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+        value.data = length;
+        value.len = ngx_sprintf(length, "%O", r->headers_out.content_length_n)
+                    - length;
 
-        p = pos;
-        pos = ngx_sprintf(pos + 1, "%O", r->headers_out.content_length_n);
-        *p = NGX_HTTP_V2_ENCODE_RAW | (u_char) (pos - p - 1);
+        pos = ngx_http_v2_write_field(r, pos, NGX_HTTP_V2_CONTENT_LENGTH_INDEX,
+                                      &content_length_name, &value,
+                                      NGX_HTTP_V2_FIELD_NO_INDEX, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
+        value.data = date;
+        value.len = ngx_http_time(date, r->headers_out.last_modified_time)
+                    - date;
 
-        ngx_http_time(pos, r->headers_out.last_modified_time);
-        len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
-
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 output header: \"last-modified: %*s\"",
-                       len, pos);
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 output header: \"last-modified: %V\"", &value);
 
-        /*
-         * Date will always be encoded using huffman in the temporary buffer,
-         * so it's safe here to use src and dst pointing to the same address.
-         */
-        pos = ngx_http_v2_write_value(pos, pos, len, tmp);
+        pos = ngx_http_v2_write_field(r, pos, NGX_HTTP_V2_LAST_MODIFIED_INDEX,
+                                      &last_modified_name, &value,
+                                      NGX_HTTP_V2_FIELD_INDEX, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -522,9 +575,13 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"location: %V\"",
                        &r->headers_out.location->value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->headers_out.location->value.data,
-                                      r->headers_out.location->value.len, tmp);
+        pos = ngx_http_v2_write_field(r, pos, NGX_HTTP_V2_LOCATION_INDEX,
+                                      &location_name,
+                                      &r->headers_out.location->value,
+                                      NGX_HTTP_V2_FIELD_INDEX, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
 #if (NGX_HTTP_GZIP)
@@ -532,8 +589,12 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"vary: Accept-Encoding\"");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
-        pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        pos = ngx_http_v2_write_field(r, pos, NGX_HTTP_V2_VARY_INDEX,
+                                      &vary_name, &accept_encoding,
+                                      NGX_HTTP_V2_FIELD_INDEX, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 #endif
 
@@ -556,28 +617,25 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
             continue;
         }
 
-#if (NGX_DEBUG)
-        if (fc->log->log_level & NGX_LOG_DEBUG_HTTP) {
-            ngx_strlow(tmp, header[i].key.data, header[i].key.len);
-
-            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                           "http2 output header: \"%*s: %V\"",
-                           header[i].key.len, tmp, &header[i].value);
-        }
-#endif
+        name.len = header[i].key.len;
+        name.data = low;
 
-        *pos++ = 0;
+        ngx_strlow(low, header[i].key.data, header[i].key.len);
 
-        pos = ngx_http_v2_write_name(pos, header[i].key.data,
-                                     header[i].key.len, tmp);
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 output header: \"%V: %V\"",
+                       &name, &header[i].value);
 
-        pos = ngx_http_v2_write_value(pos, header[i].value.data,
-                                      header[i].value.len, tmp);
+        pos = ngx_http_v2_write_field(r, pos, 0, &name, &header[i].value,
+                                      NGX_HTTP_V2_FIELD_INDEX, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
     frame = ngx_http_v2_create_headers_frame(r, start, pos);
     if (frame == NULL) {
-        return NGX_ERROR;
+        goto failed;
     }
 
     ngx_http_v2_queue_blocked_frame(r->stream->connection, frame);
@@ -596,54 +654,86 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     fc->need_last_buf = 1;
 
     return ngx_http_v2_filter_send(fc, r->stream);
+
+failed:
+
+    /*
+     * the encoder table may already include fields of the header block,
+     * so the connection cannot be used anymore
+     */
+
+    r->stream->connection->connection->error = 1;
+
+    return NGX_ERROR;
 }
 
 
 static u_char *
-ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len, u_char *tmp,
-    ngx_uint_t lower)
+ngx_http_v2_write_field(ngx_http_request_t *r, u_char *pos, ngx_uint_t index,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t mode, u_char *tmp)
 {
-    size_t  hlen;
+    ngx_int_t                rc;
+    ngx_str_t               *sensitive;
+    ngx_uint_t               i, prefix, dindex;
+    ngx_http_v2_loc_conf_t  *h2lcf;
 
-    hlen = ngx_http_v2_huff_encode(src, len, tmp, lower);
+    h2lcf = ngx_http_get_module_loc_conf(r, ngx_http_v2_module);
 
-    if (hlen > 0) {
-        *dst = NGX_HTTP_V2_ENCODE_HUFF;
-        dst = ngx_http_v2_write_int(dst, ngx_http_v2_prefix(7), hlen);
-        return ngx_cpymem(dst, tmp, hlen);
+    if (h2lcf->sensitive_headers) {
+        sensitive = h2lcf->sensitive_headers->elts;
+
+        for (i = 0; i < h2lcf->sensitive_headers->nelts; i++) {
+            if (sensitive[i].len == name->len
+                && ngx_strncasecmp(sensitive[i].data, name->data, name->len)
+                   == 0)
+            {
+                mode = NGX_HTTP_V2_FIELD_NEVER_INDEX;
+                break;
+            }
+        }
     }
 
-    *dst = NGX_HTTP_V2_ENCODE_RAW;
-    dst = ngx_http_v2_write_int(dst, ngx_http_v2_prefix(7), len);
+    rc = NGX_DECLINED;
 
-    if (lower) {
-        ngx_strlow(dst, src, len);
-        return dst + len;
-    }
+    if (mode == NGX_HTTP_V2_FIELD_INDEX) {
+        rc = ngx_http_v2_table_encode(r->stream->connection, name, value, 1,
+                                      &dindex);
 
-    return ngx_cpymem(dst, src, len);
-}
+        if (rc == NGX_ERROR) {
+            return NULL;
+        }
 
+        if (rc == NGX_OK) {
+            *pos = NGX_HTTP_V2_FIELD_INDEXED;
+            return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7), dindex);
+        }
 
-static u_char *
-ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix, ngx_uint_t value)
-{
-    if (value < prefix) {
-        *pos++ |= value;
-        return pos;
+        if (index == 0) {
+            index = dindex;
+        }
     }
 
-    *pos++ |= prefix;
-    value -= prefix;
+    if (rc == NGX_DONE) {
+        *pos = NGX_HTTP_V2_FIELD_INC_INDEXED;
+        prefix = ngx_http_v2_prefix(6);
 
-    while (value >= 128) {
-        *pos++ = value % 128 + 128;
-        value /= 128;
+    } else if (mode == NGX_HTTP_V2_FIELD_NEVER_INDEX) {
+        *pos = NGX_HTTP_V2_FIELD_NEVER_INDEXED;
+        prefix = ngx_http_v2_prefix(4);
+
+    } else {
+        *pos = NGX_HTTP_V2_FIELD_NOT_INDEXED;
+        prefix = ngx_http_v2_prefix(4);
     }
 
-    *pos++ = (u_char) value;
+    if (index) {
+        pos = ngx_http_v2_write_int(pos, prefix, index);
+
+    } else {
+        pos = ngx_http_v2_write_name(pos + 1, name->data, name->len, tmp);
+    }
 
-    return pos;
+    return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
 }
 
 
@@ -122,6 +122,13 @@ static ngx_command_t  ngx_http_v2_commands[] = {
       offsetof(ngx_http_v2_loc_conf_t, chunk_size),
       &ngx_http_v2_chunk_size_post },
 
+    { ngx_string("http2_sensitive_headers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_str_array_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_v2_loc_conf_t, sensitive_headers),
+      NULL },
+
     { ngx_string("spdy_recv_buffer_size"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
       ngx_http_v2_spdy_deprecated,
@@ -378,6 +385,7 @@ ngx_http_v2_create_loc_conf(ngx_conf_t *cf)
     }
 
     h2lcf->chunk_size = NGX_CONF_UNSET_SIZE;
+    h2lcf->sensitive_headers = NGX_CONF_UNSET_PTR;
 
     return h2lcf;
 }
@@ -391,6 +399,9 @@ ngx_http_v2_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_size_value(conf->chunk_size, prev->chunk_size, 8 * 1024);
 
+    ngx_conf_merge_ptr_value(conf->sensitive_headers,
+                             prev->sensitive_headers, NULL);
+
     return NGX_CONF_OK;
 }
 
@@ -34,6 +34,7 @@ typedef struct {
 
 typedef struct {
     size_t                          chunk_size;
+    ngx_array_t                    *sensitive_headers;
 } ngx_http_v2_loc_conf_t;
 
 
@@ -10,11 +10,12 @@
 #include <ngx_http.h>
 
 
-#define NGX_HTTP_V2_TABLE_SIZE  4096
+#define NGX_HTTP_V2_TABLE_ENTRIES  (NGX_HTTP_V2_TABLE_SIZE / 32)
 
 
 static ngx_int_t ngx_http_v2_table_account(ngx_http_v2_connection_t *h2c,
     size_t size);
+static void ngx_http_v2_table_evict(ngx_http_v2_hpack_enc_t *enc);
 
 
 static ngx_http_v2_header_t  ngx_http_v2_static_table[] = {
@@ -171,6 +172,17 @@ ngx_http_v2_get_indexed_header(ngx_http_v2_connection_t *h2c, ngx_uint_t index,
 }
 
 
+ngx_http_v2_header_t *
+ngx_http_v2_get_static_header(ngx_uint_t index)
+{
+    if (index == 0 || index > NGX_HTTP_V2_STATIC_TABLE_ENTRIES) {
+        return NULL;
+    }
+
+    return &ngx_http_v2_static_table[index - 1];
+}
+
+
 ngx_int_t
 ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header)
@@ -347,3 +359,203 @@ ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
 
     return NGX_OK;
 }
+
+
+/*
+ * The encoder side keeps a copy of the peer's dynamic table.  Field bytes
+ * are stored contiguously in a ring, and entries whose bytes have been
+ * overwritten are still accounted for, but are no longer referenced.
+ */
+
+void
+ngx_http_v2_table_encoder_size(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    if (size > NGX_HTTP_V2_TABLE_SIZE) {
+        size = NGX_HTTP_V2_TABLE_SIZE;
+    }
+
+    if (size == enc->size) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 hpack encoder table size: %uz was:%uz",
+                   size, enc->size);
+
+    /* the smallest size since the last header block is signalled too */
+
+    if (!enc->size_update || size < enc->update) {
+        enc->update = ngx_min(size, enc->size);
+    }
+
+    while (enc->size - enc->free > size) {
+        ngx_http_v2_table_evict(enc);
+    }
+
+    enc->free = size - (enc->size - enc->free);
+    enc->size = size;
+    enc->size_update = 1;
+}
+
+
+ngx_int_t
+ngx_http_v2_table_encode(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t add, ngx_uint_t *index)
+{
+    size_t                      size, len;
+    uint32_t                    hash, name_hash;
+    ngx_uint_t                  i, last;
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    enc = &h2c->hpack_enc;
+
+    *index = 0;
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, name->data, name->len);
+    name_hash = hash;
+    ngx_crc32_update(&hash, value->data, value->len);
+
+    last = ngx_max(enc->deleted, enc->stored);
+
+    for (i = enc->added; i > last; i--) {
+        entry = &enc->entries[(i - 1) % NGX_HTTP_V2_TABLE_ENTRIES];
+
+        if (entry->name_hash != name_hash
+            || entry->name_len != name->len
+            || ngx_memcmp(entry->data, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        if (*index == 0) {
+            *index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + enc->added - i + 1;
+        }
+
+        if (entry->hash != hash
+            || entry->value_len != value->len
+            || ngx_memcmp(entry->data + name->len, value->data, value->len)
+               != 0)
+        {
+            continue;
+        }
+
+        *index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + enc->added - i + 1;
+
+        /*
+         * the table is strictly FIFO: an entry which is still in use
+         * is inserted again before it gets close to eviction
+         */
+
+        if (!add || (enc->total - entry->offset) * 4 <= enc->size * 3) {
+            return NGX_OK;
+        }
+
+        break;
+    }
+
+    if (!add) {
+        return NGX_DECLINED;
+    }
+
+    size = 32 + name->len + value->len;
+
+    /* large fields would flush most of the table */
+
+    if (size > enc->size / 2) {
+        return NGX_DECLINED;
+    }
+
+    if (enc->entries == NULL) {
+        enc->entries = ngx_palloc(h2c->connection->pool,
+                                  sizeof(ngx_http_v2_hpack_entry_t)
+                                  * NGX_HTTP_V2_TABLE_ENTRIES);
+        if (enc->entries == NULL) {
+            return NGX_ERROR;
+        }
+
+        enc->storage = ngx_palloc(h2c->connection->pool,
+                                  NGX_HTTP_V2_TABLE_SIZE);
+        if (enc->storage == NULL) {
+            return NGX_ERROR;
+        }
+
+        enc->pos = enc->storage;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 add header to hpack encoder table: \"%V: %V\"",
+                   name, value);
+
+    while (size > enc->free) {
+        ngx_http_v2_table_evict(enc);
+    }
+
+    enc->free -= size;
+
+    if (enc->stored < enc->deleted) {
+        enc->stored = enc->deleted;
+    }
+
+    len = name->len + value->len;
+
+    if (enc->pos + len > enc->storage + NGX_HTTP_V2_TABLE_SIZE) {
+
+        /* the tail of the ring is skipped along with the oldest entries */
+
+        while (enc->stored < enc->added) {
+            entry = &enc->entries[enc->stored % NGX_HTTP_V2_TABLE_ENTRIES];
+
+            if (entry->data < enc->pos) {
+                break;
+            }
+
+            enc->stored++;
+        }
+
+        enc->pos = enc->storage;
+    }
+
+    while (enc->stored < enc->added) {
+        entry = &enc->entries[enc->stored % NGX_HTTP_V2_TABLE_ENTRIES];
+
+        if (entry->data >= enc->pos + len
+            || entry->data + entry->name_len + entry->value_len <= enc->pos)
+        {
+            break;
+        }
+
+        enc->stored++;
+    }
+
+    entry = &enc->entries[enc->added++ % NGX_HTTP_V2_TABLE_ENTRIES];
+
+    entry->hash = hash;
+    entry->name_hash = name_hash;
+    entry->name_len = name->len;
+    entry->value_len = value->len;
+    entry->offset = enc->total;
+    entry->data = enc->pos;
+
+    enc->pos = ngx_cpymem(enc->pos, name->data, name->len);
+    enc->pos = ngx_cpymem(enc->pos, value->data, value->len);
+
+    enc->total += size;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_v2_table_evict(ngx_http_v2_hpack_enc_t *enc)
+{
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    entry = &enc->entries[enc->deleted++ % NGX_HTTP_V2_TABLE_ENTRIES];
+    enc->free += 32 + entry->name_len + entry->value_len;
+}
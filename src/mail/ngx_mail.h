@@ -42,6 +42,7 @@ typedef struct {
     unsigned                ipv6only:1;
 #endif
     unsigned                so_keepalive:2;
+    unsigned                proxy_protocol:1;
 #if (NGX_HAVE_KEEPALIVE_TUNABLE)
     int                     tcp_keepidle;
     int                     tcp_keepintvl;
@@ -57,6 +58,7 @@ typedef struct {
 #if (NGX_MAIL_SSL)
     ngx_uint_t              ssl;    /* unsigned   ssl:1; */
 #endif
+    ngx_uint_t              proxy_protocol; /* unsigned proxy_protocol:1; */
 } ngx_mail_addr_conf_t;
 
 typedef struct {
@@ -203,6 +205,9 @@ typedef struct {
     unsigned                esmtp:1;
     unsigned                auth_method:3;
     unsigned                auth_wait:1;
+#if (NGX_MAIL_SSL)
+    unsigned                ssl:1;
+#endif
 
     ngx_str_t               login;
     ngx_str_t               passwd;
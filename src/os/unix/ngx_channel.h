@@ -22,6 +22,9 @@ typedef struct {
 } ngx_channel_t;
 
 
+typedef void (*ngx_channel_connection_pt)(ngx_channel_t *ch, ngx_log_t *log);
+
+
 ngx_int_t ngx_write_channel(ngx_socket_t s, ngx_channel_t *ch, size_t size,
     ngx_log_t *log);
 ngx_int_t ngx_read_channel(ngx_socket_t s, ngx_channel_t *ch, size_t size,
@@ -31,4 +34,7 @@ ngx_int_t ngx_add_channel_event(ngx_cycle_t *cycle, ngx_fd_t fd,
 void ngx_close_channel(ngx_fd_t *fd, ngx_log_t *log);
 
 
+extern ngx_channel_connection_pt  ngx_channel_connection_handler;
+
+
 #endif /* _NGX_CHANNEL_H_INCLUDED_ */
@@ -150,6 +150,10 @@ ngx_write_fd(ngx_fd_t fd, void *buf, size_t n)
 #define ngx_write_fd_n           "write()"
 
 
+#define ngx_fsync                fsync
+#define ngx_fsync_n              "fsync()"
+
+
 #define ngx_write_console        ngx_write_fd
 
 
@@ -15,6 +15,7 @@ static void ngx_start_worker_processes(ngx_cycle_t *cycle, ngx_int_t n,
     ngx_int_t type);
 static void ngx_start_cache_manager_processes(ngx_cycle_t *cycle,
     ngx_uint_t respawn);
+static void ngx_start_logger_process(ngx_cycle_t *cycle, ngx_uint_t respawn);
 static void ngx_pass_open_channel(ngx_cycle_t *cycle, ngx_channel_t *ch);
 static void ngx_signal_worker_processes(ngx_cycle_t *cycle, int signo);
 static ngx_uint_t ngx_reap_children(ngx_cycle_t *cycle);
@@ -26,6 +27,9 @@ static void ngx_channel_handler(ngx_event_t *ev);
 static void ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_cache_manager_process_handler(ngx_event_t *ev);
 static void ngx_cache_loader_process_handler(ngx_event_t *ev);
+static void ngx_logger_process_cycle(ngx_cycle_t *cycle, void *data);
+static void ngx_logger_process_handler(ngx_event_t *ev);
+static ngx_msec_t ngx_run_loggers(ngx_cycle_t *cycle);
 
 
 ngx_uint_t    ngx_process;
@@ -130,6 +134,7 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
     ngx_start_worker_processes(cycle, ccf->worker_processes,
                                NGX_PROCESS_RESPAWN);
     ngx_start_cache_manager_processes(cycle, 0);
+    ngx_start_logger_process(cycle, 0);
 
     ngx_new_binary = 0;
     delay = 0;
@@ -224,6 +229,7 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
                 ngx_start_worker_processes(cycle, ccf->worker_processes,
                                            NGX_PROCESS_RESPAWN);
                 ngx_start_cache_manager_processes(cycle, 0);
+                ngx_start_logger_process(cycle, 0);
                 ngx_noaccepting = 0;
 
                 continue;
@@ -243,6 +249,7 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
             ngx_start_worker_processes(cycle, ccf->worker_processes,
                                        NGX_PROCESS_JUST_RESPAWN);
             ngx_start_cache_manager_processes(cycle, 1);
+            ngx_start_logger_process(cycle, 1);
 
             /* allow new processes to start */
             ngx_msleep(100);
@@ -257,6 +264,7 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
             ngx_start_worker_processes(cycle, ccf->worker_processes,
                                        NGX_PROCESS_RESPAWN);
             ngx_start_cache_manager_processes(cycle, 0);
+            ngx_start_logger_process(cycle, 0);
             live = 1;
         }
 
@@ -423,6 +431,30 @@ ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
 }
 
 
+static void
+ngx_start_logger_process(ngx_cycle_t *cycle, ngx_uint_t respawn)
+{
+    ngx_channel_t  ch;
+
+    if (cycle->loggers.nelts == 0) {
+        return;
+    }
+
+    ngx_spawn_process(cycle, ngx_logger_process_cycle, NULL,
+                      "logger process",
+                      respawn ? NGX_PROCESS_JUST_RESPAWN : NGX_PROCESS_RESPAWN);
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_OPEN_CHANNEL;
+    ch.pid = ngx_processes[ngx_process_slot].pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = ngx_processes[ngx_process_slot].channel[0];
+
+    ngx_pass_open_channel(cycle, &ch);
+}
+
+
 static void
 ngx_pass_open_channel(ngx_cycle_t *cycle, ngx_channel_t *ch)
 {
@@ -683,12 +715,23 @@ ngx_reap_children(ngx_cycle_t *cycle)
 static void
 ngx_master_process_exit(ngx_cycle_t *cycle)
 {
-    ngx_uint_t  i;
+    ngx_uint_t    i;
+    ngx_path_t  **path;
 
     ngx_delete_pidfile(cycle);
 
     ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "exit");
 
+    /* all worker processes have exited, so the paths state is final */
+
+    path = cycle->paths.elts;
+    for (i = 0; i < cycle->paths.nelts; i++) {
+
+        if (path[i]->saver) {
+            path[i]->saver(path[i]->data);
+        }
+    }
+
     for (i = 0; cycle->modules[i]; i++) {
         if (cycle->modules[i]->exit_master) {
             cycle->modules[i]->exit_master(cycle);
@@ -740,8 +783,7 @@ ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data)
         if (ngx_exiting) {
             ngx_event_cancel_timers();
 
-            if (ngx_event_timer_rbtree.root == ngx_event_timer_rbtree.sentinel)
-            {
+            if (ngx_event_no_timers_left() == NGX_OK) {
                 ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "exiting");
 
                 ngx_worker_process_exit(cycle);
@@ -828,6 +870,8 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
         }
     }
 
+    ngx_pool_cache_init(ccf->pool_cache);
+
     if (geteuid() == 0) {
         if (setgid(ccf->group) == -1) {
             ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
@@ -1089,6 +1133,23 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].channel[0] = -1;
             break;
+
+        case NGX_CMD_PASS_CONNECTION:
+
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                           "get connection pid:%P fd:%d", ch.pid, ch.fd);
+
+            if (ngx_channel_connection_handler) {
+                ngx_channel_connection_handler(&ch, ev->log);
+                break;
+            }
+
+            if (close(ch.fd) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+                              "close() passed connection failed");
+            }
+
+            break;
         }
     }
 }
@@ -1198,3 +1259,90 @@ ngx_cache_loader_process_handler(ngx_event_t *ev)
 
     exit(0);
 }
+
+
+static void
+ngx_logger_process_cycle(ngx_cycle_t *cycle, void *data)
+{
+    void         *ident[4];
+    ngx_event_t   ev;
+
+    ngx_process = NGX_PROCESS_HELPER;
+
+    ngx_close_listening_sockets(cycle);
+
+    cycle->connection_n = 512;
+
+    ngx_worker_process_init(cycle, -1);
+
+    ngx_memzero(&ev, sizeof(ngx_event_t));
+    ev.handler = ngx_logger_process_handler;
+    ev.data = ident;
+    ev.log = cycle->log;
+    ident[3] = (void *) -1;
+
+    ngx_use_accept_mutex = 0;
+
+    ngx_setproctitle("logger process");
+
+    ngx_add_timer(&ev, 0);
+
+    for ( ;; ) {
+
+        if (ngx_terminate || ngx_quit) {
+
+            /*
+             * the records of the exiting workers which are logged
+             * after this point are written by the workers themselves
+             */
+
+            (void) ngx_run_loggers(cycle);
+
+            ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "exiting");
+            exit(0);
+        }
+
+        if (ngx_reopen) {
+            ngx_reopen = 0;
+
+            /* records logged before the signal go to the old files */
+
+            (void) ngx_run_loggers(cycle);
+
+            ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "reopening logs");
+            ngx_reopen_files(cycle, -1);
+        }
+
+        ngx_process_events_and_timers(cycle);
+    }
+}
+
+
+static void
+ngx_logger_process_handler(ngx_event_t *ev)
+{
+    ngx_add_timer(ev, ngx_run_loggers((ngx_cycle_t *) ngx_cycle));
+}
+
+
+static ngx_msec_t
+ngx_run_loggers(ngx_cycle_t *cycle)
+{
+    ngx_msec_t     next, n;
+    ngx_uint_t     i;
+    ngx_logger_t  *logger;
+
+    next = 1000;
+
+    logger = cycle->loggers.elts;
+    for (i = 0; i < cycle->loggers.nelts; i++) {
+
+        n = logger[i].handler(logger[i].data);
+
+        next = (n <= next) ? n : next;
+    }
+
+    ngx_time_update();
+
+    return next;
+}
@@ -111,6 +111,10 @@ ssize_t ngx_write_fd(ngx_fd_t fd, void *buf, size_t size);
 #define ngx_write_fd_n              "WriteFile()"
 
 
+#define ngx_fsync                   FlushFileBuffers
+#define ngx_fsync_n                 "FlushFileBuffers()"
+
+
 ssize_t ngx_write_console(ngx_fd_t fd, void *buf, size_t size);
 
 
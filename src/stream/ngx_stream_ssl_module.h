@@ -13,6 +13,10 @@
 #include <ngx_core.h>
 #include <ngx_stream.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 
 typedef struct {
     ngx_msec_t       handshake_timeout;
@@ -27,6 +31,9 @@ typedef struct {
 
     time_t           session_timeout;
 
+    size_t           dyn_rec_threshold;
+    ngx_msec_t       dyn_rec_timeout;
+
     ngx_array_t     *certificates;
     ngx_array_t     *certificate_keys;
 
@@ -41,6 +48,10 @@ typedef struct {
 
     ngx_flag_t       session_tickets;
     ngx_array_t     *session_ticket_keys;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t  *thread_pool;
+#endif
 } ngx_stream_ssl_conf_t;
 
 
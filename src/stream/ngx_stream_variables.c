@@ -19,6 +19,8 @@ static ngx_int_t ngx_stream_variable_remote_port(ngx_stream_session_t *s,
     ngx_stream_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_stream_variable_proxy_protocol_addr(
     ngx_stream_session_t *s, ngx_stream_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_stream_variable_proxy_protocol_tlv(
+    ngx_stream_session_t *s, ngx_stream_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_stream_variable_proxy_protocol_port(
     ngx_stream_session_t *s, ngx_stream_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_stream_variable_server_addr(ngx_stream_session_t *s,
@@ -341,6 +343,18 @@ ngx_stream_get_variable(ngx_stream_session_t *s, ngx_str_t *name,
         return NULL;
     }
 
+    if (name->len >= 19
+        && ngx_strncmp(name->data, "proxy_protocol_tlv_", 19) == 0)
+    {
+        if (ngx_stream_variable_proxy_protocol_tlv(s, vv, (uintptr_t) name)
+            == NGX_OK)
+        {
+            return vv;
+        }
+
+        return NULL;
+    }
+
     vv->not_found = 1;
 
     return vv;
@@ -467,6 +481,39 @@ ngx_stream_variable_proxy_protocol_port(ngx_stream_session_t *s,
 }
 
 
+static ngx_int_t
+ngx_stream_variable_proxy_protocol_tlv(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    ngx_str_t *name = (ngx_str_t *) data;
+
+    ngx_int_t  rc;
+    ngx_str_t  tlv, value;
+
+    tlv.len = name->len - (sizeof("proxy_protocol_tlv_") - 1);
+    tlv.data = name->data + sizeof("proxy_protocol_tlv_") - 1;
+
+    rc = ngx_proxy_protocol_get_tlv(s->connection, &tlv, &value);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = value.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = value.data;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_stream_variable_server_addr(ngx_stream_session_t *s,
     ngx_stream_variable_value_t *v, uintptr_t data)
@@ -1028,6 +1075,7 @@ ngx_int_t
 ngx_stream_variables_init_vars(ngx_conf_t *cf)
 {
     ngx_uint_t                    i, n;
+    ngx_str_t                     tlv;
     ngx_hash_key_t               *key;
     ngx_hash_init_t               hash;
     ngx_stream_variable_t        *v, *av;
@@ -1066,6 +1114,25 @@ ngx_stream_variables_init_vars(ngx_conf_t *cf)
             }
         }
 
+        if (v[i].name.len >= 19
+            && ngx_strncmp(v[i].name.data, "proxy_protocol_tlv_", 19) == 0)
+        {
+            tlv.len = v[i].name.len - 19;
+            tlv.data = v[i].name.data + 19;
+
+            if (ngx_proxy_protocol_check_tlv(&tlv) != NGX_OK) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "unknown PROXY protocol TLV in \"%V\" variable",
+                              &v[i].name);
+                return NGX_ERROR;
+            }
+
+            v[i].get_handler = ngx_stream_variable_proxy_protocol_tlv;
+            v[i].data = (uintptr_t) &v[i].name;
+
+            continue;
+        }
+
         ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
                       "unknown \"%V\" variable", &v[i].name);
 